@@ -1,6 +1,7 @@
 #ifndef __ADD_TRANSFER_PARAMS_HPP__
 #define __ADD_TRANSFER_PARAMS_HPP__
 #include "libed2k/md4_hash.hpp"
+#include "libed2k/aich.hpp"
 #include "libed2k/storage_defs.hpp"
 #include "libed2k/peer.hpp"
 #include "libed2k/bitfield.hpp"
@@ -37,6 +38,8 @@ namespace libed2k
         std::string file_path; // full filename in UTF8 always!
         size_type  file_size;
         std::vector<md4_hash> piece_hashses;
+        aich_hash aich_root_hash; // trusted AICH root, enables piece repair
+        std::vector<aich_hash> aich_piece_hashes; // AICH piece subtrees of shared file
         std::vector<char>* resume_data;
         storage_mode_t storage_mode;
         bool duplicate_is_error;
@@ -55,6 +58,8 @@ namespace libed2k
                     file_path == t.file_path &&
                     file_size == t.file_size &&
                     piece_hashses == t.piece_hashses &&
+                    aich_root_hash == t.aich_root_hash &&
+                    aich_piece_hashes == t.aich_piece_hashes &&
                     accepted == t.accepted &&
                     requested == t.requested &&
                     transferred == t.transferred &&
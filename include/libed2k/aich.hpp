@@ -0,0 +1,234 @@
+#ifndef __LIBED2K_AICH__
+#define __LIBED2K_AICH__
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <string.h>
+#include <ostream>
+
+#include "libed2k/constants.hpp"
+#include "libed2k/size_type.hpp"
+#include "libed2k/archive.hpp"
+#include "libed2k/sha1.hpp"
+
+namespace libed2k
+{
+    /**
+      * eMule Advanced Intelligent Corruption Handling: SHA-1 hash tree over
+      * 180 KB blocks of a file. Each ed2k piece is a subtree of the file tree,
+      * so a client knowing the tree root can verify single blocks of a piece
+      * with recovery data - the piece block hashes plus uncle hashes up to root
+     */
+    const size_type AICH_BLOCK_SIZE = 184320;
+
+    // share of AICH root votes which have to agree on the root to trust it
+    const int AICH_TRUST_PERCENT = 92;
+
+    // seconds we wait for recovery data before whole piece goes to download again
+    const int AICH_RECOVERY_TIMEOUT = 30;
+
+    class aich_hash
+    {
+    public:
+        enum { hash_size = SHA1_HASH_SIZE };
+
+        aich_hash()
+        {
+            clear();
+        }
+
+        bool defined() const
+        {
+            int sum = 0;
+            for (size_t i = 0; i < SHA1_HASH_SIZE; ++i)
+                sum |= m_hash[i];
+            return sum != 0;
+        }
+
+        unsigned char* getContainer()
+        {
+            return &m_hash[0];
+        }
+
+        const unsigned char* getContainer() const
+        {
+            return &m_hash[0];
+        }
+
+        bool operator==(const aich_hash& hash) const
+        {
+            return (memcmp(m_hash, hash.m_hash, SHA1_HASH_SIZE) == 0);
+        }
+
+        bool operator!=(const aich_hash& hash) const
+        {
+            return (memcmp(m_hash, hash.m_hash, SHA1_HASH_SIZE) != 0);
+        }
+
+        bool operator<(const aich_hash& hash) const
+        {
+            return (memcmp(m_hash, hash.m_hash, SHA1_HASH_SIZE) < 0);
+        }
+
+        void clear()
+        {
+            memset(m_hash, 0, SHA1_HASH_SIZE);
+        }
+
+        /**
+          * AICH hashes are written in base32 like in ed2k links and known.met,
+          * returns undefined hash on malformed string
+         */
+        static aich_hash fromString(const std::string& strHash);
+        std::string toString() const;
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            for (size_t n = 0; n < SHA1_HASH_SIZE; n++)
+            {
+                ar & m_hash[n];
+            }
+        }
+
+        friend std::ostream& operator<< (std::ostream& stream, const aich_hash& hash);
+
+    private:
+        unsigned char m_hash[SHA1_HASH_SIZE];
+    };
+
+    /**
+      * hashes AICH blocks of one ed2k piece, data may come in chunks of any size
+     */
+    class aich_piece_hasher
+    {
+    public:
+        aich_piece_hasher();
+
+        void update(const char* data, size_t size);
+
+        // hashes of piece blocks, the last incomplete block is closed by call
+        const std::vector<aich_hash>& block_hashes();
+
+        // hash of piece subtree, left_branch is aich_left_part() for piece
+        aich_hash final(bool left_branch);
+
+        void reset();
+
+    private:
+        sha1_context            m_context;
+        size_type               m_block_pos;
+        size_type               m_size;
+        std::vector<aich_hash>  m_blocks;
+    };
+
+    /**
+      * pieces of the file tree differ in how their blocks are split in halves,
+      * left branches give the odd block to the left child
+     */
+    bool aich_left_part(size_type file_size, int piece);
+
+    // hash of piece subtree from its block hashes
+    aich_hash aich_part_hash(const std::vector<aich_hash>& block_hashes, size_type piece_size, bool left_branch);
+
+    // root hash of the file from hashes of all its pieces
+    aich_hash aich_root_hash(size_type file_size, const std::vector<aich_hash>& part_hashes);
+
+    /**
+      * tree node hashes proving blocks of one piece against root, nodes are
+      * identified as in eMule: root is 1, children are (parent << 1) | left
+     */
+    struct aich_recovery_data
+    {
+        typedef std::vector<std::pair<boost::uint32_t, aich_hash> > hashes_t;
+        hashes_t m_hashes;
+
+        template<typename Archive>
+        void save(Archive& ar)
+        {
+            boost::uint16_t count16 = 0;
+            boost::uint16_t count32 = 0;
+
+            for (hashes_t::iterator i = m_hashes.begin(); i != m_hashes.end(); ++i)
+            {
+                if (i->first <= 0xFFFF) ++count16;
+                else ++count32;
+            }
+
+            ar & count16;
+
+            for (hashes_t::iterator i = m_hashes.begin(); i != m_hashes.end(); ++i)
+            {
+                if (i->first > 0xFFFF) continue;
+                boost::uint16_t id = static_cast<boost::uint16_t>(i->first);
+                ar & id;
+                ar & i->second;
+            }
+
+            // large files have too deep trees for 16 bit identifiers
+            ar & count32;
+
+            for (hashes_t::iterator i = m_hashes.begin(); i != m_hashes.end(); ++i)
+            {
+                if (i->first <= 0xFFFF) continue;
+                ar & i->first;
+                ar & i->second;
+            }
+        }
+
+        template<typename Archive>
+        void load(Archive& ar)
+        {
+            boost::uint16_t count16 = 0;
+            boost::uint16_t count32 = 0;
+            m_hashes.clear();
+
+            ar & count16;
+
+            for (boost::uint16_t n = 0; n < count16; ++n)
+            {
+                boost::uint16_t id;
+                aich_hash hash;
+                ar & id;
+                ar & hash;
+                m_hashes.push_back(std::make_pair(boost::uint32_t(id), hash));
+            }
+
+            // old clients have no 32 bit section
+            if (ar.bytes_left() < sizeof(count32)) return;
+
+            ar & count32;
+
+            for (boost::uint16_t n = 0; n < count32; ++n)
+            {
+                boost::uint32_t id;
+                aich_hash hash;
+                ar & id;
+                ar & hash;
+                m_hashes.push_back(std::make_pair(id, hash));
+            }
+        }
+
+        LIBED2K_SERIALIZATION_SPLIT_MEMBER()
+    };
+
+    /**
+      * collects recovery data of piece, block_hashes are hashes of piece data
+      * @return false when block hashes do not match known hash of the piece
+     */
+    bool aich_make_recovery_data(size_type file_size, int piece,
+                                 const std::vector<aich_hash>& part_hashes,
+                                 const std::vector<aich_hash>& block_hashes,
+                                 aich_recovery_data& data);
+
+    /**
+      * checks recovery data of piece against trusted root
+      * @return true and trusted hashes of piece blocks in block_hashes
+     */
+    bool aich_check_recovery_data(size_type file_size, int piece, const aich_hash& root,
+                                  const aich_recovery_data& data,
+                                  std::vector<aich_hash>& block_hashes);
+}
+
+#endif
@@ -796,6 +796,50 @@ namespace libed2k
         }
     };
 
+    struct transfer_checking_progress_alert: transfer_alert
+    {
+        transfer_checking_progress_alert(transfer_handle const& h, int checked, int total)
+            : transfer_alert(h), pieces_checked(checked), num_pieces(total)
+        {}
+
+        int pieces_checked;
+        int num_pieces;
+
+        virtual std::auto_ptr<alert> clone() const
+        { return std::auto_ptr<alert>(new transfer_checking_progress_alert(*this)); }
+        virtual char const* what() const { return "transfer checking progress"; }
+        const static int static_category = alert::progress_notification;
+        virtual int category() const { return static_category; }
+        virtual std::string message() const
+        {
+            char ret[100];
+            snprintf(ret, sizeof(ret), " checked %d of %d pieces", pieces_checked, num_pieces);
+            return transfer_alert::message() + ret;
+        }
+    };
+
+    struct storage_move_progress_alert: transfer_alert
+    {
+        storage_move_progress_alert(transfer_handle const& h, size_type moved, size_type total)
+            : transfer_alert(h), bytes_moved(moved), total_bytes(total)
+        {}
+
+        size_type bytes_moved;
+        size_type total_bytes;
+
+        virtual std::auto_ptr<alert> clone() const
+        { return std::auto_ptr<alert>(new storage_move_progress_alert(*this)); }
+        virtual char const* what() const { return "storage move progress"; }
+        const static int static_category = alert::progress_notification;
+        virtual int category() const { return static_category; }
+        virtual std::string message() const
+        {
+            char ret[100];
+            snprintf(ret, sizeof(ret), " moved %" PRId64 " of %" PRId64 " bytes", bytes_moved, total_bytes);
+            return transfer_alert::message() + ret;
+        }
+    };
+
     struct hash_failed_alert: transfer_alert
     {
         hash_failed_alert(transfer_handle const& h, int failed_index)
@@ -836,6 +880,29 @@ namespace libed2k
         error_code          m_ec;
     };
 
+    /**
+      * file of monitored share directory was deleted or moved out,
+      * transfer made of it has to be removed
+     */
+    struct shared_file_removed_alert : alert
+    {
+        const static int static_category = alert::status_notification;
+        shared_file_removed_alert(const std::string& file_path) : m_file_path(file_path)
+        {}
+
+        virtual std::auto_ptr<alert> clone() const
+                { return std::auto_ptr<alert>(new shared_file_removed_alert(*this)); }
+
+        virtual char const* what() const { return "shared file removed"; }
+        virtual int category() const { return static_category; }
+        virtual std::string message() const
+        {
+            return m_file_path + " removed";
+        }
+
+        std::string m_file_path;
+    };
+
 
 }
 
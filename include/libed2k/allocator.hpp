@@ -50,6 +50,18 @@ namespace libed2k
         static void free(char* const block);
     };
 
+    // memory of the slabs of disk buffers. Huge pages are reserved ones
+    // when the system has them, transparent ones otherwise, and regular
+    // pages where neither can be had
+    struct LIBED2K_EXTRA_EXPORT huge_page_allocator
+    {
+        enum { huge_page_size = 2 * 1024 * 1024 };
+
+        // huge - asks for huge pages, tells whether it got them
+        static char* malloc(std::size_t bytes, bool& huge);
+        static void free(char* block, std::size_t bytes, bool huge);
+    };
+
     struct LIBED2K_EXTRA_EXPORT aligned_holder
     {
         aligned_holder(): m_buf(0) {}
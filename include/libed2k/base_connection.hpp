@@ -111,6 +111,12 @@ namespace libed2k{
         void append_send_buffer(char* buffer, int size, Destructor const& destructor)
         { m_send_buffer.append_buffer(buffer, size, size, destructor); }
 
+        // sends size bytes starting offset bytes into the buffer, nothing
+        // else is ever written to it, so it may be shared with the cache
+        template <class Destructor>
+        void append_send_buffer(char* buffer, int offset, int size, Destructor const& destructor)
+        { m_send_buffer.append_buffer(buffer, offset + size, size, destructor, offset); }
+
         int send_buffer_size() const { return m_send_buffer.size(); }
         int send_buffer_capacity() const { return m_send_buffer.capacity(); }
 
@@ -75,8 +75,9 @@ namespace libed2k
 
 		void pop_front(int bytes_to_pop);
 
+		// the bytes to send start offset bytes into the buffer
 		void append_buffer(char* buffer, int s, int used_size
-			, boost::function<void(char*)> const& destructor);
+			, boost::function<void(char*)> const& destructor, int offset = 0);
 
 		// returns the number of bytes available at the
 		// end of the last chained buffer.
@@ -146,6 +146,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #if defined __AMIGA__ || defined __amigaos__ || defined __AROS__
 #define LIBED2K_AMIGA
 #define LIBED2K_USE_MLOCK 0
+#define LIBED2K_USE_MMAP 0
 #define LIBED2K_USE_WRITEV 0
 #define LIBED2K_USE_READV 0
 #define LIBED2K_USE_IPV6 0
@@ -189,6 +190,15 @@ POSSIBILITY OF SUCH DAMAGE.
 #define LIBED2K_USE_NETLINK 1
 #define LIBED2K_USE_IFCONF 1
 #define LIBED2K_HAS_SALEN 0
+#ifndef LIBED2K_USE_INOTIFY
+#define LIBED2K_USE_INOTIFY 1
+#endif
+// io_uring came with kernel 5.1, build machine headers tell if we know it
+#if !defined LIBED2K_USE_IO_URING && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#define LIBED2K_USE_IO_URING 1
+#endif
+#endif
 
 // ==== MINGW ===
 #elif defined __MINGW32__
@@ -199,6 +209,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define LIBED2K_USE_LOCALE 1
 #endif
 #define LIBED2K_USE_RLIMIT 0
+#define LIBED2K_USE_MMAP 0
 #define LIBED2K_USE_NETLINK 0
 #define LIBED2K_USE_GETADAPTERSADDRESSES 1
 #define LIBED2K_HAS_SALEN 0
@@ -221,6 +232,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define LIBED2K_USE_LOCALE 1
 #endif
 #define LIBED2K_USE_RLIMIT 0
+#define LIBED2K_USE_MMAP 0
 #define LIBED2K_HAS_FALLOCATE 0
 #ifndef LIBED2K_USE_UNC_PATHS
 #define LIBED2K_USE_UNC_PATHS 1
@@ -326,6 +338,14 @@ namespace libed2k
 #define LIBED2K_USE_GETADAPTERSADDRESSES 0
 #endif
 
+#ifndef LIBED2K_USE_INOTIFY
+#define LIBED2K_USE_INOTIFY 0
+#endif
+
+#ifndef LIBED2K_USE_IO_URING
+#define LIBED2K_USE_IO_URING 0
+#endif
+
 #ifndef LIBED2K_USE_NETLINK
 #define LIBED2K_USE_NETLINK 0
 #endif
@@ -402,6 +422,11 @@ namespace libed2k
 #define LIBED2K_USE_MLOCK 1
 #endif
 
+// mapped_storage maps files with mmap(), it falls back to regular I/O without it
+#ifndef LIBED2K_USE_MMAP
+#define LIBED2K_USE_MMAP 1
+#endif
+
 #ifndef LIBED2K_USE_WRITEV
 #define LIBED2K_USE_WRITEV 1
 #endif
@@ -59,6 +59,8 @@ const tg_nid_type FT_FAST_RESUME_DATA   = '\x31';   // fast resume data array
 // by eserver 16.46+) statistic
 
 const tg_nid_type FT_PUBLISHINFO        = '\x33';    // <uint32>
+const tg_nid_type FT_LASTSHARED         = '\x34';    // <uint32> time the file was shared last
+const tg_nid_type FT_AICHHASHSET        = '\x35';    // <blob> AICH hashes of pieces
 const tg_nid_type FT_ATTRANSFERRED      = '\x50';    // <uint32>
 const tg_nid_type FT_ATREQUESTED        = '\x51';    // <uint32>
 const tg_nid_type FT_ATACCEPTED         = '\x52';    // <uint32>
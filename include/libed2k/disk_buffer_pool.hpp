@@ -38,27 +38,34 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <libed2k/socket.hpp>
 #include <libed2k/session_settings.hpp>
 #include <libed2k/allocator.hpp>
+#include <libed2k/size_type.hpp>
 
-#ifndef LIBED2K_DISABLE_POOL_ALLOCATOR
-#include <boost/pool/pool.hpp>
-#endif
+#include <boost/detail/atomic_count.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/cstdint.hpp>
 
 #ifdef LIBED2K_DISK_STATS
 #include <fstream>
 #endif
 
-#if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS
 #include <map>
-#endif
+#include <vector>
+#include <string>
 
 namespace libed2k
 {
+    /**
+      * block sized buffers carved out of slabs, optionally backed by huge
+      * pages. Every thread keeps a magazine of free buffers in front of the
+      * pool, so allocating and freeing a buffer takes the pool mutex only
+      * when the magazine runs empty or full
+     */
     struct LIBED2K_EXTRA_EXPORT disk_buffer_pool : boost::noncopyable
     {
-        disk_buffer_pool(int block_size);
-#if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS
+        // when shared is set, buffers are allocated from and returned
+        // to that pool, so they can be freed through either of them
+        disk_buffer_pool(int block_size, disk_buffer_pool* shared = 0);
         ~disk_buffer_pool();
-#endif
 
 #if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS
         bool is_disk_buffer(char* buffer
@@ -70,20 +77,34 @@ namespace libed2k
         void free_buffer(char* buf);
         void free_multiple_buffers(char** bufvec, int numbufs);
 
+        // the buffer gets one more owner, it's returned to the pool
+        // when the last of them frees it
+        void add_buffer_ref(char* buf);
+
         int block_size() const { return m_block_size; }
 
+        // buffers allocated for each category since the pool was created
+        void category_allocations(std::map<std::string, size_type>& ret) const;
+
+        // bytes of the slabs, and the part of them on huge pages
+        void slab_memory(size_type& total, size_type& huge) const;
+
 #ifdef LIBED2K_STATS
         int disk_allocations() const
-        { return m_allocations; }
+        { return in_use(); }
 #endif
 
 #ifdef LIBED2K_DISK_STATS
         std::ofstream m_disk_access_log;
 #endif
 
+        // frees the slabs no buffer is used from
         void release_memory();
 
-        int in_use() const { return m_in_use; }
+        int in_use() const { return m_shared ? m_shared->in_use() : int(m_in_use); }
+
+        // the pools allocating buffers from the same one, this included
+        int users() const { return m_shared ? m_shared->users() : int(m_users); }
 
     protected:
 
@@ -94,23 +115,78 @@ namespace libed2k
         const int m_block_size;
 
         // number of disk buffers currently allocated
-        int m_in_use;
+        boost::detail::atomic_count m_in_use;
 
         session_settings m_settings;
 
     private:
 
+        enum { magazine_size = 8, num_categories = 7 };
+
+        struct magazine;
+        struct thread_magazines;
+
+        struct slab
+        {
+            int blocks;
+            bool huge;
+        };
+
+        struct category_counter
+        {
+            category_counter(): count(0) {}
+            boost::detail::atomic_count count;
+        };
+
+        magazine* thread_magazine();
+        void return_magazine(magazine* m);
+
+        // takes free buffers from the pool until the
+        // magazine is half full, adds a slab if needed
+        void fill_magazine(magazine& m);
+        void drain_magazine(magazine& m, int keep);
+
+        // the buffer isn't used anymore, it goes to the magazine
+        void release_buffer(char* buf);
+
+        void lock_memory(char* buf);
+        void unlock_memory(char* buf);
+
+        bool add_slab(mutex::scoped_lock& l);
+        char* take_buffer(mutex::scoped_lock& l);
+
+        disk_buffer_pool* m_shared;
+
         mutable mutex m_pool_mutex;
 
-#ifndef LIBED2K_DISABLE_POOL_ALLOCATOR
-        // memory pool for read and write operations
-        // and disk cache
-        boost::pool<page_aligned_allocator> m_pool;
-#endif
+        // never reused, magazines of destructed
+        // pools are told apart by it
+        boost::uint64_t m_id;
+
+        // extra owners of buffers shared between the read cache and
+        // send buffers
+        std::map<char*, int> m_buffer_refs;
+
+        // the number of extra owners, while there are
+        // none no buffer has to be looked up on free
+        boost::detail::atomic_count m_num_refs;
+
+        // pools sharing this one and itself
+        boost::detail::atomic_count m_users;
+
+        // slabs by their first buffer
+        std::map<char*, slab> m_slabs;
+
+        // free buffers not in any magazine
+        std::vector<char*> m_free;
+
+        // magazines of the threads using the pool
+        std::vector<magazine*> m_magazines;
+
+        category_counter m_categories_allocated[num_categories];
+
+        static boost::thread_specific_ptr<thread_magazines> s_magazines;
 
-#if defined LIBED2K_DISK_STATS || defined LIBED2K_STATS
-        int m_allocations;
-#endif
 #ifdef LIBED2K_DISK_STATS
     public:
         void rename_buffer(char* buf, char const* category);
@@ -128,4 +204,3 @@ namespace libed2k
 }
 
 #endif // LIBED2K_DISK_BUFFER_POOL
-
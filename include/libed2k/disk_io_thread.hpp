@@ -42,19 +42,25 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/function/function2.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/optional.hpp>
 #include <deque>
 #include <list>
+#include <map>
 
 #include <libed2k/config.hpp>
 #include <libed2k/thread.hpp>
 #include <libed2k/disk_buffer_pool.hpp>
+#include <libed2k/io_ring.hpp>
 #include <libed2k/constants.hpp>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/mem_fun.hpp>
+#include <boost/multi_index/composite_key.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/identity.hpp>
 
 namespace libed2k
 {
@@ -64,6 +70,9 @@ namespace libed2k
     using boost::multi_index::indexed_by;
     using boost::multi_index::member;
     using boost::multi_index::const_mem_fun;
+    using boost::multi_index::composite_key;
+    using boost::multi_index::sequenced;
+    using boost::multi_index::identity;
 
     struct cached_piece_info
     {
@@ -85,6 +94,10 @@ namespace libed2k
             , offset(0)
             , max_cache_line(0)
             , cache_min_time(0)
+            , flags(0)
+            , buffer_offset(0)
+            , moved(0)
+            , move_size(0)
         {}
 
         enum action_t
@@ -132,6 +145,23 @@ namespace libed2k
         // line caused by this operation stays in the cache
         int cache_min_time;
 
+        enum flags_t
+        {
+            // a read may be answered with a reference to the cached
+            // block instead of a copy of it
+            cache_reference = 1
+        };
+        int flags;
+
+        // the data of a read job starts this many bytes into buffer,
+        // it's only set for references to cached blocks
+        int buffer_offset;
+
+        // bytes of the files move_storage copied so far and in total,
+        // reported while the copy is in progress
+        size_type moved;
+        size_type move_size;
+
         boost::shared_ptr<entry> resume_data;
 
         // the error code from the file operation
@@ -179,6 +209,13 @@ namespace libed2k
             , cumulative_sort_time(0)
             , total_read_back(0)
             , read_queue_size(0)
+            , read_cache_misses(0)
+            , recent_ghost_hits(0)
+            , frequent_ghost_hits(0)
+            , frequent_cache_size(0)
+            , recent_cache_target(0)
+            , file_pool_hits(0)
+            , file_pool_misses(0)
         {}
 
         // the number of blocks written
@@ -224,16 +261,37 @@ namespace libed2k
         boost::uint32_t cumulative_sort_time;
         int total_read_back;
         int read_queue_size;
+
+        // pieces read into the read cache because they missed it, and
+        // the ones of them that were evicted lately from the recently
+        // or the frequently used part of the cache
+        size_type read_cache_misses;
+        size_type recent_ghost_hits;
+        size_type frequent_ghost_hits;
+
+        // blocks of the read cache in pieces read more than once, and
+        // the number of blocks the pieces read once may take before
+        // they're evicted first. The target adapts to the ghost hits
+        int frequent_cache_size;
+        int recent_cache_target;
+
+        // file opens served by an open handle of the file pool,
+        // and the ones that had to open the file
+        size_type file_pool_hits;
+        size_type file_pool_misses;
     };
 
-    // this is a singleton consisting of the thread and a queue
-    // of disk io jobs
+    // the thread and the queue of disk io jobs of one or more storage
+    // devices. The session runs one for each device, up to
+    // session_settings::disk_threads. They allocate buffers from the
+    // pool of the first one, see session_impl::disk_thread
     struct LIBED2K_EXTRA_EXPORT disk_io_thread : disk_buffer_pool
     {
         disk_io_thread(io_service& ios
             , boost::function<void()> const& queue_callback
             , file_pool& fp
-            , int block_size = BLOCK_SIZE);
+            , int block_size = BLOCK_SIZE
+            , disk_buffer_pool* buffers = 0);
         ~disk_io_thread();
 
         void abort();
@@ -267,11 +325,29 @@ namespace libed2k
 
         struct cached_block_entry
         {
-            cached_block_entry(): buf(0) {}
+            cached_block_entry(): buf(0), served_start(0), served_end(0) {}
             // the buffer pointer (this is a disk_pool buffer)
             // or 0
             char* buf;
 
+            // the bytes of the block handed out of the read cache, a
+            // read overlapping them marks its piece as frequently used.
+            // A sequential reader with requests not aligned to blocks
+            // touches blocks twice, but never the same bytes
+            int served_start;
+            int served_end;
+
+            // records [start, end) as served, returns true if some of
+            // it was served before
+            bool serve(int start, int end)
+            {
+                bool again = start < served_end && served_start < end;
+                if (served_start == served_end) served_start = start;
+                else served_start = (std::min)(served_start, start);
+                served_end = (std::max)(served_end, end);
+                return again;
+            }
+
             // callback for when this block is flushed to disk
             boost::function<void(int, disk_io_job const&)> callback;
         };
@@ -292,10 +368,19 @@ namespace libed2k
             // used to determine if this piece should be flushed
             int num_contiguous_blocks;
             // this is the first block that has not yet been hashed
-            // by the partial hasher. When minimizing read-back, this
-            // is used to determine if flushing a range would force us
-            // to read it back later when hashing
+            // by the partial hasher. Blocks are hashed as soon as they
+            // reach it in the cache, when minimizing read-back, blocks
+            // after it are kept in the cache since flushing them would
+            // force us to read them back later when hashing
             int next_block_to_hash;
+            // read cache pieces are either recently used, read once or
+            // only by one sequential reader, or frequently used. The
+            // recently used ones are evicted first while they take more
+            // than their share of the cache
+            bool frequent;
+            // a block of the piece was read again, it becomes frequently
+            // used when its last use is updated
+            bool reread;
 
             std::pair<void*, int> storage_piece_pair() const
             { return std::pair<void*, int>(storage.get(), piece); }
@@ -307,11 +392,23 @@ namespace libed2k
                 , &cached_piece_entry::storage_piece_pair> >
                 , ordered_non_unique<member<cached_piece_entry, libed2k::ptime
                     , &cached_piece_entry::expire> >
+                , ordered_non_unique<composite_key<cached_piece_entry
+                    , member<cached_piece_entry, bool, &cached_piece_entry::frequent>
+                    , member<cached_piece_entry, libed2k::ptime, &cached_piece_entry::expire> > >
                 >
             > cache_t;
 
         typedef cache_t::nth_index<0>::type cache_piece_index_t;
         typedef cache_t::nth_index<1>::type cache_lru_index_t;
+        typedef cache_t::nth_index<2>::type cache_evict_index_t;
+
+        // pieces evicted from the read cache lately, oldest first
+        typedef multi_index_container<
+            std::pair<void*, int>, indexed_by<
+                sequenced<>
+                , ordered_unique<identity<std::pair<void*, int> > >
+                >
+            > ghost_list_t;
 
     private:
 
@@ -347,7 +444,68 @@ namespace libed2k
         void flush_expired_pieces();
         int flush_contiguous_blocks(cached_piece_entry& p
             , mutex::scoped_lock& l, int lower_limit = 0, bool avoid_readback = false);
-        int flush_range(cached_piece_entry& p, int start, int end, mutex::scoped_lock& l);
+        // when keep is set, buffers of the blocks not hashed yet are moved
+        // into it, indexed by block, instead of being freed
+        int flush_range(cached_piece_entry& p, int start, int end, mutex::scoped_lock& l
+            , std::vector<char*>* keep = 0);
+        void hash_cached_blocks(cached_piece_entry& p, mutex::scoped_lock& l
+            , bool leave_complete = false);
+
+        // a range of contiguous blocks of a piece, written or read with
+        // the iovecs starting at iov
+        struct io_run
+        {
+            int offset;
+            int iov;
+            int num_bufs;
+            int size;
+        };
+
+        // writes the runs of a piece in one io_uring batch, the runs that
+        // can't be submitted or fail are written the blocking way, which
+        // sets the storage error. Returns the number of runs written
+        int write_batch(cached_piece_entry& p, file::iovec_t* iov
+            , std::vector<io_run> const& runs);
+
+        // a piece handed over to the hash threads: its partial hash taken
+        // from the storage and the rest of its data, one buffer per block
+        struct hash_job
+        {
+            disk_io_job job;
+            partial_hash ph;
+            std::vector<char*> blocks;
+            int ret;
+            int hash_time;
+        };
+
+        int queue_hash_job(disk_io_job& j, std::vector<char*>& blocks);
+        void set_hash_threads(int num);
+        void hash_thread_fun();
+
+        // transfers waiting for the checking thread of their storage device
+        // and the one it's checking now, which is aborted when cancelled is set
+        struct check_queue
+        {
+            check_queue(): current(0), cancelled(false) {}
+            std::deque<disk_io_job> jobs;
+            piece_manager* current;
+            bool cancelled;
+        };
+
+        // the storage moved to a device of another thread: its cached
+        // pieces are written and dropped and its queued jobs go to dest,
+        // jobs added later are passed on by add_job
+        void hand_over(piece_manager* s, disk_io_thread& dest);
+
+        // clears m_exceeded_write_queue once the queued writes drop below
+        // the low watermark, m_queue_mutex is expected to be held
+        void check_write_queue();
+
+        void queue_check_job(disk_io_job const& j);
+        // m_queue_mutex is expected to be held
+        void cancel_check_jobs(piece_manager* s);
+        void stop_check_threads();
+        void check_thread_fun(boost::uint64_t device);
         int cache_block(disk_io_job& j
             , boost::function<void(int,disk_io_job const&)>& handler
             , int cache_expire
@@ -356,6 +514,17 @@ namespace libed2k
         // read cache operations
         int clear_oldest_read_piece(int num_blocks, ignore_t ignore
             , mutex::scoped_lock& l);
+        // sets the part of the read cache a piece that missed it goes to,
+        // pieces evicted lately come back as frequently used
+        void admit_read_piece(cached_piece_entry& p);
+        void add_ghost(cached_piece_entry const& p);
+        int recent_cache_target() const;
+
+        // blocks counted against the cache size and the limit for them.
+        // Alone the thread counts all the buffers of the pool, threads
+        // sharing one each get an equal part of cache_size for their cache
+        int cache_used() const;
+        int cache_limit() const;
         int read_into_piece(cached_piece_entry& p, int start_block
             , int options, int num_blocks, mutex::scoped_lock& l);
         int cache_read_block(disk_io_job const& j, mutex::scoped_lock& l);
@@ -370,6 +539,8 @@ namespace libed2k
         int read_piece_from_cache_and_hash(disk_io_job const& j, md4_hash& h);
         int cache_piece(disk_io_job const& j, cache_piece_index_t::iterator& p
             , bool& hit, int options, mutex::scoped_lock& l);
+        int read_ahead(disk_io_job const& j, mutex::scoped_lock& l);
+        bool reference_cached_block(disk_io_job& j);
 
         // this mutex only protects m_jobs, m_queue_buffer_size,
         // m_exceeded_write_queue and m_abort
@@ -390,6 +561,14 @@ namespace libed2k
         // read cache
         cache_t m_read_pieces;
 
+        // pieces evicted from the recently and the frequently used part
+        // of the read cache. A miss on one of them moves the target size
+        // of the recently used part towards it, like ARC does
+        ghost_list_t m_recent_ghosts;
+        ghost_list_t m_frequent_ghosts;
+        // in blocks, -1 until it adapted the first time
+        int m_recent_target;
+
         void flip_stats(libed2k::ptime now);
 
         // total number of blocks in use by both the read
@@ -423,6 +602,25 @@ namespace libed2k
         typedef std::multimap<size_type, disk_io_job> read_jobs_t;
         read_jobs_t m_sorted_read_jobs;
 
+        // jobs of storages a checking thread was hashing a piece of, they're
+        // put back into the queue in order once it lets go of the storage.
+        // Owned by the disk io thread
+        std::deque<disk_io_job> m_deferred_jobs;
+
+        // true when the job has to wait for the checking thread of its
+        // storage, otherwise the storage's job mutex is locked
+        bool defer_job(disk_io_job const& j);
+        // m_queue_mutex is expected to be held
+        void requeue_deferred_jobs();
+
+        // reads pieces of the sorted read jobs from pos on that miss the
+        // read cache in one io_uring batch, so they're served from the cache
+        void prefetch_read_jobs(read_jobs_t::iterator pos, int direction);
+
+        // in flight reads and writes submitted by the disk io thread,
+        // open while use_io_uring is set and supported
+        io_ring m_ring;
+
 #ifdef LIBED2K_DISK_STATS
         std::ofstream m_log;
 #endif
@@ -459,6 +657,34 @@ namespace libed2k
         // in this list
         std::list<std::pair<disk_io_job, int> > m_queued_completions;
 
+        // this mutex protects m_hash_jobs and m_hash_abort
+        mutex m_hash_mutex;
+        condition m_hash_signal;
+        bool m_hash_abort;
+        std::deque<hash_job> m_hash_jobs;
+
+        // pieces verified by the hash threads and checked by the checking
+        // threads, waiting for the disk thread to post their callbacks.
+        // Protected by m_queue_mutex
+        std::list<hash_job> m_hash_results;
+
+        // threads verifying downloaded pieces, they're only
+        // started and stopped by the disk io thread
+        std::vector<boost::shared_ptr<thread> > m_hash_threads;
+
+        // this mutex protects m_check_queues, m_check_abort and
+        // m_check_delay_per_block, the settings copy the checking threads use
+        mutex m_check_mutex;
+        condition m_check_signal;
+        bool m_check_abort;
+        int m_check_delay_per_block;
+        std::map<boost::uint64_t, check_queue> m_check_queues;
+
+        // one thread per storage device checking transfers on it, so
+        // that devices are read in parallel. Their progress and results
+        // go through m_hash_results. Only the disk io thread starts them
+        std::vector<boost::shared_ptr<thread> > m_check_threads;
+
         // thread for performing blocking disk io operations
         thread m_disk_io_thread;
     };
@@ -110,6 +110,7 @@ namespace libed2k
             failed_hash_check,
             invalid_escaped_string,
             file_params_making_was_cancelled,
+            peer_banned,
             num_errors
         };
     }
@@ -5,14 +5,22 @@
 #include <string>
 #include <vector>
 #include <deque>
+#include <map>
+#include <set>
+#include <limits>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/condition.hpp>
 
 #include "libed2k/config.hpp"
 #include "libed2k/error_code.hpp"
 #include "libed2k/size_type.hpp"
+#include "libed2k/time.hpp"
 #include "libed2k/alert.hpp"
 #include "libed2k/filesystem.hpp"
 #include "libed2k/md4_hash.hpp"
@@ -105,6 +113,13 @@ namespace libed2k
     const boost::uint8_t  MET_HEADER                  = 0x0E;
     const boost::uint8_t  MET_HEADER_WITH_LARGEFILES  = 0x0F;
 
+    // hashed files are saved to known.met journal by batches of KNOWN_FLUSH_BATCH
+    // or after KNOWN_FLUSH_DELAY seconds of idle, journal is merged into known.met
+    // when it has KNOWN_COMPACT_MIN entries and no less than known.met
+    const size_t KNOWN_FLUSH_BATCH  = 32;
+    const int    KNOWN_FLUSH_DELAY  = 5;
+    const size_t KNOWN_COMPACT_MIN  = 64;
+
     typedef container_holder<boost::uint16_t, std::vector<md4_hash> > hash_list;
 
     /**
@@ -128,6 +143,18 @@ namespace libed2k
                             boost::uint64_t nTransferred,
                             boost::uint8_t  nPriority);
 
+        /**
+          * entry of file hashed by transfer_params_maker
+          * @param write_ts - file last change time when hashing started
+         */
+        known_file_entry(const add_transfer_params& atp, time_t write_ts);
+
+        /**
+          * time the file was shared last, 0 when the entry has no FT_LASTSHARED tag
+         */
+        boost::uint32_t last_shared() const;
+        void set_last_shared(boost::uint32_t ts);
+
         template<typename Archive>
         void serialize(Archive& ar)
         {
@@ -151,7 +178,28 @@ namespace libed2k
         known_file_list m_known_file_list;
 
         known_file_collection();
-        add_transfer_params extract_transfer_params(time_t, const std::string&);
+
+        /**
+          * @param write_ts - file last change time
+          * @param size - file size
+          * @param filepath in UTF-8
+          * @return parameters with defined file hash when known list has the file,
+          * the entry is marked as shared now
+         */
+        add_transfer_params extract_transfer_params(time_t write_ts, size_type size, const std::string& filepath);
+
+        /**
+          * indexes known list for extract_transfer_params, called on load.
+          * Entries appended to the list later are indexed on next lookup
+         */
+        void index();
+
+        /**
+          * drops entries of the same time, size and name as an earlier one - files hashed
+          * again are appended to the list, but lookups are served by the first entry.
+          * Entries last shared before expired are dropped too, 0 keeps them all
+         */
+        void compact(time_t expired = 0);
 
         template<typename Archive>
         void save(Archive& ar)
@@ -178,12 +226,43 @@ namespace libed2k
             }
 
             ar & m_known_file_list;
+            index();
         }
 
 
         void dump() const;
 
         LIBED2K_SERIALIZATION_SPLIT_MEMBER()
+    private:
+        struct entry_key
+        {
+            entry_key(time_t ts, size_type size, const std::string& filename) :
+                m_ts(ts), m_size(size), m_filename(filename) {}
+
+            bool operator==(const entry_key& k) const
+            {
+                return m_ts == k.m_ts && m_size == k.m_size && m_filename == k.m_filename;
+            }
+
+            friend std::size_t hash_value(const entry_key& k)
+            {
+                std::size_t seed = 0;
+                boost::hash_combine(seed, k.m_ts);
+                boost::hash_combine(seed, k.m_size);
+                boost::hash_combine(seed, k.m_filename);
+                return seed;
+            }
+
+            time_t      m_ts;
+            size_type   m_size;
+            std::string m_filename;     //!< without BOM
+        };
+
+        static entry_key key(const known_file_entry& entry);
+
+        typedef boost::unordered_map<entry_key, size_t, boost::hash<entry_key> > entries_index;
+        entries_index   m_index;        //!< entry position in known list by key
+        size_t          m_indexed;      //!< count of known list entries in index
     };
 
     /**
@@ -217,10 +296,102 @@ namespace libed2k
         std::pair<add_transfer_params, error_code> operator()(const std::string&, const bool&);
     };
 
+    /**
+      * hashes shared files for transfer_params_maker in parallel. Reader threads,
+      * at most device_readers per storage device, read whole pieces into a bounded
+      * set of read_ahead buffers. Hash threads take read pieces of any files and
+      * run them through MD4 lanes together (see hasher_batch). Handler receives
+      * parameters of each completed file in a hash thread
+     */
+    class share_hasher
+    {
+    public:
+        // parameters, file change time passed to hash_file and result
+        typedef boost::function<void (const add_transfer_params&, time_t, const error_code&)> handler_t;
+
+        share_hasher(handler_t handler, int hash_threads, int read_ahead, int device_readers);
+        ~share_hasher();
+
+        void start();
+
+        /**
+          * aborts all threads, files in progress are reported as cancelled
+         */
+        void stop();
+
+        /**
+          * @param filepath in UTF-8
+          * @param fs - file status before hashing
+         */
+        void hash_file(const std::string& filepath, const file_status& fs);
+
+        /**
+          * @return true when file was in progress, it will be reported as cancelled
+         */
+        bool cancel(const std::string& filepath);
+
+        size_t in_progress();
+    private:
+        struct hashed_file
+        {
+            hashed_file(const std::string& path, const file_status& fs);
+            add_transfer_params atp;
+            error_code ec;
+            boost::uint64_t device;
+            time_t mtime;
+            int pending;                //!< pieces read but not hashed yet
+            bool reading;
+            bool cancelled;
+            bool finished;              //!< is being reported
+        };
+
+        typedef boost::shared_ptr<hashed_file> file_ptr;
+
+        struct piece_job
+        {
+            file_ptr file;
+            int index;
+            char* buffer;
+            size_t size;
+            bool skip;                  //!< file was cancelled before hashing
+            aich_hash aich;             //!< AICH subtree hash of piece
+        };
+
+        void reader(boost::uint64_t device);
+        void read_file(boost::mutex::scoped_lock& lock, file_ptr hf);
+        void hasher();
+        void finish(file_ptr hf, std::vector<file_ptr>& done);
+        void report(const std::vector<file_ptr>& done);
+
+        handler_t   m_handler;
+        int         m_hash_threads;
+        int         m_read_ahead;
+        int         m_device_readers;
+        bool        m_abort;
+
+        boost::mutex m_mutex;
+        boost::condition m_readers_condition;  //!< new files, free buffers or cancels
+        boost::condition m_hashers_condition;  //!< read pieces
+        boost::thread_group m_threads;
+
+        std::vector<file_ptr> m_files;                          //!< all files in progress until reported
+        std::map<boost::uint64_t, std::deque<file_ptr> > m_queues;  //!< files waiting for reader per device
+        std::map<boost::uint64_t, int> m_readers;               //!< reader threads per device
+        std::deque<piece_job> m_pieces;                          //!< read pieces waiting for hash threads
+        std::vector<char*> m_buffers;                           //!< free read buffers
+        int m_allocated;                                        //!< read buffers allocated
+    };
+
     class transfer_params_maker
     {
     public:
-        transfer_params_maker(alert_manager& am, const std::string& known_filepath);
+        /**
+          * @param known_max_age - seconds a known.met entry of a file not shared
+          * anymore is kept, 0 - forever
+         */
+        transfer_params_maker(alert_manager& am, const std::string& known_filepath,
+                int hash_threads = 0, int read_ahead = 8, int device_readers = 1,
+                int known_max_age = 0);
         virtual ~transfer_params_maker();
         bool start();
         void stop();
@@ -236,20 +407,162 @@ namespace libed2k
         void cancel_transfer_params(const std::string& filepath);
     protected:
         virtual void process_item();
+        void post_transfer_params(const add_transfer_params& atp, const error_code& ec);
+        void on_file_hashed(const add_transfer_params& atp, time_t write_ts, const error_code& ec);
         alert_manager&      m_am;
         mutable bool        m_abort;                //!< cancel thread
         mutable bool        m_abort_current;       //!< cancel one file
         std::string         m_current_filepath;     //!< current file path
     private:
+        /**
+          * hashed files are appended to journal next to known.met in batches,
+          * journal is merged into known.met when it grows as large as known.met
+         */
+        std::string known_journal_path() const;
+        void load_known();
+        void flush_known();
+        void compact_known();
+
         std::string m_known_filepath;
-        known_file_collection m_kfc;
+        int m_known_max_age;
+        known_file_collection m_kfc;        //!< hashed files join it at once, guarded by m_mutex
+        size_t m_known_saved;               //!< entries of m_kfc in known.met, others are in journal
+        std::vector<known_file_entry> m_known_pending;  //!< hashed files for journal
         boost::shared_ptr<boost::thread> m_thread;
 
         boost::mutex m_mutex;
         std::deque<std::string>    m_order;
         std::queue<std::string>    m_cancel_order;  //!< order for store signals to cancel after
         boost::condition           m_condition;
+        share_hasher               m_hasher;
+
+    };
+
+    /**
+      * watches share directories and feeds transfer_params_maker with new or
+      * changed files once they stay unchanged for stable_delay seconds, removed
+      * files and changed ones before they are hashed again are posted as
+      * shared_file_removed_alert. Uses inotify on Linux, directories it can't
+      * watch are rescanned every poll_interval seconds. Symbolic links are not followed
+     */
+    class share_monitor
+    {
+    public:
+        share_monitor(alert_manager& am, transfer_params_maker& tpm, int stable_delay, int poll_interval);
+        ~share_monitor();
+
+        /**
+          * files of directory are queued for hashing, the thread starts
+          * with the first directory
+          * @param path in UTF-8
+          * @param recursive - watch subdirectories too
+         */
+        void add_directory(const std::string& path, bool recursive = true);
+
+        /**
+          * stops watching directory, its files aren't reported as removed
+         */
+        void remove_directory(const std::string& path);
+
+        void stop();
+        void operator()();
+    private:
+        struct file_state
+        {
+            file_state() : size(0), mtime(0) {}
+            explicit file_state(const file_status& fs) : size(fs.file_size), mtime(fs.mtime) {}
+
+            bool operator==(const file_state& s) const { return size == s.size && mtime == s.mtime; }
+            bool operator!=(const file_state& s) const { return !(*this == s); }
 
+            size_type size;
+            time_t mtime;
+        };
+
+        struct pending_file
+        {
+            file_state state;
+            ptime changed;              //!< last time file was seen changing
+            bool modified;              //!< file was queued before and changed since
+        };
+
+        struct command
+        {
+            std::string path;
+            bool recursive;
+            bool add;
+        };
+
+        void start();
+        void notify();
+        void wait(int timeout);
+        void execute(const command& cmd);
+
+        /**
+          * walks directory, files not in known list or differing from it
+          * become pending with changed time
+          * @param seen - collects files found when not null
+         */
+        void scan(const std::string& dir, bool recursive, ptime changed, std::set<std::string>* seen);
+        void rescan();
+        void update(const std::string& path, const file_state& state, ptime changed);
+
+        /**
+          * forgets file or all files of directory
+          * @param report - post shared_file_removed_alert for them, otherwise directory
+          * is unshared and files other roots share are kept
+         */
+        void forget(const std::string& path, bool report);
+
+        /**
+          * true when directory lies in recursive root other than itself
+         */
+        bool covered(const std::string& dir) const;
+
+        /**
+          * true when some root shares the file
+         */
+        bool shared(const std::string& path) const;
+
+        /**
+          * queues files which didn't change for stable delay
+          * @return milliseconds till next pending file is due, -1 when none
+         */
+        int check_pending();
+
+        alert_manager&          m_am;
+        transfer_params_maker&  m_tpm;
+        time_duration           m_stable_delay;
+        time_duration           m_poll_interval;
+
+        boost::mutex            m_mutex;
+        boost::condition        m_condition;
+        std::deque<command>     m_commands;     //!< directories added or removed by user
+        bool                    m_abort;
+        boost::shared_ptr<boost::thread> m_thread;
+
+        // owned by the thread
+        std::map<std::string, bool>         m_roots;    //!< watched directories and their recursive flags
+        std::map<std::string, file_state>   m_files;    //!< last seen state of files, directory files are adjacent
+        std::map<std::string, pending_file> m_pending;  //!< files waiting to settle down
+        std::map<std::string, bool>         m_unwatched; //!< directories inotify failed to watch, they are rescanned
+        bool    m_polling;                              //!< all roots are rescanned, inotify is unavailable or lost events
+        ptime   m_next_rescan;
+#if LIBED2K_USE_INOTIFY
+        void add_watch(const std::string& dir, bool recursive);
+        void unwatch(const std::string& dir);
+        void read_events();
+
+        struct directory_watch
+        {
+            std::string path;
+            bool recursive;
+        };
+
+        int m_inotify;
+        int m_wakeup[2];                                //!< pipe interrupting poll on commands
+        std::map<int, directory_watch> m_watches;       //!< directories by watch descriptors
+#endif
     };
 
     /**
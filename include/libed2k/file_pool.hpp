@@ -43,17 +43,24 @@ POSSIBILITY OF SUCH DAMAGE.
 #pragma warning(pop)
 #endif
 
-#include <map>
+#include <list>
+#include <vector>
+#include <boost/unordered_map.hpp>
 #include <libed2k/filesystem.hpp>
-#include <libed2k/time.hpp>
 #include <libed2k/thread.hpp>
+#include <libed2k/size_type.hpp>
 #include <libed2k/file_storage.hpp>
 
 namespace libed2k
 {
+    // keeps the most recently used files open. The files are spread
+    // over shards by their storage and index, each shard with its own
+    // lock and recency list, so opening a file is O(1) and different
+    // files hardly ever wait for each other
     struct LIBED2K_EXPORT file_pool : boost::noncopyable
     {
-        file_pool(int size = 40);
+        // size 0 takes a share of the process' file descriptor limit
+        file_pool(int size = 0);
         ~file_pool();
 
         boost::intrusive_ptr<file> open_file(void* st, std::string const& p
@@ -61,31 +68,71 @@ namespace libed2k
         void release(void* st);
         void release(void* st, int file_index);
         void resize(int size);
-        int size_limit() const { return m_size; }
+        int size_limit() const;
         void set_low_prio_io(bool b) { m_low_prio_io = b; }
 
+        // open_file() calls that found the file open and the ones that opened it
+        void status(size_type& hits, size_type& misses) const;
+
+        // 20% of RLIMIT_NOFILE where it's known but no more than
+        // max_default_size, 40 otherwise
+        static int default_size();
+
+        enum { max_default_size = 512 };
+
     private:
 
-        void remove_oldest();
+        enum { num_shards = 8 };
 
-        int m_size;
-        bool m_low_prio_io;
+        typedef std::pair<void*, int> file_key;
+        typedef std::vector<boost::intrusive_ptr<file> > file_list;
 
         struct lru_file_entry
         {
-            lru_file_entry(): key(0), last_use(libed2k::time_now()), mode(0) {}
+            lru_file_entry(): key(0), mode(0) {}
             mutable boost::intrusive_ptr<file> file_ptr;
             void* key;
-            libed2k::ptime last_use;
             int mode;
+            file_key index;
         };
 
+        // the least recently used entry first
+        typedef std::list<lru_file_entry> lru_list;
+
         // maps storage pointer, file index pairs to the
         // lru entry for the file
-        typedef std::map<std::pair<void*, int>, lru_file_entry> file_set;
+        typedef boost::unordered_map<file_key, lru_list::iterator, boost::hash<file_key> > file_set;
+
+        struct shard
+        {
+            shard(): limit(0), hits(0), misses(0) {}
+            mutable mutex shard_mutex;
+            lru_list lru;
+            file_set files;
+            int limit;
+            size_type hits;
+            size_type misses;
+        };
+
+        shard& shard_of(file_key const& k);
+
+        boost::intrusive_ptr<file> open_file_impl(shard& s, file_key const& k
+            , std::string const& p, file_storage::iterator fe, file_storage const& fs, int m
+            , file_list& closing, error_code& ec);
+
+        // moves the least recently used files of the shard over
+        // its limit to closing
+        void evict(shard& s, int limit, file_list& closing);
+
+        // the files are closed outside of the shard locks
+        void close_files(file_list& closing);
+
+        // resize() can be called by every disk thread sharing the pool
+        mutable mutex m_size_mutex;
+        int m_size;
+        bool m_low_prio_io;
 
-        file_set m_files;
-        mutex m_mutex;
+        shard m_shards[num_shards];
 
 #if LIBED2K_CLOSE_MAY_BLOCK
         void closer_thread_fun();
@@ -91,6 +91,7 @@ namespace libed2k
         time_t atime;
         time_t mtime;
         time_t ctime;
+        boost::uint64_t device;     //!< id of the device holding the file
         enum {
 #if defined LIBED2K_WINDOWS
             directory = _S_IFDIR,
@@ -122,6 +123,8 @@ namespace libed2k
     LIBED2K_EXPORT void remove(std::string const& f, error_code& ec);
     LIBED2K_EXPORT bool exists(std::string const& f);
     LIBED2K_EXPORT size_type file_size(std::string const& f);
+    // id of the device holding f or its closest existing parent
+    LIBED2K_EXPORT boost::uint64_t path_device(std::string const& f);
     LIBED2K_EXPORT bool is_directory(std::string const& f
         , error_code& ec);
     LIBED2K_EXPORT void recursive_copy(std::string const& old_path
@@ -191,6 +194,10 @@ namespace libed2k
             no_atime = 16,
             random_access = 32,
             lock_file = 64,
+            // transfers aligned like no_buffer ones bypass the
+            // OS cache, the rest goes through it. Unlike no_buffer
+            // any offset and size may be read or written
+            direct_io = 128,
 
             attribute_hidden = 0x1000,
             attribute_executable = 0x2000,
@@ -256,10 +263,18 @@ namespace libed2k
 
         size_type phys_offset(size_type offset);
 
+        // waits until what was written is on the disk
+        bool sync(error_code& ec);
+
 #ifdef LIBED2K_WINDOWS
         HANDLE native_handle() const { return m_file_handle; }
+        HANDLE io_handle(size_type, iovec_t const*, int) const { return m_file_handle; }
 #else
         int native_handle() const { return m_fd; }
+
+        // the descriptor bufs are transferred at file_offset through,
+        // the unbuffered one when opened in direct_io mode and they're aligned
+        int io_handle(size_type file_offset, iovec_t const* bufs, int num_bufs) const;
 #endif
 
     private:
@@ -273,6 +288,8 @@ namespace libed2k
 #endif // LIBED2K_USE_WSTRING
 #else // LIBED2K_WINDOWS
         int m_fd;
+        // opened bypassing the OS cache in direct_io mode, -1 otherwise
+        int m_direct_fd;
 #endif // LIBED2K_WINDOWS
 
 #if defined LIBED2K_WINDOWS || defined LIBED2K_LINUX || defined LIBED2K_DEBUG
@@ -287,6 +304,16 @@ namespace libed2k
         mutable int m_cluster_size;
 #endif
     };
+
+    // copies up to len bytes at offset in one file to the same offset in
+    // the other, within the kernel where it can. Returns the number of
+    // bytes copied, 0 at the end of in
+    LIBED2K_EXPORT size_type copy_range(file& in, file& out, size_type offset
+        , size_type len, error_code& ec);
+
+    // makes out share the data of in on filesystems with reflinks,
+    // returns false if it couldn't
+    LIBED2K_EXPORT bool clone_file(file const& in, file const& out);
 }
 
 #endif // LIBED2K_FILE_UTIL_HPP_INCLUDED
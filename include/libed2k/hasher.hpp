@@ -62,6 +62,56 @@ namespace libed2k
 	private:
 		md4_context m_context;
 	};
+
+	/**
+	  * hashes several independent buffers at once - pieces of a file or of
+	  * different files - in SIMD lanes where md4_batch has them. Digests are
+	  * the same as of a hasher fed with each buffer. The buffers must stay
+	  * valid until final()
+	 */
+	class hasher_batch
+	{
+	public:
+
+		void add(const char* data, size_t len)
+		{
+			LIBED2K_ASSERT(data != 0 || len == 0);
+			m_data.push_back(reinterpret_cast<const unsigned char*>(data));
+			m_size.push_back(len);
+		}
+
+		size_t size() const { return m_data.size(); }
+		bool empty() const { return m_data.empty(); }
+
+		// digests in order of add() calls, the batch is empty afterwards
+		std::vector<md4_hash> final()
+		{
+			std::vector<md4_hash> res(m_data.size());
+
+			if (!m_data.empty())
+			{
+				std::vector<unsigned char> digests(m_data.size() * MD4_HASH_SIZE);
+				md4_batch(&m_data[0], &m_size[0], m_data.size(),
+					reinterpret_cast<unsigned char(*)[MD4_HASH_SIZE]>(&digests[0]));
+
+				for (size_t i = 0; i < res.size(); ++i)
+					memcpy(res[i].getContainer(), &digests[i * MD4_HASH_SIZE], MD4_HASH_SIZE);
+			}
+
+			reset();
+			return res;
+		}
+
+		void reset()
+		{
+			m_data.clear();
+			m_size.clear();
+		}
+
+	private:
+		std::vector<const unsigned char*> m_data;
+		std::vector<size_t> m_size;
+	};
 }
 
 #endif // LIBED2K_HASHER_HPP_INCLUDED
@@ -0,0 +1,83 @@
+#ifndef __LIBED2K_IO_RING__
+#define __LIBED2K_IO_RING__
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+
+#include "libed2k/config.hpp"
+#include "libed2k/error_code.hpp"
+#include "libed2k/size_type.hpp"
+#include "libed2k/filesystem.hpp"
+
+namespace libed2k
+{
+    /**
+      * submission and completion queues of Linux io_uring. Disk thread queues
+      * reads and writes of several blocks or pieces here and has them all in
+      * flight at once instead of one blocking call after another. Talks to
+      * the kernel through raw system calls, no liburing is needed. Where
+      * io_uring isn't supported open() fails and callers stay with blocking I/O
+     */
+    class io_ring : boost::noncopyable
+    {
+    public:
+        enum op_t { read_op, write_op };
+
+        // tags of completed operations with bytes transferred or -errno
+        typedef std::vector<std::pair<boost::uint64_t, int> > results_t;
+
+        io_ring();
+        ~io_ring();
+
+        /**
+          * @param entries - max operations in flight, rounded up to power of 2
+         */
+        bool open(int entries, error_code& ec);
+        void close();
+        bool is_open() const { return m_fd >= 0; }
+
+        int entries() const { return m_entries; }
+        int queued() const { return m_queued; }
+
+        /**
+          * queues vectored operation, bufs have to stay valid till it completes
+          * @return false when the queue is full
+         */
+        bool prepare(op_t op, file const& f, size_type offset
+            , file::iovec_t const* bufs, int num_bufs, boost::uint64_t tag);
+
+        /**
+          * submits queued operations and waits until all of them complete
+          * @return false when the kernel refused some, they are reported
+          * with their error
+         */
+        bool submit_and_wait(results_t& results, error_code& ec);
+
+    private:
+        void reap(results_t& results, int& in_flight);
+
+        int m_fd;
+        int m_entries;
+        int m_queued;               //!< prepared but not submitted yet
+
+        void* m_sq_ring;
+        size_t m_sq_ring_size;
+        void* m_cq_ring;
+        size_t m_cq_ring_size;
+        void* m_sqes;
+        size_t m_sqes_size;
+
+        unsigned* m_sq_tail;
+        unsigned* m_sq_array;
+        unsigned m_sq_mask;
+        unsigned* m_cq_head;
+        unsigned* m_cq_tail;
+        unsigned m_cq_mask;
+        void* m_cqes;
+    };
+}
+
+#endif
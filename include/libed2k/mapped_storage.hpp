@@ -0,0 +1,108 @@
+#ifndef __LIBED2K_MAPPED_STORAGE__
+#define __LIBED2K_MAPPED_STORAGE__
+
+#include <map>
+#include <list>
+#include <vector>
+#include <utility>
+#include <boost/noncopyable.hpp>
+#include <boost/intrusive_ptr.hpp>
+
+#include "libed2k/config.hpp"
+#include "libed2k/thread.hpp"
+#include "libed2k/storage.hpp"
+
+namespace libed2k
+{
+    /**
+      * memory mapped windows of files shared by all mapped storages of a
+      * session. The number of windows bounds the address space they take,
+      * the least recently used window not in use is unmapped to make room.
+      * Bytes written into mappings are handed to the kernel for write-back
+      * in batches
+     */
+    class mapping_cache : boost::noncopyable
+    {
+    public:
+        // files are mapped in aligned windows of this size
+        enum { window_size = 16 * 1024 * 1024 };
+
+        struct window;
+
+        mapping_cache(int max_windows = 32, int flush_bytes = 16 * 1024 * 1024);
+        ~mapping_cache();
+
+        void set_limits(int max_windows, int flush_bytes);
+        int num_windows() const;
+
+        /**
+          * maps the window of the file holding offset and keeps it mapped
+          * until unpin(). For writes the file is extended to file_size first
+          * @return the address of offset and in size the bytes mapped from
+          * it, at most the size asked for. 0 when the range can't be mapped
+         */
+        char* pin(void* st, int file_index, boost::intrusive_ptr<file> const& f
+            , size_type offset, size_type file_size, bool write, int& size, window*& w);
+
+        /**
+          * @param dirty - bytes written at the pinned address
+         */
+        void unpin(window* w, char* p, int dirty);
+
+        // starts write-back and unmaps the windows of the storage,
+        // all of its files when file_index is -1
+        void release(void* st, int file_index = -1);
+
+    private:
+        typedef std::pair<std::pair<void*, int>, size_type> window_key;
+        typedef std::map<window_key, window*> windows_t;
+        typedef std::vector<std::pair<boost::intrusive_ptr<file>, std::pair<size_type, size_type> > > flush_list_t;
+
+        window* find_window(void* st, int file_index, boost::intrusive_ptr<file> const& f
+            , size_type offset, size_type file_size, bool write, flush_list_t& flush);
+        void unmap(window* w);
+        void take_dirty(window* w, flush_list_t& l);
+        static void write_back(flush_list_t const& l);
+
+        mutable mutex m_mutex;
+        windows_t m_windows;
+        // unused windows, the least recently used first
+        std::list<window*> m_lru;
+        int m_max_windows;
+        int m_flush_bytes;
+        int m_dirty_bytes;
+    };
+
+    /**
+      * does its I/O through memory mappings of the files instead of reads and
+      * writes into disk buffers, ranges it can't map go through default_storage.
+      * Reads are served straight from the page cache, so it's best used with
+      * the read cache turned off
+     */
+    class LIBED2K_EXPORT mapped_storage : public default_storage
+    {
+    public:
+        mapped_storage(file_storage const& fs, file_storage const* mapped, std::string const& path
+            , file_pool& fp, std::vector<boost::uint8_t> const& file_prio, mapping_cache& mappings);
+        ~mapped_storage();
+
+        int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+        int writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+        void hint_read(int slot, int offset, int len);
+        int map_slot(int slot, int offset, int size, int mode
+            , boost::intrusive_ptr<file>& f, size_type& file_offset) { return -1; }
+        bool release_files();
+        bool delete_files();
+        bool move_storage(std::string const& save_path);
+        int move_storage_some(std::string const& save_path, bool start
+            , size_type& moved, size_type& total);
+        bool rename_file(int index, std::string const& new_filename);
+
+    private:
+        int copyv(file::iovec_t const* bufs, int slot, int offset, int num_bufs, bool write);
+
+        mapping_cache& m_mappings;
+    };
+}
+
+#endif
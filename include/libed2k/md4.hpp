@@ -26,6 +26,21 @@ namespace libed2k
     void md4_init(struct md4_context *ctx);
     void md4_update(struct md4_context *ctx, const unsigned char *data, size_t size);
     void md4_final(struct md4_context *ctx, unsigned char result[MD4_HASH_SIZE]);
+
+    // the most buffers md4_batch hashes side by side (AVX2 lanes)
+    const size_t MD4_BATCH_MAX_LANES = 8;
+
+    /**
+      * hashes count independent buffers, result[i] receives digest of data[i].
+      * Buffers go through SSE2 or AVX2 lanes when the CPU has them, the best
+      * engine up to max_lanes is chosen at run time, 1 means plain md4_update
+     */
+    void md4_batch(const unsigned char* const data[], const size_t size[], size_t count,
+                   unsigned char result[][MD4_HASH_SIZE],
+                   size_t max_lanes = MD4_BATCH_MAX_LANES);
+
+    // the number of buffers md4_batch hashes at once on this CPU
+    size_t md4_batch_lanes(size_t max_lanes = MD4_BATCH_MAX_LANES);
 }
 
 #endif
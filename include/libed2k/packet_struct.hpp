@@ -8,6 +8,7 @@
 
 #include <libed2k/bitfield.hpp>
 #include <libed2k/ctag.hpp>
+#include <libed2k/aich.hpp>
 #include <libed2k/util.hpp>
 #include <libed2k/assert.hpp>
 
@@ -1452,6 +1453,168 @@ namespace libed2k
         }
     };
 
+    /**
+      * source exchange version 2
+      * version 3 and later send hybrid (host byte order) user ids,
+      * version 2 and later append user hash, version 4 and later
+      * append crypt options
+     */
+    const boost::uint8_t SOURCE_EXCHANGE2_VERSION = 4;
+
+    struct client_request_sources2
+    {
+        boost::uint8_t  m_nVersion;
+        boost::uint16_t m_nOptions;
+        md4_hash        m_hFile;
+
+        client_request_sources2() : m_nVersion(SOURCE_EXCHANGE2_VERSION), m_nOptions(0) {}
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & m_nVersion;
+            ar & m_nOptions;
+            ar & m_hFile;
+        }
+    };
+
+    struct sx2_source
+    {
+        boost::uint32_t m_nUserId;
+        boost::uint16_t m_nPort;
+        boost::uint32_t m_nServerIP;
+        boost::uint16_t m_nServerPort;
+        md4_hash        m_hUser;
+        boost::uint8_t  m_nCryptOptions;
+
+        sx2_source() : m_nUserId(0), m_nPort(0), m_nServerIP(0), m_nServerPort(0), m_nCryptOptions(0) {}
+    };
+
+    struct client_answer_sources2
+    {
+        boost::uint8_t  m_nVersion;
+        md4_hash        m_hFile;
+        std::vector<sx2_source> m_sources;
+
+        client_answer_sources2() : m_nVersion(SOURCE_EXCHANGE2_VERSION) {}
+
+        void serialize(archive::ed2k_iarchive& ar)
+        {
+            boost::uint16_t count;
+            ar & m_nVersion;
+            ar & m_hFile;
+            ar & count;
+            m_sources.resize(count);
+
+            for (std::vector<sx2_source>::iterator i = m_sources.begin(); i != m_sources.end(); ++i)
+            {
+                ar & i->m_nUserId;
+                ar & i->m_nPort;
+                ar & i->m_nServerIP;
+                ar & i->m_nServerPort;
+                if (m_nVersion >= 2) ar & i->m_hUser;
+                if (m_nVersion >= 4) ar & i->m_nCryptOptions;
+            }
+        }
+
+        void serialize(archive::ed2k_oarchive& ar)
+        {
+            boost::uint16_t count = m_sources.size();
+            ar & m_nVersion;
+            ar & m_hFile;
+            ar & count;
+
+            for (std::vector<sx2_source>::iterator i = m_sources.begin(); i != m_sources.end(); ++i)
+            {
+                ar & i->m_nUserId;
+                ar & i->m_nPort;
+                ar & i->m_nServerIP;
+                ar & i->m_nServerPort;
+                if (m_nVersion >= 2) ar & i->m_hUser;
+                if (m_nVersion >= 4) ar & i->m_nCryptOptions;
+            }
+        }
+    };
+
+    /**
+      * AICH root exchange and recovery data for corrupt pieces
+     */
+    struct client_aich_file_hash_request
+    {
+        md4_hash m_hFile;
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & m_hFile;
+        }
+    };
+
+    struct client_aich_file_hash_answer
+    {
+        md4_hash    m_hFile;
+        aich_hash   m_hRoot;
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & m_hFile;
+            ar & m_hRoot;
+        }
+    };
+
+    struct client_aich_request
+    {
+        md4_hash        m_hFile;
+        boost::uint16_t m_nPart;
+        aich_hash       m_hRoot;
+
+        client_aich_request() : m_nPart(0) {}
+
+        template<typename Archive>
+        void serialize(Archive& ar)
+        {
+            ar & m_hFile;
+            ar & m_nPart;
+            ar & m_hRoot;
+        }
+    };
+
+    /**
+      * answer consisting of file hash only means the peer can't give recovery data
+     */
+    struct client_aich_answer
+    {
+        md4_hash            m_hFile;
+        boost::uint16_t     m_nPart;
+        aich_hash           m_hRoot;
+        aich_recovery_data  m_data;
+
+        client_aich_answer() : m_nPart(0) {}
+
+        template<typename Archive>
+        void save(Archive& ar)
+        {
+            ar & m_hFile;
+            ar & m_nPart;
+            ar & m_hRoot;
+            ar & m_data;
+        }
+
+        template<typename Archive>
+        void load(Archive& ar)
+        {
+            ar & m_hFile;
+            if (ar.bytes_left() == 0) return;
+
+            ar & m_nPart;
+            ar & m_hRoot;
+            ar & m_data;
+        }
+
+        LIBED2K_SERIALIZATION_SPLIT_MEMBER()
+    };
+
     template<> struct packet_type<client_hello> {
         static const proto_type value = OP_HELLO;
         static const proto_type protocol = OP_EDONKEYPROT;
@@ -1600,6 +1763,30 @@ namespace libed2k
         static const proto_type value       = OP_ASKDIRCONTENTSANS;
         static const proto_type protocol    = OP_EDONKEYPROT;
     };
+    template<> struct packet_type<client_request_sources2>{
+        static const proto_type value       = OP_REQUESTSOURCES2;
+        static const proto_type protocol    = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_answer_sources2>{
+        static const proto_type value       = OP_ANSWERSOURCES2;
+        static const proto_type protocol    = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_file_hash_request>{
+        static const proto_type value       = OP_AICHFILEHASHREQ;
+        static const proto_type protocol    = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_file_hash_answer>{
+        static const proto_type value       = OP_AICHFILEHASHANS;
+        static const proto_type protocol    = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_request>{
+        static const proto_type value       = OP_AICHREQUEST;
+        static const proto_type protocol    = OP_EMULEPROT;
+    };
+    template<> struct packet_type<client_aich_answer>{
+        static const proto_type value       = OP_AICHANSWER;
+        static const proto_type protocol    = OP_EMULEPROT;
+    };
 
 
     // helper for get type from item
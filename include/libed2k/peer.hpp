@@ -11,7 +11,7 @@ namespace libed2k {
     {
     public:
         peer(const tcp::endpoint& ep, bool conn):
-            endpoint(ep), connection(NULL), connectable(conn)
+            endpoint(ep), connection(NULL), connectable(conn), banned(false)
         {}
 
         ip::address address() const { return endpoint.address(); }
@@ -26,6 +26,9 @@ namespace libed2k {
         // will not be considered connectable. Peers that
         // we have a listen port for will be assumed to be.
         bool connectable;
+
+        // peer sent us corrupt data, we don't talk to it anymore
+        bool banned;
     };
 
     class peer_entry
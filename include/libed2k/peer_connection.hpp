@@ -1,6 +1,8 @@
 #ifndef __LIBED2K_PEER_CONNECTION__
 #define __LIBED2K_PEER_CONNECTION__
 
+#include <set>
+
 #include <boost/smart_ptr.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/asio.hpp>
@@ -113,9 +115,23 @@ namespace libed2k
         boost::weak_ptr<transfer> get_transfer() { return m_transfer; }
         bool has_transfer() const { return !m_transfer.expired(); }
 
+        // carries one more transfer over this connection. The transfer waits
+        // until the active one is done with the peer, then the connection
+        // switches to it without new handshake. Returns false when the
+        // connection has the transfer already
+        bool add_transfer(boost::shared_ptr<transfer> t);
+
+        // leaves the active transfer and switches to the next waiting one,
+        // disconnects with the given error when there is nothing to switch to
+        void next_transfer(const error_code& ec);
+
         peer* get_peer() const { return m_peer; }
         void set_peer(peer* pi) { m_peer = pi; }
         unsigned short user_port() const;
+
+        // sends a source exchange request for our transfer when the peer
+        // supports it and wasn't asked recently. returns true when sent
+        bool request_sources(const ptime& now);
         const tcp::endpoint& remote() const { return m_remote; }
         const bitfield& remote_pieces() const { return m_remote_pieces; }
 
@@ -194,6 +210,9 @@ namespace libed2k
         void request_ismod_directory_files(const md4_hash& hash);
 
         misc_options get_misc_options() const { return m_misc_options; }
+        bool supports_aich() const { return m_misc_options.m_nAICHVersion > 0; }
+        // asks the peer for AICH data proving blocks of the piece
+        void request_aich_recovery(const md4_hash& file_hash, int piece, const aich_hash& root);
         misc_options2 get_misc_options2() const { return m_misc_options2; }
 
         bool is_active() const { return m_active; }
@@ -227,6 +246,16 @@ namespace libed2k
         // constructor method
         void reset();
         bool attach_to_transfer(const md4_hash& hash);
+        void detach_from_transfer();
+        bool attach_to_waiting_transfer();
+
+        // true when we have nothing requested from the peer for the active
+        // transfer, so the connection may serve other one
+        bool is_idle() const;
+
+        // transfer we share with the peer but don't have to be attached to,
+        // answers on file name, status and hashset requests use it
+        boost::shared_ptr<transfer> find_shared_transfer(const md4_hash& hash) const;
 
         virtual void do_read();
         virtual void do_write(int quota = std::numeric_limits<int>::max());
@@ -255,6 +284,7 @@ namespace libed2k
         void fill_send_buffer();
         void send_data(const peer_request& r);
         void on_disk_read_complete(int ret, disk_io_job const& j, peer_request r, peer_request left);
+        void read_ahead(const peer_request& r);
         void receive_data(const peer_request& r);
         void receive_data();
         void on_disk_write_complete(int ret, disk_io_job const& j,
@@ -294,6 +324,13 @@ namespace libed2k
         void write_cancel_transfer();
         void write_request_parts(client_request_parts_64 rp);
         void write_part(const peer_request& r);
+        void write_request_sources2(const md4_hash& file_hash);
+        void write_answer_sources2(const md4_hash& file_hash, boost::uint8_t version,
+                                   const std::vector<tcp::endpoint>& sources);
+        void write_aich_file_hash_request(const md4_hash& file_hash);
+        void write_aich_file_hash_answer(const md4_hash& file_hash, const aich_hash& root);
+        void write_aich_answer(const md4_hash& file_hash, int piece, const aich_hash& root,
+                               const aich_recovery_data& data);
 
         // protocol handlers
         void on_hello(const error_code& error);
@@ -326,6 +363,14 @@ namespace libed2k
         void on_client_message(const error_code& error);
         void on_client_captcha_request(const error_code& error);
         void on_client_captcha_result(const error_code& error);
+        void on_request_sources2(const error_code& error);
+        void on_answer_sources2(const error_code& error);
+        void on_aich_file_hash_request(const error_code& error);
+        void on_aich_file_hash_answer(const error_code& error);
+        void on_aich_request(const error_code& error);
+        void on_aich_answer(const error_code& error);
+        void on_aich_answer_ready(boost::shared_ptr<transfer> t, int piece,
+                                  const aich_recovery_data& data, bool ok);
         template <typename Struct> void on_request_parts(const error_code& error);
         template <typename Struct> void on_sending_part(const error_code& error);
 
@@ -341,6 +386,11 @@ namespace libed2k
         ptime m_last_sent;
         time_duration m_timeout;
 
+        // source exchange rate limits, the last time we asked the peer
+        // for sources and the last time we answered its request
+        ptime m_last_source_request;
+        ptime m_last_source_answer;
+
         // if this peer is receiving a piece, this
         // points to a disk buffer that the data is
         // read into. This eliminates a memcopy from
@@ -354,6 +404,14 @@ namespace libed2k
         // set to the transfer it belongs to.
         boost::weak_ptr<transfer> m_transfer;
 
+        // other transfers for which this peer is the source, in the order
+        // they will be switched to when the active transfer is done
+        std::deque<boost::weak_ptr<transfer> > m_waiting_transfers;
+
+        // files the peer told us it hasn't, they aren't requested again
+        // over this connection
+        std::set<md4_hash> m_missing_files;
+
         // the pieces the other end have
         bitfield m_remote_pieces;
 
@@ -361,6 +419,17 @@ namespace libed2k
         // from this peer
         std::vector<peer_request> m_requests;
 
+        // the end of the last request we have served, how many requests
+        // in a row continued the previous one and where the read ahead
+        // for the peer ends in that piece
+        int m_last_request_piece;
+        int m_last_request_end;
+        int m_sequential_requests;
+        int m_read_ahead_end;
+
+        // piece of the AICH recovery request being answered, -1 when there is none
+        int m_aich_request_piece;
+
         // the blocks we have reserved in the piece
         // picker and will request from this peer.
         std::vector<pending_block> m_request_queue;
@@ -17,7 +17,9 @@ namespace libed2k {
     public:
         policy(transfer* t);
         // this is called once for every peer we get from the server.
-        peer* add_peer(const tcp::endpoint& ep);
+        // Sources learned by source exchange are added as connectable
+        // and are passed on to other peers by it in turn
+        peer* add_peer(const tcp::endpoint& ep, bool connectable = false);
         // called when an incoming connection is accepted
         // false means the connection was refused or failed
         bool new_connection(peer_connection& c);
@@ -30,6 +32,16 @@ namespace libed2k {
         void set_connection(peer* p, peer_connection* c);
         bool connect_one_peer();
 
+        // hands this transfer to connections opened for other transfers
+        // to the peers we know as its sources
+        void share_connections();
+
+        // collects up to max_count endpoints of peers we can hand out
+        // to other peers by source exchange. Connected peers go first,
+        // peers at the requester's address are skipped
+        void get_exchange_sources(std::vector<tcp::endpoint>& sources,
+                                  const ip::address& requester, size_t max_count) const;
+
     private:
 
         typedef std::deque<peer*> peers_t;
@@ -24,7 +24,7 @@ namespace libed2k
     {
         friend class aux::session_impl;
     public:
-        server_connection(aux::session_impl& ses);
+        server_connection(aux::session_impl& ses, const std::string& hostname, int port);
         ~server_connection();
 
         /**
@@ -35,6 +35,8 @@ namespace libed2k
         void stop();
 
         const tcp::endpoint& serverEndpoint() const;
+        const std::string& hostname() const { return m_hostname; }
+        int port() const { return m_port; }
 
         bool offline()      const { return m_state == SC_OFFLINE; }
         bool online()       const { return m_state == SC_ONLINE; }
@@ -50,7 +52,9 @@ namespace libed2k
         void post_search_more_result_request();
         void post_sources_request(const md4_hash& hFile, boost::uint64_t nSize);
         void post_announce(shared_files_list& offer_list);
+        void post_callback_request(boost::uint32_t client_id);
         void check_keep_alive(int tick_interval_ms);
+        void check_reconnect(int tick_interval_ms);
     private:
 
         /**
@@ -95,6 +99,11 @@ namespace libed2k
         bool compatible_state(char c) const;
 
         int                             m_last_keep_alive_packet;
+        int                             m_last_connect_duration; //!< milliseconds since last connect attempt
+        bool                            m_user_announced;   //!< ismod extension - user was shared as file
+        std::set<md4_hash>              m_announced_files;  //!< transfers offered on this server
+        std::string                     m_hostname;
+        int                             m_port;
         char                            m_state;
         boost::uint32_t                 m_nClientId;
         tcp::resolver                   m_name_lookup;
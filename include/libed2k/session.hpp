@@ -18,6 +18,7 @@
 namespace libed2k {
 
     class session_settings;
+    struct cache_status;
     struct transfer_handle;
     class add_transfer_params;
     struct ip_filter;
@@ -50,6 +51,10 @@ namespace libed2k {
 
         session_status status() const;
 
+        // disk cache statistics of all the disk io threads together,
+        // see disk_io_thread.hpp
+        cache_status get_cache_status() const;
+
         // all transfer_handles must be destructed before the session is destructed!
         transfer_handle add_transfer(const add_transfer_params& params);
         transfer_handle find_transfer(const md4_hash& hash) const;
@@ -96,6 +101,14 @@ namespace libed2k {
         void make_transfer_parameters(const std::string& filepath);
         void cancel_transfer_parameters(const std::string& filepath);
 
+        /**
+          * files of directory are hashed as they appear or change,
+          * shared_file_removed_alert is posted for files which go away
+          * @param path in UTF-8
+         */
+        void add_share_directory(const std::string& path, bool recursive = true);
+        void remove_share_directory(const std::string& path);
+
     private:
         void init(const fingerprint& id, const char* listen_interface,
                   const session_settings& settings);
@@ -3,10 +3,12 @@
 #define __LIBED2K_SESSION_IMPL__
 
 #include <string>
+#include <list>
 #include <map>
 #include <set>
 
 #include <boost/pool/object_pool.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "libed2k/socket.hpp"
 #include "libed2k/stat.hpp"
@@ -22,6 +24,7 @@
 #include "libed2k/file.hpp"
 #include "libed2k/disk_io_thread.hpp"
 #include "libed2k/file_pool.hpp"
+#include "libed2k/mapped_storage.hpp"
 #include "libed2k/bandwidth_manager.hpp"
 #include "libed2k/connection_queue.hpp"
 #include "libed2k/session_status.hpp"
@@ -125,6 +128,9 @@ namespace libed2k {
 
             /** file hasher closed in self thread */
             transfer_params_maker    m_tpm;
+
+            /** feeds m_tpm with changes of share directories */
+            share_monitor            m_share_monitor;
         };
 
         class session_impl : public session_impl_base
@@ -134,6 +140,7 @@ namespace libed2k {
             // the size of each allocation that is chained in the send buffer
             enum { send_buffer_size = 128 };
             typedef std::set<boost::intrusive_ptr<peer_connection> > connection_map;
+            typedef std::vector<boost::intrusive_ptr<server_connection> > server_connection_list;
 
             session_impl(const fingerprint& id, const char* listen_interface,
                          const session_settings& settings);
@@ -157,6 +164,13 @@ namespace libed2k {
 
             void update_disk_thread_settings();
 
+            /**
+              * disk io thread for transfers saved to the path, one per storage
+              * device or group of them, see session_settings::disk_threads.
+              * The thread is started with the first transfer on the device
+             */
+            disk_io_thread& disk_thread(const std::string& save_path);
+
             void async_accept(boost::shared_ptr<tcp::acceptor> const& listener);
             void on_accept_connection(boost::shared_ptr<tcp::socket> const& s,
                                       boost::weak_ptr<tcp::acceptor> listener,
@@ -178,11 +192,33 @@ namespace libed2k {
             /** remove transfer from check queue */
             void dequeue_check_transfer(boost::shared_ptr<transfer> const& t);
 
+            /**
+              * transfers on different storage devices are checked in parallel,
+              * one at a time on each device, see session_settings::hashing_threads
+             */
+            boost::uint64_t check_device(const transfer& t) const;
+            std::set<boost::uint64_t> checking_devices() const;
+            void start_queued_checks();
+
+            /** stores connection in m_connections and indexes it by address */
+            void add_connection(const boost::intrusive_ptr<peer_connection>& c);
             void close_connection(const peer_connection* p, const error_code& ec);
 
             session_status status() const;
+            cache_status get_cache_status() const;
             const tcp::endpoint& server() const;
 
+            /**
+              * server connection which represents us to peers and executes searches:
+              * the first online server giving us high id, else the first online server,
+              * else the main server from settings
+             */
+            boost::intrusive_ptr<server_connection> current_server() const;
+            boost::uint32_t client_id() const;
+
+            /** true when address belongs to one of our ed2k servers */
+            bool is_server_address(const ip::address& addr) const;
+
             virtual void abort();
 
             bool is_aborted() const { return m_abort; }
@@ -260,7 +296,7 @@ namespace libed2k {
             /** this method simple send information packet to server and break search order */
             void post_cancel_search();
 
-            /** request sources for file */
+            /** request sources for file on all online servers */
             void post_sources_request(const md4_hash& hFile, boost::uint64_t nSize);
 
             /**
@@ -270,19 +306,71 @@ namespace libed2k {
             boost::intrusive_ptr<peer_connection> initialize_peer(client_id_type nIP, int nPort);
 
             /**
-              * announce transfers
-              * will perform only when server connection online
+              * ask the server which gave us the low id source to make it connect to us.
+              * pending callbacks occupy a half-open connection slot and expire
+              * after peer_callback_timeout seconds
+             */
+            void request_callback(boost::intrusive_ptr<server_connection> sc,
+                                  boost::uint32_t client_id, const md4_hash& hash);
+
+            /**
+              * an incoming connection introduced itself with client id and the
+              * server it is logged on, returns the hash of the transfer we asked
+              * it to call back for
+             */
+            bool accept_callback(const net_identifier& server, boost::uint32_t client_id, md4_hash& hash);
+
+            /**
+              * the server asks us to connect to a peer which can't reach us
+             */
+            void on_callback_requested(const net_identifier& np);
+
+            /**
+              * put transfer to announce queue, it will be (re)announced on server
+              * call on transfer add and when transfer's announce changes
+             */
+            void queue_announce(const md4_hash& hash);
+            void unqueue_announce(const md4_hash& hash);
+
+            /**
+              * server lost our offers - queue its transfers for announce again
+             */
+            void drop_server_announces(server_connection& sc);
+
+            /**
+              * online servers changed - servers which still offer transfers now
+              * belonging to another one withdraw their offers and announce again
+              * the transfers left to them, so a server coming back gets its share
+             */
+            void rebalance_announces();
+
+            /**
+              * announce transfers from announce queue
+              * every transfer is announced on one online server chosen by its hash,
+              * each server gets no more than m_max_announces_per_call files per call
              */
             void announce(int tick_interval_ms);
 
             /**
-              * perform reconnect to server
-              * will perform only when server connection offline
+              * perform reconnect to servers
+              * will perform only for offline server connections
              */
             void reconnect(int tick_interval_ms);
             void server_conn_start();
             void server_conn_stop();
 
+            /**
+              * synchronize server connections with server_hostname/server_port
+              * and additional_servers settings
+             */
+            void update_server_connections();
+
+            // low id is unique on its server only
+            typedef std::pair<net_identifier, boost::uint32_t> callback_key;
+
+            void on_callback_connect(callback_key key, int ticket);
+            void on_callback_timeout(callback_key key);
+
             void update_connections_limit();
             void update_rate_settings();
             void update_active_transfers();
@@ -310,6 +398,10 @@ namespace libed2k {
             // when they are destructed.
             file_pool m_filepool;
 
+            // windows of files mapped by mapped storages, unmapped
+            // by the storages before this is destructed
+            mapping_cache m_mappings;
+
             // handles disk io requests asynchronously
             // peers have pointers into the disk buffer
             // pool, and must be destructed before this
@@ -320,6 +412,15 @@ namespace libed2k {
             // constructed after it.
             disk_io_thread m_disk_thread;
 
+            // disk io threads of further storage devices, they allocate
+            // buffers from m_disk_thread and are destructed before it
+            std::vector<boost::shared_ptr<disk_io_thread> > m_device_threads;
+
+            // index of the disk io thread of a storage device and of a
+            // group of devices, 0 is m_disk_thread and i is m_device_threads[i - 1]
+            std::map<boost::uint64_t, int> m_device_thread_index;
+            std::map<int, int> m_group_thread_index;
+
             // this is a list of half-open tcp connections
             // (only outgoing connections)
             // this has to be one of the last
@@ -339,8 +440,27 @@ namespace libed2k {
 
             bandwidth_channel* m_bandwidth_channel[2];
 
-            // ed2k server connection
-            boost::intrusive_ptr<server_connection> m_server_connection;
+            // ed2k server connections, the first one is the server from
+            // server_hostname/server_port settings
+            server_connection_list m_server_connections;
+
+            // online servers the transfers announces are partitioned over
+            server_connection_list m_announce_servers;
+
+            // transfers waiting for (re)announce on servers in order they were
+            // queued, and their positions in the queue
+            std::list<md4_hash> m_announce_queue;
+            std::map<md4_hash, std::list<md4_hash>::iterator> m_announce_queued;
+
+            struct pending_callback
+            {
+                boost::intrusive_ptr<server_connection> server;
+                md4_hash hash;
+                int ticket;  // connection queue ticket, -1 while queued
+            };
+
+            // low id peers we asked to connect to us, by their server and client id
+            std::map<callback_key, pending_callback> m_pending_callbacks;
 
             // the index of the transfers that will be offered to
             // connect to a peer next time on_tick is called.
@@ -352,6 +472,11 @@ namespace libed2k {
             // peers.
             connection_map m_connections;
 
+            // m_connections by remote address, the port a peer listens on
+            // is known after its hello only, so lookups check it
+            typedef boost::unordered_multimap<boost::uint32_t, peer_connection*> connection_index;
+            connection_index m_connection_index;
+
             // filters incoming connections
             ip_filter m_ip_filter;
 
@@ -380,13 +505,9 @@ namespace libed2k {
             deadline_timer m_timer;
 
             ptime m_last_tick;
-            // duration in milliseconds since last server connection was executed
-            int m_last_connect_duration;
             // duration in milliseconds since last announce check was performed
             int m_last_announce_duration;
-            // ismod extension - share user as file
-            bool m_user_announced;
-            // last measured server connection state
+            // last measured server connections state, online when any server is online
             char m_server_connection_state;
 
             // total redundant and failed bytes
@@ -11,11 +11,14 @@ namespace libed2k
     {
     public:
         typedef std::vector<std::pair<std::string, bool> >  fd_list;
+        typedef std::vector<std::pair<std::string, int> >   server_list;
+        typedef std::vector<std::pair<std::string, int> >   path_groups;
 
         session_settings():
             server_timeout(220)
             , peer_timeout(120)
             , peer_connect_timeout(7)
+            , peer_callback_timeout(30)
             , block_request_timeout(10)
             , connection_speed(6)
             , allow_multiple_connections_per_ip(false)
@@ -29,6 +32,10 @@ namespace libed2k
             , server_keep_alive_timeout(200)
             , server_reconnect_timeout(5)
             , max_peerlist_size(4000)
+            , source_exchange_interval(40*60)
+            , transfer_source_exchange_interval(30)
+            , max_source_exchange_sources(500)
+            , aich_trust_sources(10)
             , tick_interval(100)
             , download_rate_limit(-1)
             , upload_rate_limit(-1)
@@ -41,11 +48,18 @@ namespace libed2k
             , m_show_shared_catalogs(true)
             , m_show_shared_files(true)
             , user_agent(md4_hash::emule)
+            , known_file_max_age(60 * 24 * 3600)
+            , share_hashing_threads(0)
+            , share_hashing_read_ahead(8)
+            , share_hashing_device_readers(1)
+            , share_monitor_stable_delay(10)
+            , share_monitor_poll_interval(60)
             , ignore_resume_timestamps(false)
             , no_recheck_incomplete_resume(false)
+            , quick_resume_verify(true)
             , alert_queue_size(1000)
             // Disk IO settings
-            , file_pool_size(40)
+            , file_pool_size(0)
             , max_queued_disk_bytes(16*1024*1024)
             , max_queued_disk_bytes_low_watermark(0)
             , cache_size((16*1024*1024) / BLOCK_SIZE)
@@ -57,8 +71,13 @@ namespace libed2k
             , disk_io_read_mode(0)
             , coalesce_reads(false)
             , coalesce_writes(false)
+            , use_io_uring(false)
+            , io_uring_queue_depth(32)
             , optimize_hashing_for_speed(true)
+            , hashing_threads(1)
+            , disk_threads(1)
             , file_checks_delay_per_block(0)
+            , move_storage_slice_size(16 * 1024 * 1024)
             , disk_cache_algorithm(avoid_readback)
             , read_cache_line_size((32*16*1024) / BLOCK_SIZE)
             , write_cache_line_size((32*16*1024) / BLOCK_SIZE)
@@ -68,11 +87,17 @@ namespace libed2k
 #ifndef LIBED2K_DISABLE_MLOCK
             , lock_disk_cache(false)
 #endif
+            , use_huge_pages(false)
             , volatile_read_cache(false)
             , default_cache_min_age(1)
             , no_atime_storage(true)
             , read_job_every(10)
             , use_disk_read_ahead(true)
+            , upload_read_ahead_seconds(4)
+            , upload_read_ahead_limit((2*1024*1024) / BLOCK_SIZE)
+            , use_mapped_storage(false)
+            , mapped_storage_windows(32)
+            , mapped_storage_flush_bytes(16*1024*1024)
             , lock_files(false)
             , low_prio_disk(true)
         {
@@ -93,6 +118,10 @@ namespace libed2k
         // connection is dropped. The time is specified in seconds.
         int peer_connect_timeout;
 
+        // the number of seconds to wait for a low id peer to connect
+        // to us after we asked the server to call it back
+        int peer_callback_timeout;
+
         // the number of seconds to wait for block request.
         int block_request_timeout;
 
@@ -121,6 +150,11 @@ namespace libed2k
         std::string server_hostname;
         // ed2k server port
         int server_port;
+        // additional ed2k servers (hostname, port) the session stays
+        // connected to together with server_hostname:server_port.
+        // shared files are partitioned between online servers for
+        // announcing and source requests go to every online server
+        server_list additional_servers;
         // ed2k peer port for incoming peer connections
         int listen_port;
         // ed2k client name
@@ -136,6 +170,23 @@ namespace libed2k
         // about, not necessarily connected to.
         int max_peerlist_size;
 
+        // the number of seconds between source exchange requests
+        // sent to the same peer for the same transfer. Incoming
+        // requests are answered at most this often too.
+        // 0 turns source exchange off
+        int source_exchange_interval;
+
+        // the number of seconds between two source exchange requests
+        // of one transfer, spreads the requests over connected peers
+        int transfer_source_exchange_interval;
+
+        // the max number of sources sent in one source exchange answer
+        int max_source_exchange_sources;
+
+        // the number of peers with distinct IPs which have to tell the same
+        // AICH root before we trust it and repair corrupt pieces with it
+        int aich_trust_sources;
+
         // the number of milliseconds between internal ticks. Should be no
         // more than one second (i.e. 1000).
         int tick_interval;
@@ -172,6 +223,28 @@ namespace libed2k
         //!< known.met file
         std::string m_known_file;
 
+        // seconds a known.met entry of a file that is not shared anymore
+        // is kept, 0 - forever
+        int known_file_max_age;
+
+        // the number of threads hashing shared files, 0 - one per CPU core
+        int share_hashing_threads;
+
+        // the max number of pieces read ahead for share hashing threads,
+        // each one takes a buffer of PIECE_SIZE
+        int share_hashing_read_ahead;
+
+        // the number of files read at once from one storage device while
+        // hashing shares. Keep 1 for spinning disks, SSDs take more
+        int share_hashing_device_readers;
+
+        // seconds a new or changed file in a monitored share directory has
+        // to stay unchanged before it is hashed
+        int share_monitor_stable_delay;
+
+        // seconds between rescans of share directories inotify can't watch
+        int share_monitor_poll_interval;
+
         //!< users files and directories
         //!< second parameter true for recursive search and false otherwise
         fd_list m_fd_list;
@@ -194,6 +267,12 @@ namespace libed2k
         // we have none of the files and go straight to download
         bool no_recheck_incomplete_resume;
 
+        // resume data keeps fingerprints of the pieces we have, hashes of a
+        // few pages sampled from each. When files changed since it was saved
+        // (e.g. their timestamps were reset) and this is set, the pieces it
+        // has are only hashed in full when their sampled pages don't match
+        bool quick_resume_verify;
+
         // the max alert queue size
         int alert_queue_size;
 
@@ -213,6 +292,7 @@ namespace libed2k
         // usually a good idea to find this limit and set the
         // number of connections and the number of files
         // limits so their sum is slightly below it.
+        // 0 takes 20% of the file descriptor limit (RLIMIT_NOFILE)
         int file_pool_size;
 
         // the maximum number of bytes a connection may have
@@ -260,11 +340,16 @@ namespace libed2k
         // cached.
         bool explicit_read_cache;
 
+        // with disable_os_cache_for_aligned_blocks in either mode, block
+        // sized transfers from disk buffers bypass the OS cache, leaving
+        // the disk cache the only one. Unaligned ones, like the tail of a
+        // file, go through the OS cache and are dropped from it after
         enum io_buffer_mode_t
         {
             enable_os_cache = 0,
             disable_os_cache_for_aligned_files = 1,
-            disable_os_cache = 2
+            disable_os_cache = 2,
+            disable_os_cache_for_aligned_blocks = 3
         };
         int disk_io_write_mode;
         int disk_io_read_mode;
@@ -272,11 +357,41 @@ namespace libed2k
         bool coalesce_reads;
         bool coalesce_writes;
 
+        // on Linux the disk thread submits flushed write cache blocks and
+        // read cache misses in batches through io_uring, instead of
+        // one blocking call per file range. Ignored where io_uring isn't
+        // available, the disk thread stays with blocking I/O then
+        bool use_io_uring;
+
+        // the max number of reads or writes in flight in one batch
+        int io_uring_queue_depth;
+
         // if this is set to false, the hashing will be
         // optimized for memory usage instead of the
         // number of read operations
         bool optimize_hashing_for_speed;
 
+        // the number of threads verifying downloaded pieces, so
+        // hashing doesn't hold up reads and writes of the disk
+        // thread. Unless it's 0, files of transfers are also checked
+        // by a thread per storage device. 0 means pieces are hashed
+        // and files are checked by the disk thread
+        int hashing_threads;
+
+        // the max number of disk io threads. Each storage device gets its
+        // own thread with its own job queue and elevator, so transfers on
+        // different devices are read and written in parallel. When there
+        // are more devices than threads, devices share threads. Disk
+        // buffers are shared and cache_size limits all the threads together,
+        // each of them caches up to an equal part of it.
+        // Every thread runs hashing_threads hash threads of its own
+        int disk_threads;
+
+        // (path, group) pairs, devices of the paths of one group share
+        // a disk io thread, like partitions of one disk or a RAID. Takes
+        // effect for transfers added later
+        path_groups disk_thread_groups;
+
         // if > 0, file checks will have a short
         // delay between disk operations, to make it 
         // less intrusive on the system as a whole
@@ -287,6 +402,11 @@ namespace libed2k
         // the checking rate to 1.6 MiB per second
         int file_checks_delay_per_block;
 
+        // when storage is moved to another device the files are copied
+        // this many bytes at a time, the disk thread runs the jobs
+        // queued meanwhile before it copies the next slice
+        int move_storage_slice_size;
+
         enum disk_cache_algo_t
         { lru, largest_contiguous, avoid_readback };
 
@@ -330,6 +450,11 @@ namespace libed2k
         bool lock_disk_cache;
 #endif
 
+        // back the disk buffers with 2 MiB pages where the system has
+        // them. Big caches take much fewer TLB entries this way. Slabs
+        // allocated from now on are affected
+        bool use_huge_pages;
+
         // if this is set to true, any block read from the
         // disk cache will be dropped from the cache immediately
         // following. This may be useful if the block is not
@@ -353,6 +478,26 @@ namespace libed2k
         // ahead of time
         bool use_disk_read_ahead;
 
+        // when a peer requests consecutive ranges of a piece, the rest of
+        // the piece is read into the cache this many seconds of its upload
+        // rate ahead of the requests, 0 disables it
+        int upload_read_ahead_seconds;
+
+        // the max number of blocks read ahead for one peer
+        int upload_read_ahead_limit;
+
+        // transfers added from now on do their disk I/O through memory
+        // mappings of the files. Reads then come from the page cache,
+        // turn off use_read_cache not to keep the data twice
+        bool use_mapped_storage;
+
+        // the max number of 16 MiB windows of files mapped at once
+        int mapped_storage_windows;
+
+        // after this many bytes written into mappings the kernel is
+        // asked to start writing them out
+        int mapped_storage_flush_bytes;
+
         // if set to true, files will be locked when opened.
         // preventing any other process from modifying them
         bool lock_files;
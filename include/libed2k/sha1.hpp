@@ -0,0 +1,27 @@
+/*
+ * SHA-1 (FIPS 180-1) message digest with the same interface as md4.hpp,
+ * used by AICH hash trees. Placed in the public domain.
+ */
+
+#ifndef __SHA1_H
+#define __SHA1_H
+
+#include "libed2k/size_type.hpp"
+
+namespace libed2k
+{
+    const size_t SHA1_HASH_SIZE = 160/8;
+
+    struct sha1_context
+    {
+        boost::uint32_t lo, hi;
+        boost::uint32_t state[5];
+        unsigned char buffer[64];
+    };
+
+    void sha1_init(struct sha1_context *ctx);
+    void sha1_update(struct sha1_context *ctx, const unsigned char *data, size_t size);
+    void sha1_final(struct sha1_context *ctx, unsigned char result[SHA1_HASH_SIZE]);
+}
+
+#endif
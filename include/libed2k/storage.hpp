@@ -46,6 +46,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/intrusive_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -124,6 +125,13 @@ namespace libed2k
 
         virtual size_type physical_offset(int slot, int offset) = 0;
 
+        // finds the file that holds the start of the range and the offset
+        // in it, so the caller can do the I/O on the file by itself. Returns
+        // the number of bytes of the range in that file, or -1 if the range
+        // can't be accessed directly (no files, pad file, unaligned access)
+        virtual int map_slot(int slot, int offset, int size, int mode
+            , boost::intrusive_ptr<file>& f, size_type& file_offset) { return -1; }
+
         // returns the end of the sparse region the slot 'start'
         // resides in i.e. the next slot with content. If start
         // is not in a sparse region, start itself is returned
@@ -132,6 +140,20 @@ namespace libed2k
         // non-zero return value indicates an error
         virtual bool move_storage(std::string const& save_path) = 0;
 
+        // moves the files a slice at a time, so that other disk jobs run
+        // in between. The call with start set begins the move, replacing
+        // one not finished, the next ones continue it. Returns 1 while
+        // there's more to move, with the bytes moved so far and in total,
+        // 0 when it's done and -1 on errors. By default the first call
+        // moves everything
+        virtual int move_storage_some(std::string const& save_path, bool start
+            , size_type& moved, size_type& total)
+        { return move_storage(save_path) ? 0 : -1; }
+
+        // drops the move begun by move_storage_some, the files stay
+        // at the old save path
+        virtual void abandon_move() {}
+
         // verify storage dependent fast resume entries
         virtual bool verify_resume_data(lazy_entry const& rd, error_code& error) = 0;
 
@@ -195,6 +217,8 @@ namespace libed2k
         bool delete_files();
         bool initialize(bool allocate_files);
         bool move_storage(std::string const& save_path);
+        int move_storage_some(std::string const& save_path, bool start
+            , size_type& moved, size_type& total);
         int read(char* buf, int slot, int offset, int size);
         int write(char const* buf, int slot, int offset, int size);
         int sparse_end(int start) const;
@@ -202,6 +226,8 @@ namespace libed2k
         int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
         int writev(file::iovec_t const* buf, int slot, int offset, int num_bufs);
         size_type physical_offset(int slot, int offset);
+        int map_slot(int slot, int offset, int size, int mode
+            , boost::intrusive_ptr<file>& f, size_type& file_offset);
         bool move_slot(int src_slot, int dst_slot);
         bool swap_slots(int slot1, int slot2);
         bool swap_slots3(int slot1, int slot2, int slot3);
@@ -226,6 +252,14 @@ namespace libed2k
         int readwritev(file::iovec_t const* bufs, int slot, int offset
             , int num_bufs, fileop const&);
 
+        // a range of files already copied by an unfinished move was
+        // written, its slot is copied again after the rest
+        void moved_range_written(int slot, int offset, int size);
+        // copies a slot written behind the copy again and syncs it
+        bool copy_moved_slot(int slot);
+        // removes the copies of an unfinished move
+        void abandon_move();
+
         size_type read_unaligned(boost::intrusive_ptr<file> const& file_handle
             , size_type file_offset, file::iovec_t const* bufs, int num_bufs, error_code& ec);
         size_type write_unaligned(boost::intrusive_ptr<file> const& file_handle
@@ -249,6 +283,35 @@ namespace libed2k
 
         int m_page_size;
         bool m_allocate_files;
+
+        // files being copied to another device by move_storage_some
+        struct move_state
+        {
+            struct moved_file
+            {
+                int index;
+                std::string from;
+                std::string to;
+                size_type size;
+            };
+
+            std::string save_path;
+            std::vector<moved_file> files;
+            // the top level entries of the old save path, removed after
+            std::vector<std::string> remove;
+            // the file being copied, the bytes of it copied and the
+            // handles it's copied with
+            int current;
+            size_type offset;
+            boost::intrusive_ptr<file> from;
+            boost::intrusive_ptr<file> to;
+            size_type moved;
+            size_type total;
+            // slots written after they were copied, they're copied
+            // again once all files are
+            std::vector<bool> dirty;
+        };
+        boost::scoped_ptr<move_state> m_move;
     };
 
     // this storage implementation does not write anything to disk
@@ -308,6 +371,11 @@ namespace libed2k
         boost::intrusive_ptr<transfer_info const> info() const { return m_info; }
         void write_resume_data(entry& rd) const;
 
+        // false while the write queue of its disk io thread is full
+        bool can_write() const;
+
+        disk_io_thread& io_thread() const;
+
         void async_finalize_file(int file);
 
         void async_check_fastresume(lazy_entry const* resume_data
@@ -318,11 +386,13 @@ namespace libed2k
         void async_rename_file(int index, std::string const& name
             , boost::function<void(int, disk_io_job const&)> const& handler);
 
+        // flags are disk_io_job::flags_t
         void async_read(
             peer_request const& r
             , boost::function<void(int, disk_io_job const&)> const& handler
             , int cache_line_size = 0
-            , int cache_expiry = 0);
+            , int cache_expiry = 0
+            , int flags = 0);
 
         void async_read_and_hash(
             peer_request const& r
@@ -333,6 +403,12 @@ namespace libed2k
             , boost::function<void(int, disk_io_job const&)> const& handler
             , int cache_expiry = 0);
 
+        // reads the range into the read cache ahead of the requests for it
+        void async_read_ahead(peer_request const& r
+            , boost::function<void(int, disk_io_job const&)> const& handler
+            = boost::function<void(int, disk_io_job const&)>()
+            , int cache_expiry = 0);
+
         // returns the write queue size
         int async_write(
             peer_request const& r
@@ -355,8 +431,11 @@ namespace libed2k
             boost::function<void(int, disk_io_job const&)> const& handler
             = boost::function<void(int, disk_io_job const&)>());
 
+        // when io is set, the storage runs its jobs on that disk io thread
+        // once it's moved, see session_impl::disk_thread
         void async_move_storage(std::string const& p
-            , boost::function<void(int, disk_io_job const&)> const& handler);
+            , boost::function<void(int, disk_io_job const&)> const& handler
+            , disk_io_thread* io = 0);
 
         void async_save_resume_data(
             boost::function<void(int, disk_io_job const&)> const& handler);
@@ -436,8 +515,41 @@ namespace libed2k
             , int offset
             , int num_bufs);
 
+        // advances the partial hash of the piece when the data starts
+        // where it stopped, returns false if the data was not hashed
+        bool update_partial_hash(
+            int piece_index
+            , int offset
+            , file::iovec_t const* bufs
+            , int num_bufs);
+
+        // the number of bytes of the piece hashed so far
+        int partial_hash_offset(int piece_index) const;
+
+        // removes the partial hash of the piece to finish it elsewhere
+        partial_hash take_partial_hash(int piece_index);
+
+        // MD4 of a few pages sampled across the slot, a cheap check that
+        // its data didn't change. Returns false if the pages can't be read
+        bool fingerprint_slot(int slot, boost::uint64_t& fp);
+
+        // remembers the piece passed the hash check, its fingerprint
+        // is taken by update_fingerprints before resume data is saved
+        void queue_fingerprint(int piece_index);
+        void update_fingerprints();
+
+        // loads fingerprints of the pieces resume data has, when files_changed
+        // is set those pieces are verified by check_files. Returns false
+        // if the resume data has no fingerprints
+        bool read_fingerprints(lazy_entry const& rd, bool files_changed);
+
         size_type physical_offset(int piece_index, int offset);
 
+        // the file and the offset in it to read or write the piece range
+        // without going through the storage, see storage_interface::map_slot
+        int map_piece_impl(int piece_index, int offset, int size, bool write
+            , boost::intrusive_ptr<file>& f, size_type& file_offset);
+
         void finalize_file(int index);
 
         // returns the number of pieces left in the
@@ -458,7 +570,9 @@ namespace libed2k
         int rename_file_impl(int index, std::string const& new_filename)
         { return m_storage->rename_file(index, new_filename); }
 
-        int move_storage_impl(std::string const& save_path);
+        int move_storage_impl(std::string const& save_path, bool start
+            , size_type& moved, size_type& total);
+        void abandon_move_impl() { m_storage->abandon_move(); }
 
         int allocate_slot_for_piece(int piece_index);
 #ifdef LIBED2K_DEBUG
@@ -502,6 +616,21 @@ namespace libed2k
 
         mutable mutex m_mutex;
 
+        // fingerprints of good pieces by piece index, 0 when unknown,
+        // and the pieces waiting to be fingerprinted. Protected by m_mutex
+        std::vector<boost::uint64_t> m_fingerprints;
+        std::vector<int> m_fingerprint_queue;
+
+        // pieces the resume data has, set when files changed since it was
+        // saved. Pieces with a fingerprint are checked by their sampled
+        // pages only, the others are hashed in full
+        std::vector<bool> m_resume_pieces;
+
+        // held by the disk thread while it runs a job of this storage and
+        // by a checking thread while it checks a piece of it, see disk_io_thread.
+        // The disk thread only tries to lock it, jobs wait while it's taken
+        boost::mutex m_job_mutex;
+
         enum {
             // the default initial state
             state_none,
@@ -542,7 +671,11 @@ namespace libed2k
         // disk-io thread.
         std::map<int, partial_hash> m_piece_hasher;
 
-        disk_io_thread& m_io_thread;
+        // the disk io thread running jobs of the storage and the one it
+        // goes to when the move in progress is done. Protected by m_io_mutex
+        disk_io_thread* m_io_thread;
+        disk_io_thread* m_move_thread;
+        mutable mutex m_io_mutex;
 
         // the reason for this to be a void pointer
         // is to avoid creating a dependency on the
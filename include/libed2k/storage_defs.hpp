@@ -43,6 +43,7 @@ namespace libed2k
     struct storage_interface;
     class file_storage;
     struct file_pool;
+    class mapping_cache;
 
     enum storage_mode_t
     {
@@ -66,6 +67,11 @@ namespace libed2k
         file_storage const&, file_storage const* mapped, std::string const&, file_pool&
         , std::vector<boost::uint8_t> const&);
 
+    // bind the mapping_cache to get a storage_constructor_type
+    LIBED2K_EXPORT storage_interface* mapped_storage_constructor(
+        file_storage const&, file_storage const* mapped, std::string const&, file_pool&
+        , std::vector<boost::uint8_t> const&, mapping_cache& mappings);
+
 }
 
 #endif
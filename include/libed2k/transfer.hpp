@@ -3,6 +3,7 @@
 #define __LIBED2K_TRANSFER__
 
 #include <set>
+#include <map>
 #include <boost/asio.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/intrusive_ptr.hpp>
@@ -13,6 +14,7 @@
 #include "libed2k/lazy_entry.hpp"
 #include "libed2k/policy.hpp"
 #include "libed2k/piece_picker.hpp"
+#include "libed2k/peer_request.hpp"
 #include "libed2k/packet_struct.hpp"
 #include "libed2k/peer_info.hpp"
 #include "libed2k/storage_defs.hpp"
@@ -20,6 +22,7 @@
 #include "libed2k/stat.hpp"
 #include "libed2k/transfer_handle.hpp"
 #include "libed2k/bandwidth_limit.hpp"
+#include "libed2k/aich.hpp"
 
 namespace libed2k
 {
@@ -29,6 +32,7 @@ namespace libed2k
         class session_impl;
     }
     class peer;
+    class server_connection;
     class server_request;
     class server_response;
     class piece_manager;
@@ -71,8 +75,13 @@ namespace libed2k
 
         bool want_more_peers() const;
         void request_peers();
-        void add_peer(const tcp::endpoint& peer);
+        void add_peer(const tcp::endpoint& peer, bool connectable = false);
         bool connect_to_peer(peer* peerinfo);
+        // the peers we may tell other peers about by source exchange
+        void get_exchange_sources(std::vector<tcp::endpoint>& sources,
+                                  const ip::address& requester, size_t max_count) const
+        { m_policy.get_exchange_sources(sources, requester, max_count); }
+        bool want_exchange_sources() const;
         // used by peer_connection to attach itself to a torrent
         // since incoming connections don't know what torrent
         // they're a part of until they have received an info_hash.
@@ -193,6 +202,32 @@ namespace libed2k
         bool has_picker() const { return m_picker.get() != 0; }
         piece_picker& picker() { return *m_picker; }
 
+        typedef boost::function<void(int, const std::vector<char>&, const error_code&)> read_piece_handler;
+
+        // reads whole piece from storage, handler gets piece index, data and error
+        void async_read_piece(int index, const read_piece_handler& handler);
+
+        // --------------------------------------------
+        // AICH CORRUPTION HANDLING
+        // --------------------------------------------
+        // trusted root, undefined until it came with parameters,
+        // from share hashing or from enough peers
+        const aich_hash& aich_root() const { return m_aich_root; }
+        const std::vector<aich_hash>& aich_piece_hashes() const { return m_aich_piece_hashes; }
+
+        // the peer told AICH root it knows for the file
+        void aich_root_vote(const ip::address& addr, const aich_hash& root);
+
+        typedef boost::function<void(int, const aich_recovery_data&, bool)> aich_answer_handler;
+
+        // recovery data of the piece we have for a peer asking for it, handler gets piece index,
+        // the data and false when it can't be made. Peers asking for the same piece share one
+        // disk read and the last answers are kept, so repeated requests don't read the piece again
+        void async_aich_answer(int index, const aich_answer_handler& handler);
+
+        // recovery data answer for piece, -1 means the peer can't give any
+        void aich_recovery_received(peer_connection* c, int index, const aich_recovery_data& data);
+
         // returns true if we have downloaded the given piece
         bool have_piece(int index) const
         {
@@ -226,6 +261,8 @@ namespace libed2k
         size_t num_free_blocks() const;
 
         piece_manager& filesystem() { return *m_storage; }
+        // whether the disk io thread of the storage takes more writes
+        bool can_write_to_disk() const;
         storage_interface* get_storage();
         void move_storage(const std::string& save_path);
         bool rename_file(const std::string& name);
@@ -262,8 +299,10 @@ namespace libed2k
         // --------------------------------------------
         // SERVER MANAGEMENT
         // --------------------------------------------
-        /** convert transfer info into announce */
+        /** convert transfer info into announce for current server */
         shared_file_entry getAnnounce() const;
+        /** convert transfer info into announce for the server */
+        shared_file_entry getAnnounce(const server_connection& sc) const;
 
         tcp::endpoint const& get_interface() const { return m_net_interface; }
 
@@ -297,6 +336,34 @@ namespace libed2k
         void write_resume_data(entry& rd) const;
         void read_resume_data(lazy_entry const& rd);
 
+        struct read_piece_struct
+        {
+            int index;
+            std::vector<char> data;
+            int blocks_left;
+            error_code ec;
+            read_piece_handler handler;
+        };
+
+        void on_piece_read(int ret, disk_io_job const& j, peer_request r,
+                           boost::shared_ptr<read_piece_struct> rp);
+
+        // failed piece waiting for AICH recovery data or being checked with it
+        struct aich_recovery
+        {
+            peer_connection* source;        //!< peer asked, 0 when answer came
+            ptime requested;
+            std::vector<void*> downloaders; //!< peers sent piece blocks
+        };
+
+        bool request_aich_recovery(int index, const std::vector<void*>& downloaders);
+        void on_aich_piece_read(int index, const std::vector<char>& data, const error_code& ec,
+                                std::vector<aich_hash> block_hashes);
+        // downloads the whole piece again
+        void aich_recovery_failed(int index);
+        void on_aich_answer_read(int index, const std::vector<char>& data, const error_code& ec);
+        void ban_peer(peer* p);
+
         // this is the upload and download statistics for the whole transfer.
         // it's updated from all its peers once every second.
         stat m_stat;
@@ -397,6 +464,9 @@ namespace libed2k
 
         duration_timer m_minute_timer;
 
+        // the last time one of our peers was asked for sources
+        ptime m_last_source_exchange;
+
         /** previously saved resume data */
         std::vector<char>  m_resume_data;
         lazy_entry m_resume_entry;
@@ -406,6 +476,19 @@ namespace libed2k
 
         // the number of seconds since the last active state
         boost::uint16_t m_last_active;
+
+        aich_hash m_aich_root;
+        std::vector<aich_hash> m_aich_piece_hashes;
+
+        // AICH roots told by peers, one vote per IP
+        std::map<ip::address, aich_hash> m_aich_votes;
+
+        // failed pieces by index
+        std::map<int, aich_recovery> m_aich_recovery;
+
+        // peers waiting for recovery data of the piece being read and the last answers made
+        std::map<int, std::vector<aich_answer_handler> > m_aich_answer_waiters;
+        std::map<int, aich_recovery_data> m_aich_answers;
     };
 
     extern shared_file_entry transfer2sfe(const std::pair<md4_hash, boost::shared_ptr<transfer> >& tran);
@@ -8,6 +8,7 @@ namespace libed2k
         {
             DBG("add_transfer_params::dump");
             DBG("file hash: " << file_hash << " all hashes size: " << piece_hashses.size());
+            DBG("aich root: " << aich_root_hash << " aich hashes size: " << aich_piece_hashes.size());
             DBG("file path: " << convert_to_native(file_path));
             DBG("file size: " << file_size);
             DBG("accepted: " << accepted <<
@@ -0,0 +1,286 @@
+#include <map>
+
+#include "libed2k/aich.hpp"
+#include "libed2k/escape_string.hpp"
+#include "libed2k/util.hpp"
+#include "libed2k/assert.hpp"
+
+namespace libed2k
+{
+    namespace
+    {
+        typedef std::map<boost::uint32_t, aich_hash> nodes_map;
+
+        aich_hash combine(const aich_hash& left, const aich_hash& right)
+        {
+            aich_hash result;
+            sha1_context ctx;
+            sha1_init(&ctx);
+            sha1_update(&ctx, left.getContainer(), SHA1_HASH_SIZE);
+            sha1_update(&ctx, right.getContainer(), SHA1_HASH_SIZE);
+            sha1_final(&ctx, result.getContainer());
+            return result;
+        }
+
+        /**
+          * size of left child of node as eMule's CAICHHashTree splits it,
+          * unit is piece size above pieces and block size inside them
+         */
+        size_type left_size(size_type size, bool left_branch, size_type unit)
+        {
+            size_type blocks = div_ceil(size, unit);
+            return ((left_branch ? blocks + 1 : blocks) / 2) * unit;
+        }
+
+        // hash of node made of consecutive leaves covering unit bytes each
+        aich_hash tree_hash(const aich_hash* leaves, size_type size, bool left_branch, size_type unit)
+        {
+            if (size <= unit) return *leaves;
+
+            size_type left = left_size(size, left_branch, unit);
+            return combine(tree_hash(leaves, left, true, unit),
+                           tree_hash(leaves + left / unit, size - left, false, unit));
+        }
+
+        void collect_leaves(const aich_hash* leaves, size_type size, bool left_branch,
+                            boost::uint32_t id, aich_recovery_data& data)
+        {
+            if (size <= AICH_BLOCK_SIZE)
+            {
+                data.m_hashes.push_back(std::make_pair(id, *leaves));
+                return;
+            }
+
+            size_type left = left_size(size, left_branch, AICH_BLOCK_SIZE);
+            collect_leaves(leaves, left, true, (id << 1) | 1, data);
+            collect_leaves(leaves + left / AICH_BLOCK_SIZE, size - left, false, id << 1, data);
+        }
+
+        bool rebuild_part(const nodes_map& nodes, size_type size, bool left_branch,
+                          boost::uint32_t id, aich_hash& hash, std::vector<aich_hash>& leaves)
+        {
+            if (size <= AICH_BLOCK_SIZE)
+            {
+                nodes_map::const_iterator itr = nodes.find(id);
+                if (itr == nodes.end()) return false;
+                hash = itr->second;
+                leaves.push_back(hash);
+                return true;
+            }
+
+            aich_hash left_hash;
+            aich_hash right_hash;
+            size_type left = left_size(size, left_branch, AICH_BLOCK_SIZE);
+
+            if (!rebuild_part(nodes, left, true, (id << 1) | 1, left_hash, leaves) ||
+                !rebuild_part(nodes, size - left, false, id << 1, right_hash, leaves))
+                return false;
+
+            hash = combine(left_hash, right_hash);
+            return true;
+        }
+
+        // sibling of node on the way from root to piece
+        struct uncle
+        {
+            boost::uint32_t id;
+            size_type offset;
+            size_type size;
+        };
+
+        /**
+          * piece subtree position in file tree: its identifier, size and branch
+          * and the uncles met on the way down from root, top first
+         */
+        struct part_path
+        {
+            boost::uint32_t id;
+            size_type size;
+            bool left_branch;
+            std::vector<uncle> uncles;
+        };
+
+        part_path find_part(size_type file_size, int piece)
+        {
+            part_path path;
+            path.id = 1;
+            path.size = file_size;
+            path.left_branch = true;
+
+            size_type offset = 0;
+            size_type piece_offset = size_type(piece) * PIECE_SIZE;
+
+            while (path.size > PIECE_SIZE)
+            {
+                size_type left = left_size(path.size, path.left_branch, PIECE_SIZE);
+
+                if (piece_offset < offset + left)
+                {
+                    uncle u = { path.id << 1, offset + left, path.size - left };
+                    path.uncles.push_back(u);
+                    path.id = (path.id << 1) | 1;
+                    path.size = left;
+                    path.left_branch = true;
+                }
+                else
+                {
+                    uncle u = { (path.id << 1) | 1, offset, left };
+                    path.uncles.push_back(u);
+                    path.id = path.id << 1;
+                    path.size -= left;
+                    path.left_branch = false;
+                    offset += left;
+                }
+            }
+
+            return path;
+        }
+    }
+
+    aich_hash aich_hash::fromString(const std::string& strHash)
+    {
+        aich_hash hash;
+        std::string raw = base32decode(strHash);
+
+        if (raw.size() == SHA1_HASH_SIZE)
+        {
+            memcpy(hash.m_hash, raw.c_str(), SHA1_HASH_SIZE);
+        }
+
+        return hash;
+    }
+
+    std::string aich_hash::toString() const
+    {
+        return base32encode(std::string(reinterpret_cast<const char*>(m_hash), SHA1_HASH_SIZE));
+    }
+
+    std::ostream& operator<< (std::ostream& stream, const aich_hash& hash)
+    {
+        stream << hash.toString();
+        return stream;
+    }
+
+    aich_piece_hasher::aich_piece_hasher()
+    {
+        reset();
+    }
+
+    void aich_piece_hasher::update(const char* data, size_t size)
+    {
+        while (size > 0)
+        {
+            size_t chunk = size_t(std::min<size_type>(AICH_BLOCK_SIZE - m_block_pos, size));
+            sha1_update(&m_context, reinterpret_cast<const unsigned char*>(data), chunk);
+            m_block_pos += chunk;
+            m_size += chunk;
+            data += chunk;
+            size -= chunk;
+
+            if (m_block_pos == AICH_BLOCK_SIZE)
+            {
+                m_blocks.push_back(aich_hash());
+                sha1_final(&m_context, m_blocks.back().getContainer());
+                sha1_init(&m_context);
+                m_block_pos = 0;
+            }
+        }
+    }
+
+    const std::vector<aich_hash>& aich_piece_hasher::block_hashes()
+    {
+        if (m_block_pos > 0)
+        {
+            m_blocks.push_back(aich_hash());
+            sha1_final(&m_context, m_blocks.back().getContainer());
+            sha1_init(&m_context);
+            m_block_pos = 0;
+        }
+
+        return m_blocks;
+    }
+
+    aich_hash aich_piece_hasher::final(bool left_branch)
+    {
+        block_hashes();
+        LIBED2K_ASSERT(!m_blocks.empty());
+        return aich_part_hash(m_blocks, m_size, left_branch);
+    }
+
+    void aich_piece_hasher::reset()
+    {
+        sha1_init(&m_context);
+        m_block_pos = 0;
+        m_size = 0;
+        m_blocks.clear();
+    }
+
+    bool aich_left_part(size_type file_size, int piece)
+    {
+        return find_part(file_size, piece).left_branch;
+    }
+
+    aich_hash aich_part_hash(const std::vector<aich_hash>& block_hashes, size_type piece_size, bool left_branch)
+    {
+        LIBED2K_ASSERT(size_type(block_hashes.size()) == div_ceil(piece_size, AICH_BLOCK_SIZE));
+        return tree_hash(&block_hashes[0], piece_size, left_branch, AICH_BLOCK_SIZE);
+    }
+
+    aich_hash aich_root_hash(size_type file_size, const std::vector<aich_hash>& part_hashes)
+    {
+        LIBED2K_ASSERT(size_type(part_hashes.size()) == div_ceil(file_size, PIECE_SIZE));
+        // single piece file has the piece as root
+        return tree_hash(&part_hashes[0], file_size, true, PIECE_SIZE);
+    }
+
+    bool aich_make_recovery_data(size_type file_size, int piece,
+                                 const std::vector<aich_hash>& part_hashes,
+                                 const std::vector<aich_hash>& block_hashes,
+                                 aich_recovery_data& data)
+    {
+        part_path path = find_part(file_size, piece);
+        data.m_hashes.clear();
+
+        if (size_type(part_hashes.size()) != div_ceil(file_size, PIECE_SIZE) ||
+            size_type(block_hashes.size()) != div_ceil(path.size, AICH_BLOCK_SIZE) ||
+            aich_part_hash(block_hashes, path.size, path.left_branch) != part_hashes[piece])
+            return false;
+
+        for (std::vector<uncle>::const_iterator i = path.uncles.begin(), end(path.uncles.end()); i != end; ++i)
+        {
+            const aich_hash* parts = &part_hashes[size_t(i->offset / PIECE_SIZE)];
+            data.m_hashes.push_back(std::make_pair(i->id, tree_hash(parts, i->size, (i->id & 1) != 0, PIECE_SIZE)));
+        }
+
+        collect_leaves(&block_hashes[0], path.size, path.left_branch, path.id, data);
+        return true;
+    }
+
+    bool aich_check_recovery_data(size_type file_size, int piece, const aich_hash& root,
+                                  const aich_recovery_data& data,
+                                  std::vector<aich_hash>& block_hashes)
+    {
+        if (piece < 0 || size_type(piece) >= div_ceil(file_size, PIECE_SIZE)) return false;
+
+        nodes_map nodes(data.m_hashes.begin(), data.m_hashes.end());
+        part_path path = find_part(file_size, piece);
+        aich_hash hash;
+        std::vector<aich_hash> leaves;
+
+        if (!rebuild_part(nodes, path.size, path.left_branch, path.id, hash, leaves)) return false;
+
+        // climb up from piece to root
+        for (std::vector<uncle>::const_reverse_iterator i = path.uncles.rbegin(), end(path.uncles.rend()); i != end; ++i)
+        {
+            nodes_map::const_iterator itr = nodes.find(i->id);
+            if (itr == nodes.end()) return false;
+
+            hash = (i->id & 1) ? combine(itr->second, hash) : combine(hash, itr->second);
+        }
+
+        if (hash != root) return false;
+
+        block_hashes.swap(leaves);
+        return true;
+    }
+}
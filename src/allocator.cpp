@@ -44,6 +44,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <unistd.h> // _SC_PAGESIZE
 #endif
 
+#if LIBED2K_USE_MMAP
+#include <sys/mman.h>
+#endif
+
 #if LIBED2K_USE_MEMALIGN || LIBED2K_USE_POSIX_MEMALIGN
 #include <malloc.h> // memalign
 #endif
@@ -160,5 +164,49 @@ namespace libed2k
 	}
 
 
+	char* huge_page_allocator::malloc(std::size_t bytes, bool& huge)
+	{
+#if LIBED2K_USE_MMAP && defined MAP_ANONYMOUS
+		if (huge)
+		{
+			std::size_t size = (bytes + huge_page_size - 1) & ~std::size_t(huge_page_size - 1);
+#ifdef MAP_HUGETLB
+			void* ret = mmap(0, size, PROT_READ | PROT_WRITE
+				, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (ret != MAP_FAILED) return (char*)ret;
+#endif
+#ifdef MADV_HUGEPAGE
+			// transparent huge pages only back aligned ranges, map one
+			// more huge page and trim it to the alignment
+			char* p = (char*)mmap(0, size + huge_page_size, PROT_READ | PROT_WRITE
+				, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p != (char*)MAP_FAILED)
+			{
+				char* ret = (char*)((std::size_t(p) + huge_page_size - 1) & ~std::size_t(huge_page_size - 1));
+				if (ret != p) munmap(p, ret - p);
+				if (ret + size != p + size + huge_page_size)
+					munmap(ret + size, p + size + huge_page_size - (ret + size));
+				madvise(ret, size, MADV_HUGEPAGE);
+				return ret;
+			}
+#endif
+		}
+#endif
+		huge = false;
+		return page_aligned_allocator::malloc(bytes);
+	}
+
+	void huge_page_allocator::free(char* block, std::size_t bytes, bool huge)
+	{
+#if LIBED2K_USE_MMAP && defined MAP_ANONYMOUS
+		if (huge)
+		{
+			munmap(block, (bytes + huge_page_size - 1) & ~std::size_t(huge_page_size - 1));
+			return;
+		}
+#endif
+		page_aligned_allocator::free(block);
+	}
+
 }
 
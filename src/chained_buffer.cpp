@@ -64,13 +64,13 @@ namespace libed2k
 	}
 
 	void chained_buffer::append_buffer(char* buffer, int s, int used_size
-		, boost::function<void(char*)> const& destructor)
+		, boost::function<void(char*)> const& destructor, int offset)
 	{
-	    LIBED2K_ASSERT(s >= used_size);
+	    LIBED2K_ASSERT(s >= used_size + offset);
 		buffer_t b;
 		b.buf = buffer;
 		b.size = s;
-		b.start = buffer;
+		b.start = buffer + offset;
 		b.used_size = used_size;
 		b.free = destructor;
 		m_vec.push_back(b);
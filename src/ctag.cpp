@@ -92,6 +92,7 @@ std::string tagIdtoString(tg_nid_type tid)
                     std::make_pair(FT_FILEHASH,             std::string("FT_FILEHASH")),
                     std::make_pair(FT_COMPLETE_SOURCES,     std::string("FT_COMPLETE_SOURCES")),
                     std::make_pair(FT_PUBLISHINFO,          std::string("FT_PUBLISHINFO")),
+                    std::make_pair(FT_AICHHASHSET,          std::string("FT_AICHHASHSET")),
                     std::make_pair(FT_ATTRANSFERRED,        std::string("FT_ATTRANSFERRED")),
                     std::make_pair(FT_ATREQUESTED,          std::string("FT_ATREQUESTED")),
                     std::make_pair(FT_ATACCEPTED,           std::string("FT_ATACCEPTED")),
@@ -33,6 +33,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <libed2k/disk_buffer_pool.hpp>
 #include <libed2k/assert.hpp>
 #include <algorithm>
+#include <string.h>
 
 #if LIBED2K_USE_MLOCK && !defined LIBED2K_WINDOWS
 #include <sys/mman.h>
@@ -44,16 +45,83 @@ POSSIBILITY OF SUCH DAMAGE.
 
 namespace libed2k
 {
-    disk_buffer_pool::disk_buffer_pool(int block_size)
+    namespace
+    {
+        // the categories allocations are counted for, the last one
+        // takes the rest
+        char const* const categories[] = { "read cache", "write cache"
+            , "send buffer", "receive buffer", "hash temp", "move temp", "other" };
+
+        int category_index(char const* category)
+        {
+            int i = 0;
+            for (; i < int(sizeof(categories) / sizeof(categories[0])) - 1; ++i)
+                if (strcmp(category, categories[i]) == 0) break;
+            return i;
+        }
+
+        typedef std::map<boost::uint64_t, disk_buffer_pool*> pools_t;
+
+        // the pools alive by their ids. They're never destructed since
+        // threads may return their magazines after static destructors ran
+        mutex& pools_mutex()
+        {
+            static mutex* m = new mutex;
+            return *m;
+        }
+
+        pools_t& live_pools()
+        {
+            static pools_t* p = new pools_t;
+            return *p;
+        }
+
+        boost::uint64_t next_pool_id = 1;
+    }
+
+    // free buffers a thread keeps to itself, the last freed is taken first
+    struct disk_buffer_pool::magazine
+    {
+        magazine(): size(0) {}
+        int size;
+        char* buffers[magazine_size];
+    };
+
+    // the magazines of the pools a thread uses, by the pool ids
+    struct disk_buffer_pool::thread_magazines
+    {
+        enum { max_pools = 4 };
+
+        thread_magazines()
+        {
+            std::fill(ids, ids + max_pools, 0);
+            std::fill(magazines, magazines + max_pools, (magazine*)0);
+        }
+
+        // the thread exits, the pools still alive get their buffers back
+        ~thread_magazines()
+        {
+            mutex::scoped_lock l(pools_mutex());
+            for (int i = 0; i < max_pools; ++i)
+            {
+                pools_t::iterator p = live_pools().find(ids[i]);
+                if (p != live_pools().end()) p->second->return_magazine(magazines[i]);
+            }
+        }
+
+        boost::uint64_t ids[max_pools];
+        magazine* magazines[max_pools];
+    };
+
+    boost::thread_specific_ptr<disk_buffer_pool::thread_magazines> disk_buffer_pool::s_magazines;
+
+    disk_buffer_pool::disk_buffer_pool(int block_size, disk_buffer_pool* shared)
         : m_block_size(block_size)
         , m_in_use(0)
-#ifndef LIBED2K_DISABLE_POOL_ALLOCATOR
-        , m_pool(block_size, m_settings.cache_buffer_chunk_size)
-#endif
+        , m_shared(shared)
+        , m_num_refs(0)
+        , m_users(1)
     {
-#if defined LIBED2K_DISK_STATS || defined LIBED2K_STATS
-        m_allocations = 0;
-#endif
 #ifdef LIBED2K_DISK_STATS
         m_log.open("disk_buffers.log", std::ios::trunc);
         m_categories["read cache"] = 0;
@@ -64,15 +132,36 @@ namespace libed2k
 #if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS
         m_magic = 0x1337;
 #endif
+        if (m_shared) ++m_shared->m_users;
+
+        mutex::scoped_lock l(pools_mutex());
+        m_id = next_pool_id++;
+        live_pools()[m_id] = this;
     }
 
-#if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS
     disk_buffer_pool::~disk_buffer_pool()
     {
         LIBED2K_ASSERT(m_magic == 0x1337);
+
+        if (m_shared) --m_shared->m_users;
+
+        mutex::scoped_lock l(pools_mutex());
+        live_pools().erase(m_id);
+        l.unlock();
+
+        // the threads won't find the magazines under the id anymore
+        for (std::vector<magazine*>::iterator i = m_magazines.begin()
+            , end(m_magazines.end()); i != end; ++i)
+            delete *i;
+
+        for (std::map<char*, slab>::iterator i = m_slabs.begin()
+            , end(m_slabs.end()); i != end; ++i)
+            huge_page_allocator::free(i->first, std::size_t(i->second.blocks) * m_block_size, i->second.huge);
+
+#if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS
         m_magic = 0;
-    }
 #endif
+    }
 
 #if defined LIBED2K_DEBUG || LIBED2K_RELEASE_ASSERTS || defined LIBED2K_DISK_STATS
     bool disk_buffer_pool::is_disk_buffer(char* buffer
@@ -83,57 +172,158 @@ namespace libed2k
         if (m_buf_to_category.find(buffer)
             == m_buf_to_category.end()) return false;
 #endif
-#ifdef LIBED2K_DISABLE_POOL_ALLOCATOR
-        return true;
-#else
-        return m_pool.is_from(buffer);
-#endif
+        std::map<char*, slab>::const_iterator i = m_slabs.upper_bound(buffer);
+        if (i == m_slabs.begin()) return false;
+        --i;
+        std::ptrdiff_t offset = buffer - i->first;
+        return offset < std::ptrdiff_t(i->second.blocks) * m_block_size
+            && offset % m_block_size == 0;
     }
 
     bool disk_buffer_pool::is_disk_buffer(char* buffer) const
     {
+        if (m_shared) return m_shared->is_disk_buffer(buffer);
         mutex::scoped_lock l(m_pool_mutex);
         return is_disk_buffer(buffer, l);
     }
 #endif
 
-    char* disk_buffer_pool::allocate_buffer(char const* category)
+    disk_buffer_pool::magazine* disk_buffer_pool::thread_magazine()
+    {
+        thread_magazines* t = s_magazines.get();
+        if (t == 0)
+        {
+            t = new thread_magazines;
+            s_magazines.reset(t);
+        }
+
+        for (int i = 0; i < thread_magazines::max_pools; ++i)
+            if (t->ids[i] == m_id) return t->magazines[i];
+
+        // takes the slot of a destructed pool, or the one
+        // of the oldest pool, which gets its buffers back
+        mutex::scoped_lock l(pools_mutex());
+        int slot = 0;
+        for (int i = 0; i < thread_magazines::max_pools; ++i)
+        {
+            if (live_pools().count(t->ids[i]) == 0)
+            {
+                slot = i;
+                break;
+            }
+            if (t->ids[i] < t->ids[slot]) slot = i;
+        }
+
+        pools_t::iterator p = live_pools().find(t->ids[slot]);
+        if (p != live_pools().end()) p->second->return_magazine(t->magazines[slot]);
+
+        magazine* m = new magazine;
+        mutex::scoped_lock l2(m_pool_mutex);
+        m_magazines.push_back(m);
+        l2.unlock();
+
+        t->ids[slot] = m_id;
+        t->magazines[slot] = m;
+        return m;
+    }
+
+    void disk_buffer_pool::return_magazine(magazine* m)
     {
         mutex::scoped_lock l(m_pool_mutex);
-        LIBED2K_ASSERT(m_magic == 0x1337);
+        m_free.insert(m_free.end(), m->buffers, m->buffers + m->size);
+        m_magazines.erase(std::find(m_magazines.begin(), m_magazines.end(), m));
+        delete m;
+    }
+
+    void disk_buffer_pool::fill_magazine(magazine& m)
+    {
+        mutex::scoped_lock l(m_pool_mutex);
+        while (m.size < magazine_size / 2)
+        {
+            char* buf = take_buffer(l);
+            if (buf == 0) break;
+            m.buffers[m.size++] = buf;
+        }
+    }
+
+    void disk_buffer_pool::drain_magazine(magazine& m, int keep)
+    {
+        mutex::scoped_lock l(m_pool_mutex);
+        m_free.insert(m_free.end(), m.buffers + keep, m.buffers + m.size);
+        m.size = keep;
+    }
+
+    char* disk_buffer_pool::take_buffer(mutex::scoped_lock& l)
+    {
+        if (m_free.empty() && !add_slab(l)) return 0;
+        char* ret = m_free.back();
+        m_free.pop_back();
+        return ret;
+    }
+
+    bool disk_buffer_pool::add_slab(mutex::scoped_lock& l)
+    {
+        slab s;
 #ifdef LIBED2K_DISABLE_POOL_ALLOCATOR
-        char* ret = page_aligned_allocator::malloc(m_block_size);
+        // every buffer is allocated by itself
+        s.blocks = 1;
+        s.huge = false;
 #else
-        char* ret = (char*)m_pool.malloc();
-        m_pool.set_next_size(m_settings.cache_buffer_chunk_size);
+        s.blocks = (std::max)(m_settings.cache_buffer_chunk_size, 1);
+        s.huge = m_settings.use_huge_pages;
 #endif
-        ++m_in_use;
-#if LIBED2K_USE_MLOCK
-        if (m_settings.lock_disk_cache)
+        if (s.huge)
         {
-#ifdef LIBED2K_WINDOWS
-            VirtualLock(ret, m_block_size);
-#else
-            mlock(ret, m_block_size);
-#endif
+            // whole huge pages of blocks
+            int per_page = (std::max)(int(huge_page_allocator::huge_page_size) / m_block_size, 1);
+            s.blocks = (s.blocks + per_page - 1) / per_page * per_page;
         }
-#endif
 
-#if defined LIBED2K_DISK_STATS || defined LIBED2K_STATS
-        ++m_allocations;
+        char* base = huge_page_allocator::malloc(std::size_t(s.blocks) * m_block_size, s.huge);
+        if (base == 0) return false;
+
+        m_slabs.insert(std::make_pair(base, s));
+        for (int i = s.blocks - 1; i >= 0; --i)
+            m_free.push_back(base + i * m_block_size);
+        return true;
+    }
+
+    char* disk_buffer_pool::allocate_buffer(char const* category)
+    {
+        if (m_shared) return m_shared->allocate_buffer(category);
+        LIBED2K_ASSERT(m_magic == 0x1337);
+
+#ifdef LIBED2K_DISK_STATS
+        // buffers are tracked by category under the mutex
+        mutex::scoped_lock l(m_pool_mutex);
+        char* ret = take_buffer(l);
+#else
+        magazine* m = thread_magazine();
+        if (m->size == 0) fill_magazine(*m);
+        char* ret = m->size > 0 ? m->buffers[--m->size] : 0;
 #endif
+        if (ret == 0) return 0;
+
+        ++m_in_use;
+        ++m_categories_allocated[category_index(category)].count;
+        lock_memory(ret);
+
 #ifdef LIBED2K_DISK_STATS
         ++m_categories[category];
         m_buf_to_category[ret] = category;
         m_log << log_time() << " " << category << ": " << m_categories[category] << "\n";
+        LIBED2K_ASSERT(is_disk_buffer(ret, l));
+#else
+        LIBED2K_ASSERT(is_disk_buffer(ret));
 #endif
-        LIBED2K_ASSERT(ret == 0 || is_disk_buffer(ret, l));
         return ret;
     }
 
 #ifdef LIBED2K_DISK_STATS
     void disk_buffer_pool::rename_buffer(char* buf, char const* category)
     {
+        if (m_shared) return m_shared->rename_buffer(buf, category);
+
         mutex::scoped_lock l(m_pool_mutex);
         LIBED2K_ASSERT(is_disk_buffer(buf, l));
         LIBED2K_ASSERT(m_categories.find(m_buf_to_category[buf])
@@ -152,7 +342,16 @@ namespace libed2k
 
     void disk_buffer_pool::free_multiple_buffers(char** bufvec, int numbufs)
     {
+        if (m_shared) return m_shared->free_multiple_buffers(bufvec, numbufs);
+
         char** end = bufvec + numbufs;
+#ifndef LIBED2K_DISK_STATS
+        if (m_num_refs == 0)
+        {
+            for (; bufvec != end; ++bufvec) release_buffer(*bufvec);
+            return;
+        }
+#endif
         // sort the pointers in order to maximize cache hits
         std::sort(bufvec, end);
 
@@ -161,24 +360,67 @@ namespace libed2k
         {
             char* buf = *bufvec;
             LIBED2K_ASSERT(buf);
-            free_buffer_impl(buf, l);;
+            free_buffer_impl(buf, l);
         }
     }
 
     void disk_buffer_pool::free_buffer(char* buf)
     {
+        if (m_shared) return m_shared->free_buffer(buf);
+
+#ifndef LIBED2K_DISK_STATS
+        // while no buffer is shared, there's nothing to look up
+        if (m_num_refs == 0)
+        {
+            release_buffer(buf);
+            return;
+        }
+#endif
         mutex::scoped_lock l(m_pool_mutex);
         free_buffer_impl(buf, l);
     }
 
+    void disk_buffer_pool::add_buffer_ref(char* buf)
+    {
+        if (m_shared) return m_shared->add_buffer_ref(buf);
+
+        mutex::scoped_lock l(m_pool_mutex);
+        LIBED2K_ASSERT(is_disk_buffer(buf, l));
+        ++m_buffer_refs[buf];
+        ++m_num_refs;
+    }
+
+    void disk_buffer_pool::release_buffer(char* buf)
+    {
+        LIBED2K_ASSERT(buf);
+        LIBED2K_ASSERT(m_magic == 0x1337);
+        LIBED2K_ASSERT(is_disk_buffer(buf));
+
+        unlock_memory(buf);
+        --m_in_use;
+
+        magazine* m = thread_magazine();
+        if (m->size == magazine_size) drain_magazine(*m, magazine_size / 2);
+        m->buffers[m->size++] = buf;
+    }
+
     void disk_buffer_pool::free_buffer_impl(char* buf, mutex::scoped_lock& l)
     {
         LIBED2K_ASSERT(buf);
         LIBED2K_ASSERT(m_magic == 0x1337);
         LIBED2K_ASSERT(is_disk_buffer(buf, l));
-#if defined LIBED2K_DISK_STATS || defined LIBED2K_STATS
-        --m_allocations;
-#endif
+
+        if (!m_buffer_refs.empty())
+        {
+            std::map<char*, int>::iterator i = m_buffer_refs.find(buf);
+            if (i != m_buffer_refs.end())
+            {
+                if (--i->second == 0) m_buffer_refs.erase(i);
+                --m_num_refs;
+                return;
+            }
+        }
+
 #ifdef LIBED2K_DISK_STATS
         LIBED2K_ASSERT(m_categories.find(m_buf_to_category[buf])
             != m_categories.end());
@@ -187,31 +429,100 @@ namespace libed2k
         m_log << log_time() << " " << category << ": " << m_categories[category] << "\n";
         m_buf_to_category.erase(buf);
 #endif
+        unlock_memory(buf);
+        --m_in_use;
+        m_free.push_back(buf);
+    }
+
+    void disk_buffer_pool::lock_memory(char* buf)
+    {
 #if LIBED2K_USE_MLOCK
         if (m_settings.lock_disk_cache)
         {
 #ifdef LIBED2K_WINDOWS
-            VirtualUnlock(buf, m_block_size);
+            VirtualLock(buf, m_block_size);
 #else
-            munlock(buf, m_block_size);
+            mlock(buf, m_block_size);
 #endif
         }
 #endif
-#ifdef LIBED2K_DISABLE_POOL_ALLOCATOR
-        page_aligned_allocator::free(buf);
+    }
+
+    void disk_buffer_pool::unlock_memory(char* buf)
+    {
+#if LIBED2K_USE_MLOCK
+        if (m_settings.lock_disk_cache)
+        {
+#ifdef LIBED2K_WINDOWS
+            VirtualUnlock(buf, m_block_size);
 #else
-        m_pool.free(buf);
+            munlock(buf, m_block_size);
+#endif
+        }
 #endif
-        --m_in_use;
+    }
+
+    void disk_buffer_pool::category_allocations(std::map<std::string, size_type>& ret) const
+    {
+        if (m_shared) return m_shared->category_allocations(ret);
+
+        ret.clear();
+        for (int i = 0; i < num_categories; ++i)
+        {
+            long n = m_categories_allocated[i].count;
+            if (n > 0) ret[categories[i]] = n;
+        }
+    }
+
+    void disk_buffer_pool::slab_memory(size_type& total, size_type& huge) const
+    {
+        if (m_shared) return m_shared->slab_memory(total, huge);
+
+        total = 0;
+        huge = 0;
+        mutex::scoped_lock l(m_pool_mutex);
+        for (std::map<char*, slab>::const_iterator i = m_slabs.begin()
+            , end(m_slabs.end()); i != end; ++i)
+        {
+            size_type bytes = size_type(i->second.blocks) * m_block_size;
+            total += bytes;
+            if (i->second.huge) huge += bytes;
+        }
     }
 
     void disk_buffer_pool::release_memory()
     {
         LIBED2K_ASSERT(m_magic == 0x1337);
-#ifndef LIBED2K_DISABLE_POOL_ALLOCATOR
-        mutex::scoped_lock l(m_pool_mutex);
-        m_pool.release_memory();
+        if (m_shared) return m_shared->release_memory();
+
+#ifndef LIBED2K_DISK_STATS
+        drain_magazine(*thread_magazine(), 0);
 #endif
+
+        // the slabs all of whose buffers are free are found
+        // walking them and the sorted free buffers side by side
+        mutex::scoped_lock l(m_pool_mutex);
+        std::sort(m_free.begin(), m_free.end());
+        std::vector<char*> keep;
+        keep.reserve(m_free.size());
+        std::vector<char*>::iterator f = m_free.begin();
+        for (std::map<char*, slab>::iterator i = m_slabs.begin(); i != m_slabs.end();)
+        {
+            std::vector<char*>::iterator first = std::lower_bound(f, m_free.end(), i->first);
+            keep.insert(keep.end(), f, first);
+            f = std::lower_bound(first, m_free.end(), i->first + std::ptrdiff_t(i->second.blocks) * m_block_size);
+
+            if (f - first < i->second.blocks)
+            {
+                keep.insert(keep.end(), first, f);
+                ++i;
+                continue;
+            }
+
+            huge_page_allocator::free(i->first, std::size_t(i->second.blocks) * m_block_size, i->second.huge);
+            m_slabs.erase(i++);
+        }
+        keep.insert(keep.end(), f, m_free.end());
+        m_free.swap(keep);
     }
 }
-
@@ -40,6 +40,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <libed2k/alloca.hpp>
 #include <libed2k/invariant_check.hpp>
 #include <libed2k/file_pool.hpp>
+#include <libed2k/filesystem.hpp>
+#include <libed2k/log.hpp>
 #include <boost/scoped_array.hpp>
 #include <boost/bind.hpp>
 
@@ -72,12 +74,14 @@ namespace libed2k
     disk_io_thread::disk_io_thread(io_service& ios
         , boost::function<void()> const& queue_callback
         , file_pool& fp
-        , int block_size)
-        : disk_buffer_pool(block_size)
+        , int block_size
+        , disk_buffer_pool* buffers)
+        : disk_buffer_pool(block_size, buffers)
         , m_abort(false)
         , m_waiting_to_shutdown(false)
         , m_queue_buffer_size(0)
         , m_last_file_check(libed2k::time_now_hires())
+        , m_recent_target(-1)
         , m_last_stats_flip(libed2k::time_now())
         , m_physical_ram(0)
         , m_exceeded_write_queue(false)
@@ -85,6 +89,9 @@ namespace libed2k
         , m_queue_callback(queue_callback)
         , m_work(io_service::work(m_ios))
         , m_file_pool(fp)
+        , m_hash_abort(false)
+        , m_check_abort(false)
+        , m_check_delay_per_block(m_settings.file_checks_delay_per_block)
         , m_disk_io_thread(boost::bind(&disk_io_thread::thread_fun, this))
     {
         // don't do anything in here. Essentially all members
@@ -182,8 +189,16 @@ namespace libed2k
 
         cache_status ret = m_cache_stats;
 
+        ret.frequent_cache_size = 0;
+        std::pair<cache_evict_index_t::const_iterator, cache_evict_index_t::const_iterator> frequent
+            = m_read_pieces.get<2>().equal_range(boost::make_tuple(true));
+        for (cache_evict_index_t::const_iterator i = frequent.first; i != frequent.second; ++i)
+            ret.frequent_cache_size += i->num_blocks;
+        ret.recent_cache_target = recent_cache_target();
+
         ret.job_queue_length = m_jobs.size() + m_sorted_read_jobs.size();
         ret.read_queue_size = m_sorted_read_jobs.size();
+        m_file_pool.status(ret.file_pool_hits, ret.file_pool_misses);
 
         return ret;
     }
@@ -192,7 +207,7 @@ namespace libed2k
     void disk_io_thread::stop(boost::intrusive_ptr<piece_manager> s)
     {
         mutex::scoped_lock l(m_queue_mutex);
-        // read jobs are aborted, write and move jobs are syncronized
+        // read jobs and moves are aborted, write jobs are syncronized
         for (std::deque<disk_io_job>::iterator i = m_jobs.begin();
             i != m_jobs.end();)
         {
@@ -208,12 +223,16 @@ namespace libed2k
                     LIBED2K_ASSERT(m_queue_buffer_size >= i->buffer_size);
                     m_queue_buffer_size -= i->buffer_size;
                 }
+                // the copies of the move are removed by abort_torrent
+                if (i->action == disk_io_job::move_storage)
+                    i->error = error_code(boost::asio::error::operation_aborted);
                 post_callback(*i, -3);
                 i = m_jobs.erase(i);
                 continue;
             }
             ++i;
         }
+        cancel_check_jobs(s.get());
         disk_io_job j;
         j.action = disk_io_job::abort_torrent;
         j.storage = s;
@@ -227,6 +246,8 @@ namespace libed2k
         {
             LIBED2K_ASSERT(p.storage);
             p.expire = libed2k::time_now() + libed2k::seconds(expire);
+            if (p.reread) p.frequent = true;
+            p.reread = false;
         }
         int expire;
     };
@@ -256,23 +277,28 @@ namespace libed2k
         while (i != widx.end() && now - i->expire > cut_off)
         {
             LIBED2K_ASSERT(i->storage);
-            flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
-            LIBED2K_ASSERT(i->num_blocks == 0);
-
-            // we want to keep the piece in here to have an accurate
-            // number for next_block_to_hash, if we're in avoid_readback mode
+            cached_piece_entry& p = const_cast<cached_piece_entry&>(*i);
 
-            bool erase = m_settings.disk_cache_algorithm != session_settings::avoid_readback;
-            if (!erase)
+            if (m_settings.disk_cache_algorithm != session_settings::avoid_readback)
             {
-                // however, if we've already hashed the whole piece, in-order
-                // there's no need to keep it around
-                int piece_size = i->storage->info()->piece_size(i->piece);
-                int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
-                erase = i->next_block_to_hash == blocks_in_piece;
+                flush_range(p, 0, INT_MAX, l);
+                LIBED2K_ASSERT(i->num_blocks == 0);
+                widx.erase(i++);
+                continue;
             }
 
-            if (erase) widx.erase(i++);
+            // in avoid_readback mode only the blocks already hashed are flushed,
+            // the ones after a gap stay pinned until the hash cursor reaches them.
+            // we want to keep the piece in here to have an accurate
+            // number for next_block_to_hash
+            if (p.next_block_to_hash > 0) flush_range(p, 0, p.next_block_to_hash, l);
+
+            // however, if we've already hashed the whole piece, in-order
+            // there's no need to keep it around
+            int piece_size = p.storage->info()->piece_size(p.piece);
+            int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+
+            if (p.num_blocks == 0 && p.next_block_to_hash == blocks_in_piece) widx.erase(i++);
             else ++i;
         }
 
@@ -340,14 +366,29 @@ namespace libed2k
     {
         INVARIANT_CHECK;
 
-        cache_lru_index_t& idx = m_read_pieces.get<1>();
+        cache_evict_index_t& idx = m_read_pieces.get<2>();
         if (idx.empty()) return 0;
 
-        cache_lru_index_t::iterator i = idx.begin();
+        // recently used pieces go first while they take more than their
+        // target, so a sequential reader going through a large file doesn't
+        // push out the pieces other peers keep requesting
+        std::pair<cache_evict_index_t::iterator, cache_evict_index_t::iterator> recent
+            = idx.equal_range(boost::make_tuple(false));
+        int recent_blocks = 0;
+        for (cache_evict_index_t::iterator k = recent.first; k != recent.second; ++k)
+            recent_blocks += k->num_blocks;
+
+        cache_evict_index_t::iterator i = recent.second;
+        if (recent_blocks > recent_cache_target() || recent.second == idx.end())
+            i = recent.first;
+
         if (i->piece == ignore.piece && i->storage == ignore.storage)
         {
             ++i;
             if (i == idx.end()) return 0;
+            // the reader of a recently used piece doesn't get to evict the
+            // frequently used ones, its reads go around the cache instead
+            if (i == recent.second && recent_blocks > recent_cache_target()) return 0;
         }
 
         // don't replace an entry that hasn't expired yet
@@ -398,12 +439,78 @@ namespace libed2k
                 --num_blocks;
             }
         }
-        if (i->num_blocks == 0) idx.erase(i);
+        if (i->num_blocks == 0)
+        {
+            add_ghost(*i);
+            idx.erase(i);
+        }
 
         if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
         return blocks;
     }
 
+    int disk_io_thread::recent_cache_target() const
+    {
+        if (m_recent_target < 0) return cache_limit() / 4;
+        return (std::min)(m_recent_target, cache_limit());
+    }
+
+    int disk_io_thread::cache_used() const
+    {
+        return users() > 1 ? m_cache_stats.cache_size : in_use();
+    }
+
+    int disk_io_thread::cache_limit() const
+    {
+        int threads = users();
+        if (threads == 1 || m_settings.cache_size <= 0) return m_settings.cache_size;
+        return (std::max)(m_settings.cache_size / threads, 1);
+    }
+
+    void disk_io_thread::admit_read_piece(cached_piece_entry& p)
+    {
+        ++m_cache_stats.read_cache_misses;
+        p.frequent = false;
+
+        typedef ghost_list_t::nth_index<1>::type ghost_index_t;
+        ghost_index_t& recent = m_recent_ghosts.get<1>();
+        ghost_index_t& frequent = m_frequent_ghosts.get<1>();
+        int line = (std::max)(m_settings.read_cache_line_size, 1);
+
+        ghost_index_t::iterator i = recent.find(p.storage_piece_pair());
+        if (i != recent.end())
+        {
+            // it was evicted too early, the recently used pieces get more room
+            int delta = line * (std::max)(int(frequent.size() / recent.size()), 1);
+            m_recent_target = (std::min)(recent_cache_target() + delta, cache_limit());
+            recent.erase(i);
+            ++m_cache_stats.recent_ghost_hits;
+            p.frequent = true;
+            return;
+        }
+
+        i = frequent.find(p.storage_piece_pair());
+        if (i != frequent.end())
+        {
+            int delta = line * (std::max)(int(recent.size() / frequent.size()), 1);
+            m_recent_target = (std::max)(recent_cache_target() - delta, 0);
+            frequent.erase(i);
+            ++m_cache_stats.frequent_ghost_hits;
+            p.frequent = true;
+        }
+    }
+
+    void disk_io_thread::add_ghost(cached_piece_entry const& p)
+    {
+        ghost_list_t& ghosts = p.frequent ? m_frequent_ghosts : m_recent_ghosts;
+        ghosts.push_back(p.storage_piece_pair());
+
+        // remember as many pieces as there are cache lines in the cache
+        size_t limit = (std::max)(cache_limit()
+            / (std::max)(m_settings.read_cache_line_size, 1), 16);
+        while (ghosts.size() > limit) ghosts.pop_front();
+    }
+
     int contiguous_blocks(disk_io_thread::cached_piece_entry const& b)
     {
         int ret = 0;
@@ -434,30 +541,22 @@ namespace libed2k
         int blocks_in_piece = (p.storage->info()->piece_size(p.piece)
             + m_block_size - 1) / m_block_size;
 
-        if (avoid_readback)
-        {
-            start = p.next_block_to_hash;
-            for (int i = p.next_block_to_hash; i < blocks_in_piece; ++i)
-            {
-                if (p.blocks[i].buf) ++current;
-                else break;
-            }
-        }
-        else
+        // when avoiding read-back only the blocks already hashed
+        // may be flushed, the rest is needed to hash the piece
+        int end = avoid_readback ? p.next_block_to_hash : blocks_in_piece;
+
+        for (int i = 0; i < end; ++i)
         {
-            for (int i = 0; i < blocks_in_piece; ++i)
+            if (p.blocks[i].buf) ++current;
+            else
             {
-                if (p.blocks[i].buf) ++current;
-                else
+                if (current > len)
                 {
-                    if (current > len)
-                    {
-                        len = current;
-                        pos = start;
-                    }
-                    current = 0;
-                    start = i + 1;
+                    len = current;
+                    pos = start;
                 }
+                current = 0;
+                start = i + 1;
             }
         }
         if (current > len)
@@ -533,14 +632,12 @@ namespace libed2k
                 cache_lru_index_t::iterator piece = i;
                 ++i;
 
-                if (!piece->blocks[p.next_block_to_hash].buf) continue;
+                // blocks before the hash cursor are hashed already,
+                // flushing them costs no read-back
+                if (p.next_block_to_hash == 0) continue;
                 int piece_size = p.storage->info()->piece_size(p.piece);
                 int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
-                int start = p.next_block_to_hash;
-                int end = start + 1;
-                while (end < blocks_in_piece && p.blocks[end].buf) ++end;
-                tmp = flush_range(p, start, end, l);
-                p.num_contiguous_blocks = contiguous_blocks(p);
+                tmp = flush_range(p, 0, p.next_block_to_hash, l);
                 if (p.num_blocks == 0 && p.next_block_to_hash == blocks_in_piece)
                     idx.erase(piece);
                 blocks -= tmp;
@@ -567,7 +664,7 @@ namespace libed2k
     }
 
     int disk_io_thread::flush_range(cached_piece_entry& p
-        , int start, int end, mutex::scoped_lock& l)
+        , int start, int end, mutex::scoped_lock& l, std::vector<char*>* keep)
     {
         INVARIANT_CHECK;
 
@@ -585,10 +682,15 @@ namespace libed2k
 
         boost::scoped_array<char> buf;
         file::iovec_t* iov = 0;
+        int iov_start = 0;
         int iov_counter = 0;
         if (m_settings.coalesce_writes) buf.reset(new (std::nothrow) char[piece_size]);
         else iov = LIBED2K_ALLOCA(file::iovec_t, blocks_in_piece);
 
+        // with io_uring the runs are collected and written in one go,
+        // their iovecs stay in iov until then
+        std::vector<io_run> runs;
+
         end = (std::min)(end, blocks_in_piece);
         int num_write_calls = 0;
         libed2k::ptime write_start = libed2k::time_now_hires();
@@ -599,6 +701,16 @@ namespace libed2k
                 if (buffer_size == 0) continue;
 
                 LIBED2K_ASSERT(buffer_size <= i * m_block_size);
+                if (iov && m_ring.is_open())
+                {
+                    io_run r = { (std::min)(i * m_block_size, piece_size) - buffer_size
+                        , iov_start, iov_counter - iov_start, buffer_size };
+                    runs.push_back(r);
+                    iov_start = iov_counter;
+                    ++m_cache_stats.writes;
+                    buffer_size = 0;
+                    continue;
+                }
                 l.unlock();
                 if (iov)
                 {
@@ -647,6 +759,13 @@ namespace libed2k
             if (i == p.next_block_to_hash) ++p.next_block_to_hash;
         }
 
+        if (!runs.empty())
+        {
+            l.unlock();
+            num_write_calls += write_batch(p, iov, runs);
+            l.lock();
+        }
+
         libed2k::ptime done = libed2k::time_now_hires();
 
         int ret = 0;
@@ -657,6 +776,7 @@ namespace libed2k
         j.piece = p.piece;
         test_error(j);
         std::vector<char*> buffers;
+        if (keep) keep->resize(blocks_in_piece, 0);
         for (int i = start; i < end; ++i)
         {
             if (p.blocks[i].buf == 0) continue;
@@ -664,7 +784,8 @@ namespace libed2k
             int result = j.error ? -1 : j.buffer_size;
             j.offset = i * m_block_size;
             j.callback = p.blocks[i].callback;
-            buffers.push_back(p.blocks[i].buf);
+            if (keep && i >= p.next_block_to_hash) (*keep)[i] = p.blocks[i].buf;
+            else buffers.push_back(p.blocks[i].buf);
             post_callback(j, result);
             p.blocks[i].callback.clear();
             p.blocks[i].buf = 0;
@@ -689,6 +810,389 @@ namespace libed2k
         return ret;
     }
 
+    int disk_io_thread::write_batch(cached_piece_entry& p, file::iovec_t* iov
+        , std::vector<io_run> const& runs)
+    {
+        // the files have to stay open until the writes complete
+        std::vector<boost::intrusive_ptr<file> > files(runs.size());
+        std::vector<int> results(runs.size(), -1);
+
+        for (int i = 0; i < int(runs.size()); ++i)
+        {
+            io_run const& r = runs[i];
+            size_type file_offset = 0;
+            if (p.storage->map_piece_impl(p.piece, r.offset, r.size, true
+                , files[i], file_offset) != r.size) continue;
+            m_ring.prepare(io_ring::write_op, *files[i], file_offset
+                , iov + r.iov, r.num_bufs, i);
+        }
+
+        if (m_ring.queued() > 0)
+        {
+            io_ring::results_t completed;
+            // refused writes are redone below, their error is reported there
+            error_code ec;
+            m_ring.submit_and_wait(completed, ec);
+
+            for (io_ring::results_t::iterator i = completed.begin()
+                , end(completed.end()); i != end; ++i)
+                results[int(i->first)] = i->second;
+        }
+
+        int ret = 0;
+        for (int i = 0; i < int(runs.size()); ++i)
+        {
+            io_run const& r = runs[i];
+            if (results[i] == r.size)
+            {
+                p.storage->update_partial_hash(p.piece, r.offset, iov + r.iov, r.num_bufs);
+                ++ret;
+                continue;
+            }
+
+            // spans files, wasn't queued, failed or was short
+            if (p.storage->write_impl(iov + r.iov, p.piece, r.offset, r.num_bufs) > 0)
+                ++ret;
+        }
+
+        return ret;
+    }
+
+    // advances the partial hash of the piece over the cached blocks at the
+    // hash cursor, so the piece is verified without reading them back
+    void disk_io_thread::hash_cached_blocks(cached_piece_entry& p, mutex::scoped_lock& l
+        , bool leave_complete)
+    {
+        int piece_size = p.storage->info()->piece_size(p.piece);
+        int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+
+        if (m_settings.disable_hash_checks)
+        {
+            // nothing is hashed, blocks may be flushed in any order
+            p.next_block_to_hash = blocks_in_piece;
+            return;
+        }
+
+        // the storage knows how far the piece is hashed, including
+        // blocks written around the cache
+        p.next_block_to_hash = (p.storage->partial_hash_offset(p.piece)
+            + m_block_size - 1) / m_block_size;
+
+        if (leave_complete)
+        {
+            // once the rest of the piece is in the cache, its hash job
+            // follows and takes these blocks to a hash thread
+            int missing = p.next_block_to_hash;
+            while (missing < blocks_in_piece && p.blocks[missing].buf) ++missing;
+            if (missing == blocks_in_piece) return;
+        }
+
+        while (p.next_block_to_hash < blocks_in_piece && p.blocks[p.next_block_to_hash].buf)
+        {
+            int block = p.next_block_to_hash;
+            file::iovec_t b = { p.blocks[block].buf
+                , size_t((std::min)(piece_size - block * m_block_size, m_block_size)) };
+            l.unlock();
+            bool hashed = p.storage->update_partial_hash(p.piece, block * m_block_size, &b, 1);
+            l.lock();
+            if (!hashed) break;
+            ++p.next_block_to_hash;
+        }
+    }
+
+    // hands the rest of the piece over to the hash threads. Blocks kept
+    // from the write cache are hashed from memory, the others are read
+    // back here. Returns 0 if the piece was queued and -1 on errors
+    int disk_io_thread::queue_hash_job(disk_io_job& j, std::vector<char*>& blocks)
+    {
+        hash_job h;
+        h.job = j;
+        h.ph = j.storage->take_partial_hash(j.piece);
+        h.ret = 0;
+        h.hash_time = 0;
+
+        int piece_size = j.storage->info()->piece_size(j.piece);
+        int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+        int first = (h.ph.offset + m_block_size - 1) / m_block_size;
+        LIBED2K_ASSERT(h.ph.offset == piece_size || (h.ph.offset % m_block_size) == 0);
+        blocks.resize(blocks_in_piece, 0);
+
+        // these were hashed before they were flushed
+        for (int i = 0; i < first; ++i)
+        {
+            if (blocks[i] == 0) continue;
+            free_buffer(blocks[i]);
+            blocks[i] = 0;
+        }
+
+        file::iovec_t* iov = LIBED2K_ALLOCA(file::iovec_t, blocks_in_piece);
+        int readback = 0;
+        for (int i = first; i < blocks_in_piece;)
+        {
+            if (blocks[i]) { ++i; continue; }
+
+            // read back the run of blocks flushed before they were hashed
+            int start = i;
+            int num_bufs = 0;
+            for (; i < blocks_in_piece && blocks[i] == 0; ++i, ++num_bufs)
+            {
+                blocks[i] = allocate_buffer("hash temp");
+                if (blocks[i] == 0) break;
+                iov[num_bufs].iov_base = blocks[i];
+                iov[num_bufs].iov_len = (std::min)(piece_size - i * m_block_size, m_block_size);
+            }
+
+            int ret = -1;
+            if (i < blocks_in_piece && blocks[i] == 0)
+            {
+#if BOOST_VERSION == 103500
+                j.error = error_code(boost::system::posix_error::not_enough_memory
+                    , get_posix_category());
+#elif BOOST_VERSION > 103500
+                j.error = error_code(boost::system::errc::not_enough_memory
+                    , get_posix_category());
+#else
+                j.error = error::no_memory;
+#endif
+                j.str.clear();
+            }
+            else if (num_bufs > 0)
+            {
+                ret = j.storage->read_impl(iov, j.piece, start * m_block_size, num_bufs);
+                if (ret < 0) test_error(j);
+            }
+
+            if (ret < 0)
+            {
+                for (int k = first; k < blocks_in_piece; ++k)
+                    if (blocks[k]) free_buffer(blocks[k]);
+                return -1;
+            }
+
+            readback += ret;
+        }
+
+        m_cache_stats.total_read_back += readback / m_block_size;
+        h.blocks.assign(blocks.begin() + first, blocks.end());
+
+        mutex::scoped_lock l(m_hash_mutex);
+        m_hash_jobs.push_back(h);
+        m_hash_signal.signal_all(l);
+        return 0;
+    }
+
+    // lets the running hash threads finish the queued pieces
+    // and starts the new number of them
+    void disk_io_thread::set_hash_threads(int num)
+    {
+        if (num < 0) num = 0;
+        if (num == int(m_hash_threads.size())) return;
+
+        mutex::scoped_lock l(m_hash_mutex);
+        m_hash_abort = true;
+        m_hash_signal.signal_all(l);
+        l.unlock();
+
+        for (std::vector<boost::shared_ptr<thread> >::iterator i = m_hash_threads.begin()
+            , end(m_hash_threads.end()); i != end; ++i)
+            (*i)->join();
+
+        m_hash_threads.clear();
+        m_hash_abort = false;
+
+        for (int i = 0; i < num; ++i)
+            m_hash_threads.push_back(boost::shared_ptr<thread>(
+                new thread(boost::bind(&disk_io_thread::hash_thread_fun, this))));
+    }
+
+    void disk_io_thread::hash_thread_fun()
+    {
+        for (;;)
+        {
+            mutex::scoped_lock l(m_hash_mutex);
+            while (m_hash_jobs.empty() && !m_hash_abort)
+                m_hash_signal.wait(l);
+
+            if (m_hash_jobs.empty()) return;
+
+            hash_job h = m_hash_jobs.front();
+            m_hash_jobs.pop_front();
+            l.unlock();
+
+            libed2k::ptime hash_start = libed2k::time_now_hires();
+            int piece_size = h.job.storage->info()->piece_size(h.job.piece);
+
+            for (std::vector<char*>::iterator i = h.blocks.begin(), end(h.blocks.end()); i != end; ++i)
+            {
+                int size = (std::min)(piece_size - h.ph.offset, m_block_size);
+                h.ph.h.update(*i, size);
+                h.ph.offset += size;
+            }
+
+            if (!h.blocks.empty()) free_multiple_buffers(&h.blocks[0], h.blocks.size());
+            h.blocks.clear();
+
+            h.ret = (h.job.storage->info()->hash_for_piece(h.job.piece) == h.ph.h.final()) ? 0 : -2;
+            if (h.ret == -2) h.job.storage->mark_failed(h.job.piece);
+            else h.job.storage->queue_fingerprint(h.job.piece);
+            h.hash_time = total_microseconds(libed2k::time_now_hires() - hash_start);
+
+            // the disk thread posts the result, after the
+            // write callbacks of the piece it has queued
+            mutex::scoped_lock jl(m_queue_mutex);
+            m_hash_results.push_back(h);
+            m_signal.signal(jl);
+        }
+    }
+
+    // the checking thread of a device is started with the
+    // first transfer checked on it and runs until shutdown
+    void disk_io_thread::queue_check_job(disk_io_job const& j)
+    {
+        boost::uint64_t device = path_device(j.storage->save_path());
+
+        mutex::scoped_lock l(m_check_mutex);
+        std::map<boost::uint64_t, check_queue>::iterator i = m_check_queues.find(device);
+        if (i == m_check_queues.end())
+        {
+            i = m_check_queues.insert(std::make_pair(device, check_queue())).first;
+            m_check_threads.push_back(boost::shared_ptr<thread>(
+                new thread(boost::bind(&disk_io_thread::check_thread_fun, this, device))));
+        }
+        i->second.jobs.push_back(j);
+        m_check_signal.signal_all(l);
+    }
+
+    void disk_io_thread::cancel_check_jobs(piece_manager* s)
+    {
+        mutex::scoped_lock l(m_check_mutex);
+        for (std::map<boost::uint64_t, check_queue>::iterator i = m_check_queues.begin()
+            , end(m_check_queues.end()); i != end; ++i)
+        {
+            check_queue& q = i->second;
+            if (q.current == s) q.cancelled = true;
+
+            for (std::deque<disk_io_job>::iterator k = q.jobs.begin(); k != q.jobs.end();)
+            {
+                if (k->storage != s)
+                {
+                    ++k;
+                    continue;
+                }
+                post_callback(*k, piece_manager::disk_check_aborted);
+                k = q.jobs.erase(k);
+            }
+        }
+    }
+
+    // aborts the running checks and the queued ones
+    void disk_io_thread::stop_check_threads()
+    {
+        mutex::scoped_lock l(m_check_mutex);
+        m_check_abort = true;
+        m_check_signal.signal_all(l);
+        l.unlock();
+
+        for (std::vector<boost::shared_ptr<thread> >::iterator i = m_check_threads.begin()
+            , end(m_check_threads.end()); i != end; ++i)
+            (*i)->join();
+        m_check_threads.clear();
+
+        mutex::scoped_lock jl(m_queue_mutex);
+        l.lock();
+        for (std::map<boost::uint64_t, check_queue>::iterator i = m_check_queues.begin()
+            , end(m_check_queues.end()); i != end; ++i)
+        {
+            for (std::deque<disk_io_job>::iterator k = i->second.jobs.begin()
+                , kend(i->second.jobs.end()); k != kend; ++k)
+                post_callback(*k, piece_manager::disk_check_aborted);
+        }
+        m_check_queues.clear();
+    }
+
+    void disk_io_thread::check_thread_fun(boost::uint64_t device)
+    {
+        libed2k::ptime last_file_check = libed2k::time_now_hires();
+
+        for (;;)
+        {
+            mutex::scoped_lock l(m_check_mutex);
+            check_queue& q = m_check_queues[device];
+            while (q.jobs.empty() && !m_check_abort)
+                m_check_signal.wait(l);
+
+            if (m_check_abort) return;
+
+            disk_io_job j = q.jobs.front();
+            q.jobs.pop_front();
+            q.current = j.storage.get();
+            q.cancelled = false;
+            l.unlock();
+
+            int piece_size = j.storage->info()->piece_length();
+            int ret = piece_manager::need_full_check;
+            while (ret == piece_manager::need_full_check)
+            {
+#if BOOST_VERSION > 103600
+                l.lock();
+                int delay_per_block = m_check_delay_per_block;
+                l.unlock();
+
+                libed2k::ptime now = libed2k::time_now_hires();
+                if (now < last_file_check) now = last_file_check;
+
+                if (now - last_file_check < libed2k::milliseconds(delay_per_block))
+                {
+                    int sleep_time = delay_per_block
+                        * (piece_size / m_block_size)
+                        - total_milliseconds(now - last_file_check);
+                    if (sleep_time > 0) sleep(sleep_time);
+                }
+                last_file_check = libed2k::time_now_hires();
+#endif
+
+                hash_job h;
+                h.hash_time = 0;
+
+                // m_waiting_to_shutdown is set under the queue mutex
+                mutex::scoped_lock jl(m_queue_mutex);
+                bool cancelled = m_waiting_to_shutdown;
+                jl.unlock();
+
+                l.lock();
+                cancelled = cancelled || q.cancelled || m_check_abort;
+                l.unlock();
+
+                if (cancelled)
+                {
+                    ret = piece_manager::disk_check_aborted;
+                }
+                else
+                {
+                    // other jobs of the storage run between its pieces
+                    libed2k::ptime hash_start = libed2k::time_now_hires();
+                    boost::mutex::scoped_lock sl(j.storage->m_job_mutex);
+                    ret = j.storage->check_files(j.piece, j.offset, j.error);
+                    if (test_error(j)) ret = piece_manager::fatal_disk_error;
+                    sl.unlock();
+                    LIBED2K_ASSERT(ret != -2 || j.error);
+                    h.hash_time = total_microseconds(libed2k::time_now_hires() - hash_start);
+                }
+
+                h.job = j;
+                h.ret = ret;
+
+                // progress and the result are posted by the disk thread
+                jl.lock();
+                m_hash_results.push_back(h);
+                m_signal.signal(jl);
+            }
+
+            l.lock();
+            q.current = 0;
+        }
+    }
+
     // returns -1 on failure
     int disk_io_thread::cache_block(disk_io_job& j
         , boost::function<void(int,disk_io_job const&)>& handler
@@ -717,6 +1221,8 @@ namespace libed2k
         p.num_blocks = 1;
         p.num_contiguous_blocks = 1;
         p.next_block_to_hash = 0;
+        p.frequent = false;
+        p.reread = false;
         p.blocks.reset(new (std::nothrow) cached_block_entry[blocks_in_piece]);
         if (!p.blocks) return -1;
         int block = j.offset / m_block_size;
@@ -752,7 +1258,7 @@ namespace libed2k
         boost::scoped_array<char> buf;
         for (int i = start_block; i < blocks_in_piece
             && ((options & ignore_cache_size)
-                || in_use() < m_settings.cache_size); ++i)
+                || cache_used() < cache_limit()); ++i)
         {
             int block_size = (std::min)(piece_size - piece_offset, m_block_size);
             LIBED2K_ASSERT(piece_offset <= piece_size);
@@ -865,6 +1371,150 @@ namespace libed2k
         return ret;
     }
 
+    void disk_io_thread::prefetch_read_jobs(read_jobs_t::iterator pos, int direction)
+    {
+        int depth = (std::min)(m_ring.entries(), m_settings.io_uring_queue_depth);
+        std::vector<cached_piece_entry> pieces;
+        std::vector<io_run> runs;
+
+        mutex::scoped_lock l(m_piece_mutex);
+        cache_piece_index_t& idx = m_read_pieces.get<0>();
+
+        for (read_jobs_t::iterator i = pos; int(pieces.size()) < depth;)
+        {
+            disk_io_job const& j = i->second;
+            cached_piece_entry p;
+            p.piece = j.piece;
+            p.storage = j.storage;
+
+            bool queued = false;
+            for (std::vector<cached_piece_entry>::iterator k = pieces.begin()
+                , end(pieces.end()); k != end; ++k)
+            {
+                if (k->storage_piece_pair() == p.storage_piece_pair()) queued = true;
+            }
+
+            if (j.action == disk_io_job::read && !queued
+                && find_cached_piece(m_read_pieces, j, l) == idx.end())
+            {
+                int piece_size = j.storage->info()->piece_size(j.piece);
+                int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+                int start_block = j.offset / m_block_size;
+                int blocks_to_read = (std::min)(blocks_in_piece - start_block
+                    , m_settings.read_cache_line_size);
+                if (j.max_cache_line > 0) blocks_to_read = (std::min)(blocks_to_read, j.max_cache_line);
+
+                // prefetching doesn't evict anything
+                if (cache_used() + blocks_to_read > cache_limit()) break;
+
+                p.expire = libed2k::time_now() + libed2k::seconds(j.cache_min_time < 0
+                    ? m_settings.default_cache_min_age : j.cache_min_time);
+                p.num_blocks = 0;
+                p.num_contiguous_blocks = 0;
+                p.next_block_to_hash = 0;
+                p.reread = false;
+                admit_read_piece(p);
+                p.blocks.reset(new (std::nothrow) cached_block_entry[blocks_in_piece]);
+                if (!p.blocks) break;
+
+                io_run r = { start_block * m_block_size, 0, 0, 0 };
+                for (int b = start_block; b < start_block + blocks_to_read; ++b)
+                {
+                    p.blocks[b].buf = allocate_buffer("read cache");
+                    if (p.blocks[b].buf == 0) break;
+                    ++p.num_blocks;
+                    ++m_cache_stats.cache_size;
+                    ++m_cache_stats.read_cache_size;
+                    r.size += (std::min)(piece_size - b * m_block_size, m_block_size);
+                }
+
+                if (p.num_blocks < blocks_to_read)
+                {
+                    free_piece(p, l);
+                    break;
+                }
+
+                r.num_bufs = p.num_blocks;
+                pieces.push_back(p);
+                runs.push_back(r);
+            }
+
+            if (direction > 0)
+            {
+                if (++i == m_sorted_read_jobs.end()) break;
+            }
+            else
+            {
+                if (i == m_sorted_read_jobs.begin()) break;
+                --i;
+            }
+        }
+
+        if (pieces.empty()) return;
+
+        l.unlock();
+
+        std::vector<file::iovec_t> iov;
+        for (int i = 0; i < int(pieces.size()); ++i)
+        {
+            cached_piece_entry const& p = pieces[i];
+            runs[i].iov = int(iov.size());
+            for (int b = runs[i].offset / m_block_size, n = 0; n < runs[i].num_bufs; ++b, ++n)
+            {
+                file::iovec_t v = { p.blocks[b].buf, (std::min)(
+                    p.storage->info()->piece_size(p.piece) - b * m_block_size, m_block_size) };
+                iov.push_back(v);
+            }
+        }
+
+        // the files have to stay open until the reads complete
+        std::vector<boost::intrusive_ptr<file> > files(pieces.size());
+        std::vector<int> results(pieces.size(), -1);
+
+        for (int i = 0; i < int(pieces.size()); ++i)
+        {
+            io_run const& r = runs[i];
+            cached_piece_entry const& p = pieces[i];
+            size_type file_offset = 0;
+
+            // the checking thread of the storage may be moving its slots,
+            // the piece is read by its job later then
+            boost::mutex::scoped_lock sl(p.storage->m_job_mutex, boost::try_to_lock);
+            if (!sl.owns_lock()) continue;
+            if (p.storage->map_piece_impl(p.piece, r.offset, r.size, false
+                , files[i], file_offset) != r.size) continue;
+            sl.unlock();
+
+            m_ring.prepare(io_ring::read_op, *files[i], file_offset
+                , &iov[r.iov], r.num_bufs, i);
+        }
+
+        if (m_ring.queued() > 0)
+        {
+            // refused reads are left to the blocking path of their jobs
+            io_ring::results_t completed;
+            error_code ec;
+            m_ring.submit_and_wait(completed, ec);
+
+            for (io_ring::results_t::iterator i = completed.begin()
+                , end(completed.end()); i != end; ++i)
+                results[int(i->first)] = i->second;
+        }
+
+        l.lock();
+
+        for (int i = 0; i < int(pieces.size()); ++i)
+        {
+            cached_piece_entry& p = pieces[i];
+            if (results[i] == runs[i].size)
+            {
+                ++m_cache_stats.reads;
+                idx.insert(p);
+            }
+            else free_piece(p, l);
+        }
+    }
+
     // returns -1 on read error, -2 if there isn't any space in the cache
     // or the number of bytes read
     int disk_io_thread::cache_read_block(disk_io_job const& j, mutex::scoped_lock& l)
@@ -884,14 +1534,14 @@ namespace libed2k
         int start_block = j.offset / m_block_size;
 
         int blocks_to_read = blocks_in_piece - start_block;
-        blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_settings.cache_size
-            + m_cache_stats.read_cache_size - in_use())/2, 3));
+        blocks_to_read = (std::min)(blocks_to_read, (std::max)((cache_limit()
+            + m_cache_stats.read_cache_size - cache_used())/2, 3));
         blocks_to_read = (std::min)(blocks_to_read, m_settings.read_cache_line_size);
         if (j.max_cache_line > 0) blocks_to_read = (std::min)(blocks_to_read, j.max_cache_line);
 
-        if (in_use() + blocks_to_read > m_settings.cache_size)
+        if (cache_used() + blocks_to_read > cache_limit())
         {
-            int clear = in_use() + blocks_to_read - m_settings.cache_size;
+            int clear = cache_used() + blocks_to_read - cache_limit();
             if (flush_cache_blocks(l, clear, ignore_t(j.piece, j.storage.get())
                 , dont_flush_write_blocks) < clear)
                 return -2;
@@ -904,6 +1554,8 @@ namespace libed2k
         p.num_blocks = 0;
         p.num_contiguous_blocks = 0;
         p.next_block_to_hash = 0;
+        p.reread = false;
+        admit_read_piece(p);
         p.blocks.reset(new (std::nothrow) cached_block_entry[blocks_in_piece]);
         if (!p.blocks) return -1;
 
@@ -1028,6 +1680,8 @@ namespace libed2k
             pe.num_blocks = 0;
             pe.num_contiguous_blocks = 0;
             pe.next_block_to_hash = 0;
+            pe.reread = false;
+            admit_read_piece(pe);
             pe.blocks.reset(new (std::nothrow) cached_block_entry[blocks_in_piece]);
             if (!pe.blocks) return -1;
             ret = read_into_piece(pe, 0, options, INT_MAX, l);
@@ -1047,6 +1701,68 @@ namespace libed2k
         return ret;
     }
 
+    // reads the missing blocks of the range specified by j into the read
+    // cache, as many as fit without evicting anything. Returns the number
+    // of bytes read
+    int disk_io_thread::read_ahead(disk_io_job const& j, mutex::scoped_lock& l)
+    {
+        INVARIANT_CHECK;
+
+        LIBED2K_ASSERT(j.cache_min_time >= 0);
+
+        int piece_size = j.storage->info()->piece_size(j.piece);
+        int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+        int start_block = j.offset / m_block_size;
+        int end_block = (std::min)((j.offset + j.buffer_size + m_block_size - 1)
+            / m_block_size, blocks_in_piece);
+
+        cache_piece_index_t& idx = m_read_pieces.get<0>();
+        cache_piece_index_t::iterator p = find_cached_piece(m_read_pieces, j, l);
+
+        cached_piece_entry pe;
+        if (p == idx.end())
+        {
+            pe.piece = j.piece;
+            pe.storage = j.storage;
+            pe.expire = libed2k::time_now() + libed2k::seconds(j.cache_min_time);
+            pe.num_blocks = 0;
+            pe.num_contiguous_blocks = 0;
+            pe.next_block_to_hash = 0;
+            pe.reread = false;
+            admit_read_piece(pe);
+            pe.blocks.reset(new (std::nothrow) cached_block_entry[blocks_in_piece]);
+            if (!pe.blocks) return -1;
+        }
+        cached_piece_entry& e = p == idx.end() ? pe : const_cast<cached_piece_entry&>(*p);
+
+        int ret = 0;
+        for (int b = start_block; b < end_block;)
+        {
+            if (e.blocks[b].buf) { ++b; continue; }
+
+            int budget = cache_limit() - cache_used();
+            if (budget <= 0) break;
+
+            int run = 0;
+            while (b + run < end_block && run < budget && e.blocks[b + run].buf == 0) ++run;
+
+            int r = read_into_piece(e, b, 0, run, l);
+            if (r == -2) break;
+            if (r < 0) { ret = r; break; }
+            ret += r;
+            b += run;
+        }
+
+        // a failed read frees the whole piece
+        if (p == idx.end())
+        {
+            if (pe.num_blocks > 0) idx.insert(pe);
+        }
+        else if (p->num_blocks == 0) idx.erase(p);
+
+        return ret;
+    }
+
     // cache the entire piece and hash it
     int disk_io_thread::read_piece_from_cache_and_hash(disk_io_job const& j, md4_hash& h)
     {
@@ -1059,9 +1775,9 @@ namespace libed2k
         int piece_size = j.storage->info()->piece_size(j.piece);
         int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
 
-        if (in_use() + blocks_in_piece >= m_settings.cache_size)
+        if (cache_used() + blocks_in_piece >= cache_limit())
         {
-            flush_cache_blocks(l, in_use() - m_settings.cache_size + blocks_in_piece);
+            flush_cache_blocks(l, cache_used() - cache_limit() + blocks_in_piece);
         }
 
         cache_piece_index_t::iterator p;
@@ -1094,7 +1810,7 @@ namespace libed2k
         // also, if the piece wasn't in the cache when
         // the function was called, and we're using an
         // explicit read cache, remove it again
-        if (in_use() >= m_settings.cache_size
+        if (cache_used() >= cache_limit()
             || !m_settings.use_read_cache
             || (m_settings.explicit_read_cache && !hit))
         {
@@ -1177,16 +1893,16 @@ namespace libed2k
             while (end_block < blocks_in_piece && p.blocks[end_block].buf == 0) ++end_block;
 
             int blocks_to_read = end_block - block;
-            blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_settings.cache_size
-                + m_cache_stats.read_cache_size - in_use())/2, 3));
+            blocks_to_read = (std::min)(blocks_to_read, (std::max)((cache_limit()
+                + m_cache_stats.read_cache_size - cache_used())/2, 3));
             blocks_to_read = (std::min)(blocks_to_read, m_settings.read_cache_line_size);
             blocks_to_read = (std::max)(blocks_to_read, min_blocks_to_read);
             if (j.max_cache_line > 0) blocks_to_read = (std::min)(blocks_to_read, j.max_cache_line);
 
             // if we don't have enough space for the new piece, try flushing something else
-            if (in_use() + blocks_to_read > m_settings.cache_size)
+            if (cache_used() + blocks_to_read > cache_limit())
             {
-                int clear = in_use() + blocks_to_read - m_settings.cache_size;
+                int clear = cache_used() + blocks_to_read - cache_limit();
                 if (flush_cache_blocks(l, clear, ignore_t(p.piece, p.storage.get())
                     , dont_flush_write_blocks) < clear)
                     return -2;
@@ -1207,6 +1923,7 @@ namespace libed2k
             LIBED2K_ASSERT(p.blocks[block].buf);
             int to_copy = (std::min)(m_block_size
                     - block_offset, size);
+            if (p.blocks[block].serve(block_offset, block_offset + to_copy)) p.reread = true;
             std::memcpy(j.buffer + buffer_offset
                 , p.blocks[block].buf + block_offset
                 , to_copy);
@@ -1235,6 +1952,40 @@ namespace libed2k
         return j.buffer_size;
     }
 
+    // hands out a reference to the cached block holding the whole range
+    // of the read job, it stays valid after the block leaves the cache.
+    // Returns false when the range isn't in the cache as one block
+    bool disk_io_thread::reference_cached_block(disk_io_job& j)
+    {
+        LIBED2K_ASSERT(j.buffer == 0);
+        LIBED2K_ASSERT(j.cache_min_time >= 0);
+
+        mutex::scoped_lock l(m_piece_mutex);
+        // a volatile cache drops blocks once they're read, copying
+        // them costs nothing more
+        if (!m_settings.use_read_cache || m_settings.volatile_read_cache) return false;
+
+        int block = j.offset / m_block_size;
+        int block_offset = j.offset & (m_block_size - 1);
+        if (block_offset + j.buffer_size > m_block_size) return false;
+
+        cache_piece_index_t& idx = m_read_pieces.get<0>();
+        cache_piece_index_t::iterator p = find_cached_piece(m_read_pieces, j, l);
+        if (p == idx.end() || p->blocks[block].buf == 0) return false;
+
+        cached_block_entry& b = p->blocks[block];
+        if (b.serve(block_offset, block_offset + j.buffer_size))
+            const_cast<cached_piece_entry&>(*p).reread = true;
+        add_buffer_ref(b.buf);
+        j.buffer = b.buf;
+        j.buffer_offset = block_offset;
+        idx.modify(p, update_last_use(j.cache_min_time));
+
+        ++m_cache_stats.blocks_read;
+        ++m_cache_stats.blocks_read_hit;
+        return true;
+    }
+
     int disk_io_thread::try_read_from_cache(disk_io_job const& j, bool& hit, int flags)
     {
         LIBED2K_ASSERT(j.buffer);
@@ -1366,9 +2117,107 @@ namespace libed2k
             || j.action == disk_io_job::update_settings);
         LIBED2K_ASSERT(j.buffer_size <= m_block_size);
         mutex::scoped_lock l(m_queue_mutex);
+
+        // the storage was handed over to another thread meanwhile
+        if (j.storage)
+        {
+            disk_io_thread& io = j.storage->io_thread();
+            if (&io != this)
+            {
+                l.unlock();
+                return io.add_job(j, f);
+            }
+        }
+
         return add_job(j, l, f);
     }
 
+    void disk_io_thread::hand_over(piece_manager* s, disk_io_thread& dest)
+    {
+        mutex::scoped_lock l(m_piece_mutex);
+
+        for (cache_t::iterator i = m_pieces.begin(); i != m_pieces.end();)
+        {
+            if (i->storage != s)
+            {
+                ++i;
+                continue;
+            }
+
+            flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+            i = m_pieces.erase(i);
+        }
+
+        for (cache_t::iterator i = m_read_pieces.begin(); i != m_read_pieces.end();)
+        {
+            if (i->storage != s)
+            {
+                ++i;
+                continue;
+            }
+
+            free_piece(const_cast<cached_piece_entry&>(*i), l);
+            i = m_read_pieces.erase(i);
+        }
+
+        l.unlock();
+
+        // both queues are locked in the same order by threads handing
+        // over storages to each other, so queued jobs stay ahead of the
+        // ones passed on by add_job. Sorted read jobs are served here
+        mutex::scoped_lock first(this < &dest ? m_queue_mutex : dest.m_queue_mutex);
+        mutex::scoped_lock second(this < &dest ? dest.m_queue_mutex : m_queue_mutex);
+
+        {
+            mutex::scoped_lock sl(s->m_io_mutex);
+            s->m_io_thread = &dest;
+            s->m_move_thread = 0;
+            s->get_storage_impl()->m_disk_pool = &dest;
+        }
+
+        mutex::scoped_lock& dl = this < &dest ? second : first;
+
+        for (std::deque<disk_io_job>::iterator i = m_jobs.begin(); i != m_jobs.end();)
+        {
+            if (i->storage != s)
+            {
+                ++i;
+                continue;
+            }
+
+            if (i->action == disk_io_job::write)
+            {
+                LIBED2K_ASSERT(m_queue_buffer_size >= i->buffer_size);
+                m_queue_buffer_size -= i->buffer_size;
+            }
+
+            dest.add_job(*i, dl, i->callback);
+            i = m_jobs.erase(i);
+        }
+
+        check_write_queue();
+    }
+
+    void disk_io_thread::check_write_queue()
+    {
+        if (!m_exceeded_write_queue) return;
+
+        int low_watermark = m_settings.max_queued_disk_bytes_low_watermark == 0
+            || m_settings.max_queued_disk_bytes_low_watermark >= m_settings.max_queued_disk_bytes
+            ? size_type(m_settings.max_queued_disk_bytes) * 7 / 8
+            : m_settings.max_queued_disk_bytes_low_watermark;
+
+        if (m_queue_buffer_size < low_watermark
+            || m_settings.max_queued_disk_bytes == 0)
+        {
+            m_exceeded_write_queue = false;
+            // we just dropped below the high watermark of number of bytes
+            // queued for writing to the disk. Notify the session so that it
+            // can trigger all the connections waiting for this event
+            if (m_queue_callback) m_ios.post(m_queue_callback);
+        }
+    }
+
     bool disk_io_thread::test_error(disk_io_job& j)
     {
         LIBED2K_ASSERT(j.storage);
@@ -1406,7 +2255,7 @@ namespace libed2k
         read_operation + buffer_operation + cancel_on_abort // read
         , buffer_operation // write
         , 0 // hash
-        , 0 // move_storage
+        , cancel_on_abort // move_storage
         , 0 // release_files
         , 0 // delete_files
         , 0 // check_fastresume
@@ -1422,6 +2271,63 @@ namespace libed2k
         , 0 // finalize_file
     };
 
+    // unlocks the mutex locked already at the end of the scope, if there is one
+    struct adopted_lock
+    {
+        adopted_lock(boost::mutex* m): m_mutex(m) {}
+        ~adopted_lock() { if (m_mutex) m_mutex->unlock(); }
+        boost::mutex* m_mutex;
+    };
+
+    bool disk_io_thread::defer_job(disk_io_job const& j)
+    {
+        if (!j.storage) return false;
+
+        // jobs of a storage keep their order
+        for (std::deque<disk_io_job>::iterator i = m_deferred_jobs.begin()
+            , end(m_deferred_jobs.end()); i != end; ++i)
+        {
+            if (i->storage == j.storage) return true;
+        }
+
+        return !j.storage->m_job_mutex.try_lock();
+    }
+
+    void disk_io_thread::requeue_deferred_jobs()
+    {
+        if (m_deferred_jobs.empty()) return;
+
+        // the checking thread signals after each piece, it may have
+        // taken the storage again by now and the jobs are deferred again
+        std::map<piece_manager*, bool> released;
+        std::deque<disk_io_job> ready;
+
+        for (std::deque<disk_io_job>::iterator i = m_deferred_jobs.begin(); i != m_deferred_jobs.end();)
+        {
+            std::map<piece_manager*, bool>::iterator r = released.find(i->storage.get());
+            if (r == released.end())
+            {
+                boost::mutex& m = i->storage->m_job_mutex;
+                bool free = m.try_lock();
+                if (free) m.unlock();
+                r = released.insert(std::make_pair(i->storage.get(), free)).first;
+            }
+
+            if (!r->second)
+            {
+                ++i;
+                continue;
+            }
+
+            // taken off the queue size once more when it's picked
+            if (i->action == disk_io_job::write) m_queue_buffer_size += i->buffer_size;
+            ready.push_back(*i);
+            i = m_deferred_jobs.erase(i);
+        }
+
+        m_jobs.insert(m_jobs.begin(), ready.begin(), ready.end());
+    }
+
     bool should_cancel_on_abort(disk_io_job const& j)
     {
         LIBED2K_ASSERT(j.action >= 0 && j.action < int(sizeof(action_flags)));
@@ -1487,6 +2393,8 @@ namespace libed2k
             }
         }
 #endif
+        set_hash_threads(m_settings.hashing_threads);
+
         // 1 = forward in list, -1 = backwards in list
         int elevator_direction = 1;
 
@@ -1504,6 +2412,18 @@ namespace libed2k
 
             mutex::scoped_lock jl(m_queue_mutex);
 
+            // pieces verified by the hash threads and check progress. Posting
+            // their callbacks from here keeps them behind the write callbacks
+            // of the piece
+            for (std::list<hash_job>::iterator i = m_hash_results.begin()
+                , end(m_hash_results.end()); i != end; ++i)
+            {
+                m_hash_time.add_sample(i->hash_time);
+                m_cache_stats.cumulative_hash_time += i->hash_time / 1000;
+                post_callback(i->job, i->ret);
+            }
+            m_hash_results.clear();
+
             if (m_queued_completions.size() >= 30 || (m_jobs.empty() && !m_queued_completions.empty()))
             {
                 job_queue_t* q = new job_queue_t;
@@ -1512,8 +2432,12 @@ namespace libed2k
             }
 
 
+            requeue_deferred_jobs();
+
+            // deferred jobs wait for the checking threads to signal
             libed2k::ptime job_start;
-            while (m_jobs.empty() && m_sorted_read_jobs.empty() && !m_abort)
+            while (m_jobs.empty() && m_sorted_read_jobs.empty()
+                && m_hash_results.empty() && (!m_abort || !m_deferred_jobs.empty()))
             {
                 // if there hasn't been an event in one second
                 // see if we should flush the cache
@@ -1526,10 +2450,28 @@ namespace libed2k
                 if (job_start >= m_last_stats_flip + libed2k::seconds(1)) flip_stats(job_start);
             }
 
-            if (m_abort && m_jobs.empty())
+            if (m_abort && m_jobs.empty() && m_deferred_jobs.empty())
             {
                 jl.unlock();
 
+                // the hash threads finish the pieces they have queued and
+                // checks are aborted, their callbacks are posted before we
+                // let go of the io_service
+                stop_check_threads();
+                set_hash_threads(0);
+                jl.lock();
+                for (std::list<hash_job>::iterator i = m_hash_results.begin()
+                    , end(m_hash_results.end()); i != end; ++i)
+                    post_callback(i->job, i->ret);
+                m_hash_results.clear();
+                if (!m_queued_completions.empty())
+                {
+                    job_queue_t* q = new job_queue_t;
+                    q->swap(m_queued_completions);
+                    m_ios.post(boost::bind(completion_queue_handler, q));
+                }
+                jl.unlock();
+
                 mutex::scoped_lock l(m_piece_mutex);
                 // flush all disk caches
                 cache_piece_index_t& widx = m_pieces.get<0>();
@@ -1557,6 +2499,9 @@ namespace libed2k
                 return;
             }
 
+            // woken up by the hash or checking threads only
+            if (m_jobs.empty() && m_sorted_read_jobs.empty()) continue;
+
             disk_io_job j;
 
             libed2k::ptime now = libed2k::time_now_hires();
@@ -1597,24 +2542,7 @@ namespace libed2k
                 {
                     LIBED2K_ASSERT(m_queue_buffer_size >= j.buffer_size);
                     m_queue_buffer_size -= j.buffer_size;
-
-                    if (m_exceeded_write_queue)
-                    {
-                        int low_watermark = m_settings.max_queued_disk_bytes_low_watermark == 0
-                            || m_settings.max_queued_disk_bytes_low_watermark >= m_settings.max_queued_disk_bytes
-                            ? size_type(m_settings.max_queued_disk_bytes) * 7 / 8
-                            : m_settings.max_queued_disk_bytes_low_watermark;
-
-                        if (m_queue_buffer_size < low_watermark
-                            || m_settings.max_queued_disk_bytes == 0)
-                        {
-                            m_exceeded_write_queue = false;
-                            // we just dropped below the high watermark of number of bytes
-                            // queued for writing to the disk. Notify the session so that it
-                            // can trigger all the connections waiting for this event
-                            if (m_queue_callback) m_ios.post(m_queue_callback);
-                        }
-                    }
+                    check_write_queue();
                 }
 
                 jl.unlock();
@@ -1704,6 +2632,13 @@ namespace libed2k
                 LIBED2K_ASSERT(!m_sorted_read_jobs.empty());
 
                 LIBED2K_ASSERT(elevator_job_pos != m_sorted_read_jobs.end());
+
+                // reads for the next jobs in the elevator's direction go
+                // out together and the jobs find their pieces in the cache
+                if (m_ring.is_open() && m_settings.use_read_cache
+                    && !m_settings.explicit_read_cache)
+                    prefetch_read_jobs(elevator_job_pos, elevator_direction);
+
                 j = elevator_job_pos->second;
                 read_jobs_t::iterator to_erase = elevator_job_pos;
 
@@ -1751,6 +2686,16 @@ namespace libed2k
             if (j.storage && j.storage->get_storage_impl()->m_settings == 0)
                 j.storage->get_storage_impl()->m_settings = &m_settings;
 
+            // the checking thread is hashing a piece of the storage, other
+            // storages' jobs go on meanwhile
+            if (defer_job(j))
+            {
+                holder.release();
+                m_deferred_jobs.push_back(j);
+                continue;
+            }
+            adopted_lock storage_lock(j.storage ? &j.storage->m_job_mutex : 0);
+
             switch (j.action)
             {
                 case disk_io_job::update_settings:
@@ -1775,6 +2720,22 @@ namespace libed2k
                     m_settings = *s;
                     delete s;
 
+                    {
+                        mutex::scoped_lock cl(m_check_mutex);
+                        m_check_delay_per_block = m_settings.file_checks_delay_per_block;
+                    }
+
+                    set_hash_threads(m_settings.hashing_threads);
+
+                    if (!m_settings.use_io_uring) m_ring.close();
+                    else if (m_ring.entries() < m_settings.io_uring_queue_depth)
+                    {
+                        error_code ec;
+                        if (!m_ring.open(m_settings.io_uring_queue_depth, ec))
+                            ERR("io_uring is not available, disk I/O stays blocking: "
+                                << ec.message());
+                    }
+
                     m_file_pool.resize(m_settings.file_pool_size);
 #if defined __APPLE__ && defined __MACH__ && MAC_OS_X_VERSION_MIN_REQUIRED >= 1050
                     setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD
@@ -1817,6 +2778,8 @@ namespace libed2k
                                 LIBED2K_ASSERT(m_queue_buffer_size >= i->buffer_size);
                                 m_queue_buffer_size -= i->buffer_size;
                             }
+                            if (i->action == disk_io_job::move_storage)
+                                i->error = error_code(boost::asio::error::operation_aborted);
                             post_callback(*i, -3);
                             i = m_jobs.erase(i);
                             continue;
@@ -1838,6 +2801,9 @@ namespace libed2k
                     }
                     jl.unlock();
 
+                    // a move cancelled in the middle leaves the files where they were
+                    j.storage->abandon_move_impl();
+
                     mutex::scoped_lock l(m_piece_mutex);
 
                     // build a vector of all the buffers we need to free
@@ -1879,6 +2845,11 @@ namespace libed2k
                                 LIBED2K_ASSERT(m_queue_buffer_size >= i->buffer_size);
                                 m_queue_buffer_size -= i->buffer_size;
                             }
+                            if (i->action == disk_io_job::move_storage)
+                            {
+                                i->storage->abandon_move_impl();
+                                i->error = error_code(boost::asio::error::operation_aborted);
+                            }
                             post_callback(*i, -3);
                             i = m_jobs.erase(i);
                             continue;
@@ -1981,6 +2952,17 @@ namespace libed2k
                     m_log << log_time();
 #endif
                     INVARIANT_CHECK;
+                    // a cache hit is answered with the cached block itself
+                    if ((j.flags & disk_io_job::cache_reference) && j.buffer == 0
+                        && reference_cached_block(j))
+                    {
+                        ret = j.buffer_size;
+#ifdef LIBED2K_DISK_STATS
+                        m_log << " read-cache-reference " << j.buffer_size << std::endl;
+#endif
+                        break;
+                    }
+
                     if (j.buffer == 0) j.buffer = allocate_buffer("send buffer");
                     LIBED2K_ASSERT(j.buffer_size <= m_block_size);
                     if (j.buffer == 0)
@@ -2064,9 +3046,9 @@ namespace libed2k
                     LIBED2K_ASSERT(!j.storage->error());
                     LIBED2K_ASSERT(j.cache_min_time >= 0);
 
-                    if (in_use() >= m_settings.cache_size)
+                    if (cache_used() >= cache_limit())
                     {
-                        flush_cache_blocks(l, in_use() - m_settings.cache_size + 1);
+                        flush_cache_blocks(l, cache_used() - cache_limit() + 1);
                         if (test_error(j)) break;
                     }
                     LIBED2K_ASSERT(!j.storage->error());
@@ -2109,12 +3091,14 @@ namespace libed2k
                             const_cast<cached_piece_entry&>(*p).num_contiguous_blocks = contiguous_blocks(*p);
                         }
                         idx.modify(p, update_last_use(j.cache_min_time));
+                        hash_cached_blocks(const_cast<cached_piece_entry&>(*p), l
+                            , !m_hash_threads.empty());
                         // we might just have created a contiguous range
                         // that meets the requirement to be flushed. try it
-                        // if we're in avoid_readback mode, don't do this. Only flush
-                        // pieces when we need more space in the cache (which will avoid
-                        // flushing blocks out-of-order) or when we issue a hash job,
-                        // wich indicates the piece is completely downloaded
+                        // if we're in avoid_readback mode, only flush blocks already
+                        // hashed. The rest is flushed when we need more space in the
+                        // cache or when we issue a hash job, wich indicates the piece
+                        // is completely downloaded
                         flush_contiguous_blocks(const_cast<cached_piece_entry&>(*p)
                             , l, m_settings.write_cache_line_size
                             , m_settings.disk_cache_algorithm == session_settings::avoid_readback);
@@ -2146,15 +3130,20 @@ namespace libed2k
                             break;
                         }
                         LIBED2K_ASSERT(!j.storage->error());
+
+                        p = find_cached_piece(m_pieces, j, l);
+                        LIBED2K_ASSERT(p != idx.end());
+                        hash_cached_blocks(const_cast<cached_piece_entry&>(*p), l
+                            , !m_hash_threads.empty());
                     }
                     // we've now inserted the buffer
                     // in the cache, we should not
                     // free it at the end
                     holder.release();
 
-                    if (in_use() > m_settings.cache_size)
+                    if (cache_used() > cache_limit())
                     {
-                        flush_cache_blocks(l, in_use() - m_settings.cache_size);
+                        flush_cache_blocks(l, cache_used() - cache_limit());
                         test_error(j);
                     }
                     LIBED2K_ASSERT(!j.storage->error());
@@ -2163,6 +3152,11 @@ namespace libed2k
                 }
                 case disk_io_job::cache_piece:
                 {
+                    // a range read ahead for an uploading peer, the kernel is
+                    // told about it too in case the cache has no room for it
+                    if (j.buffer_size > 0 && m_settings.use_disk_read_ahead)
+                        j.storage->hint_read_impl(j.piece, j.offset, j.buffer_size);
+
                     mutex::scoped_lock l(m_piece_mutex);
 
                     if (test_error(j))
@@ -2176,6 +3170,13 @@ namespace libed2k
                     INVARIANT_CHECK;
                     LIBED2K_ASSERT(j.buffer == 0);
 
+                    if (j.buffer_size > 0)
+                    {
+                        ret = m_settings.use_read_cache ? read_ahead(j, l) : 0;
+                        if (ret < 0) test_error(j);
+                        break;
+                    }
+
                     cache_piece_index_t::iterator p;
                     bool hit;
                     ret = cache_piece(j, p, hit, 0, l);
@@ -2193,17 +3194,27 @@ namespace libed2k
                     mutex::scoped_lock l(m_piece_mutex);
                     INVARIANT_CHECK;
 
+                    bool hash_threads = !m_hash_threads.empty() && !m_settings.disable_hash_checks;
+
+                    // blocks not hashed yet stay in memory for the hash threads
+                    std::vector<char*> blocks;
                     cache_piece_index_t& idx = m_pieces.get<0>();
                     cache_piece_index_t::iterator i = find_cached_piece(m_pieces, j, l);
                     if (i != idx.end())
                     {
                         LIBED2K_ASSERT(i->storage);
-                        int ret = flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+                        // the remaining blocks are hashed from memory
+                        // before they go to disk
+                        if (!hash_threads) hash_cached_blocks(const_cast<cached_piece_entry&>(*i), l);
+                        int ret = flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l
+                            , hash_threads ? &blocks : 0);
                         idx.erase(i);
                         if (test_error(j))
                         {
                             ret = -1;
                             j.storage->mark_failed(j.piece);
+                            for (std::vector<char*>::iterator b = blocks.begin(); b != blocks.end(); ++b)
+                                if (*b) free_buffer(*b);
                             break;
                         }
                     }
@@ -2214,6 +3225,18 @@ namespace libed2k
                         break;
                     }
 
+                    if (hash_threads)
+                    {
+                        if (queue_hash_job(j, blocks) < 0)
+                        {
+                            ret = -1;
+                            j.storage->mark_failed(j.piece);
+                            break;
+                        }
+                        // the callback is posted once a hash thread is done
+                        continue;
+                    }
+
                     libed2k::ptime hash_start = libed2k::time_now_hires();
 
                     int readback = 0;
@@ -2229,6 +3252,7 @@ namespace libed2k
 
                     ret = (j.storage->info()->hash_for_piece(j.piece) == h)?0:-2;
                     if (ret == -2) j.storage->mark_failed(j.piece);
+                    else j.storage->queue_fingerprint(j.piece);
 
                     libed2k::ptime done = libed2k::time_now_hires();
                     m_hash_time.add_sample(total_microseconds(done - hash_start));
@@ -2241,13 +3265,32 @@ namespace libed2k
                     m_log << log_time() << " move" << std::endl;
 #endif
                     LIBED2K_ASSERT(j.buffer == 0);
-                    ret = j.storage->move_storage_impl(j.str);
-                    if (ret != 0)
+                    // piece is set once the move is started, the job is queued
+                    // again after every slice of the copy
+                    ret = j.storage->move_storage_impl(j.str, j.piece == 0, j.moved, j.move_size);
+                    if (ret < 0)
                     {
                         test_error(j);
                         break;
                     }
+                    if (ret > 0)
+                    {
+                        // report the progress and let the jobs queued meanwhile run
+                        j.piece = 1;
+                        LIBED2K_TRY {
+                            post_callback(j, ret);
+                        } LIBED2K_CATCH(std::exception&) {}
+                        add_job(j, j.callback);
+                        continue;
+                    }
                     j.str = j.storage->save_path();
+
+                    {
+                        mutex::scoped_lock sl(j.storage->m_io_mutex);
+                        disk_io_thread* dest = j.storage->m_move_thread;
+                        sl.unlock();
+                        if (dest && dest != this) hand_over(j.storage.get(), *dest);
+                    }
                     break;
                 }
                 case disk_io_job::release_files:
@@ -2366,6 +3409,14 @@ namespace libed2k
 #ifdef LIBED2K_DISK_STATS
                     m_log << log_time() << " check_files" << std::endl;
 #endif
+                    // transfers are checked by the thread of their storage
+                    // device unless pieces are hashed by the disk thread
+                    if (m_settings.hashing_threads > 0)
+                    {
+                        queue_check_job(j);
+                        continue;
+                    }
+
                     int piece_size = j.storage->info()->piece_length();
                     for (int processed = 0; processed < 4 * 1024 * 1024; processed += piece_size)
                     {
@@ -2428,6 +3479,7 @@ namespace libed2k
                     m_log << log_time() << " save_resume_data" << std::endl;
 #endif
                     j.resume_data.reset(new entry(entry::dictionary_t));
+                    j.storage->update_fingerprints();
                     j.storage->write_resume_data(*j.resume_data);
                     ret = 0;
                     break;
@@ -103,7 +103,8 @@ namespace libed2k
             "hashes dont match pieces",
             "failed hash check",
             "invalid escaped string",
-            "file parameters making was cancelled"
+            "file parameters making was cancelled",
+            "peer banned for sending corrupt data"
         };
 
         if (ev < 0 || ev >= static_cast<int>(sizeof(msgs)/sizeof(msgs[0])))
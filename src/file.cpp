@@ -5,10 +5,13 @@
 #include <algorithm>
 #include <locale>
 
+#include <boost/bind.hpp>
+
 #include "libed2k/constants.hpp"
 #include "libed2k/log.hpp"
 #include "libed2k/file.hpp"
 #include "libed2k/hasher.hpp"
+#include "libed2k/aich.hpp"
 #include "libed2k/util.hpp"
 #include "libed2k/thread.hpp"
 
@@ -16,6 +19,15 @@
 #include <windows.h>
 #endif
 
+#if LIBED2K_USE_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
 namespace libed2k
 {
     typedef std::map<std::string, EED2KFileType> SED2KFileTypeMap;
@@ -585,6 +597,68 @@ namespace libed2k
         }
     }
 
+    known_file_entry::known_file_entry(const add_transfer_params& atp, time_t write_ts) :
+                                        m_nLastChanged(static_cast<boost::uint32_t>(write_ts)),
+                                        m_hFile(atp.file_hash)
+    {
+        // single piece file keeps its hash as file hash only
+        if (atp.piece_hashses.size() > 1)
+        {
+            m_hash_list.m_collection = atp.piece_hashses;
+        }
+
+        m_list.add_tag(make_string_tag(libed2k::filename(atp.file_path), FT_FILENAME, true));
+        m_list.add_tag(make_string_tag(libed2k::filename(atp.file_path), FT_FILENAME, true));  // write same name for backward compatibility
+
+        if (atp.file_size > std::numeric_limits<boost::uint32_t>::max())
+        {
+            m_list.add_tag(make_typed_tag(static_cast<boost::uint64_t>(atp.file_size), FT_FILESIZE, true));
+        }
+        else
+        {
+            m_list.add_tag(make_typed_tag(static_cast<boost::uint32_t>(atp.file_size), FT_FILESIZE, true));
+        }
+
+        if (atp.aich_root_hash.defined())
+        {
+            m_list.add_tag(make_string_tag(atp.aich_root_hash.toString(), FT_AICH_HASH, true));
+        }
+
+        // single piece is the root of its tree
+        if (atp.aich_piece_hashes.size() > 1)
+        {
+            std::vector<char> hashes(atp.aich_piece_hashes.size() * SHA1_HASH_SIZE);
+
+            for (size_t n = 0; n < atp.aich_piece_hashes.size(); ++n)
+            {
+                memcpy(&hashes[n * SHA1_HASH_SIZE], atp.aich_piece_hashes[n].getContainer(), SHA1_HASH_SIZE);
+            }
+
+            m_list.add_tag(make_blob_tag(hashes, FT_AICHHASHSET, true));
+        }
+
+        set_last_shared(static_cast<boost::uint32_t>(time(0)));
+    }
+
+    boost::uint32_t known_file_entry::last_shared() const
+    {
+        boost::shared_ptr<base_tag> p = m_list.getTagByNameId(FT_LASTSHARED);
+        return p && is_int_tag(p) ? static_cast<boost::uint32_t>(p->asInt()) : 0;
+    }
+
+    void known_file_entry::set_last_shared(boost::uint32_t ts)
+    {
+        tag_list<boost::uint32_t> tags;
+
+        for (size_t j = 0; j < m_list.count(); j++)
+        {
+            if (m_list[j]->getNameId() != FT_LASTSHARED) tags.add_tag(m_list[j]);
+        }
+
+        tags.add_tag(make_typed_tag(ts, FT_LASTSHARED, true));
+        m_list = tags;
+    }
+
     void known_file_entry::dump() const
     {
         DBG("known_file_entry::dump(TS: " << m_nLastChanged
@@ -593,30 +667,86 @@ namespace libed2k
                 << " tag list size: " << m_list.count());
     }
 
-    known_file_collection::known_file_collection() : m_nHeader(MET_HEADER_WITH_LARGEFILES)
+    known_file_collection::known_file_collection() : m_nHeader(MET_HEADER_WITH_LARGEFILES), m_indexed(0)
     {
     }
 
-    add_transfer_params known_file_collection::extract_transfer_params(time_t write_ts, const std::string& filepath)
+    known_file_collection::entry_key known_file_collection::key(const known_file_entry& entry)
     {
-        add_transfer_params atp;
+        size_type size = 0;
 
-        for (size_t n = 0; n < m_known_file_list.m_collection.size(); n++)
+        for (size_t j = 0; j < entry.m_list.count(); j++)
         {
-            // pass files when change time isn't equal
-            if (write_ts != static_cast<time_t>(m_known_file_list.m_collection[n].m_nLastChanged))
-            {
-                continue;
-            }
+            const boost::shared_ptr<base_tag> p = entry.m_list[j];
 
-            // ok, we have equal change time - let's check filepath
-            if (bom_filter(filename(filepath)) != bom_filter(m_known_file_list.m_collection[n].m_list.getStringTagByNameId(FT_FILENAME)))
+            if (is_int_tag(p) && p->getNameId() == FT_FILESIZE)
             {
-                DBG("orig: " << convert_to_native(filepath)
-                    << " isn't equal: " << convert_to_native(bom_filter(m_known_file_list.m_collection[n].m_list.getStringTagByNameId(FT_FILENAME))));
-                continue;
+                size = p->asInt();
+                break;
             }
+        }
+
+        return entry_key(static_cast<time_t>(entry.m_nLastChanged), size,
+                bom_filter(entry.m_list.getStringTagByNameId(FT_FILENAME)));
+    }
+
+    void known_file_collection::index()
+    {
+        m_index.clear();
+        m_index.rehash(m_known_file_list.m_collection.size());
+
+        for (size_t n = 0; n < m_known_file_list.m_collection.size(); n++)
+        {
+            // the first of duplicated entries wins as it was with list scan
+            m_index.insert(std::make_pair(key(m_known_file_list.m_collection[n]), n));
+        }
+
+        m_indexed = m_known_file_list.m_collection.size();
+        DBG("known file collection indexed {entries: " << m_indexed << ", keys: " << m_index.size() << "}");
+    }
+
+    void known_file_collection::compact(time_t expired)
+    {
+        std::deque<known_file_entry> entries;
+        boost::unordered_set<entry_key, boost::hash<entry_key> > keys;
+
+        for (std::deque<known_file_entry>::iterator i = m_known_file_list.m_collection.begin(),
+                end(m_known_file_list.m_collection.end()); i != end; ++i)
+        {
+            // entries without the tag came from elsewhere, their age is unknown
+            boost::uint32_t shared = i->last_shared();
+            if (shared != 0 && time_t(shared) < expired) continue;
+
+            if (keys.insert(key(*i)).second) entries.push_back(*i);
+        }
+
+        DBG("known file collection compacted {entries: " << m_known_file_list.m_collection.size()
+                << ", kept: " << entries.size() << "}");
+        m_known_file_list.m_collection.swap(entries);
+        index();
+    }
+
+    add_transfer_params known_file_collection::extract_transfer_params(time_t write_ts, size_type size, const std::string& filepath)
+    {
+        add_transfer_params atp;
 
+        if (m_indexed > m_known_file_list.m_collection.size())
+        {
+            index();
+        }
+
+        // appended entries are indexed without the rest, earlier ones win
+        for (; m_indexed < m_known_file_list.m_collection.size(); ++m_indexed)
+        {
+            m_index.insert(std::make_pair(key(m_known_file_list.m_collection[m_indexed]), m_indexed));
+        }
+
+        entries_index::const_iterator itr = m_index.find(entry_key(write_ts, size, bom_filter(filename(filepath))));
+
+        if (itr != m_index.end())
+        {
+            size_t n = itr->second;
+            m_known_file_list.m_collection[n].set_last_shared(static_cast<boost::uint32_t>(time(0)));
             atp.file_path = filepath;
             atp.file_hash = m_known_file_list.m_collection[n].m_hFile;
 
@@ -633,7 +763,27 @@ namespace libed2k
             for (size_t j = 0; j < m_known_file_list.m_collection[n].m_list.count(); j++)
             {
                 const boost::shared_ptr<base_tag> p = m_known_file_list.m_collection[n].m_list[j];
-                // we process only int tags - check only ints
+
+                if (is_string_tag(p) && p->getNameId() == FT_AICH_HASH)
+                {
+                    atp.aich_root_hash = aich_hash::fromString(p->asString());
+                    continue;
+                }
+
+                if (p->getType() == TAGTYPE_BLOB && p->getNameId() == FT_AICHHASHSET)
+                {
+                    const std::vector<char>& hashes = p->asBlob();
+                    atp.aich_piece_hashes.resize(hashes.size() / SHA1_HASH_SIZE);
+
+                    for (size_t h = 0; h < atp.aich_piece_hashes.size(); ++h)
+                    {
+                        memcpy(atp.aich_piece_hashes[h].getContainer(), &hashes[h * SHA1_HASH_SIZE], SHA1_HASH_SIZE);
+                    }
+
+                    continue;
+                }
+
+                // the rest we process are int tags - check only ints
                 if (!is_int_tag(p))
                     continue;
 
@@ -660,18 +810,31 @@ namespace libed2k
                     default:
                         // ignore unused tags like
                         // FT_PERMISSIONS
-                        // FT_AICH_HASH:
                         // and all kad tags
                         // also FT_FILENAME was already checked
                         break;
                 }
             }
 
+            // piece hash of single piece file is the AICH root
+            if (atp.aich_root_hash.defined() && atp.aich_piece_hashes.empty() &&
+                atp.file_size <= PIECE_SIZE)
+            {
+                atp.aich_piece_hashes.push_back(atp.aich_root_hash);
+            }
+
+            // AICH root from foreign client without piece hashes can't serve recovery
+            if (!atp.aich_piece_hashes.empty() &&
+                (size_type(atp.aich_piece_hashes.size()) != div_ceil(atp.file_size, PIECE_SIZE) ||
+                 aich_root_hash(atp.file_size, atp.aich_piece_hashes) != atp.aich_root_hash))
+            {
+                atp.aich_piece_hashes.clear();
+            }
+
             atp.file_path = filepath;
             atp.seed_mode  = true;
             DBG("metadata was migrated for {" << convert_to_native(filepath) << "}{"
                     << atp.file_hash.toString() << "}{" << atp.file_size << "}");
-            break;
         }
 
         return atp;
@@ -701,186 +864,561 @@ namespace libed2k
     transfer_resume_data::transfer_resume_data()
     {}
 
-    transfer_params_maker::transfer_params_maker(alert_manager& am, const std::string& known_filepath) :
-            m_am(am),
-            m_abort(false),
-            m_abort_current(false),
-            m_current_filepath(""),
-            m_known_filepath(known_filepath)
-    {
-    }
-
-    bool transfer_params_maker::start()
+    /**
+      * hashing runs in background, it shouldn't take CPU from the rest of system
+     */
+    static void set_idle_priority(boost::thread* th)
     {
-        LIBED2K_ASSERT(!m_thread);
-        m_thread.reset(new boost::thread(boost::ref(*this)));
 #ifdef WIN32
-        HANDLE th = m_thread->native_handle();
-        if (!SetThreadPriority(th, THREAD_PRIORITY_IDLE))
+        if (!SetThreadPriority(th->native_handle(), THREAD_PRIORITY_IDLE))
         {
             ERR("Unable to set idle priority to hasher thread");
         }
 #endif
-        return true;
-    }
-
-    transfer_params_maker::~transfer_params_maker()
-    {
-        stop();
     }
 
-    void transfer_params_maker::stop()
+    /**
+      * completes parameters of file with all piece hashes calculated
+     */
+    static void set_file_hash(add_transfer_params& atp)
     {
-        boost::mutex::scoped_lock lock(m_mutex);
-        m_order.clear();
-        m_abort_current = true;
-        m_abort = true;
-        m_condition.notify_one();
+        // AICH tree has no extra piece for files of whole pieces
+        if (!atp.aich_piece_hashes.empty())
+        {
+            atp.aich_root_hash = aich_root_hash(atp.file_size, atp.aich_piece_hashes);
+        }
 
-        lock.unlock();
+        if (size_type(atp.piece_hashses.size())*libed2k::PIECE_SIZE == atp.file_size)
+        {
+            atp.piece_hashses.push_back(libed2k::md4_hash::terminal);
+        }
 
-        // when thread exists - wait it
-        if (m_thread.get())
+        // calculate full file hash
+        if (atp.piece_hashses.size() > 1)
         {
-            m_thread->join();
+            hasher hproc;
+            hproc.update(reinterpret_cast<const char*>(&atp.piece_hashses[0]), atp.piece_hashses.size()*MD4_HASH_SIZE);
+            atp.file_hash = hproc.final();
+        }
+        else
+        {
+            atp.file_hash = atp.piece_hashses[0];
         }
 
-        m_thread.reset();   //!< remove thread
-        m_abort = false;
+        atp.seed_mode   = true;
     }
 
-    size_t transfer_params_maker::order_size()
+    share_hasher::hashed_file::hashed_file(const std::string& path, const file_status& fs) :
+            atp(path), device(fs.device), mtime(fs.mtime), pending(0), reading(false), cancelled(false), finished(false)
     {
-        boost::mutex::scoped_lock lock(m_mutex);
-        return m_order.size();
+        atp.file_size = 0;
     }
 
-    std::string transfer_params_maker::current_filepath()
+    share_hasher::share_hasher(handler_t handler, int hash_threads, int read_ahead, int device_readers) :
+            m_handler(handler),
+            m_hash_threads(hash_threads > 0 ? hash_threads : std::max<int>(boost::thread::hardware_concurrency(), 1)),
+            m_read_ahead(std::max(read_ahead, 1)),
+            m_device_readers(std::max(device_readers, 1)),
+            m_abort(false),
+            m_allocated(0)
     {
-        boost::mutex::scoped_lock lock(m_mutex);
-        return m_current_filepath;
     }
 
-    void transfer_params_maker::make_transfer_params(const std::string& filepath)
+    share_hasher::~share_hasher()
     {
-        boost::mutex::scoped_lock lock(m_mutex);
-        m_order.push_front(filepath);
-        m_condition.notify_one();
+        stop();
     }
 
-    void transfer_params_maker::cancel_transfer_params(const std::string& filepath)
+    void share_hasher::start()
+    {
+        for (int i = 0; i < m_hash_threads; ++i)
+        {
+            set_idle_priority(m_threads.create_thread(boost::bind(&share_hasher::hasher, this)));
+        }
+    }
+
+    void share_hasher::stop()
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        std::deque<std::string>::iterator itr = std::remove(m_order.begin(), m_order.end(), filepath);
+        m_abort = true;
+        m_readers_condition.notify_all();
+        m_hashers_condition.notify_all();
+        lock.unlock();
 
-        // we got target in order - simply erase it and exit
-        // it doesn't claim any signals
-        if (itr != m_order.end())
+        m_threads.join_all();
+
+        // threads are gone, all buffers are either free or hold unhashed pieces
+        lock.lock();
+
+        for (std::deque<piece_job>::iterator i = m_pieces.begin(), end(m_pieces.end()); i != end; ++i)
         {
-            m_order.erase(itr, m_order.end());
-            return;
+            m_buffers.push_back(i->buffer);
         }
 
-        if (m_current_filepath == filepath)
+        LIBED2K_ASSERT(m_buffers.size() == size_t(m_allocated));
+
+        for (std::vector<char*>::iterator i = m_buffers.begin(), end(m_buffers.end()); i != end; ++i)
         {
-            m_abort_current = true;               // erase flag available only on current iteration
+            delete [] *i;
         }
 
-        m_cancel_order.push(filepath);  // this alert will emit after current file processing completed
+        std::vector<file_ptr> done;
+        done.swap(m_files);
+
+        for (std::vector<file_ptr>::iterator i = done.begin(), end(done.end()); i != end; ++i)
+        {
+            (*i)->cancelled = true;
+        }
+
+        m_pieces.clear();
+        m_buffers.clear();
+        m_queues.clear();
+        m_readers.clear();
+        m_allocated = 0;
+        m_abort = false;
+        lock.unlock();
+
+        report(done);
     }
 
-    void transfer_params_maker::operator()()
+    void share_hasher::hash_file(const std::string& filepath, const file_status& fs)
     {
-        // when we have known filepath path - attempt to extract its content
-        if (!m_known_filepath.empty())
-        {
-            std::ifstream fstream(convert_to_native(m_known_filepath).c_str(), std::ios_base::binary | std::ios_base::in);
+        boost::mutex::scoped_lock lock(m_mutex);
+        file_ptr hf(new hashed_file(filepath, fs));
+        m_files.push_back(hf);
+        m_queues[hf->device].push_back(hf);
 
-            if (fstream)
-            {
-                libed2k::archive::ed2k_iarchive ifa(fstream);
+        int& readers = m_readers[hf->device];
 
-                try
-                {
-                    ifa >> m_kfc;
-                }
-                catch(libed2k_exception&)
-                {
-                    m_kfc.m_known_file_list.m_collection.clear();
-                }
-            }
+        if (readers < m_device_readers)
+        {
+            ++readers;
+            set_idle_priority(m_threads.create_thread(boost::bind(&share_hasher::reader, this, hf->device)));
         }
 
+        m_readers_condition.notify_all();
+    }
+
+    bool share_hasher::cancel(const std::string& filepath)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        std::vector<file_ptr> done;
 
-        while(1)
+        for (std::vector<file_ptr>::iterator i = m_files.begin(), end(m_files.end()); i != end; ++i)
         {
-            boost::mutex::scoped_lock lock(m_mutex);
-            m_current_filepath.clear();
-            m_abort_current = false;
+            file_ptr hf = *i;
+            if (hf->atp.file_path != filepath || hf->cancelled || hf->finished) continue;
 
-            if (m_abort) { break; }
+            hf->cancelled = true;
 
-            // ok, alert all cancels
-            while(!m_cancel_order.empty())
+            // file isn't touched yet - drop it from reader queue
+            if (!hf->reading && hf->pending == 0)
             {
-                m_am.post_alert_should(transfer_params_alert(add_transfer_params(m_cancel_order.front()), errors::file_params_making_was_cancelled));
-                m_cancel_order.pop();
+                std::deque<file_ptr>& queue = m_queues[hf->device];
+                queue.erase(std::remove(queue.begin(), queue.end(), hf), queue.end());
+                finish(hf, done);
             }
 
-            if(m_order.empty())
-            {
-                m_condition.wait(lock);
-            }
+            // reader waiting for buffer has to see cancel
+            m_readers_condition.notify_all();
+            lock.unlock();
 
-            if (!m_order.empty())
+            report(done);
+            return true;
+        }
+
+        return false;
+    }
+
+    size_t share_hasher::in_progress()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_files.size();
+    }
+
+    void share_hasher::reader(boost::uint64_t device)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        while (!m_abort)
+        {
+            std::deque<file_ptr>& queue = m_queues[device];
+
+            if (queue.empty())
             {
-                m_current_filepath = m_order.back();
-                m_order.pop_back();
+                m_readers_condition.wait(lock);
+                continue;
             }
 
-            lock.unlock();
+            file_ptr hf = queue.front();
+            queue.pop_front();
+            hf->reading = true;
+            read_file(lock, hf);
+            hf->reading = false;
 
-            if (!m_current_filepath.empty()) process_item();
+            if (hf->pending == 0 && !m_abort)
+            {
+                std::vector<file_ptr> done;
+                finish(hf, done);
+                lock.unlock();
+                report(done);
+                lock.lock();
+            }
         }
 
-        DBG("transfer_params_maker {thread exit}");
+        DBG("share_hasher {reader exit}");
     }
 
-    std::pair<add_transfer_params, error_code> file2atp::operator()(const std::string& filepath, const bool& cancel)
+    void share_hasher::read_file(boost::mutex::scoped_lock& lock, file_ptr hf)
     {
-        std::pair<add_transfer_params, error_code> res_pair;
-        // references
-        add_transfer_params& atp = res_pair.first;
-        error_code& ec = res_pair.second;
-
-        // store filepath always for search node ability!
-        atp.file_path = filepath;
-        atp.file_size = 0;
+        add_transfer_params& atp = hf->atp;
+        error_code ec;
 
-        file f(filepath, file::read_only, ec);
+        lock.unlock();
+        file f(atp.file_path, file::read_only, ec);
+        if (!ec) atp.file_size = f.get_size(ec);
+        if (!ec && atp.file_size == 0) ec = errors::filesize_is_zero;
+        lock.lock();
 
-        // check size when file opened successfully
-        if (!ec)
+        if (ec)
         {
-            atp.file_size = f.get_size(ec);
+            hf->ec = ec;
+            return;
         }
 
-        if (!ec && atp.file_size != 0)
+        int pieces_count = div_ceil(atp.file_size, PIECE_SIZE);
+        atp.piece_hashses.resize(pieces_count);
+        atp.aich_piece_hashes.resize(pieces_count);
+        DBG("share_hasher {" << convert_to_native(atp.file_path) << ", pieces: " << pieces_count << "}");
+
+        for (int i = 0; i < pieces_count; ++i)
         {
-            int pieces_count = div_ceil(atp.file_size, PIECE_SIZE);
-            LIBED2K_ASSERT(pieces_count != 0);
-            DBG("stat file: {" << convert_to_native(filepath) << ", pieces: " << pieces_count  << "}");
+            while (!m_abort && !hf->cancelled && m_buffers.empty() && m_allocated == m_read_ahead)
+                m_readers_condition.wait(lock);
 
-            // prepare results vector
-            atp.piece_hashses.resize(pieces_count);
-            size_type capacity = atp.file_size;
-            size_type offset = 0;
-            char chBlock[BLOCK_SIZE];
-            hasher hproc;
+            if (m_abort || hf->cancelled) return;
 
-            for (int i = 0; i < pieces_count; ++i)
+            char* buffer = 0;
+
+            if (m_buffers.empty())
             {
-                size_type in_piece_capacity = std::min<size_type>(libed2k::PIECE_SIZE, capacity);
+                buffer = new char[PIECE_SIZE];
+                ++m_allocated;
+            }
+            else
+            {
+                buffer = m_buffers.back();
+                m_buffers.pop_back();
+            }
+
+            size_type offset = i * PIECE_SIZE;
+            size_t size = size_t(std::min<size_type>(PIECE_SIZE, atp.file_size - offset));
+
+            // one read for whole piece keeps disk access sequential
+            lock.unlock();
+            file::iovec_t b = { buffer, size };
+            size_type read = f.readv(offset, &b, 1, ec);
+            if (!ec && read != size_type(size)) ec = errors::file_was_truncated;
+            lock.lock();
+
+            if (ec || m_abort || hf->cancelled)
+            {
+                m_buffers.push_back(buffer);
+                m_readers_condition.notify_all();
+                hf->ec = ec;
+                return;
+            }
+
+            piece_job job = { hf, i, buffer, size, false, aich_hash() };
+            m_pieces.push_back(job);
+            ++hf->pending;
+            m_hashers_condition.notify_one();
+        }
+    }
+
+    void share_hasher::hasher()
+    {
+        const size_t lanes = md4_batch_lanes();
+        std::vector<piece_job> jobs;
+        hasher_batch batch;
+        aich_piece_hasher aich_hasher;
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        while (!m_abort)
+        {
+            if (m_pieces.empty())
+            {
+                m_hashers_condition.wait(lock);
+                continue;
+            }
+
+            // spread read pieces over hash threads, but fill MD4 lanes when pieces are plenty
+            size_t count = std::min(lanes, std::max<size_t>(m_pieces.size() / m_hash_threads, 1));
+            jobs.assign(m_pieces.begin(), m_pieces.begin() + count);
+            m_pieces.erase(m_pieces.begin(), m_pieces.begin() + count);
+
+            for (std::vector<piece_job>::iterator i = jobs.begin(), end(jobs.end()); i != end; ++i)
+            {
+                i->skip = i->file->cancelled;
+                if (!i->skip) batch.add(i->buffer, i->size);
+            }
+
+            lock.unlock();
+
+            std::vector<md4_hash> hashes = batch.final();
+
+            // AICH trees are SHA-1 and go piece by piece
+            for (std::vector<piece_job>::iterator i = jobs.begin(), end(jobs.end()); i != end; ++i)
+            {
+                if (i->skip) continue;
+                aich_hasher.reset();
+                aich_hasher.update(i->buffer, i->size);
+                i->aich = aich_hasher.final(aich_left_part(i->file->atp.file_size, i->index));
+            }
+            std::vector<md4_hash>::iterator h = hashes.begin();
+            std::vector<file_ptr> done;
+
+            lock.lock();
+
+            for (std::vector<piece_job>::iterator i = jobs.begin(), end(jobs.end()); i != end; ++i)
+            {
+                hashed_file& hf = *i->file;
+
+                if (!i->skip)
+                {
+                    hf.atp.piece_hashses[i->index] = *h;
+                    hf.atp.aich_piece_hashes[i->index] = i->aich;
+                    ++h;
+                }
+
+                m_buffers.push_back(i->buffer);
+                --hf.pending;
+
+                if (hf.pending == 0 && !hf.reading) finish(i->file, done);
+            }
+
+            m_readers_condition.notify_all();
+
+            if (!done.empty())
+            {
+                lock.unlock();
+                report(done);
+                lock.lock();
+            }
+        }
+
+        DBG("share_hasher {hasher exit}");
+    }
+
+    void share_hasher::finish(file_ptr hf, std::vector<file_ptr>& done)
+    {
+        hf->finished = true;
+        done.push_back(hf);
+    }
+
+    void share_hasher::report(const std::vector<file_ptr>& done)
+    {
+        for (std::vector<file_ptr>::const_iterator i = done.begin(), end(done.end()); i != end; ++i)
+        {
+            hashed_file& hf = **i;
+
+            if (hf.cancelled)
+                hf.ec = errors::file_params_making_was_cancelled;
+            else if (!hf.ec)
+                set_file_hash(hf.atp);
+
+            DBG("share_hasher {" << convert_to_native(hf.atp.file_path) << "} res: {" << hf.ec.message() << "}");
+            m_handler(hf.atp, hf.mtime, hf.ec);
+
+            // file leaves progress only when reported
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_files.erase(std::remove(m_files.begin(), m_files.end(), *i), m_files.end());
+        }
+    }
+
+    transfer_params_maker::transfer_params_maker(alert_manager& am, const std::string& known_filepath,
+            int hash_threads, int read_ahead, int device_readers, int known_max_age) :
+            m_am(am),
+            m_abort(false),
+            m_abort_current(false),
+            m_current_filepath(""),
+            m_known_filepath(known_filepath),
+            m_known_max_age(known_max_age),
+            m_known_saved(0),
+            m_hasher(boost::bind(&transfer_params_maker::on_file_hashed, this, _1, _2, _3),
+                     hash_threads, read_ahead, device_readers)
+    {
+    }
+
+    bool transfer_params_maker::start()
+    {
+        LIBED2K_ASSERT(!m_thread);
+        m_hasher.start();
+        m_thread.reset(new boost::thread(boost::ref(*this)));
+        set_idle_priority(m_thread.get());
+        return true;
+    }
+
+    transfer_params_maker::~transfer_params_maker()
+    {
+        stop();
+    }
+
+    void transfer_params_maker::stop()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_order.clear();
+        m_abort_current = true;
+        m_abort = true;
+        m_condition.notify_one();
+
+        lock.unlock();
+
+        // when thread exists - wait it
+        if (m_thread.get())
+        {
+            m_thread->join();
+        }
+
+        m_thread.reset();   //!< remove thread
+        m_hasher.stop();    //!< cancels files being hashed
+        flush_known();      //!< threads are gone - save the rest of hashed files
+        m_abort = false;
+    }
+
+    size_t transfer_params_maker::order_size()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_order.size() + m_hasher.in_progress();
+    }
+
+    std::string transfer_params_maker::current_filepath()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_current_filepath;
+    }
+
+    void transfer_params_maker::make_transfer_params(const std::string& filepath)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_order.push_front(filepath);
+        m_condition.notify_one();
+    }
+
+    void transfer_params_maker::cancel_transfer_params(const std::string& filepath)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        std::deque<std::string>::iterator itr = std::remove(m_order.begin(), m_order.end(), filepath);
+
+        // we got target in order - simply erase it and exit
+        // it doesn't claim any signals
+        if (itr != m_order.end())
+        {
+            m_order.erase(itr, m_order.end());
+            return;
+        }
+
+        // file is being hashed - hasher reports it
+        if (m_hasher.cancel(filepath))
+        {
+            return;
+        }
+
+        if (m_current_filepath == filepath)
+        {
+            m_abort_current = true;               // erase flag available only on current iteration
+        }
+
+        m_cancel_order.push(filepath);  // this alert will emit after current file processing completed
+    }
+
+    void transfer_params_maker::operator()()
+    {
+        load_known();
+
+        while(1)
+        {
+            bool flush = false;
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_current_filepath.clear();
+            m_abort_current = false;
+
+            if (m_abort) { break; }
+
+            // ok, alert all cancels
+            while(!m_cancel_order.empty())
+            {
+                m_am.post_alert_should(transfer_params_alert(add_transfer_params(m_cancel_order.front()), errors::file_params_making_was_cancelled));
+                m_cancel_order.pop();
+            }
+
+            if(m_order.empty())
+            {
+                if (m_known_pending.empty())
+                {
+                    m_condition.wait(lock);
+                }
+                else if (!m_condition.timed_wait(lock, boost::posix_time::seconds(KNOWN_FLUSH_DELAY)))
+                {
+                    // nothing to do for a while - save hashed files we have
+                    flush = true;
+                }
+            }
+
+            if (m_known_pending.size() >= KNOWN_FLUSH_BATCH) flush = true;
+
+            if (!m_order.empty())
+            {
+                m_current_filepath = m_order.back();
+                m_order.pop_back();
+            }
+
+            lock.unlock();
+
+            if (flush) flush_known();
+            if (!m_current_filepath.empty()) process_item();
+        }
+
+        DBG("transfer_params_maker {thread exit}");
+    }
+
+    std::pair<add_transfer_params, error_code> file2atp::operator()(const std::string& filepath, const bool& cancel)
+    {
+        std::pair<add_transfer_params, error_code> res_pair;
+        // references
+        add_transfer_params& atp = res_pair.first;
+        error_code& ec = res_pair.second;
+
+        // store filepath always for search node ability!
+        atp.file_path = filepath;
+        atp.file_size = 0;
+
+        file f(filepath, file::read_only, ec);
+
+        // check size when file opened successfully
+        if (!ec)
+        {
+            atp.file_size = f.get_size(ec);
+        }
+
+        if (!ec && atp.file_size != 0)
+        {
+            int pieces_count = div_ceil(atp.file_size, PIECE_SIZE);
+            LIBED2K_ASSERT(pieces_count != 0);
+            DBG("stat file: {" << convert_to_native(filepath) << ", pieces: " << pieces_count  << "}");
+
+            // prepare results vector
+            atp.piece_hashses.resize(pieces_count);
+            atp.aich_piece_hashes.resize(pieces_count);
+            size_type capacity = atp.file_size;
+            size_type offset = 0;
+            char chBlock[BLOCK_SIZE];
+            hasher hproc;
+            aich_piece_hasher aich_hproc;
+
+            for (int i = 0; i < pieces_count; ++i)
+            {
+                size_type in_piece_capacity = std::min<size_type>(libed2k::PIECE_SIZE, capacity);
 
                 while(in_piece_capacity > 0)
                 {
@@ -895,6 +1433,7 @@ namespace libed2k
                         break;
 
                     hproc.update(chBlock, current_block_size);
+                    aich_hproc.update(chBlock, current_block_size);
                     capacity -= current_block_size;
                     in_piece_capacity -= current_block_size;
                     offset += current_block_size;
@@ -905,26 +1444,13 @@ namespace libed2k
 
                 atp.piece_hashses[i] = hproc.final();
                 hproc.reset();
+                atp.aich_piece_hashes[i] = aich_hproc.final(aich_left_part(atp.file_size, i));
+                aich_hproc.reset();
             }
 
             if (!ec)
             {
-                if (pieces_count*libed2k::PIECE_SIZE == atp.file_size)
-                {
-                    atp.piece_hashses.push_back(libed2k::md4_hash::terminal);
-                }
-                // calculate full file hash
-                if (atp.piece_hashses.size() > 1)
-                {
-                    hproc.update(reinterpret_cast<const char*>(&atp.piece_hashses[0]), atp.piece_hashses.size()*MD4_HASH_SIZE);
-                    atp.file_hash = hproc.final();
-                }
-                else
-                {
-                    atp.file_hash = atp.piece_hashses[0];
-                }
-
-                atp.seed_mode   = true;
+                set_file_hash(atp);
             }
 
         }
@@ -947,27 +1473,834 @@ namespace libed2k
         add_transfer_params atp;
         atp.file_path = m_current_filepath;
 
+        if (!ec && fs.file_size == 0)
+        {
+            ec = errors::filesize_is_zero;
+        }
+
         if (!ec)
         {
-            atp = m_kfc.extract_transfer_params(fs.mtime, m_current_filepath);
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                atp = m_kfc.extract_transfer_params(fs.mtime, fs.file_size, m_current_filepath);
+            }
 
             if (!atp.file_hash.defined() || (atp.file_size == 0)) // avoid some fails on zero lengths
             {
-                file2atp fatp;
-                std::pair<add_transfer_params, error_code> rp = fatp(m_current_filepath, m_abort_current);
-                atp = rp.first;
-                ec =  rp.second;
+                // hasher posts result, cancelled file was reported via cancel order
+                boost::mutex::scoped_lock lock(m_mutex);
+                if (!m_abort_current) m_hasher.hash_file(m_current_filepath, fs);
+                return;
             }
         }
 
         if (m_am.pending()) libed2k::sleep(300);
+        post_transfer_params(atp, ec);
+    }
 
+    void transfer_params_maker::post_transfer_params(const add_transfer_params& atp, const error_code& ec)
+    {
         if (!m_am.post_alert(transfer_params_alert(atp, ec)))
         {
             ERR("add transfer parameters for {" << atp.file_path << "} waren't added because order overflow!");
         }
     }
 
+    void transfer_params_maker::on_file_hashed(const add_transfer_params& atp, time_t write_ts, const error_code& ec)
+    {
+        post_transfer_params(atp, ec);
+
+        // cancelled files are reported under m_mutex - nothing to save for them
+        if (ec || m_known_filepath.empty()) return;
+
+        // file changed while it was being hashed - hashes may be wrong
+        error_code sec;
+        file_status fs;
+        stat_file(atp.file_path, &fs, sec);
+        if (sec || fs.mtime != write_ts || fs.file_size != atp.file_size) return;
+
+        // rescans find the file at once, the journal gets it on next flush
+        known_file_entry entry(atp, write_ts);
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_kfc.m_known_file_list.m_collection.push_back(entry);
+        m_known_pending.push_back(entry);
+        if (m_known_pending.size() >= KNOWN_FLUSH_BATCH) m_condition.notify_one();
+    }
+
+    std::string transfer_params_maker::known_journal_path() const
+    {
+        return m_known_filepath + ".journal";
+    }
+
+    void transfer_params_maker::load_known()
+    {
+        known_file_collection kfc;
+        size_t saved = 0;
+
+        // when we have known filepath path - attempt to extract its content
+        if (!m_known_filepath.empty())
+        {
+            std::ifstream fstream(convert_to_native(m_known_filepath).c_str(), std::ios_base::binary | std::ios_base::in);
+
+            if (fstream)
+            {
+                libed2k::archive::ed2k_iarchive ifa(fstream);
+
+                try
+                {
+                    ifa >> kfc;
+                }
+                catch(libed2k_exception&)
+                {
+                    kfc.m_known_file_list.m_collection.clear();
+                }
+            }
+        }
+
+        saved = kfc.m_known_file_list.m_collection.size();
+        bool broken = false;
+
+        if (!m_known_filepath.empty())
+        {
+            std::ifstream fstream(convert_to_native(known_journal_path()).c_str(), std::ios_base::binary | std::ios_base::in);
+
+            if (fstream)
+            {
+                libed2k::archive::ed2k_iarchive ifa(fstream);
+
+                // entries go one by one, tail may be lost on crash
+                while (fstream.peek() != std::char_traits<char>::eof())
+                {
+                    known_file_entry entry;
+
+                    try
+                    {
+                        ifa >> entry;
+                    }
+                    catch(libed2k_exception&)
+                    {
+                        broken = true;
+                        break;
+                    }
+
+                    kfc.m_known_file_list.m_collection.push_back(entry);
+                }
+            }
+        }
+
+        // entries saved without the time they were shared start aging now
+        boost::uint32_t now = static_cast<boost::uint32_t>(time(0));
+
+        for (std::deque<known_file_entry>::iterator i = kfc.m_known_file_list.m_collection.begin(),
+                end(kfc.m_known_file_list.m_collection.end()); i != end; ++i)
+        {
+            if (i->last_shared() == 0) i->set_last_shared(now);
+        }
+
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_kfc = known_file_collection();
+            m_kfc.m_known_file_list.m_collection.swap(kfc.m_known_file_list.m_collection);
+            m_kfc.index();
+            m_known_saved = saved;
+            DBG("known files loaded {saved: " << m_known_saved << ", journal: "
+                    << m_kfc.m_known_file_list.m_collection.size() - m_known_saved << "}");
+        }
+
+        // appending after broken tail makes the rest unreadable - merge journal now
+        if (broken) compact_known();
+    }
+
+    void transfer_params_maker::flush_known()
+    {
+        std::vector<known_file_entry> entries;
+
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            entries.swap(m_known_pending);
+        }
+
+        if (entries.empty()) return;
+
+        std::ofstream fstream(convert_to_native(known_journal_path()).c_str(),
+                std::ios_base::binary | std::ios_base::out | std::ios_base::app);
+
+        if (fstream)
+        {
+            libed2k::archive::ed2k_oarchive ofa(fstream);
+
+            for (std::vector<known_file_entry>::iterator i = entries.begin(), end(entries.end()); i != end; ++i)
+            {
+                ofa << *i;
+            }
+
+            fstream.flush();
+        }
+
+        if (!fstream)
+        {
+            ERR("unable to write known files journal {" << convert_to_native(known_journal_path()) << "}");
+        }
+
+        size_t journal = 0;
+
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            journal = m_kfc.m_known_file_list.m_collection.size() - m_known_saved;
+        }
+
+        DBG("known files journal {written: " << entries.size() << ", total: " << journal << "}");
+
+        if (journal >= std::max(KNOWN_COMPACT_MIN, m_known_saved)) compact_known();
+    }
+
+    void transfer_params_maker::compact_known()
+    {
+        std::string tmp_path = m_known_filepath + ".tmp";
+        error_code ec;
+        known_file_collection kfc;
+
+        {
+            // entries of files hashed again are never looked up,
+            // files not shared for long are gone
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_kfc.compact(m_known_max_age > 0 ? time(0) - m_known_max_age : 0);
+            kfc.m_known_file_list = m_kfc.m_known_file_list;
+        }
+
+        {
+            std::ofstream fstream(convert_to_native(tmp_path).c_str(),
+                    std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+
+            if (fstream)
+            {
+                libed2k::archive::ed2k_oarchive ofa(fstream);
+
+                try
+                {
+                    ofa << kfc;
+                }
+                catch(libed2k_exception& e)
+                {
+                    ec = e.error();
+                }
+
+                fstream.flush();
+            }
+
+            if (!fstream && !ec) ec = errors::file_unavaliable;
+        }
+
+        // known.met must not be replaced by a file that isn't on the disk yet
+        if (!ec)
+        {
+            file f(tmp_path, file::read_write, ec);
+            if (!ec) f.sync(ec);
+        }
+
+        if (!ec) rename(tmp_path, m_known_filepath, ec);
+
+        if (ec)
+        {
+            ERR("unable to save known files {" << convert_to_native(m_known_filepath) << "}: " << ec.message());
+            remove(tmp_path, ec);
+            return;
+        }
+
+        // files hashed meanwhile are still waiting for the journal
+        remove(known_journal_path(), ec);
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_known_saved = kfc.m_known_file_list.m_collection.size();
+        DBG("known files saved {" << m_known_saved << "}");
+    }
+
+    /**
+      * true for files and directories under dir at any depth
+     */
+    static bool inside_directory(const std::string& path, const std::string& dir)
+    {
+        return path.size() > dir.size() && path.compare(0, dir.size(), dir) == 0 &&
+            (path[dir.size()] == '/' || path[dir.size()] == '\\');
+    }
+
+    // file is shared by directory, not recursive one shares its own files only
+    static bool shared_by(const std::string& path, const std::string& dir, bool recursive)
+    {
+        return inside_directory(path, dir) &&
+            (recursive || path.find_first_of("/\\", dir.size() + 1) == std::string::npos);
+    }
+
+    // directory lies in recursive one of dirs other than itself
+    static bool covered_by(const std::string& dir, const std::map<std::string, bool>& dirs)
+    {
+        for (std::map<std::string, bool>::const_iterator i = dirs.begin(), end(dirs.end()); i != end; ++i)
+        {
+            if (i->second && inside_directory(dir, i->first)) return true;
+        }
+
+        return false;
+    }
+
+    share_monitor::share_monitor(alert_manager& am, transfer_params_maker& tpm, int stable_delay, int poll_interval) :
+            m_am(am),
+            m_tpm(tpm),
+            m_stable_delay(seconds(std::max(stable_delay, 0))),
+            m_poll_interval(seconds(std::max(poll_interval, 1))),
+            m_abort(false),
+            m_polling(!LIBED2K_USE_INOTIFY)
+#if LIBED2K_USE_INOTIFY
+            , m_inotify(-1)
+#endif
+    {
+#if LIBED2K_USE_INOTIFY
+        m_wakeup[0] = m_wakeup[1] = -1;
+#endif
+    }
+
+    share_monitor::~share_monitor()
+    {
+        stop();
+    }
+
+    void share_monitor::add_directory(const std::string& path, bool recursive)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        command cmd = { path, recursive, true };
+        m_commands.push_back(cmd);
+
+        if (!m_thread)
+        {
+            start();
+            return;
+        }
+
+        notify();
+    }
+
+    void share_monitor::remove_directory(const std::string& path)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (!m_thread) return;
+        command cmd = { path, false, false };
+        m_commands.push_back(cmd);
+        notify();
+    }
+
+    void share_monitor::start()
+    {
+#if LIBED2K_USE_INOTIFY
+        m_inotify = inotify_init();
+
+        if (m_inotify >= 0 && pipe(m_wakeup) != 0)
+        {
+            close(m_inotify);
+            m_inotify = -1;
+        }
+
+        if (m_inotify >= 0)
+        {
+            fcntl(m_wakeup[0], F_SETFL, O_NONBLOCK);
+            fcntl(m_wakeup[1], F_SETFL, O_NONBLOCK);
+        }
+        else
+        {
+            ERR("share_monitor {inotify is unavailable: " << strerror(errno) << ", directories are rescanned}");
+            m_wakeup[0] = m_wakeup[1] = -1;
+            m_polling = true;
+        }
+#endif
+        m_thread.reset(new boost::thread(boost::ref(*this)));
+        set_idle_priority(m_thread.get());
+    }
+
+    void share_monitor::stop()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (!m_thread) return;
+        m_abort = true;
+        notify();
+        lock.unlock();
+
+        m_thread->join();
+        m_thread.reset();
+
+#if LIBED2K_USE_INOTIFY
+        if (m_inotify >= 0)
+        {
+            close(m_inotify);
+            close(m_wakeup[0]);
+            close(m_wakeup[1]);
+        }
+
+        m_inotify = -1;
+        m_wakeup[0] = m_wakeup[1] = -1;
+        m_watches.clear();
+#endif
+        m_commands.clear();
+        m_roots.clear();
+        m_unwatched.clear();
+        m_files.clear();
+        m_pending.clear();
+        m_polling = !LIBED2K_USE_INOTIFY;
+        m_abort = false;
+    }
+
+    void share_monitor::notify()
+    {
+#if LIBED2K_USE_INOTIFY
+        if (m_wakeup[1] >= 0)
+        {
+            char c = 0;
+            if (write(m_wakeup[1], &c, 1) < 0) {} // full pipe wakes thread as well
+            return;
+        }
+#endif
+        m_condition.notify_one();
+    }
+
+    void share_monitor::operator()()
+    {
+        m_next_rescan = time_now_hires() + m_poll_interval;
+
+        while (1)
+        {
+            std::deque<command> commands;
+
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                if (m_abort) break;
+                commands.swap(m_commands);
+            }
+
+            for (std::deque<command>::iterator i = commands.begin(), end(commands.end()); i != end; ++i)
+            {
+                execute(*i);
+            }
+
+            bool polling = m_polling || !m_unwatched.empty();
+
+            if (polling && time_now_hires() >= m_next_rescan)
+            {
+                rescan();
+                m_next_rescan = time_now_hires() + m_poll_interval;
+            }
+
+            int timeout = check_pending();
+
+            if (polling)
+            {
+                int rescan_timeout = std::max(int(total_milliseconds(m_next_rescan - time_now_hires())), 0);
+                timeout = timeout < 0 ? rescan_timeout : std::min(timeout, rescan_timeout);
+            }
+
+            wait(timeout);
+        }
+
+        DBG("share_monitor {thread exit}");
+    }
+
+    void share_monitor::wait(int timeout)
+    {
+#if LIBED2K_USE_INOTIFY
+        if (m_inotify >= 0)
+        {
+            pollfd fds[2];
+            fds[0].fd = m_inotify;
+            fds[0].events = POLLIN;
+            fds[1].fd = m_wakeup[0];
+            fds[1].events = POLLIN;
+
+            if (poll(fds, 2, timeout) <= 0) return;
+
+            if (fds[0].revents & POLLIN) read_events();
+
+            if (fds[1].revents & POLLIN)
+            {
+                char buf[64];
+                while (read(m_wakeup[0], buf, sizeof(buf)) > 0) {}
+            }
+
+            return;
+        }
+#endif
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (m_abort || !m_commands.empty()) return;
+
+        if (timeout < 0)
+        {
+            m_condition.wait(lock);
+        }
+        else
+        {
+            m_condition.timed_wait(lock, boost::posix_time::milliseconds(timeout));
+        }
+    }
+
+    void share_monitor::execute(const command& cmd)
+    {
+        DBG("share_monitor {" << (cmd.add ? "add: " : "remove: ") << convert_to_native(cmd.path) << "}");
+
+        if (cmd.add)
+        {
+            if (m_roots.find(cmd.path) != m_roots.end()) return;
+            m_roots[cmd.path] = cmd.recursive;
+
+            // nested root is scanned and watched with enclosing one
+            if (covered(cmd.path)) return;
+
+            // files found there are due at once
+            scan(cmd.path, cmd.recursive, time_now_hires() - m_stable_delay, NULL);
+            return;
+        }
+
+        if (m_roots.erase(cmd.path) == 0) return;
+        if (covered(cmd.path)) return;
+        forget(cmd.path, false);
+#if LIBED2K_USE_INOTIFY
+        unwatch(cmd.path);
+#endif
+
+        // roots inside removed one get their watches back, their files are kept
+        for (std::map<std::string, bool>::iterator i = m_roots.begin(), end(m_roots.end()); i != end; ++i)
+        {
+            if (inside_directory(i->first, cmd.path) && !covered(i->first))
+                scan(i->first, i->second, time_now_hires() - m_stable_delay, NULL);
+        }
+    }
+
+    void share_monitor::scan(const std::string& dir, bool recursive, ptime changed, std::set<std::string>* seen)
+    {
+#if LIBED2K_USE_INOTIFY
+        // rescans walk directories which have watches already
+        if (!seen) add_watch(dir, recursive);
+#endif
+        error_code ec;
+
+        for (directory d(dir, ec); !ec && !d.done(); d.next(ec))
+        {
+            std::string name = d.file();
+            if (name == "." || name == "..") continue;
+
+            std::string path = combine_path(dir, name);
+            file_status fs;
+            error_code sec;
+            stat_file(path, &fs, sec, dont_follow_links);
+            if (sec) continue;
+
+            if ((fs.mode & S_IFMT) == file_status::directory)
+            {
+                if (recursive) scan(path, true, changed, seen);
+                continue;
+            }
+
+            if ((fs.mode & S_IFMT) != file_status::regular_file || fs.file_size == 0) continue;
+
+            if (seen) seen->insert(path);
+
+            file_state state(fs);
+            std::map<std::string, file_state>::iterator i = m_files.find(path);
+            if (i == m_files.end() || i->second != state) update(path, state, changed);
+        }
+
+        if (ec) ERR("share_monitor {unable to scan " << convert_to_native(dir) << ": " << ec.message() << "}");
+    }
+
+    void share_monitor::rescan()
+    {
+        // watched directories report changes themselves
+        if (!m_polling)
+        {
+            for (std::map<std::string, bool>::iterator i = m_unwatched.begin(); i != m_unwatched.end();)
+            {
+                file_status fs;
+                error_code ec;
+                stat_file(i->first, &fs, ec, dont_follow_links);
+
+                // subdirectory went away, roots are kept till user removes them
+                if (ec && m_roots.find(i->first) == m_roots.end()) m_unwatched.erase(i++);
+                else ++i;
+            }
+        }
+
+        const std::map<std::string, bool>& dirs = m_polling ? m_roots : m_unwatched;
+        std::set<std::string> seen;
+        ptime now = time_now_hires();
+
+        for (std::map<std::string, bool>::const_iterator i = dirs.begin(), end(dirs.end()); i != end; ++i)
+        {
+            if (!covered_by(i->first, dirs)) scan(i->first, i->second, now, &seen);
+        }
+
+        std::vector<std::string> removed;
+
+        for (std::map<std::string, file_state>::iterator i = m_files.begin(), end(m_files.end()); i != end; ++i)
+        {
+            if (seen.find(i->first) != seen.end()) continue;
+
+            for (std::map<std::string, bool>::const_iterator d = dirs.begin(), dend(dirs.end()); d != dend; ++d)
+            {
+                if (shared_by(i->first, d->first, d->second))
+                {
+                    removed.push_back(i->first);
+                    break;
+                }
+            }
+        }
+
+        for (std::vector<std::string>::iterator i = removed.begin(), end(removed.end()); i != end; ++i)
+        {
+            forget(*i, true);
+        }
+    }
+
+    void share_monitor::update(const std::string& path, const file_state& state, ptime changed)
+    {
+        std::map<std::string, pending_file>::iterator i = m_pending.find(path);
+
+        if (i == m_pending.end())
+        {
+            // known file which isn't pending has been queued already
+            pending_file pf;
+            pf.modified = m_files.find(path) != m_files.end();
+            i = m_pending.insert(std::make_pair(path, pf)).first;
+        }
+
+        m_files[path] = state;
+        i->second.state = state;
+        i->second.changed = changed;
+    }
+
+    void share_monitor::forget(const std::string& path, bool report)
+    {
+        std::map<std::string, file_state>::iterator i = m_files.lower_bound(path);
+
+        while (i != m_files.end() && i->first.compare(0, path.size(), path) == 0)
+        {
+            if (i->first != path && !inside_directory(i->first, path))
+            {
+                ++i;
+                continue;
+            }
+
+            if (!report && shared(i->first))
+            {
+                ++i;
+                continue;
+            }
+
+            m_pending.erase(i->first);
+
+            if (report)
+            {
+                DBG("share_monitor {removed: " << convert_to_native(i->first) << "}");
+                m_am.post_alert_should(shared_file_removed_alert(i->first));
+            }
+
+            m_files.erase(i++);
+        }
+    }
+
+    bool share_monitor::covered(const std::string& dir) const
+    {
+        return covered_by(dir, m_roots);
+    }
+
+    bool share_monitor::shared(const std::string& path) const
+    {
+        for (std::map<std::string, bool>::const_iterator i = m_roots.begin(), end(m_roots.end()); i != end; ++i)
+        {
+            if (shared_by(path, i->first, i->second)) return true;
+        }
+
+        return false;
+    }
+
+    int share_monitor::check_pending()
+    {
+        ptime now = time_now_hires();
+        int timeout = -1;
+
+        for (std::map<std::string, pending_file>::iterator i = m_pending.begin(); i != m_pending.end();)
+        {
+            pending_file& pf = i->second;
+
+            if (pf.changed + m_stable_delay > now)
+            {
+                int due = int(total_milliseconds(pf.changed + m_stable_delay - now));
+                timeout = timeout < 0 ? due : std::min(timeout, due);
+                ++i;
+                continue;
+            }
+
+            file_status fs;
+            error_code ec;
+            stat_file(i->first, &fs, ec);
+
+            // removal is reported by watch or rescan
+            if (ec)
+            {
+                m_pending.erase(i++);
+                continue;
+            }
+
+            file_state state(fs);
+
+            if (state != pf.state)
+            {
+                // still being written
+                pf.state = state;
+                pf.changed = now;
+                m_files[i->first] = state;
+                int due = int(total_milliseconds(m_stable_delay));
+                timeout = timeout < 0 ? due : std::min(timeout, due);
+                ++i;
+                continue;
+            }
+
+            if (pf.modified)
+            {
+                // old parameters go away before the file is hashed again
+                DBG("share_monitor {changed: " << convert_to_native(i->first) << "}");
+                m_am.post_alert_should(shared_file_removed_alert(i->first));
+            }
+
+            DBG("share_monitor {queue: " << convert_to_native(i->first) << "}");
+            m_tpm.make_transfer_params(i->first);
+            m_pending.erase(i++);
+        }
+
+        return timeout;
+    }
+
+#if LIBED2K_USE_INOTIFY
+    void share_monitor::add_watch(const std::string& dir, bool recursive)
+    {
+        if (m_inotify < 0) return;
+
+        int wd = inotify_add_watch(m_inotify, convert_to_native(dir).c_str(),
+            IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+            IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW);
+
+        if (wd < 0)
+        {
+            // usually out of watches, see fs.inotify.max_user_watches
+            ERR("share_monitor {unable to watch " << convert_to_native(dir) << ": " << strerror(errno) << ", it is rescanned}");
+            bool& r = m_unwatched[dir];
+            r = r || recursive;
+            return;
+        }
+
+        m_unwatched.erase(dir);
+
+        // directory of nested root is watched already - the watch keeps
+        // its path and stays recursive if it was
+        std::map<int, directory_watch>::iterator i = m_watches.find(wd);
+
+        if (i != m_watches.end())
+        {
+            i->second.recursive = i->second.recursive || recursive;
+            return;
+        }
+
+        directory_watch& w = m_watches[wd];
+        w.path = dir;
+        w.recursive = recursive;
+    }
+
+    void share_monitor::unwatch(const std::string& dir)
+    {
+        for (std::map<int, directory_watch>::iterator i = m_watches.begin(); i != m_watches.end();)
+        {
+            if (i->second.path != dir && !inside_directory(i->second.path, dir))
+            {
+                ++i;
+                continue;
+            }
+
+            inotify_rm_watch(m_inotify, i->first);
+            m_watches.erase(i++);
+        }
+
+        for (std::map<std::string, bool>::iterator i = m_unwatched.begin(); i != m_unwatched.end();)
+        {
+            if (i->first == dir || inside_directory(i->first, dir)) m_unwatched.erase(i++);
+            else ++i;
+        }
+    }
+
+    void share_monitor::read_events()
+    {
+        // aligned for inotify_event
+        boost::uint64_t buf[512];
+        ssize_t len = read(m_inotify, buf, sizeof(buf));
+        if (len <= 0) return;
+
+        ptime now = time_now_hires();
+        char* p = reinterpret_cast<char*>(buf);
+        char* end = p + len;
+
+        while (p < end)
+        {
+            inotify_event* e = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + e->len;
+
+            if (e->mask & IN_Q_OVERFLOW)
+            {
+                // events were lost, directories can't be trusted to watches anymore
+                ERR("share_monitor {inotify queue overflow, directories are rescanned}");
+                m_polling = true;
+                m_next_rescan = now;
+                continue;
+            }
+
+            std::map<int, directory_watch>::iterator w = m_watches.find(e->wd);
+            if (w == m_watches.end()) continue;
+
+            if (e->mask & IN_IGNORED)
+            {
+                m_watches.erase(w);
+                continue;
+            }
+
+            if (e->len == 0) continue;
+
+            std::string path = combine_path(w->second.path, convert_from_native(e->name));
+            bool recursive = w->second.recursive;
+
+            if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                forget(path, true);
+                if (e->mask & IN_ISDIR) unwatch(path);
+                continue;
+            }
+
+            if (e->mask & IN_ISDIR)
+            {
+                if (recursive && (e->mask & (IN_CREATE | IN_MOVED_TO))) scan(path, true, now, NULL);
+                continue;
+            }
+
+            // writes go on, no need to stat the file each time
+            std::map<std::string, pending_file>::iterator i = m_pending.find(path);
+
+            if (i != m_pending.end() && e->mask == IN_MODIFY)
+            {
+                i->second.changed = now;
+                continue;
+            }
+
+            file_status fs;
+            error_code ec;
+            stat_file(path, &fs, ec, dont_follow_links);
+
+            if (!ec && (fs.mode & S_IFMT) == file_status::regular_file && fs.file_size > 0)
+            {
+                update(path, file_state(fs), now);
+            }
+        }
+    }
+#endif
+
     void emule_binary_collection::dump() const
     {
         DBG("emule_collection::dump");
@@ -39,17 +39,24 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <libed2k/error_code.hpp>
 #include <libed2k/file_storage.hpp> // for file_entry
 
+#if LIBED2K_USE_RLIMIT
+#include <sys/resource.h>
+#include <limits.h>
+#endif
+
 namespace libed2k
 {
 
     file_pool::file_pool(int size)
-        : m_size(size)
+        : m_size(0)
         , m_low_prio_io(true)
 #if LIBED2K_CLOSE_MAY_BLOCK
         , m_stop_thread(false)
         , m_closer_thread(boost::bind(&file_pool::closer_thread_fun, this))
 #endif
-    {}
+    {
+        resize(size);
+    }
 
     file_pool::~file_pool()
     {
@@ -102,6 +109,29 @@ namespace libed2k
     }
 #endif
 
+    int file_pool::default_size()
+    {
+#if LIBED2K_USE_RLIMIT
+        rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > 20)
+        {
+            // deduct some margin like the session does for its sockets,
+            // 20% of the rest goes towards regular files
+            rlim_t files = (std::min)(rl.rlim_cur - 20, rlim_t(INT_MAX)) / 5;
+            return (std::min)(int(max_default_size), (std::max)(40, int(files)));
+        }
+#endif
+        return 40;
+    }
+
+    file_pool::shard& file_pool::shard_of(file_key const& k)
+    {
+        // the maps of the shards take the low bits of the hash,
+        // the shard is picked by the high bits of it mixed
+        boost::uint64_t h = boost::uint64_t(boost::hash<file_key>()(k)) * 0x9E3779B97F4A7C15ULL;
+        return m_shards[boost::uint32_t(h >> 32) % num_shards];
+    }
+
     boost::intrusive_ptr<file> file_pool::open_file(void* st, std::string const& p
         , file_storage::iterator fe, file_storage const& fs, int m, error_code& ec)
     {
@@ -109,12 +139,28 @@ namespace libed2k
         LIBED2K_ASSERT(is_complete(p));
         LIBED2K_ASSERT((m & file::rw_mask) == file::read_only
             || (m & file::rw_mask) == file::read_write);
-        mutex::scoped_lock l(m_mutex);
-        file_set::iterator i = m_files.find(std::make_pair(st, fs.file_index(*fe)));
-        if (i != m_files.end())
+
+        file_key k(st, fs.file_index(*fe));
+        shard& s = shard_of(k);
+        file_list closing;
+        mutex::scoped_lock l(s.shard_mutex);
+        boost::intrusive_ptr<file> ret = open_file_impl(s, k, p, fe, fs, m, closing, ec);
+        l.unlock();
+        close_files(closing);
+        return ret;
+    }
+
+    boost::intrusive_ptr<file> file_pool::open_file_impl(shard& s, file_key const& k
+        , std::string const& p, file_storage::iterator fe, file_storage const& fs, int m
+        , file_list& closing, error_code& ec)
+    {
+        void* st = k.first;
+        file_set::iterator i = s.files.find(k);
+        if (i != s.files.end())
         {
-            lru_file_entry& e = i->second;
-            e.last_use = libed2k::time_now();
+            ++s.hits;
+            lru_file_entry& e = *i->second;
+            s.lru.splice(s.lru.end(), s.lru, i->second);
 
             if (e.key != st && ((e.mode & file::rw_mask) != file::read_only
                 || (m & file::rw_mask) != file::read_only))
@@ -134,24 +180,20 @@ namespace libed2k
             if ((((e.mode & file::rw_mask) != file::read_write)
                 && ((m & file::rw_mask) == file::read_write))
                 || (e.mode & file::no_buffer) != (m & file::no_buffer)
+                || (e.mode & file::direct_io) != (m & file::direct_io)
                 || (e.mode & file::random_access) != (m & file::random_access))
             {
                 // close the file before we open it with
                 // the new read/write privilages
                 LIBED2K_ASSERT(e.file_ptr->refcount() == 1);
-
-#if LIBED2K_CLOSE_MAY_BLOCK
-                mutex::scoped_lock l(m_closer_mutex);
-                m_queued_for_close.push_back(e.file_ptr);
-                l.unlock();
+                closing.push_back(e.file_ptr);
                 e.file_ptr = new file;
-#else
-                e.file_ptr->close();
-#endif
+
                 std::string full_path = combine_path(p, fs.file_path(*fe));
                 if (!e.file_ptr->open(full_path, m, ec))
                 {
-                    m_files.erase(i);
+                    s.lru.erase(i->second);
+                    s.files.erase(i);
                     return boost::intrusive_ptr<file>();
                 }
 #ifdef LIBED2K_WINDOWS
@@ -173,13 +215,14 @@ namespace libed2k
             LIBED2K_ASSERT((e.mode & file::no_buffer) == (m & file::no_buffer));
             return e.file_ptr;
         }
+
         // the file is not in our cache
-        if ((int)m_files.size() >= m_size)
-        {
-            // the file cache is at its maximum size, close
-            // the least recently used (lru) file from it
-            remove_oldest();
-        }
+        ++s.misses;
+
+        // the shard is at its share of the pool, close
+        // its least recently used (lru) file
+        if (s.limit > 0) evict(s, s.limit - 1, closing);
+
         lru_file_entry e;
         e.file_ptr.reset(new (std::nothrow)file);
         if (!e.file_ptr)
@@ -190,74 +233,120 @@ namespace libed2k
         std::string full_path = combine_path(p, fs.file_path(*fe));
         if (!e.file_ptr->open(full_path, m, ec))
             return boost::intrusive_ptr<file>();
+
+        // the pool is smaller than the number of shards
+        if (s.limit == 0) return e.file_ptr;
+
         e.mode = m;
         e.key = st;
-        m_files.insert(std::make_pair(std::make_pair(st, fs.file_index(*fe)), e));
+        e.index = k;
+        s.files.insert(std::make_pair(k, s.lru.insert(s.lru.end(), e)));
         LIBED2K_ASSERT(e.file_ptr->is_open());
         return e.file_ptr;
     }
 
-    void file_pool::remove_oldest()
+    void file_pool::evict(shard& s, int limit, file_list& closing)
     {
-        file_set::iterator i = std::min_element(m_files.begin(), m_files.end()
-            , boost::bind(&lru_file_entry::last_use, boost::bind(&file_set::value_type::second, _1))
-                < boost::bind(&lru_file_entry::last_use, boost::bind(&file_set::value_type::second, _2)));
-        if (i == m_files.end()) return;
+        while (int(s.lru.size()) > limit)
+        {
+            lru_file_entry& e = s.lru.front();
+            closing.push_back(e.file_ptr);
+            s.files.erase(e.index);
+            s.lru.pop_front();
+        }
+    }
 
+    void file_pool::close_files(file_list& closing)
+    {
+        if (closing.empty()) return;
 #if LIBED2K_CLOSE_MAY_BLOCK
         mutex::scoped_lock l(m_closer_mutex);
-        m_queued_for_close.push_back(i->second.file_ptr);
+        m_queued_for_close.insert(m_queued_for_close.end(), closing.begin(), closing.end());
         l.unlock();
 #endif
-        m_files.erase(i);
+        // files nobody else holds are closed here
+        closing.clear();
     }
 
     void file_pool::release(void* st, int file_index)
     {
-        mutex::scoped_lock l(m_mutex);
-        file_set::iterator i = m_files.find(std::make_pair(st, file_index));
-        if (i == m_files.end()) return;
+        file_key k(st, file_index);
+        shard& s = shard_of(k);
+        file_list closing;
+        mutex::scoped_lock l(s.shard_mutex);
+        file_set::iterator i = s.files.find(k);
+        if (i == s.files.end()) return;
 
-#if LIBED2K_CLOSE_MAY_BLOCK
-        mutex::scoped_lock l2(m_closer_mutex);
-        m_queued_for_close.push_back(i->second.file_ptr);
-        l2.unlock();
-#endif
-        m_files.erase(i);
+        closing.push_back(i->second->file_ptr);
+        s.lru.erase(i->second);
+        s.files.erase(i);
+        l.unlock();
+        close_files(closing);
     }
 
     // closes files belonging to the specified
     // storage. If 0 is passed, all files are closed
     void file_pool::release(void* st)
     {
-        mutex::scoped_lock l(m_mutex);
-        if (st == 0)
+        file_list closing;
+        for (int n = 0; n < num_shards; ++n)
         {
-            m_files.clear();
-            return;
-        }
-
-        for (file_set::iterator i = m_files.begin();
-            i != m_files.end();)
-        {
-            if (i->second.key == st)
-                m_files.erase(i++);
-            else
-                ++i;
+            shard& s = m_shards[n];
+            mutex::scoped_lock l(s.shard_mutex);
+            for (lru_list::iterator i = s.lru.begin(); i != s.lru.end();)
+            {
+                if (st != 0 && i->key != st)
+                {
+                    ++i;
+                    continue;
+                }
+                closing.push_back(i->file_ptr);
+                s.files.erase(i->index);
+                s.lru.erase(i++);
+            }
         }
+        close_files(closing);
     }
 
     void file_pool::resize(int size)
     {
-        LIBED2K_ASSERT(size > 0);
+        if (size <= 0) size = default_size();
+
+        mutex::scoped_lock sl(m_size_mutex);
         if (size == m_size) return;
-        mutex::scoped_lock l(m_mutex);
         m_size = size;
-        if (int(m_files.size()) <= m_size) return;
 
-        // close the least recently used files
-        while (int(m_files.size()) > m_size)
-            remove_oldest();
+        // the pool is split evenly, shards of a pool smaller than
+        // their number don't keep files open at all
+        file_list closing;
+        for (int n = 0; n < num_shards; ++n)
+        {
+            shard& s = m_shards[n];
+            mutex::scoped_lock l(s.shard_mutex);
+            s.limit = size / num_shards + (n < size % num_shards ? 1 : 0);
+            evict(s, s.limit, closing);
+        }
+        sl.unlock();
+        close_files(closing);
+    }
+
+    int file_pool::size_limit() const
+    {
+        mutex::scoped_lock l(m_size_mutex);
+        return m_size;
+    }
+
+    void file_pool::status(size_type& hits, size_type& misses) const
+    {
+        hits = 0;
+        misses = 0;
+        for (int n = 0; n < num_shards; ++n)
+        {
+            shard const& s = m_shards[n];
+            mutex::scoped_lock l(s.shard_mutex);
+            hits += s.hits;
+            misses += s.misses;
+        }
     }
 
 }
@@ -83,6 +83,11 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <asm/unistd.h> // For __NR_fallocate
 
+#ifndef FICLONE
+// reflinks, from linux/fs.h of Linux 4.5
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 // circumvent the lack of support in glibc
 static int my_fallocate(int fd, int mode, loff_t offset, loff_t len)
 {
@@ -196,6 +201,7 @@ namespace libed2k
         s->atime = ret.st_atime;
         s->mtime = ret.st_mtime;
         s->ctime = ret.st_ctime;
+        s->device = ret.st_dev;
         s->mode = ret.st_mode;
     }
 
@@ -638,6 +644,22 @@ namespace libed2k
         return true;
     }
 
+    boost::uint64_t path_device(std::string const& f)
+    {
+        // files which are not there yet will be created
+        // on the device of their closest existing parent
+        std::string p = complete(f);
+        for (;;)
+        {
+            error_code ec;
+            file_status s;
+            stat_file(p, &s, ec);
+            if (!ec) return s.device;
+            if (!has_parent_path(p)) return 0;
+            p = parent_path(p);
+        }
+    }
+
     void remove(std::string const& inf, error_code& ec)
     {
         ec.clear();
@@ -831,6 +853,7 @@ namespace libed2k
         : m_file_handle(INVALID_HANDLE_VALUE)
 #else
         : m_fd(-1)
+        , m_direct_fd(-1)
 #endif
         , m_open_mode(0)
 #if defined LIBED2K_WINDOWS || defined LIBED2K_LINUX
@@ -843,6 +866,7 @@ namespace libed2k
         : m_file_handle(INVALID_HANDLE_VALUE)
 #else
         : m_fd(-1)
+        , m_direct_fd(-1)
 #endif
         , m_open_mode(0)
     {
@@ -1055,6 +1079,31 @@ namespace libed2k
         }
 #endif
 
+        if ((mode & direct_io) && (mode & no_buffer) == 0)
+        {
+            // the file exists now, a second descriptor to it takes the
+            // aligned transfers. Where it can't be had (no O_DIRECT on
+            // the filesystem) everything stays buffered
+#if defined O_DIRECT
+            m_direct_fd = ::open(convert_to_native(path).c_str()
+                , (mode_array[mode & rw_mask] & ~O_CREAT) | O_DIRECT);
+#elif defined F_NOCACHE
+            m_direct_fd = ::open(convert_to_native(path).c_str()
+                , mode_array[mode & rw_mask] & ~O_CREAT);
+            int yes = 1;
+            if (m_direct_fd != -1 && fcntl(m_direct_fd, F_NOCACHE, &yes) != 0)
+            {
+                ::close(m_direct_fd);
+                m_direct_fd = -1;
+            }
+#endif
+        }
+        if (m_direct_fd == -1) mode &= ~direct_io;
+
+#endif
+#ifdef LIBED2K_WINDOWS
+        // unbuffered handles take overlapped I/O only, direct_io stays buffered
+        mode &= ~direct_io;
 #endif
         m_open_mode = mode;
 
@@ -1154,6 +1203,8 @@ namespace libed2k
         if (m_fd == -1) return;
         ::close(m_fd);
         m_fd = -1;
+        if (m_direct_fd != -1) ::close(m_direct_fd);
+        m_direct_fd = -1;
 #endif
         m_open_mode = 0;
     }
@@ -1176,6 +1227,9 @@ namespace libed2k
 
     void file::hint_read(size_type file_offset, int len)
     {
+        // aligned reads don't look in the OS cache, filling it is wasted
+        if (m_open_mode & direct_io) return;
+
 #if defined POSIX_FADV_WILLNEED
         posix_fadvise(m_fd, file_offset, len, POSIX_FADV_WILLNEED);
 #elif defined F_RDADVISE
@@ -1188,6 +1242,33 @@ namespace libed2k
 #endif
     }
 
+#ifndef LIBED2K_WINDOWS
+    namespace
+    {
+        // the OS cache keeps what went through it in direct_io mode only
+        // till it's written back
+        void drop_cached(int fd, size_type file_offset, size_type len)
+        {
+#ifdef POSIX_FADV_DONTNEED
+            if (len > 0) posix_fadvise(fd, file_offset, len, POSIX_FADV_DONTNEED);
+#endif
+        }
+    }
+
+    int file::io_handle(size_type file_offset, iovec_t const* bufs, int num_bufs) const
+    {
+        if (m_direct_fd == -1) return m_fd;
+        if ((file_offset & (pos_alignment()-1)) != 0) return m_fd;
+        for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
+        {
+            if ((uintptr_t(i->iov_base) & (buf_alignment()-1)) != 0
+                || (i->iov_len & (size_alignment()-1)) != 0)
+                return m_fd;
+        }
+        return m_direct_fd;
+    }
+#endif
+
     size_type file::readv(size_type file_offset, iovec_t const* bufs, int num_bufs, error_code& ec)
     {
         LIBED2K_ASSERT((m_open_mode & rw_mask) == read_only || (m_open_mode & rw_mask) == read_write);
@@ -1321,7 +1402,8 @@ namespace libed2k
 
 #else // LIBED2K_WINDOWS
 
-        size_type ret = lseek(m_fd, file_offset, SEEK_SET);
+        int fd = io_handle(file_offset, bufs, num_bufs);
+        size_type ret = lseek(fd, file_offset, SEEK_SET);
         if (ret < 0)
         {
             ec.assign(errno, get_posix_category());
@@ -1347,7 +1429,7 @@ namespace libed2k
             if (aligned)
 #endif // LIBED2K_LINUX
             {
-                tmp_ret = ::readv(m_fd, bufs, nbufs);
+                tmp_ret = ::readv(fd, bufs, nbufs);
                 if (tmp_ret < 0)
                 {
                     ec.assign(errno, get_posix_category());
@@ -1362,7 +1444,7 @@ namespace libed2k
                 memcpy(temp_bufs, bufs, sizeof(file::iovec_t) * nbufs);
                 iovec_t& last = temp_bufs[nbufs-1];
                 last.iov_len = (last.iov_len & ~(size_alignment()-1)) + m_page_size;
-                tmp_ret = ::readv(m_fd, temp_bufs, nbufs);
+                tmp_ret = ::readv(fd, temp_bufs, nbufs);
                 if (tmp_ret < 0)
                 {
                     ec.assign(errno, get_posix_category());
@@ -1376,6 +1458,8 @@ namespace libed2k
             bufs += nbufs;
         }
 
+        if (fd != m_direct_fd && (m_open_mode & direct_io))
+            drop_cached(fd, file_offset, ret);
         return ret;
 
 #else // LIBED2K_USE_READV
@@ -1383,7 +1467,7 @@ namespace libed2k
         ret = 0;
         for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
         {
-            int tmp = read(m_fd, i->iov_base, i->iov_len);
+            int tmp = read(fd, i->iov_base, i->iov_len);
             if (tmp < 0)
             {
                 ec.assign(errno, get_posix_category());
@@ -1392,6 +1476,8 @@ namespace libed2k
             ret += tmp;
             if (tmp < i->iov_len) break;
         }
+        if (fd != m_direct_fd && (m_open_mode & direct_io))
+            drop_cached(fd, file_offset, ret);
         return ret;
 
 #endif // LIBED2K_USE_READV
@@ -1529,7 +1615,8 @@ namespace libed2k
         if (file_size > 0) set_size(file_size, ec);
         return ret;
 #else
-        size_type ret = lseek(m_fd, file_offset, SEEK_SET);
+        int fd = io_handle(file_offset, bufs, num_bufs);
+        size_type ret = lseek(fd, file_offset, SEEK_SET);
         if (ret < 0)
         {
             ec.assign(errno, get_posix_category());
@@ -1556,7 +1643,7 @@ namespace libed2k
             if (aligned)
 #endif
             {
-                tmp_ret = ::writev(m_fd, bufs, nbufs);
+                tmp_ret = ::writev(fd, bufs, nbufs);
                 if (tmp_ret < 0)
                 {
                     ec.assign(errno, get_posix_category());
@@ -1571,13 +1658,13 @@ namespace libed2k
                 memcpy(temp_bufs, bufs, sizeof(file::iovec_t) * nbufs);
                 iovec_t& last = temp_bufs[nbufs-1];
                 last.iov_len = (last.iov_len & ~(size_alignment()-1)) + size_alignment();
-                tmp_ret = ::writev(m_fd, temp_bufs, nbufs);
+                tmp_ret = ::writev(fd, temp_bufs, nbufs);
                 if (tmp_ret < 0)
                 {
                     ec.assign(errno, get_posix_category());
                     return -1;
                 }
-                if (ftruncate(m_fd, file_offset + size) < 0)
+                if (ftruncate(fd, file_offset + size) < 0)
                 {
                     ec.assign(errno, get_posix_category());
                     return -1;
@@ -1590,6 +1677,8 @@ namespace libed2k
             bufs += nbufs;
         }
 
+        if (fd != m_direct_fd && (m_open_mode & direct_io))
+            drop_cached(fd, file_offset, ret);
         return ret;
 
 #else // LIBED2K_USE_WRITEV
@@ -1597,7 +1686,7 @@ namespace libed2k
         ret = 0;
         for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
         {
-            int tmp = write(m_fd, i->iov_base, i->iov_len);
+            int tmp = write(fd, i->iov_base, i->iov_len);
             if (tmp < 0)
             {
                 ec.assign(errno, get_posix_category());
@@ -1606,6 +1695,8 @@ namespace libed2k
             ret += tmp;
             if (tmp < i->iov_len) break;
         }
+        if (fd != m_direct_fd && (m_open_mode & direct_io))
+            drop_cached(fd, file_offset, ret);
         return ret;
 
 #endif // LIBED2K_USE_WRITEV
@@ -1613,6 +1704,24 @@ namespace libed2k
 #endif // LIBED2K_WINDOWS
     }
 
+    bool file::sync(error_code& ec)
+    {
+#ifdef LIBED2K_WINDOWS
+        if (FlushFileBuffers(m_file_handle) == 0)
+        {
+            ec.assign(GetLastError(), get_system_category());
+            return false;
+        }
+#else
+        if (fsync(m_fd) != 0)
+        {
+            ec.assign(errno, get_posix_category());
+            return false;
+        }
+#endif
+        return true;
+    }
+
     size_type file::phys_offset(size_type offset)
     {
 #ifdef FIEMAP_EXTENT_UNKNOWN
@@ -1985,5 +2094,38 @@ typedef struct _FILE_ALLOCATED_RANGE_BUFFER {
 #endif
     }
 
+    size_type copy_range(file& in, file& out, size_type offset, size_type len, error_code& ec)
+    {
+#if defined LIBED2K_LINUX && defined __NR_copy_file_range
+        loff_t in_offset = offset;
+        loff_t out_offset = offset;
+        long ret = syscall(__NR_copy_file_range, in.native_handle(), &in_offset
+            , out.native_handle(), &out_offset, size_t(len), 0u);
+        if (ret >= 0) return ret;
+        // older kernels don't copy between filesystems, some filesystems
+        // not at all. Those copies go through user space
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+        {
+            ec.assign(errno, get_posix_category());
+            return -1;
+        }
+#endif
+        std::vector<char> buf(size_t((std::min)(len, size_type(1024 * 1024))));
+        file::iovec_t b = { &buf[0], buf.size() };
+        size_type read = in.readv(offset, &b, 1, ec);
+        if (read <= 0) return read;
+        b.iov_len = size_t(read);
+        return out.writev(offset, &b, 1, ec);
+    }
+
+    bool clone_file(file const& in, file const& out)
+    {
+#ifdef LIBED2K_LINUX
+        return ioctl(out.native_handle(), FICLONE, in.native_handle()) == 0;
+#else
+        return false;
+#endif
+    }
+
 }
 
@@ -0,0 +1,232 @@
+#include "libed2k/io_ring.hpp"
+
+#if LIBED2K_USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+namespace libed2k
+{
+    io_ring::io_ring() :
+        m_fd(-1),
+        m_entries(0),
+        m_queued(0),
+        m_sq_ring(0),
+        m_sq_ring_size(0),
+        m_cq_ring(0),
+        m_cq_ring_size(0),
+        m_sqes(0),
+        m_sqes_size(0),
+        m_sq_tail(0),
+        m_sq_array(0),
+        m_sq_mask(0),
+        m_cq_head(0),
+        m_cq_tail(0),
+        m_cq_mask(0),
+        m_cqes(0)
+    {
+    }
+
+    io_ring::~io_ring()
+    {
+        close();
+    }
+
+#if LIBED2K_USE_IO_URING
+
+    bool io_ring::open(int entries, error_code& ec)
+    {
+        close();
+
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        int fd = int(syscall(__NR_io_uring_setup, unsigned(entries), &p));
+
+        if (fd < 0)
+        {
+            ec.assign(errno, boost::system::get_generic_category());
+            return false;
+        }
+
+        m_fd = fd;
+        m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+        // both rings live in one mapping
+        single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) m_sq_ring_size = m_cq_ring_size = (std::max)(m_sq_ring_size, m_cq_ring_size);
+#endif
+        m_sq_ring = mmap(0, m_sq_ring_size, PROT_READ | PROT_WRITE
+            , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (m_sq_ring == MAP_FAILED) m_sq_ring = 0;
+
+        if (single_mmap) m_cq_ring = m_sq_ring;
+        else
+        {
+            m_cq_ring = mmap(0, m_cq_ring_size, PROT_READ | PROT_WRITE
+                , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (m_cq_ring == MAP_FAILED) m_cq_ring = 0;
+        }
+
+        m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = mmap(0, m_sqes_size, PROT_READ | PROT_WRITE
+            , MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (m_sqes == MAP_FAILED) m_sqes = 0;
+
+        if (!m_sq_ring || !m_cq_ring || !m_sqes)
+        {
+            ec.assign(errno, boost::system::get_generic_category());
+            close();
+            return false;
+        }
+
+        char* sq = static_cast<char*>(m_sq_ring);
+        char* cq = static_cast<char*>(m_cq_ring);
+        m_sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        m_sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        m_sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        m_cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        m_cqes = cq + p.cq_off.cqes;
+        m_entries = int(p.sq_entries);
+        m_queued = 0;
+        return true;
+    }
+
+    void io_ring::close()
+    {
+        if (m_sqes) munmap(m_sqes, m_sqes_size);
+        if (m_cq_ring && m_cq_ring != m_sq_ring) munmap(m_cq_ring, m_cq_ring_size);
+        if (m_sq_ring) munmap(m_sq_ring, m_sq_ring_size);
+        if (m_fd >= 0) ::close(m_fd);
+
+        m_fd = -1;
+        m_entries = 0;
+        m_queued = 0;
+        m_sq_ring = 0;
+        m_cq_ring = 0;
+        m_sqes = 0;
+    }
+
+    bool io_ring::prepare(op_t op, file const& f, size_type offset
+        , file::iovec_t const* bufs, int num_bufs, boost::uint64_t tag)
+    {
+        if (m_fd < 0 || m_queued >= m_entries) return false;
+
+        // the kernel doesn't read the tail before io_uring_enter, we own it
+        unsigned tail = *m_sq_tail;
+        unsigned index = tail & m_sq_mask;
+        io_uring_sqe* sqe = static_cast<io_uring_sqe*>(m_sqes) + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = op == read_op ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->fd = f.io_handle(offset, bufs, num_bufs);
+        sqe->off = boost::uint64_t(offset);
+        sqe->addr = boost::uint64_t(uintptr_t(bufs));
+        sqe->len = unsigned(num_bufs);
+        sqe->user_data = tag;
+        m_sq_array[index] = index;
+        __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++m_queued;
+        return true;
+    }
+
+    bool io_ring::submit_and_wait(results_t& results, error_code& ec)
+    {
+        results.clear();
+        int to_submit = m_queued;
+        int in_flight = m_queued;
+        m_queued = 0;
+        bool ret = true;
+
+        while (in_flight > 0)
+        {
+            int submitted = int(syscall(__NR_io_uring_enter, m_fd, unsigned(to_submit), 1u
+                , unsigned(IORING_ENTER_GETEVENTS), (void*)0, size_t(0)));
+
+            if (submitted < 0)
+            {
+                int err = errno;
+                if (err == EINTR) continue;
+
+                ec.assign(err, boost::system::get_generic_category());
+                ret = false;
+
+                // the kernel still owns the buffers of operations in flight,
+                // their completions are picked from the ring without waiting
+                if (to_submit == 0)
+                {
+                    int before = in_flight;
+                    reap(results, in_flight);
+                    if (in_flight == before) sched_yield();
+                    continue;
+                }
+
+                // operations the kernel didn't take are taken back from the
+                // queue and failed, the ones in flight are waited for
+                unsigned tail = *m_sq_tail;
+                for (unsigned i = tail - unsigned(to_submit); i != tail; ++i)
+                {
+                    io_uring_sqe const* sqe = static_cast<io_uring_sqe*>(m_sqes) + m_sq_array[i & m_sq_mask];
+                    results.push_back(std::make_pair(boost::uint64_t(sqe->user_data), -err));
+                }
+
+                __atomic_store_n(m_sq_tail, tail - unsigned(to_submit), __ATOMIC_RELEASE);
+                in_flight -= to_submit;
+                to_submit = 0;
+                continue;
+            }
+
+            to_submit -= submitted;
+            reap(results, in_flight);
+        }
+
+        return ret;
+    }
+
+    void io_ring::reap(results_t& results, int& in_flight)
+    {
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head)
+        {
+            io_uring_cqe const* cqe = static_cast<io_uring_cqe*>(m_cqes) + (head & m_cq_mask);
+            results.push_back(std::make_pair(boost::uint64_t(cqe->user_data), int(cqe->res)));
+            --in_flight;
+        }
+
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    }
+
+#else
+
+    bool io_ring::open(int, error_code& ec)
+    {
+        ec = boost::asio::error::operation_not_supported;
+        return false;
+    }
+
+    void io_ring::close() {}
+
+    bool io_ring::prepare(op_t, file const&, size_type, file::iovec_t const*, int, boost::uint64_t)
+    {
+        return false;
+    }
+
+    bool io_ring::submit_and_wait(results_t& results, error_code&)
+    {
+        results.clear();
+        return true;
+    }
+
+    void io_ring::reap(results_t&, int&) {}
+
+#endif
+}
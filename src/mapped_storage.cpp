@@ -0,0 +1,452 @@
+#include "libed2k/mapped_storage.hpp"
+#include "libed2k/allocator.hpp" // page_size
+
+#include <string.h>
+
+#if LIBED2K_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+namespace libed2k
+{
+#if LIBED2K_USE_MMAP
+    namespace
+    {
+        // stores into a hole of a sparse file fault with SIGBUS when the disk
+        // is full, so a range is mapped for writing only when its blocks exist
+        bool allocated(int fd, size_type start, int len)
+        {
+#ifdef LIBED2K_LINUX
+            return posix_fallocate(fd, start, len) == 0;
+#else
+            // only files without holes are mapped, the rest goes through writev
+            struct stat st;
+            if (fstat(fd, &st) != 0) return false;
+            return size_type(st.st_blocks) * 512 >= size_type(st.st_size);
+#endif
+        }
+    }
+#endif
+
+    struct mapping_cache::window
+    {
+        window_key key;
+        boost::intrusive_ptr<file> f;
+        size_type start;
+        char* base;
+        int size;
+        bool writable;
+        // released while pinned, unmapped by the last unpin
+        bool detached;
+        int refs;
+        // written range relative to base, empty when both are 0
+        int dirty_start;
+        int dirty_end;
+        std::list<window*>::iterator lru;
+    };
+
+    mapping_cache::mapping_cache(int max_windows, int flush_bytes) :
+        m_max_windows(max_windows),
+        m_flush_bytes(flush_bytes),
+        m_dirty_bytes(0)
+    {
+    }
+
+    mapping_cache::~mapping_cache()
+    {
+        flush_list_t flush;
+        for (windows_t::iterator i = m_windows.begin(), end(m_windows.end()); i != end; ++i)
+        {
+            LIBED2K_ASSERT(i->second->refs == 0);
+            take_dirty(i->second, flush);
+            unmap(i->second);
+        }
+        write_back(flush);
+    }
+
+    void mapping_cache::set_limits(int max_windows, int flush_bytes)
+    {
+        mutex::scoped_lock l(m_mutex);
+        m_max_windows = max_windows;
+        m_flush_bytes = flush_bytes;
+
+        flush_list_t flush;
+        while (int(m_windows.size()) > m_max_windows && !m_lru.empty())
+        {
+            window* w = m_lru.front();
+            m_lru.pop_front();
+            m_windows.erase(w->key);
+            take_dirty(w, flush);
+            unmap(w);
+        }
+        l.unlock();
+        write_back(flush);
+    }
+
+    int mapping_cache::num_windows() const
+    {
+        mutex::scoped_lock l(m_mutex);
+        return int(m_windows.size());
+    }
+
+    char* mapping_cache::pin(void* st, int file_index, boost::intrusive_ptr<file> const& f
+        , size_type offset, size_type file_size, bool write, int& size, window*& w)
+    {
+        flush_list_t flush;
+        mutex::scoped_lock l(m_mutex);
+        w = find_window(st, file_index, f, offset, file_size, write, flush);
+        l.unlock();
+        write_back(flush);
+
+        if (w == 0) return 0;
+        size = int((std::min)(size_type(size), w->start + w->size - offset));
+        return w->base + (offset - w->start);
+    }
+
+    mapping_cache::window* mapping_cache::find_window(void* st, int file_index
+        , boost::intrusive_ptr<file> const& f, size_type offset, size_type file_size
+        , bool write, flush_list_t& flush)
+    {
+#if LIBED2K_USE_MMAP
+        size_type start = offset - offset % window_size;
+        window_key key(std::make_pair(st, file_index), start / window_size);
+
+        windows_t::iterator i = m_windows.find(key);
+        if (i != m_windows.end())
+        {
+            window* w = i->second;
+            if (offset < w->start + w->size && (!write || w->writable))
+            {
+                if (w->refs++ == 0) m_lru.erase(w->lru);
+                return w;
+            }
+
+            // the file grew or is written now, the window is mapped
+            // again unless somebody is using it
+            if (w->refs > 0) return 0;
+            m_windows.erase(i);
+            m_lru.erase(w->lru);
+            take_dirty(w, flush);
+            unmap(w);
+        }
+
+        while (int(m_windows.size()) >= m_max_windows && !m_lru.empty())
+        {
+            window* old = m_lru.front();
+            m_lru.pop_front();
+            m_windows.erase(old->key);
+            take_dirty(old, flush);
+            unmap(old);
+        }
+        if (int(m_windows.size()) >= m_max_windows) return 0;
+
+        // pages past the end of the file can't be touched, writes
+        // give the file its full size first
+        error_code ec;
+        size_type current = f->get_size(ec);
+        if (ec) return 0;
+        if (write && current < file_size)
+        {
+            if (!f->set_size(file_size, ec)) return 0;
+            current = file_size;
+        }
+        if (offset >= current) return 0;
+
+        int len = int((std::min)(size_type(window_size), current - start));
+        if (write && !allocated(f->native_handle(), start, len)) return 0;
+
+        void* base = mmap(0, len, write ? PROT_READ | PROT_WRITE : PROT_READ
+            , MAP_SHARED, f->native_handle(), start);
+        if (base == MAP_FAILED) return 0;
+
+        window* w = new window;
+        w->key = key;
+        w->f = f;
+        w->start = start;
+        w->base = static_cast<char*>(base);
+        w->size = len;
+        w->writable = write;
+        w->detached = false;
+        w->refs = 1;
+        w->dirty_start = 0;
+        w->dirty_end = 0;
+        m_windows.insert(std::make_pair(key, w));
+        return w;
+#else
+        return 0;
+#endif
+    }
+
+    void mapping_cache::unpin(window* w, char* p, int dirty)
+    {
+        flush_list_t flush;
+        mutex::scoped_lock l(m_mutex);
+        LIBED2K_ASSERT(w->refs > 0);
+
+        if (dirty > 0)
+        {
+            int start = int(p - w->base);
+            if (w->dirty_end == 0)
+            {
+                w->dirty_start = start;
+                w->dirty_end = start + dirty;
+            }
+            else
+            {
+                w->dirty_start = (std::min)(w->dirty_start, start);
+                w->dirty_end = (std::max)(w->dirty_end, start + dirty);
+            }
+            m_dirty_bytes += dirty;
+        }
+
+        if (--w->refs == 0)
+        {
+            if (w->detached)
+            {
+                take_dirty(w, flush);
+                unmap(w);
+            }
+            else w->lru = m_lru.insert(m_lru.end(), w);
+        }
+
+        if (m_dirty_bytes >= m_flush_bytes)
+        {
+            for (windows_t::iterator i = m_windows.begin(), end(m_windows.end()); i != end; ++i)
+                take_dirty(i->second, flush);
+            m_dirty_bytes = 0;
+        }
+
+        l.unlock();
+        write_back(flush);
+    }
+
+    void mapping_cache::release(void* st, int file_index)
+    {
+        flush_list_t flush;
+        mutex::scoped_lock l(m_mutex);
+
+        windows_t::iterator i = m_windows.lower_bound(
+            window_key(std::make_pair(st, (std::max)(file_index, 0)), 0));
+        while (i != m_windows.end() && i->first.first.first == st
+            && (file_index < 0 || i->first.first.second == file_index))
+        {
+            window* w = i->second;
+            take_dirty(w, flush);
+            m_windows.erase(i++);
+
+            if (w->refs > 0) w->detached = true;
+            else
+            {
+                m_lru.erase(w->lru);
+                unmap(w);
+            }
+        }
+
+        l.unlock();
+        write_back(flush);
+    }
+
+    void mapping_cache::unmap(window* w)
+    {
+#if LIBED2K_USE_MMAP
+        munmap(w->base, w->size);
+#endif
+        delete w;
+    }
+
+    void mapping_cache::take_dirty(window* w, flush_list_t& l)
+    {
+        if (w->dirty_end == 0) return;
+#if LIBED2K_USE_MMAP
+#ifdef LIBED2K_LINUX
+        l.push_back(std::make_pair(w->f, std::make_pair(w->start + w->dirty_start
+            , size_type(w->dirty_end - w->dirty_start))));
+#else
+        // without sync_file_range the write-back is scheduled through the mapping
+        char* start = w->base + (w->dirty_start & ~(page_size() - 1));
+        msync(start, w->base + w->dirty_end - start, MS_ASYNC);
+#endif
+#endif
+        w->dirty_start = 0;
+        w->dirty_end = 0;
+    }
+
+    void mapping_cache::write_back(flush_list_t const& l)
+    {
+#if LIBED2K_USE_MMAP && defined LIBED2K_LINUX
+        // starts writing the pages out, doesn't wait for them
+        for (flush_list_t::const_iterator i = l.begin(), end(l.end()); i != end; ++i)
+        {
+            sync_file_range(i->first->native_handle(), i->second.first, i->second.second
+                , SYNC_FILE_RANGE_WRITE);
+        }
+#endif
+    }
+
+    mapped_storage::mapped_storage(file_storage const& fs, file_storage const* mapped
+        , std::string const& path, file_pool& fp, std::vector<boost::uint8_t> const& file_prio
+        , mapping_cache& mappings) :
+        default_storage(fs, mapped, path, fp, file_prio),
+        m_mappings(mappings)
+    {
+    }
+
+    mapped_storage::~mapped_storage()
+    {
+        m_mappings.release(this);
+    }
+
+    int mapped_storage::readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs)
+    {
+        return copyv(bufs, slot, offset, num_bufs, false);
+    }
+
+    int mapped_storage::writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs)
+    {
+        int ret = copyv(bufs, slot, offset, num_bufs, true);
+        if (m_move && ret > 0) moved_range_written(slot, offset, ret);
+        return ret;
+    }
+
+    int mapped_storage::copyv(file::iovec_t const* bufs, int slot, int offset, int num_bufs, bool write)
+    {
+        int size = 0;
+        for (int i = 0; i < num_bufs; ++i) size += int(bufs[i].iov_len);
+
+        file::iovec_t const* b = bufs;
+        int pos = 0;
+        int done = 0;
+        bool mapped = true;
+
+        while (mapped && done < size)
+        {
+            boost::intrusive_ptr<file> f;
+            size_type file_offset;
+            int n = default_storage::map_slot(slot, offset + done, size - done
+                , write ? file::read_write : file::read_only, f, file_offset);
+            if (n <= 0) break;
+
+            file_storage::iterator fi = files().file_at_offset(
+                size_type(slot) * files().piece_length() + offset + done);
+            int file_index = files().file_index(*fi);
+            size_type file_size = files().file_base(*fi) + fi->size;
+
+            while (n > 0)
+            {
+                mapping_cache::window* w;
+                int len = n;
+                char* p = m_mappings.pin(this, file_index, f, file_offset, file_size, write, len, w);
+                if (p == 0)
+                {
+                    mapped = false;
+                    break;
+                }
+
+                for (int copied = 0; copied < len;)
+                {
+                    int chunk = (std::min)(len - copied, int(b->iov_len) - pos);
+                    char* buf = static_cast<char*>(b->iov_base) + pos;
+                    if (write) memcpy(p + copied, buf, chunk);
+                    else memcpy(buf, p + copied, chunk);
+                    copied += chunk;
+                    pos += chunk;
+                    if (pos == int(b->iov_len))
+                    {
+                        ++b;
+                        pos = 0;
+                    }
+                }
+
+                m_mappings.unpin(w, p, write ? len : 0);
+                done += len;
+                n -= len;
+                file_offset += len;
+            }
+        }
+
+        if (done == size) return size;
+
+        // what couldn't be mapped goes through regular I/O
+        std::vector<file::iovec_t> rest(b, bufs + num_bufs);
+        rest.front().iov_base = static_cast<char*>(rest.front().iov_base) + pos;
+        rest.front().iov_len -= pos;
+        int ret = write
+            ? default_storage::writev(&rest[0], slot, offset + done, int(rest.size()))
+            : default_storage::readv(&rest[0], slot, offset + done, int(rest.size()));
+        if (ret < 0) return ret;
+        return done + ret;
+    }
+
+    void mapped_storage::hint_read(int slot, int offset, int len)
+    {
+        len = (std::min)(len, files().piece_size(slot) - offset);
+        boost::intrusive_ptr<file> f;
+        size_type file_offset;
+        int n = default_storage::map_slot(slot, offset, len, file::read_only, f, file_offset);
+
+        char* p = 0;
+        mapping_cache::window* w = 0;
+        if (n > 0)
+        {
+            file_storage::iterator fi = files().file_at_offset(
+                size_type(slot) * files().piece_length() + offset);
+            p = m_mappings.pin(this, files().file_index(*fi), f, file_offset
+                , files().file_base(*fi) + fi->size, false, n, w);
+        }
+
+        if (p == 0)
+        {
+            default_storage::hint_read(slot, offset, len);
+            return;
+        }
+
+#if LIBED2K_USE_MMAP
+        // reads fault the pages in one at a time, have them read at once
+        char* start = p - (size_t(p) & (page_size() - 1));
+        madvise(start, p + n - start, MADV_WILLNEED);
+#endif
+        m_mappings.unpin(w, p, 0);
+    }
+
+    bool mapped_storage::release_files()
+    {
+        m_mappings.release(this);
+        return default_storage::release_files();
+    }
+
+    bool mapped_storage::delete_files()
+    {
+        m_mappings.release(this);
+        return default_storage::delete_files();
+    }
+
+    bool mapped_storage::move_storage(std::string const& save_path)
+    {
+        m_mappings.release(this);
+        return default_storage::move_storage(save_path);
+    }
+
+    int mapped_storage::move_storage_some(std::string const& save_path, bool start
+        , size_type& moved, size_type& total)
+    {
+        int ret = default_storage::move_storage_some(save_path, start, moved, total);
+        // the windows still map the files at the old path
+        if (ret == 0) m_mappings.release(this);
+        return ret;
+    }
+
+    bool mapped_storage::rename_file(int index, std::string const& new_filename)
+    {
+        m_mappings.release(this, index);
+        return default_storage::rename_file(index, new_filename);
+    }
+
+    storage_interface* mapped_storage_constructor(file_storage const& fs
+        , file_storage const* mapped, std::string const& path, file_pool& fp
+        , std::vector<boost::uint8_t> const& file_prio, mapping_cache& mappings)
+    {
+        return new mapped_storage(fs, mapped, path, fp, file_prio, mappings);
+    }
+}
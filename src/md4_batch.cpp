@@ -0,0 +1,347 @@
+/*
+ * Multi-buffer MD4: several independent messages are hashed at once, each
+ * one in its own 32-bit lane of SSE2 (4 lanes) or AVX2 (8 lanes) registers.
+ * Rounds are the same as in md4.cpp, lanes never mix. The engine is picked
+ * at run time, CPUs without SSE2 and non x86 builds use md4_update.
+ */
+
+#include <algorithm>
+#include <vector>
+#include <string.h>
+
+#include "libed2k/md4.hpp"
+
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define LIBED2K_MD4_SIMD
+#include <immintrin.h>
+#endif
+
+namespace libed2k
+{
+
+namespace
+{
+    const size_t block_size = 64;
+
+    typedef void (*blocks_function)(md4_context* ctx[], const unsigned char* data[], size_t blocks);
+
+    struct engine
+    {
+        size_t lanes;
+        blocks_function blocks;
+    };
+
+#ifdef LIBED2K_MD4_SIMD
+
+/*
+ * The four rounds over message words x[0..15] of all lanes, the same
+ * steps as in md4.cpp written with vector operations.
+ */
+#define MD4_F(x, y, z) XOR((z), AND((x), XOR((y), (z))))
+#define MD4_G(x, y, z) OR(AND((x), (y)), AND((z), OR((x), (y))))
+#define MD4_H(x, y, z) XOR(XOR((x), (y)), (z))
+
+#define MD4_STEP(f, a, b, c, d, x, s) \
+    (a) = ADD((a), ADD(f((b), (c), (d)), (x))); \
+    (a) = OR(SHL((a), (s)), SHR((a), 32 - (s)))
+
+#define MD4_ROUNDS(x, k2, k3) \
+    MD4_STEP(MD4_F, a, b, c, d, x[ 0],  3); \
+    MD4_STEP(MD4_F, d, a, b, c, x[ 1],  7); \
+    MD4_STEP(MD4_F, c, d, a, b, x[ 2], 11); \
+    MD4_STEP(MD4_F, b, c, d, a, x[ 3], 19); \
+    MD4_STEP(MD4_F, a, b, c, d, x[ 4],  3); \
+    MD4_STEP(MD4_F, d, a, b, c, x[ 5],  7); \
+    MD4_STEP(MD4_F, c, d, a, b, x[ 6], 11); \
+    MD4_STEP(MD4_F, b, c, d, a, x[ 7], 19); \
+    MD4_STEP(MD4_F, a, b, c, d, x[ 8],  3); \
+    MD4_STEP(MD4_F, d, a, b, c, x[ 9],  7); \
+    MD4_STEP(MD4_F, c, d, a, b, x[10], 11); \
+    MD4_STEP(MD4_F, b, c, d, a, x[11], 19); \
+    MD4_STEP(MD4_F, a, b, c, d, x[12],  3); \
+    MD4_STEP(MD4_F, d, a, b, c, x[13],  7); \
+    MD4_STEP(MD4_F, c, d, a, b, x[14], 11); \
+    MD4_STEP(MD4_F, b, c, d, a, x[15], 19); \
+    MD4_STEP(MD4_G, a, b, c, d, ADD(x[ 0], k2),  3); \
+    MD4_STEP(MD4_G, d, a, b, c, ADD(x[ 4], k2),  5); \
+    MD4_STEP(MD4_G, c, d, a, b, ADD(x[ 8], k2),  9); \
+    MD4_STEP(MD4_G, b, c, d, a, ADD(x[12], k2), 13); \
+    MD4_STEP(MD4_G, a, b, c, d, ADD(x[ 1], k2),  3); \
+    MD4_STEP(MD4_G, d, a, b, c, ADD(x[ 5], k2),  5); \
+    MD4_STEP(MD4_G, c, d, a, b, ADD(x[ 9], k2),  9); \
+    MD4_STEP(MD4_G, b, c, d, a, ADD(x[13], k2), 13); \
+    MD4_STEP(MD4_G, a, b, c, d, ADD(x[ 2], k2),  3); \
+    MD4_STEP(MD4_G, d, a, b, c, ADD(x[ 6], k2),  5); \
+    MD4_STEP(MD4_G, c, d, a, b, ADD(x[10], k2),  9); \
+    MD4_STEP(MD4_G, b, c, d, a, ADD(x[14], k2), 13); \
+    MD4_STEP(MD4_G, a, b, c, d, ADD(x[ 3], k2),  3); \
+    MD4_STEP(MD4_G, d, a, b, c, ADD(x[ 7], k2),  5); \
+    MD4_STEP(MD4_G, c, d, a, b, ADD(x[11], k2),  9); \
+    MD4_STEP(MD4_G, b, c, d, a, ADD(x[15], k2), 13); \
+    MD4_STEP(MD4_H, a, b, c, d, ADD(x[ 0], k3),  3); \
+    MD4_STEP(MD4_H, d, a, b, c, ADD(x[ 8], k3),  9); \
+    MD4_STEP(MD4_H, c, d, a, b, ADD(x[ 4], k3), 11); \
+    MD4_STEP(MD4_H, b, c, d, a, ADD(x[12], k3), 15); \
+    MD4_STEP(MD4_H, a, b, c, d, ADD(x[ 2], k3),  3); \
+    MD4_STEP(MD4_H, d, a, b, c, ADD(x[10], k3),  9); \
+    MD4_STEP(MD4_H, c, d, a, b, ADD(x[ 6], k3), 11); \
+    MD4_STEP(MD4_H, b, c, d, a, ADD(x[14], k3), 15); \
+    MD4_STEP(MD4_H, a, b, c, d, ADD(x[ 1], k3),  3); \
+    MD4_STEP(MD4_H, d, a, b, c, ADD(x[ 9], k3),  9); \
+    MD4_STEP(MD4_H, c, d, a, b, ADD(x[ 5], k3), 11); \
+    MD4_STEP(MD4_H, b, c, d, a, ADD(x[13], k3), 15); \
+    MD4_STEP(MD4_H, a, b, c, d, ADD(x[ 3], k3),  3); \
+    MD4_STEP(MD4_H, d, a, b, c, ADD(x[11], k3),  9); \
+    MD4_STEP(MD4_H, c, d, a, b, ADD(x[ 7], k3), 11); \
+    MD4_STEP(MD4_H, b, c, d, a, ADD(x[15], k3), 15)
+
+#define ADD(x, y) _mm_add_epi32((x), (y))
+#define AND(x, y) _mm_and_si128((x), (y))
+#define OR(x, y)  _mm_or_si128((x), (y))
+#define XOR(x, y) _mm_xor_si128((x), (y))
+#define SHL(x, s) _mm_slli_epi32((x), (s))
+#define SHR(x, s) _mm_srli_epi32((x), (s))
+
+    __attribute__((target("sse2")))
+    void md4_blocks_sse2(md4_context* ctx[], const unsigned char* data[], size_t blocks)
+    {
+        __m128i a = _mm_set_epi32(ctx[3]->a, ctx[2]->a, ctx[1]->a, ctx[0]->a);
+        __m128i b = _mm_set_epi32(ctx[3]->b, ctx[2]->b, ctx[1]->b, ctx[0]->b);
+        __m128i c = _mm_set_epi32(ctx[3]->c, ctx[2]->c, ctx[1]->c, ctx[0]->c);
+        __m128i d = _mm_set_epi32(ctx[3]->d, ctx[2]->d, ctx[1]->d, ctx[0]->d);
+        const __m128i k2 = _mm_set1_epi32(0x5A827999);
+        const __m128i k3 = _mm_set1_epi32(0x6ED9EBA1);
+        __m128i x[16];
+
+        for (size_t offset = 0; offset < blocks * block_size; offset += block_size)
+        {
+            // transpose 4 words of every lane into 4 vectors of the same word
+            for (int w = 0; w < 16; w += 4)
+            {
+                __m128i r0 = _mm_loadu_si128((const __m128i*)(data[0] + offset + w * 4));
+                __m128i r1 = _mm_loadu_si128((const __m128i*)(data[1] + offset + w * 4));
+                __m128i r2 = _mm_loadu_si128((const __m128i*)(data[2] + offset + w * 4));
+                __m128i r3 = _mm_loadu_si128((const __m128i*)(data[3] + offset + w * 4));
+                __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+                __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+                __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+                __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+                x[w + 0] = _mm_unpacklo_epi64(t0, t1);
+                x[w + 1] = _mm_unpackhi_epi64(t0, t1);
+                x[w + 2] = _mm_unpacklo_epi64(t2, t3);
+                x[w + 3] = _mm_unpackhi_epi64(t2, t3);
+            }
+
+            __m128i saved_a = a, saved_b = b, saved_c = c, saved_d = d;
+            MD4_ROUNDS(x, k2, k3);
+            a = ADD(a, saved_a);
+            b = ADD(b, saved_b);
+            c = ADD(c, saved_c);
+            d = ADD(d, saved_d);
+        }
+
+        boost::uint32_t out[4][4];
+        _mm_storeu_si128((__m128i*)out[0], a);
+        _mm_storeu_si128((__m128i*)out[1], b);
+        _mm_storeu_si128((__m128i*)out[2], c);
+        _mm_storeu_si128((__m128i*)out[3], d);
+
+        for (int i = 0; i < 4; ++i)
+        {
+            ctx[i]->a = out[0][i];
+            ctx[i]->b = out[1][i];
+            ctx[i]->c = out[2][i];
+            ctx[i]->d = out[3][i];
+        }
+    }
+
+#undef ADD
+#undef AND
+#undef OR
+#undef XOR
+#undef SHL
+#undef SHR
+
+#define ADD(x, y) _mm256_add_epi32((x), (y))
+#define AND(x, y) _mm256_and_si256((x), (y))
+#define OR(x, y)  _mm256_or_si256((x), (y))
+#define XOR(x, y) _mm256_xor_si256((x), (y))
+#define SHL(x, s) _mm256_slli_epi32((x), (s))
+#define SHR(x, s) _mm256_srli_epi32((x), (s))
+
+    __attribute__((target("avx2")))
+    void md4_blocks_avx2(md4_context* ctx[], const unsigned char* data[], size_t blocks)
+    {
+#define LANES(m) ctx[7]->m, ctx[6]->m, ctx[5]->m, ctx[4]->m, ctx[3]->m, ctx[2]->m, ctx[1]->m, ctx[0]->m
+        __m256i a = _mm256_set_epi32(LANES(a));
+        __m256i b = _mm256_set_epi32(LANES(b));
+        __m256i c = _mm256_set_epi32(LANES(c));
+        __m256i d = _mm256_set_epi32(LANES(d));
+#undef LANES
+        const __m256i k2 = _mm256_set1_epi32(0x5A827999);
+        const __m256i k3 = _mm256_set1_epi32(0x6ED9EBA1);
+        __m256i x[16];
+
+        for (size_t offset = 0; offset < blocks * block_size; offset += block_size)
+        {
+            // transpose 8 words of every lane into 8 vectors of the same word
+            for (int w = 0; w < 16; w += 8)
+            {
+                __m256i r[8];
+                for (int i = 0; i < 8; ++i)
+                    r[i] = _mm256_loadu_si256((const __m256i*)(data[i] + offset + w * 4));
+
+                __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+                __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+                __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+                __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+                __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+                __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+                __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+                __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+                __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+                __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+                __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+                __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+                __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+                __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+                __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+                __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+                x[w + 0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+                x[w + 1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+                x[w + 2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+                x[w + 3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+                x[w + 4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+                x[w + 5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+                x[w + 6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+                x[w + 7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+            }
+
+            __m256i saved_a = a, saved_b = b, saved_c = c, saved_d = d;
+            MD4_ROUNDS(x, k2, k3);
+            a = ADD(a, saved_a);
+            b = ADD(b, saved_b);
+            c = ADD(c, saved_c);
+            d = ADD(d, saved_d);
+        }
+
+        boost::uint32_t out[4][8];
+        _mm256_storeu_si256((__m256i*)out[0], a);
+        _mm256_storeu_si256((__m256i*)out[1], b);
+        _mm256_storeu_si256((__m256i*)out[2], c);
+        _mm256_storeu_si256((__m256i*)out[3], d);
+
+        for (int i = 0; i < 8; ++i)
+        {
+            ctx[i]->a = out[0][i];
+            ctx[i]->b = out[1][i];
+            ctx[i]->c = out[2][i];
+            ctx[i]->d = out[3][i];
+        }
+    }
+
+#undef ADD
+#undef AND
+#undef OR
+#undef XOR
+#undef SHL
+#undef SHR
+
+#undef MD4_ROUNDS
+#undef MD4_STEP
+#undef MD4_F
+#undef MD4_G
+#undef MD4_H
+
+#endif // LIBED2K_MD4_SIMD
+
+    engine make_engine(size_t lanes, blocks_function blocks)
+    {
+        engine e;
+        e.lanes = lanes;
+        e.blocks = blocks;
+        return e;
+    }
+
+    engine select_engine(size_t max_lanes)
+    {
+#ifdef LIBED2K_MD4_SIMD
+        __builtin_cpu_init();
+        if (max_lanes >= 8 && __builtin_cpu_supports("avx2")) return make_engine(8, md4_blocks_avx2);
+        if (max_lanes >= 4 && __builtin_cpu_supports("sse2")) return make_engine(4, md4_blocks_sse2);
+#endif
+        return make_engine(1, 0);
+    }
+
+    const engine& find_engine(size_t max_lanes)
+    {
+        // CPU features don't change, look them up once for every lanes limit
+        static const engine engines[MD4_BATCH_MAX_LANES + 1] = {
+            select_engine(0), select_engine(1), select_engine(2),
+            select_engine(3), select_engine(4), select_engine(5),
+            select_engine(6), select_engine(7), select_engine(8) };
+        return engines[std::min(max_lanes, MD4_BATCH_MAX_LANES)];
+    }
+
+    struct longer
+    {
+        longer(const size_t* size): m_size(size) {}
+        bool operator()(size_t l, size_t r) const { return m_size[l] > m_size[r]; }
+        const size_t* m_size;
+    };
+}
+
+void md4_batch(const unsigned char* const data[], const size_t size[], size_t count,
+               unsigned char result[][MD4_HASH_SIZE], size_t max_lanes)
+{
+    const engine& e = find_engine(max_lanes);
+
+    // longest buffers go first so lanes of a group have similar lengths
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), longer(size));
+
+    for (size_t group = 0; group < count; group += e.lanes)
+    {
+        const size_t n = std::min(e.lanes, count - group);
+        md4_context ctx[MD4_BATCH_MAX_LANES];
+        md4_context idle[MD4_BATCH_MAX_LANES];
+        md4_context* lane_ctx[MD4_BATCH_MAX_LANES];
+        const unsigned char* lane_data[MD4_BATCH_MAX_LANES];
+        size_t blocks = size[order[group + n - 1]] / block_size;
+
+        for (size_t i = 0; i < e.lanes; ++i)
+        {
+            // lanes without buffer hash the first one again to nowhere
+            lane_ctx[i] = i < n ? &ctx[i] : &idle[i];
+            lane_data[i] = data[order[group + (i < n ? i : 0)]];
+            md4_init(lane_ctx[i]);
+        }
+
+        if (n > 1 && blocks > 0) e.blocks(lane_ctx, lane_data, blocks);
+        else blocks = 0;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            const size_t index = order[group + i];
+            const boost::uint64_t done = boost::uint64_t(blocks) * block_size;
+
+            // bit counters as md4_update keeps them
+            ctx[i].lo = boost::uint32_t(done & 0x1fffffff);
+            ctx[i].hi = boost::uint32_t(done >> 29);
+
+            md4_update(&ctx[i], data[index] + done, size[index] - done);
+            md4_final(&ctx[i], result[index]);
+        }
+    }
+}
+
+size_t md4_batch_lanes(size_t max_lanes)
+{
+    return find_engine(max_lanes).lanes;
+}
+
+}
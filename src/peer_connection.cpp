@@ -52,7 +52,8 @@ std::pair<peer_request, peer_request> split_request(const peer_request& req)
 {
     peer_request r = req;
     peer_request left = req;
-    r.length = std::min(req.length, int(BLOCK_SIZE));
+    // never cross a block, every part can be sent from one cached block
+    r.length = std::min(req.length, int(BLOCK_SIZE - offset_in_block(req)));
     left.start = r.start + r.length;
     left.length = req.length - r.length;
 
@@ -106,6 +107,8 @@ void peer_connection::reset()
     m_last_receive = time_now();
     m_last_sent = time_now();
     m_timeout = seconds(m_ses.settings().peer_timeout);
+    m_last_source_request = min_time();
+    m_last_source_answer = min_time();
 
     m_connection_ticket = -1;
     m_quota[upload_channel] = 0;
@@ -117,6 +120,11 @@ void peer_connection::reset()
     m_desired_queue_size = 3;
     m_max_busy_blocks = 1;
     m_recv_pos = 0;
+    m_last_request_piece = -1;
+    m_last_request_end = 0;
+    m_sequential_requests = 0;
+    m_read_ahead_end = 0;
+    m_aich_request_piece = -1;
 
     add_handler(std::make_pair(OP_HELLO, OP_EDONKEYPROT), boost::bind(&peer_connection::on_hello, this, _1));
     add_handler(get_proto_pair<client_hello_answer>(), boost::bind(&peer_connection::on_hello_answer, this, _1));
@@ -145,6 +153,16 @@ void peer_connection::reset()
                 boost::bind(&peer_connection::on_sending_part<client_sending_part_64>, this, _1));
     add_handler(/*OP_END_OF_DOWNLOAD*/get_proto_pair<client_end_download>(), boost::bind(&peer_connection::on_end_download, this, _1));
 
+    // source exchange
+    add_handler(/*OP_REQUESTSOURCES2*/get_proto_pair<client_request_sources2>(), boost::bind(&peer_connection::on_request_sources2, this, _1));
+    add_handler(/*OP_ANSWERSOURCES2*/get_proto_pair<client_answer_sources2>(), boost::bind(&peer_connection::on_answer_sources2, this, _1));
+
+    // AICH corruption handling
+    add_handler(/*OP_AICHFILEHASHREQ*/get_proto_pair<client_aich_file_hash_request>(), boost::bind(&peer_connection::on_aich_file_hash_request, this, _1));
+    add_handler(/*OP_AICHFILEHASHANS*/get_proto_pair<client_aich_file_hash_answer>(), boost::bind(&peer_connection::on_aich_file_hash_answer, this, _1));
+    add_handler(/*OP_AICHREQUEST*/get_proto_pair<client_aich_request>(), boost::bind(&peer_connection::on_aich_request, this, _1));
+    add_handler(/*OP_AICHANSWER*/get_proto_pair<client_aich_answer>(), boost::bind(&peer_connection::on_aich_answer, this, _1));
+
     // shared files request and answer
     add_handler(/*OP_ASKSHAREDFILES*/get_proto_pair<client_shared_files_request>(), boost::bind(&peer_connection::on_shared_files_request, this, _1));
     add_handler(/*OP_ASKSHAREDDENIEDANS*/get_proto_pair<client_shared_files_denied>(), boost::bind(&peer_connection::on_shared_files_denied, this, _1));
@@ -331,6 +349,23 @@ void peer_connection::second_tick(int tick_interval_ms)
     m_statistics.second_tick(tick_interval_ms);
 }
 
+bool peer_connection::request_sources(const ptime& now)
+{
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    if (!t || m_disconnecting || !m_handshake_complete) return false;
+
+    // the peer must have told us it has the file
+    if (!m_misc_options2.support_source_ext2() || m_remote_pieces.size() == 0)
+        return false;
+
+    if (now - m_last_source_request < seconds(m_ses.settings().source_exchange_interval))
+        return false;
+
+    m_last_source_request = now;
+    write_request_sources2(t->hash());
+    return true;
+}
+
 bool peer_connection::attach_to_transfer(const md4_hash& hash)
 {
     boost::weak_ptr<transfer> wpt = m_ses.find_transfer(hash);
@@ -372,6 +407,8 @@ bool peer_connection::attach_to_transfer(const md4_hash& hash)
     // hash and peer_id. If we do. close this connection.
     if (!t->attach_peer(this)) return false;
     m_transfer = wpt;
+    m_last_request_piece = -1;
+    m_read_ahead_end = 0;
 
     // if the transfer isn't ready to accept
     // connections yet, we'll have to wait with
@@ -380,6 +417,83 @@ bool peer_connection::attach_to_transfer(const md4_hash& hash)
     return true;
 }
 
+bool peer_connection::add_transfer(boost::shared_ptr<transfer> t)
+{
+    if (!t || m_disconnecting || t == m_transfer.lock()) return false;
+    if (m_missing_files.count(t->hash())) return false;
+
+    for (std::deque<boost::weak_ptr<transfer> >::const_iterator i = m_waiting_transfers.begin(),
+             end(m_waiting_transfers.end()); i != end; ++i)
+    {
+        if (i->lock() == t) return false;
+    }
+
+    DBG("transfer " << t->hash() << " waits for connection " << m_remote);
+    m_waiting_transfers.push_back(t);
+
+    // the connection isn't used by any transfer, take this one right away
+    if (!has_transfer() && m_handshake_complete) attach_to_waiting_transfer();
+    return true;
+}
+
+void peer_connection::next_transfer(const error_code& ec)
+{
+    if (m_disconnecting) return;
+
+    if (m_waiting_transfers.empty())
+    {
+        disconnect(ec);
+        return;
+    }
+
+    detach_from_transfer();
+    if (!attach_to_waiting_transfer() && !m_disconnecting) disconnect(ec);
+}
+
+void peer_connection::detach_from_transfer()
+{
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    if (!t) return;
+
+    DBG("detach from transfer " << t->hash() << " {remote: " << m_remote << "}");
+    abort_all_requests();
+    t->remove_peer(this);
+    m_transfer.reset();
+
+    // remote state and upload requests belong to the previous file
+    m_remote_pieces.free();
+    m_requests.clear();
+}
+
+bool peer_connection::attach_to_waiting_transfer()
+{
+    while (!m_waiting_transfers.empty() && !m_disconnecting)
+    {
+        boost::shared_ptr<transfer> t = m_waiting_transfers.front().lock();
+        m_waiting_transfers.pop_front();
+
+        if (!t || t->is_finished() || !attach_to_transfer(t->hash())) continue;
+
+        // file request goes after hello answer otherwise
+        if (m_handshake_complete) write_file_request(t->hash());
+        return true;
+    }
+
+    return false;
+}
+
+bool peer_connection::is_idle() const
+{
+    return m_download_queue.empty() && m_request_queue.empty() && m_requests.empty();
+}
+
+boost::shared_ptr<transfer> peer_connection::find_shared_transfer(const md4_hash& hash) const
+{
+    boost::shared_ptr<transfer> t = m_ses.find_transfer(hash).lock();
+    if (t && (t->is_aborted() || t->is_paused())) t.reset();
+    return t;
+}
+
 void peer_connection::do_read()
 {
     if (m_disconnecting) return;
@@ -1008,7 +1122,9 @@ bool peer_connection::can_read(char* state) const
     bool bw_limit = m_quota[download_channel] > 0;
     if (!bw_limit) return false;
 
-    bool disk = m_ses.settings().max_queued_disk_bytes == 0 || m_ses.can_write_to_disk();
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    bool disk = m_ses.settings().max_queued_disk_bytes == 0
+        || (t ? t->can_write_to_disk() : m_ses.can_write_to_disk());
     if (!disk)
     {
         if (state) *state = peer_info::bw_disk;
@@ -1126,6 +1242,7 @@ void peer_connection::fill_send_buffer()
     if (!m_requests.empty() && m_send_buffer.size() < m_ses.settings().send_buffer_watermark)
     {
         const peer_request& req = m_requests.front();
+        read_ahead(req);
         write_part(req);
         send_data(req);
         m_requests.erase(m_requests.begin());
@@ -1144,7 +1261,8 @@ void peer_connection::send_data(const peer_request& req)
     if (r.length > 0)
     {
         t->filesystem().async_read(r, boost::bind(&peer_connection::on_disk_read_complete,
-                                                  self_as<peer_connection>(), _1, _2, r, left));
+                                                  self_as<peer_connection>(), _1, _2, r, left),
+                                   0, 0, disk_io_job::cache_reference);
         m_channel_state[upload_channel] |= peer_info::bw_seq;
     }
     else
@@ -1177,7 +1295,9 @@ void peer_connection::on_disk_read_complete(
         t->handle_disk_error(j, this);
         return;
     }
-    append_send_buffer(buffer.get(), r.length,
+    // the buffer may be a block of the read cache, freeing it then only
+    // drops our reference
+    append_send_buffer(buffer.get(), j.buffer_offset, r.length,
                        boost::bind(&aux::session_impl::free_disk_buffer, boost::ref(m_ses), _1));
     buffer.release();
 
@@ -1186,6 +1306,47 @@ void peer_connection::on_disk_read_complete(
     send_data(left);
 }
 
+void peer_connection::read_ahead(const peer_request& req)
+{
+    if (req.piece == m_last_request_piece && req.start == m_last_request_end)
+        ++m_sequential_requests;
+    else
+    {
+        m_sequential_requests = 0;
+        if (req.piece != m_last_request_piece) m_read_ahead_end = 0;
+    }
+
+    m_last_request_piece = req.piece;
+    m_last_request_end = req.start + req.length;
+
+    // ed2k clients request up to three parts at once, wait for one more
+    // in a row before taking the access as sequential
+    const session_settings& settings = m_ses.settings();
+    if (settings.upload_read_ahead_seconds <= 0 || m_sequential_requests < 2) return;
+
+    boost::shared_ptr<transfer> t = m_transfer.lock();
+    if (!t) return;
+
+    // what the peer takes in the next seconds, at least one block
+    size_type window = (std::max)(size_type(m_statistics.upload_payload_rate())
+        * settings.upload_read_ahead_seconds, size_type(BLOCK_SIZE));
+    window = (std::min)(window, size_type(settings.upload_read_ahead_limit) * BLOCK_SIZE);
+
+    int piece_size = t->filesystem().info()->piece_size(req.piece);
+    int start = (std::max)(m_read_ahead_end, m_last_request_end);
+    int end = int((std::min)(size_type(m_last_request_end) + window, size_type(piece_size)));
+
+    // read ahead whole blocks, except for the tail of the piece
+    if (end <= start || (end - start < BLOCK_SIZE && end < piece_size)) return;
+
+    peer_request r;
+    r.piece = req.piece;
+    r.start = start;
+    r.length = end - start;
+    t->filesystem().async_read_ahead(r);
+    m_read_ahead_end = end;
+}
+
 void peer_connection::receive_data(const peer_request& req)
 {
     LIBED2K_ASSERT((m_channel_state[download_channel] & (peer_info::bw_network | peer_info::bw_seq)) == 0);
@@ -1422,6 +1583,7 @@ void peer_connection::append_misc_info(tag_list<boost::uint32_t>& t)
     misc_options mo(0);
     mo.m_nUnicodeSupport = 1;
     mo.m_nNoViewSharedFiles = !m_ses.settings().m_show_shared_files;
+    mo.m_nAICHVersion = 1;
 
     misc_options2 mo2(0);
     mo2.set_captcha();
@@ -1437,7 +1599,7 @@ void peer_connection::write_hello()
     DBG("hello ==> " << m_remote);
     const session_settings& settings = m_ses.settings();
     client_hello hello(m_ses.settings().user_agent,
-            net_identifier(m_ses.m_server_connection->client_id(), m_ses.settings().listen_port),
+            net_identifier(m_ses.client_id(), m_ses.settings().listen_port),
             net_identifier(address2int(m_ses.server().address()), m_ses.server().port()),
             m_ses.settings().client_name,
             m_ses.settings().mod_name,
@@ -1445,7 +1607,7 @@ void peer_connection::write_hello()
 
     // fill special fields
     hello.m_nHashLength = MD4_HASH_SIZE;
-    hello.m_network_point.m_nIP = m_ses.m_server_connection->client_id();
+    hello.m_network_point.m_nIP = m_ses.client_id();
     hello.m_network_point.m_nPort = settings.listen_port;
     append_misc_info(hello.m_list);
     write_struct(hello);
@@ -1463,7 +1625,7 @@ void peer_connection::write_hello_answer()
 {
     // prepare hello answer
     client_hello_answer cha(m_ses.settings().user_agent,
-            net_identifier(m_ses.m_server_connection->client_id(), m_ses.settings().listen_port),
+            net_identifier(m_ses.client_id(), m_ses.settings().listen_port),
             net_identifier(address2int(m_ses.server().address()), m_ses.server().port()),
             m_ses.settings().client_name,
             m_ses.settings().mod_name,
@@ -1603,6 +1765,76 @@ void peer_connection::write_part(const peer_request& r)
         << " ==> " << m_remote);
 }
 
+void peer_connection::write_request_sources2(const md4_hash& file_hash)
+{
+    DBG("request sources " << file_hash << " ==> " << m_remote);
+    client_request_sources2 rs;
+    rs.m_hFile = file_hash;
+    write_struct(rs);
+}
+
+void peer_connection::write_answer_sources2(
+    const md4_hash& file_hash, boost::uint8_t version, const std::vector<tcp::endpoint>& sources)
+{
+    DBG("answer sources {file: " << file_hash << ", version: " << int(version)
+        << ", count: " << sources.size() << "} ==> " << m_remote);
+
+    client_answer_sources2 as;
+    as.m_nVersion = version;
+    as.m_hFile = file_hash;
+    as.m_sources.resize(sources.size());
+
+    for (size_t n = 0; n < sources.size(); ++n)
+    {
+        // version 3 and later use hybrid ids which are in host byte order
+        boost::uint32_t id = address2int(sources[n].address());
+        as.m_sources[n].m_nUserId = version >= 3 ? ntohl(id) : id;
+        as.m_sources[n].m_nPort = sources[n].port();
+    }
+
+    write_struct(as);
+}
+
+void peer_connection::write_aich_file_hash_request(const md4_hash& file_hash)
+{
+    DBG("request AICH root " << file_hash << " ==> " << m_remote);
+    client_aich_file_hash_request fr;
+    fr.m_hFile = file_hash;
+    write_struct(fr);
+}
+
+void peer_connection::write_aich_file_hash_answer(const md4_hash& file_hash, const aich_hash& root)
+{
+    DBG("AICH root {file: " << file_hash << ", root: " << root << "} ==> " << m_remote);
+    client_aich_file_hash_answer fa;
+    fa.m_hFile = file_hash;
+    fa.m_hRoot = root;
+    write_struct(fa);
+}
+
+void peer_connection::request_aich_recovery(const md4_hash& file_hash, int piece, const aich_hash& root)
+{
+    DBG("request AICH recovery {file: " << file_hash << ", piece: " << piece << "} ==> " << m_remote);
+    client_aich_request ar;
+    ar.m_hFile = file_hash;
+    ar.m_nPart = static_cast<boost::uint16_t>(piece);
+    ar.m_hRoot = root;
+    write_struct(ar);
+}
+
+void peer_connection::write_aich_answer(
+    const md4_hash& file_hash, int piece, const aich_hash& root, const aich_recovery_data& data)
+{
+    DBG("AICH recovery {file: " << file_hash << ", piece: " << piece
+        << ", hashes: " << data.m_hashes.size() << "} ==> " << m_remote);
+    client_aich_answer aa;
+    aa.m_hFile = file_hash;
+    aa.m_nPart = static_cast<boost::uint16_t>(piece);
+    aa.m_hRoot = root;
+    aa.m_data = data;
+    write_struct(aa);
+}
+
 void peer_connection::on_hello(const error_code& error)
 {
     if (!error)
@@ -1612,6 +1844,16 @@ void peer_connection::on_hello(const error_code& error)
         m_hClient = hello.m_hClient;
         m_options.m_nPort = hello.m_network_point.m_nPort;
         DBG("hello {port: " << m_options.m_nPort << "} <== " << m_remote);
+
+        // low id peer of the server we asked connected to us on our callback request,
+        // take it as a source for the transfer - file request goes after its hello answer
+        md4_hash hash;
+        if (!m_active && !has_transfer() && isLowId(hello.m_network_point.m_nIP) &&
+            m_ses.accept_callback(hello.m_server_network_point, hello.m_network_point.m_nIP, hash))
+        {
+            attach_to_transfer(hash);
+        }
+
         write_hello_answer();
 
         //write hello only if we didn't send it yet - when we isn't active peer
@@ -1729,7 +1971,7 @@ void peer_connection::on_hello_answer(const error_code& error)
     boost::shared_ptr<transfer> t = m_transfer.lock();
 
     if (t && !t->is_finished()) write_file_request(t->hash());
-	else fill_send_buffer();
+    else if (t || !attach_to_waiting_transfer()) fill_send_buffer();
 }
 
 void peer_connection::on_ext_hello(const error_code& error)
@@ -1763,9 +2005,12 @@ void peer_connection::on_file_request(const error_code& error)
         DECODE_PACKET(client_file_request, fr);
         DBG("file request " << fr.m_hFile << " <== " << m_remote);
 
-        if (attach_to_transfer(fr.m_hFile))
+        // the first requested file attaches the connection, others are
+        // answered as is - the peer selects them by OP_SETREQFILEID later
+        boost::shared_ptr<transfer> t = find_shared_transfer(fr.m_hFile);
+
+        if (t && (has_transfer() || attach_to_transfer(fr.m_hFile)))
         {
-            boost::shared_ptr<transfer> t = m_transfer.lock();
             write_file_answer(t->hash(), t->name());
         }
         else
@@ -1816,7 +2061,10 @@ void peer_connection::on_no_file(const error_code& error)
         DECODE_PACKET(client_no_file, nf);
         DBG("no file " << nf.m_hFile << " <== " << m_remote);
 
-        disconnect(errors::file_unavaliable, 2);
+        // try next file we want from this peer
+        m_missing_files.insert(nf.m_hFile);
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t || t->hash() == nf.m_hFile) next_transfer(errors::file_unavaliable);
     }
     else
     {
@@ -1832,7 +2080,27 @@ void peer_connection::on_filestatus_request(const error_code& error)
         DBG("file status request " << fr.m_hFile << " <== " << m_remote);
 
         boost::shared_ptr<transfer> t = m_transfer.lock();
-        if (!t) return;
+
+        // the peer selects other file, switch to it unless we download from
+        // the peer right now. Our transfer waits for its turn
+        if (t && t->hash() != fr.m_hFile && is_idle() && find_shared_transfer(fr.m_hFile))
+        {
+            detach_from_transfer();
+            if (!t->is_finished()) m_waiting_transfers.push_front(t);
+            t.reset();
+        }
+
+        if (!t)
+        {
+            if (!attach_to_transfer(fr.m_hFile))
+            {
+                write_no_file(fr.m_hFile);
+                attach_to_waiting_transfer();
+                return;
+            }
+
+            t = m_transfer.lock();
+        }
 
         if (t->hash() == fr.m_hFile)
         {
@@ -1841,7 +2109,6 @@ void peer_connection::on_filestatus_request(const error_code& error)
         else
         {
             write_no_file(fr.m_hFile);
-            disconnect(errors::file_unavaliable, 2);
         }
     }
     else
@@ -1869,6 +2136,11 @@ void peer_connection::on_file_status(const error_code& error)
         {
             m_remote_pieces = fs.m_status;
             t->picker().inc_refcount(fs.m_status);
+
+            // AICH root of the peer is a vote for trusted root and tells
+            // whether the peer is able to help with corrupt pieces
+            if (supports_aich()) write_aich_file_hash_request(fs.m_hFile);
+
             if (t->size() < PIECE_SIZE)
                 write_start_upload(fs.m_hFile);
             else if (fs.m_status.count() > 0)
@@ -1886,6 +2158,188 @@ void peer_connection::on_file_status(const error_code& error)
     }
 }
 
+void peer_connection::on_request_sources2(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_request_sources2, rs);
+        DBG("request sources {file: " << rs.m_hFile << ", version: " << int(rs.m_nVersion)
+            << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t || t->hash() != rs.m_hFile) return;
+
+        const session_settings& settings = m_ses.settings();
+        ptime now = time_now();
+
+        // ignore requests coming more often than we ask ourselves
+        if (settings.source_exchange_interval <= 0 ||
+            now - m_last_source_answer < seconds(settings.source_exchange_interval))
+        {
+            DBG("ignore sources request from " << m_remote);
+            return;
+        }
+
+        m_last_source_answer = now;
+
+        std::vector<tcp::endpoint> sources;
+        t->get_exchange_sources(sources, m_remote.address(), settings.max_source_exchange_sources);
+        if (sources.empty()) return;
+
+        boost::uint8_t version = std::max<boost::uint8_t>(
+            1, std::min(rs.m_nVersion, SOURCE_EXCHANGE2_VERSION));
+        write_answer_sources2(t->hash(), version, sources);
+    }
+    else
+    {
+        ERR("request sources error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_answer_sources2(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_answer_sources2, as);
+        DBG("answer sources {file: " << as.m_hFile << ", version: " << int(as.m_nVersion)
+            << ", count: " << as.m_sources.size() << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t || t->hash() != as.m_hFile) return;
+
+        for (std::vector<sx2_source>::const_iterator i = as.m_sources.begin(),
+                 end(as.m_sources.end()); i != end; ++i)
+        {
+            // low id sources are reachable through their server only
+            if (isLowId(i->m_nUserId) || i->m_nPort == 0) continue;
+
+            boost::uint32_t id = as.m_nVersion >= 3 ? htonl(i->m_nUserId) : i->m_nUserId;
+            if (id == m_ses.client_id()) continue;
+
+            // the policy drops duplicates and respects max_peerlist_size
+            t->add_peer(tcp::endpoint(ip::address::from_string(int2ipstr(id)), i->m_nPort), true);
+        }
+    }
+    else
+    {
+        ERR("answer sources error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_file_hash_request(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_file_hash_request, fr);
+        DBG("AICH root request " << fr.m_hFile << " <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = find_shared_transfer(fr.m_hFile);
+
+        if (t && t->aich_root().defined())
+            write_aich_file_hash_answer(t->hash(), t->aich_root());
+    }
+    else
+    {
+        ERR("AICH root request error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_file_hash_answer(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_file_hash_answer, fa);
+        DBG("AICH root {file: " << fa.m_hFile << ", root: " << fa.m_hRoot << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t || t->hash() != fa.m_hFile || !fa.m_hRoot.defined()) return;
+
+        t->aich_root_vote(m_remote.address(), fa.m_hRoot);
+    }
+    else
+    {
+        ERR("AICH root answer error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_request(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_request, ar);
+        DBG("AICH recovery request {file: " << ar.m_hFile << ", piece: " << ar.m_nPart << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = find_shared_transfer(ar.m_hFile);
+
+        // one request at a time, the others are dropped while its piece is read
+        if (m_aich_request_piece >= 0)
+        {
+            DBG("AICH recovery request dropped {piece: " << ar.m_nPart << ", outstanding: "
+                << m_aich_request_piece << "} <== " << m_remote);
+            return;
+        }
+
+        // recovery data needs hashes of all pieces and data of the piece
+        if (t && t->aich_root() == ar.m_hRoot && !t->aich_piece_hashes().empty() &&
+            ar.m_nPart < t->num_pieces() && t->have_piece(ar.m_nPart))
+        {
+            m_aich_request_piece = ar.m_nPart;
+            t->async_aich_answer(ar.m_nPart, boost::bind(&peer_connection::on_aich_answer_ready,
+                                                         self_as<peer_connection>(), t, _1, _2, _3));
+        }
+        else
+        {
+            client_aich_answer aa;
+            aa.m_hFile = ar.m_hFile;
+            write_struct(aa);
+        }
+    }
+    else
+    {
+        ERR("AICH recovery request error " << error.message() << " <== " << m_remote);
+    }
+}
+
+void peer_connection::on_aich_answer_ready(
+    boost::shared_ptr<transfer> t, int piece, const aich_recovery_data& data, bool ok)
+{
+    m_aich_request_piece = -1;
+    if (m_disconnecting) return;
+
+    if (ok)
+    {
+        write_aich_answer(t->hash(), piece, t->aich_root(), data);
+        return;
+    }
+
+    client_aich_answer aa;
+    aa.m_hFile = t->hash();
+    write_struct(aa);
+}
+
+void peer_connection::on_aich_answer(const error_code& error)
+{
+    if (!error)
+    {
+        DECODE_PACKET(client_aich_answer, aa);
+        DBG("AICH recovery {file: " << aa.m_hFile << ", piece: " << aa.m_nPart
+            << ", hashes: " << aa.m_data.m_hashes.size() << "} <== " << m_remote);
+
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (!t || t->hash() != aa.m_hFile) return;
+
+        // empty answer rejects all our requests
+        if (aa.m_data.m_hashes.empty() || aa.m_hRoot != t->aich_root())
+            t->aich_recovery_received(this, -1, aa.m_data);
+        else
+            t->aich_recovery_received(this, aa.m_nPart, aa.m_data);
+    }
+    else
+    {
+        ERR("AICH recovery error " << error.message() << " <== " << m_remote);
+    }
+}
+
 void peer_connection::on_hashset_request(const error_code& error)
 {
     if (!error)
@@ -1893,17 +2347,13 @@ void peer_connection::on_hashset_request(const error_code& error)
         DECODE_PACKET(client_hashset_request, hr);
         DBG("hashset request " << hr.m_hFile << " <== " << m_remote);
 
-        boost::shared_ptr<transfer> t = m_transfer.lock();
-        if (!t) return;
-
-        if (t->hash() == hr.m_hFile)
+        if (boost::shared_ptr<transfer> t = find_shared_transfer(hr.m_hFile))
         {
             write_hashset_answer(t->hash(), t->piece_hashses());
         }
         else
         {
             write_no_file(hr.m_hFile);
-            disconnect(errors::file_unavaliable, 2);
         }
     }
     else
@@ -2014,7 +2464,7 @@ void peer_connection::on_cancel_transfer(const error_code& error)
     {
         DBG("cancel transfer <== " << m_remote);
         // TODO: handle it.
-        disconnect(errors::transfer_aborted);
+        next_transfer(errors::transfer_aborted);
     }
     else
     {
@@ -2028,6 +2478,11 @@ void peer_connection::on_end_download(const error_code& error)
     {
         DECODE_PACKET(client_end_download, ed);
         DBG("end download " << ed.m_hFile << " <== " << m_remote);
+
+        // the peer got what it wanted from us, go on with our own requests
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+        if (t && t->hash() == ed.m_hFile && is_idle() && !m_waiting_transfers.empty())
+            next_transfer(errors::no_error);
     }
     else
     {
@@ -2352,6 +2807,14 @@ void peer_connection::on_request_parts(const error_code& error)
             << "[" << rp.m_begin_offset[1] << ", " << rp.m_end_offset[1] << "]"
             << "[" << rp.m_begin_offset[2] << ", " << rp.m_end_offset[2] << "]"
             << " <== " << m_remote);
+
+        if (rp.m_hFile != t->hash())
+        {
+            // the peer has to select the file by OP_SETREQFILEID first
+            DBG("requested parts of inactive file " << rp.m_hFile << " from " << m_remote);
+            write_no_file(rp.m_hFile);
+            return;
+        }
         for (size_t i = 0; i < 3; ++i)
         {
             if (rp.m_begin_offset[i] < rp.m_end_offset[i])
@@ -2386,6 +2849,17 @@ void peer_connection::on_sending_part(const error_code& error)
             << " <== " << m_remote);
 
         peer_request r = mk_peer_request(sp.m_begin_offset, sp.m_end_offset);
+        boost::shared_ptr<transfer> t = m_transfer.lock();
+
+        if (!t || t->hash() != sp.m_hFile)
+        {
+            // late part of the file we have switched from
+            m_recv_pos = 0;
+            m_recv_req = r;
+            skip_data();
+            return;
+        }
+
         receive_data(r);
     }
     else
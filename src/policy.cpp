@@ -33,7 +33,7 @@ policy::policy(transfer* t): m_transfer(t)
 {
 }
 
-peer* policy::add_peer(const tcp::endpoint& ep)
+peer* policy::add_peer(const tcp::endpoint& ep, bool connectable)
 {
     aux::session_impl& ses = m_transfer->session();
 
@@ -68,11 +68,13 @@ peer* policy::add_peer(const tcp::endpoint& ep)
     {
         // we don't have any info about this peer.
         // add a new entry
+        if (int(m_peers.size()) >= ses.settings().max_peerlist_size)
+            return NULL;
 
         peer* p = (peer*)ses.m_peer_pool.malloc();
         if (p == 0) return NULL;
         ses.m_peer_pool.set_next_size(500);
-        new (p) peer(ep, false);
+        new (p) peer(ep, connectable);
 
         iter = m_peers.insert(iter, p);
         //if (m_round_robin >= iter - m_peers.begin()) ++m_round_robin;
@@ -113,7 +115,11 @@ bool policy::new_connection(peer_connection& c)
     {
         i = *iter;
 
-        // TODO: check banned
+        if (i->banned)
+        {
+            c.disconnect(errors::peer_banned);
+            return false;
+        }
 
         if (i->connection != 0)
         {
@@ -283,6 +289,55 @@ bool policy::connect_one_peer()
     return true;
 }
 
+void policy::share_connections()
+{
+    const aux::session_impl& ses = m_transfer->session();
+    std::vector<boost::intrusive_ptr<peer_connection> > connections;
+
+    for (peers_t::iterator i = m_peers.begin(), end(m_peers.end()); i != end; ++i)
+    {
+        if ((*i)->connection) continue;
+
+        boost::intrusive_ptr<peer_connection> c = ses.find_peer_connection((*i)->endpoint);
+        if (c && !c->is_disconnecting()) connections.push_back(c);
+    }
+
+    // the connection may attach to us right away and change the peer list
+    for (std::vector<boost::intrusive_ptr<peer_connection> >::iterator i = connections.begin(),
+             end(connections.end()); i != end; ++i)
+    {
+        (*i)->add_transfer(m_transfer->shared_from_this());
+    }
+}
+
+void policy::get_exchange_sources(std::vector<tcp::endpoint>& sources,
+                                  const ip::address& requester, size_t max_count) const
+{
+    // first pass takes connected peers only since they are known to be alive,
+    // the second one fills the rest with connectable peers from the list
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (peers_t::const_iterator i = m_peers.begin(), end(m_peers.end()); i != end; ++i)
+        {
+            if (sources.size() >= max_count) return;
+
+            const peer& p = **i;
+            if (p.address() == requester || !p.address().is_v4()) continue;
+
+            if (pass == 0 && p.connection)
+            {
+                // incoming connections have the listen port in the hello only
+                unsigned short port = p.connection->user_port();
+                if (port != 0) sources.push_back(tcp::endpoint(p.address(), port));
+            }
+            else if (pass == 1 && !p.connection && p.connectable)
+            {
+                sources.push_back(p.endpoint);
+            }
+        }
+    }
+}
+
 policy::peers_t::iterator policy::find_connect_candidate()
 {
     for(peers_t::iterator pi = m_peers.begin(); pi != m_peers.end(); ++pi)
@@ -294,7 +349,7 @@ policy::peers_t::iterator policy::find_connect_candidate()
 bool policy::is_connect_candidate(peer const& p) const
 {
     if (p.connection
-//        || p.banned
+        || p.banned
 //        || !p.connectable
 //        || (p.seed && finished)
 //        || int(p.failcount) >= m_transfer->settings().max_failcount
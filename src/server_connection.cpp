@@ -17,8 +17,13 @@ namespace libed2k
 
     typedef boost::iostreams::basic_array_source<char> Device;
 
-    server_connection::server_connection(aux::session_impl& ses):
+    server_connection::server_connection(aux::session_impl& ses,
+                                         const std::string& hostname, int port):
         m_last_keep_alive_packet(0),
+        m_last_connect_duration(0),
+        m_user_announced(false),
+        m_hostname(hostname),
+        m_port(port),
         m_state(SC_OFFLINE),
         m_nClientId(0),
         m_name_lookup(ses.m_io_service),
@@ -41,12 +46,9 @@ namespace libed2k
         STATE_CMP(SC_TO_ONLINE)
         m_state = SC_PROCESS;
 
-        const session_settings& settings = m_ses.settings();
-
         m_deadline.async_wait(boost::bind(&server_connection::check_deadline, self()));
 
-        tcp::resolver::query q(settings.server_hostname,
-                               boost::lexical_cast<std::string>(settings.server_port));
+        tcp::resolver::query q(m_hostname, boost::lexical_cast<std::string>(m_port));
 
         m_name_lookup.async_resolve(
             q, boost::bind(&server_connection::on_name_lookup, self(), _1, _2));
@@ -73,6 +75,7 @@ namespace libed2k
         m_nClientId = 0;
         m_nTCPFlags = 0;
         m_nAuxPort  = 0;
+        m_user_announced = false;
         m_ses.m_alerts.post_alert_should(server_connection_closed(ec));
     }
 
@@ -113,6 +116,15 @@ namespace libed2k
         do_write(offer_list);
     }
 
+    void server_connection::post_callback_request(boost::uint32_t client_id)
+    {
+        DBG("server_connection::post_callback_request(" << client_id << ")");
+        STATE_CMP(SC_TO_SERVER)
+        callback_request_out cbr;
+        cbr.m_nClientId = client_id;
+        do_write(cbr);
+    }
+
     void server_connection::check_keep_alive(int tick_interval_ms)
     {
         // keep alive only on online server and settings set keep alive packets
@@ -134,6 +146,27 @@ namespace libed2k
         do_write(sgl);
     }
 
+    void server_connection::check_reconnect(int tick_interval_ms)
+    {
+        // reconnect only offline server and when settings allow reconnects
+        if (SC_OFFLINE != m_state || m_ses.settings().server_reconnect_timeout == -1)
+        {
+            m_last_connect_duration = 0;
+            return;
+        }
+
+        m_last_connect_duration += tick_interval_ms;
+
+        if (m_last_connect_duration < m_ses.settings().server_reconnect_timeout*1000)
+        {
+            return;
+        }
+
+        DBG("reconnect to server: " << m_hostname << ":" << m_port);
+        m_last_connect_duration = 0;
+        start();
+    }
+
     void server_connection::on_name_lookup(
         const error_code& error, tcp::resolver::iterator i)
     {
@@ -143,7 +176,7 @@ namespace libed2k
 
         if (error || i == tcp::resolver::iterator())
         {
-            ERR("server name: " << settings.server_hostname
+            ERR("server name: " << m_hostname
                 << ", resolve failed: " << error);
             close(error);
             return;
@@ -215,6 +248,16 @@ namespace libed2k
                  sources.m_sources.m_collection.begin();
              i != sources.m_sources.m_collection.end(); ++i)
         {
+            if (isLowId(i->m_nIP))
+            {
+                // firewalled peer can only connect to us and
+                // two low id clients can't reach each other
+                if (isLowId(m_nClientId) || t->is_paused()) continue;
+                APP("found low id peer: " << i->m_nIP << ", request callback");
+                m_ses.request_callback(self(), i->m_nIP, sources.m_hFile);
+                continue;
+            }
+
             tcp::endpoint peer(
                 ip::address::from_string(int2ipstr(i->m_nIP)), i->m_nPort);
             APP("found peer: " << peer);
@@ -417,6 +460,18 @@ namespace libed2k
                         break;
                     }
                     case OP_CALLBACKREQUESTED:
+                    {
+                        callback_request_in cbr;
+                        ia >> cbr;
+                        DBG("callback requested by " << int2ipstr(cbr.m_network_point.m_nIP)
+                            << ":" << cbr.m_network_point.m_nPort);
+                        m_ses.on_callback_requested(cbr.m_network_point);
+                        break;
+                    }
+                    case OP_CALLBACK_FAIL:
+                        // the server doesn't tell which request failed,
+                        // pending callbacks expire by timeout
+                        DBG("callback request failed");
                         break;
                     default:
                         ERR("ignore unhandled packet: " << m_in_header.m_type);
@@ -29,6 +29,12 @@ namespace libed2k
         return m_impl->status();
     }
 
+    cache_status session::get_cache_status() const
+    {
+        boost::mutex::scoped_lock l(m_impl->m_mutex);
+        return m_impl->get_cache_status();
+    }
+
     transfer_handle session::add_transfer(const add_transfer_params& params)
     {
         boost::mutex::scoped_lock l(m_impl->m_mutex);
@@ -231,4 +237,14 @@ namespace libed2k
     {
         m_impl->m_tpm.cancel_transfer_params(filepath);
     }
+
+    void session::add_share_directory(const std::string& path, bool recursive)
+    {
+        m_impl->m_share_monitor.add_directory(path, recursive);
+    }
+
+    void session::remove_share_directory(const std::string& path)
+    {
+        m_impl->m_share_monitor.remove_directory(path);
+    }
 }
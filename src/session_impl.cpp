@@ -22,6 +22,43 @@
 namespace libed2k{
 namespace aux{
 
+// index of online server which announces transfer with given hash
+// highest random weight is used, so a server going online or offline
+// moves only its own share of transfers
+static size_t announce_server_index(
+    const md4_hash& hash, const session_impl::server_connection_list& servers)
+{
+    boost::uint32_t file_key = (hash[0] << 24) | (hash[1] << 16) | (hash[2] << 8) | hash[3];
+    size_t res = 0;
+    boost::uint32_t max_weight = 0;
+
+    for (size_t n = 0; n < servers.size(); ++n)
+    {
+        // FNV-1a of server address
+        boost::uint32_t w = 2166136261U;
+        const std::string& host = servers[n]->hostname();
+        for (std::string::const_iterator c = host.begin(); c != host.end(); ++c)
+            w = (w ^ boost::uint8_t(*c)) * 16777619U;
+        w = (w ^ boost::uint32_t(servers[n]->port())) * 16777619U;
+
+        // mix with file key
+        w ^= file_key;
+        w ^= w >> 16;
+        w *= 0x85ebca6bU;
+        w ^= w >> 13;
+        w *= 0xc2b2ae35U;
+        w ^= w >> 16;
+
+        if (n == 0 || w > max_weight)
+        {
+            max_weight = w;
+            res = n;
+        }
+    }
+
+    return res;
+}
+
 session_impl_base::session_impl_base(const session_settings& settings) :
     m_io_service(),
     m_abort(false),
@@ -29,7 +66,11 @@ session_impl_base::session_impl_base(const session_settings& settings) :
     m_transfers(),
     m_active_transfers(),
     m_alerts(m_io_service),
-    m_tpm(m_alerts, settings.m_known_file)
+    m_tpm(m_alerts, settings.m_known_file, settings.share_hashing_threads,
+          settings.share_hashing_read_ahead, settings.share_hashing_device_readers,
+          settings.known_file_max_age),
+    m_share_monitor(m_alerts, m_tpm, settings.share_monitor_stable_delay,
+          settings.share_monitor_poll_interval)
 {
 }
 
@@ -42,6 +83,7 @@ void session_impl_base::abort()
 {
     if (m_abort) return;
     m_abort = true;
+    m_share_monitor.stop();
     m_tpm.stop();
 }
 
@@ -88,20 +130,18 @@ session_impl::session_impl(const fingerprint& id, const char* listen_interface,
     m_peer_pool(500),
     m_send_buffers(send_buffer_size),
     m_skip_buffer(4096),
-    m_filepool(40),
+    m_filepool(settings.file_pool_size),
+    m_mappings(settings.mapped_storage_windows, settings.mapped_storage_flush_bytes),
     m_disk_thread(m_io_service, boost::bind(&session_impl::on_disk_queue, this), m_filepool, BLOCK_SIZE),
     m_half_open(m_io_service),
     m_download_rate(peer_connection::download_channel),
     m_upload_rate(peer_connection::upload_channel),
-    m_server_connection(new server_connection(*this)),
     m_next_connect_transfer(m_active_transfers),
     m_paused(false),
     m_second_timer(seconds(1)),
     m_timer(m_io_service),
     m_last_tick(time_now_hires()),
-    m_last_connect_duration(0),
     m_last_announce_duration(0),
-    m_user_announced(false),
     m_server_connection_state(SC_OFFLINE),
     m_total_failed_bytes(0),
     m_total_redundant_bytes(0)
@@ -220,6 +260,7 @@ session_impl::session_impl(const fingerprint& id, const char* listen_interface,
 
     update_rate_settings();
     update_connections_limit();
+    update_server_connections();
 
     m_io_service.post(boost::bind(&session_impl::on_tick, this, ec));
 
@@ -238,6 +279,9 @@ session_impl::~session_impl()
     // the main thread has handled all the outstanding requests
     // we know it's safe to destruct the disk thread.
     DBG("waiting for disk io thread");
+    for (std::vector<boost::shared_ptr<disk_io_thread> >::iterator i = m_device_threads.begin(),
+             end(m_device_threads.end()); i != end; ++i)
+        (*i)->join();
     m_disk_thread.join();
 
     DBG("waiting for main thread");
@@ -253,7 +297,7 @@ const session_settings& session_impl::settings() const
 
 void session_impl::set_settings(const session_settings& s)
 {
-    LIBED2K_ASSERT_VAL(s.file_pool_size > 0, s.file_pool_size);
+    LIBED2K_ASSERT_VAL(s.file_pool_size >= 0, s.file_pool_size);
 
     // if disk io thread settings were changed
     // post a notification to that thread
@@ -261,12 +305,16 @@ void session_impl::set_settings(const session_settings& s)
     if (m_settings.cache_size != s.cache_size
         || m_settings.cache_expiry != s.cache_expiry
         || m_settings.optimize_hashing_for_speed != s.optimize_hashing_for_speed
+        || m_settings.hashing_threads != s.hashing_threads
         || m_settings.file_checks_delay_per_block != s.file_checks_delay_per_block
+        || m_settings.move_storage_slice_size != s.move_storage_slice_size
         || m_settings.disk_cache_algorithm != s.disk_cache_algorithm
         || m_settings.read_cache_line_size != s.read_cache_line_size
         || m_settings.write_cache_line_size != s.write_cache_line_size
         || m_settings.coalesce_writes != s.coalesce_writes
         || m_settings.coalesce_reads != s.coalesce_reads
+        || m_settings.use_io_uring != s.use_io_uring
+        || m_settings.io_uring_queue_depth != s.io_uring_queue_depth
         || m_settings.max_queued_disk_bytes != s.max_queued_disk_bytes
         || m_settings.max_queued_disk_bytes_low_watermark != s.max_queued_disk_bytes_low_watermark
         || m_settings.disable_hash_checks != s.disable_hash_checks
@@ -283,11 +331,15 @@ void session_impl::set_settings(const session_settings& s)
         || m_settings.no_atime_storage!= s.no_atime_storage
         || m_settings.ignore_resume_timestamps != s.ignore_resume_timestamps
         || m_settings.no_recheck_incomplete_resume != s.no_recheck_incomplete_resume
+        || m_settings.quick_resume_verify != s.quick_resume_verify
         || m_settings.low_prio_disk != s.low_prio_disk
         || m_settings.lock_files != s.lock_files)
         update_disk_io_thread = true;
 
     bool connections_limit_changed = m_settings.connections_limit != s.connections_limit;
+    bool servers_changed = m_settings.server_hostname != s.server_hostname
+        || m_settings.server_port != s.server_port
+        || m_settings.additional_servers != s.additional_servers;
 
     if (m_settings.alert_queue_size != s.alert_queue_size)
         m_alerts.set_alert_queue_size_limit(s.alert_queue_size);
@@ -301,8 +353,12 @@ void session_impl::set_settings(const session_settings& s)
 
     if (connections_limit_changed) update_connections_limit();
 
+    if (servers_changed) update_server_connections();
+
     if (m_settings.connection_speed < 0) m_settings.connection_speed = 200;
 
+    m_mappings.set_limits(m_settings.mapped_storage_windows, m_settings.mapped_storage_flush_bytes);
+
     if (update_disk_io_thread)
         update_disk_thread_settings();
 }
@@ -317,7 +373,7 @@ void session_impl::operator()()
     {
         boost::mutex::scoped_lock l(m_mutex);
         open_listen_port();
-        m_server_connection->start();
+        server_conn_start();
     }
 
     m_tpm.start();
@@ -436,6 +492,64 @@ void session_impl::update_disk_thread_settings()
     j.buffer = (char*) new session_settings(m_settings);
     j.action = disk_io_job::update_settings;
     m_disk_thread.add_job(j);
+
+    for (std::vector<boost::shared_ptr<disk_io_thread> >::iterator i = m_device_threads.begin(),
+             end(m_device_threads.end()); i != end; ++i)
+    {
+        j.buffer = (char*) new session_settings(m_settings);
+        (*i)->add_job(j);
+    }
+}
+
+disk_io_thread& session_impl::disk_thread(const std::string& save_path)
+{
+    if (m_settings.disk_threads <= 1) return m_disk_thread;
+
+    boost::uint64_t device = path_device(save_path);
+    std::map<boost::uint64_t, int>::iterator i = m_device_thread_index.find(device);
+
+    if (i == m_device_thread_index.end())
+    {
+        int group = -1;
+        for (session_settings::path_groups::const_iterator g = m_settings.disk_thread_groups.begin(),
+                 end(m_settings.disk_thread_groups.end()); g != end; ++g)
+        {
+            if (path_device(g->first) == device) group = g->second;
+        }
+
+        std::map<int, int>::iterator gi = m_group_thread_index.find(group);
+        int index = 0;
+
+        if (group >= 0 && gi != m_group_thread_index.end())
+        {
+            index = gi->second;
+        }
+        else if (int(m_device_threads.size()) + 1 < m_settings.disk_threads
+            && !m_device_thread_index.empty())
+        {
+            // the first device takes m_disk_thread
+            m_device_threads.push_back(boost::shared_ptr<disk_io_thread>(new disk_io_thread(
+                m_io_service, boost::bind(&session_impl::on_disk_queue, this), m_filepool,
+                BLOCK_SIZE, &m_disk_thread)));
+            index = int(m_device_threads.size());
+
+            disk_io_job j;
+            j.buffer = (char*) new session_settings(m_settings);
+            j.action = disk_io_job::update_settings;
+            m_device_threads.back()->add_job(j);
+            DBG("started disk io thread " << index << " for device " << device);
+        }
+        else
+        {
+            // no threads left, devices share them round robin
+            index = int(m_device_thread_index.size() % (m_device_threads.size() + 1));
+        }
+
+        if (group >= 0) m_group_thread_index[group] = index;
+        i = m_device_thread_index.insert(std::make_pair(device, index)).first;
+    }
+
+    return i->second == 0 ? m_disk_thread : *m_device_threads[i->second - 1];
 }
 
 void session_impl::async_accept(boost::shared_ptr<ip::tcp::acceptor> const& listener)
@@ -549,9 +663,9 @@ void session_impl::incoming_connection(boost::shared_ptr<tcp::socket> const& s)
     if (!c->is_disconnecting())
     {
         // store connection in map only for real peers
-        if (m_server_connection->m_target.address() != endp.address())
+        if (!is_server_address(endp.address()))
         {
-            m_connections.insert(c);
+            add_connection(c);
         }
 
         c->start();
@@ -586,9 +700,14 @@ boost::weak_ptr<transfer> session_impl::find_transfer(const std::string& filenam
 
 boost::intrusive_ptr<peer_connection> session_impl::find_peer_connection(const net_identifier& np) const
 {
-    connection_map::const_iterator itr = std::find_if(
-        m_connections.begin(), m_connections.end(), boost::bind(&peer_connection::has_network_point, _1, np));
-    if (itr != m_connections.end())  {  return *itr; }
+    std::pair<connection_index::const_iterator, connection_index::const_iterator> range =
+        m_connection_index.equal_range(np.m_nIP);
+
+    for (connection_index::const_iterator i = range.first; i != range.second; ++i)
+    {
+        if (i->second->has_network_point(np)) return boost::intrusive_ptr<peer_connection>(i->second);
+    }
+
     return boost::intrusive_ptr<peer_connection>();
 }
 
@@ -650,7 +769,7 @@ void session_impl::queue_check_transfer(boost::shared_ptr<transfer> const& t)
     if (m_abort) return;
     LIBED2K_ASSERT(t->should_check_file());
     LIBED2K_ASSERT(t->state() != transfer_status::checking_files);
-    if (m_queued_for_checking.empty()) t->start_checking();
+    if (checking_devices().count(check_device(*t)) == 0) t->start_checking();
     else t->set_state(transfer_status::queued_for_checking);
 
     LIBED2K_ASSERT(
@@ -666,30 +785,78 @@ void session_impl::dequeue_check_transfer(boost::shared_ptr<transfer> const& t)
 
     if (m_queued_for_checking.empty()) return;
 
-    boost::shared_ptr<transfer> next_check = *m_queued_for_checking.begin();
-    check_queue_t::iterator done = m_queued_for_checking.end();
+    check_queue_t::iterator done = std::find(m_queued_for_checking.begin()
+        , m_queued_for_checking.end(), t);
+    LIBED2K_ASSERT(done != m_queued_for_checking.end());
+    if (done == m_queued_for_checking.end()) return;
+
+    m_queued_for_checking.erase(done);
+
+    // only start new ones if we removed one that is checking
+    if (t->state() == transfer_status::checking_files) start_queued_checks();
+}
+
+boost::uint64_t session_impl::check_device(const transfer& t) const
+{
+    // the disk thread checks all files itself when it hashes pieces
+    if (m_settings.hashing_threads == 0) return 0;
+    return path_device(t.save_path());
+}
+
+std::set<boost::uint64_t> session_impl::checking_devices() const
+{
+    std::set<boost::uint64_t> ret;
+    for (check_queue_t::const_iterator i = m_queued_for_checking.begin()
+        , end(m_queued_for_checking.end()); i != end; ++i)
+    {
+        if ((*i)->state() == transfer_status::checking_files)
+            ret.insert(check_device(**i));
+    }
+    return ret;
+}
+
+void session_impl::start_queued_checks()
+{
+    std::set<boost::uint64_t> busy = checking_devices();
+    std::vector<boost::shared_ptr<transfer> > queued;
+
     for (check_queue_t::iterator i = m_queued_for_checking.begin()
         , end(m_queued_for_checking.end()); i != end; ++i)
     {
-        LIBED2K_ASSERT(*i == t || (*i)->should_check_file());
-        if (*i == t) done = i;
-        if (next_check == t || next_check->queue_position() > (*i)->queue_position())
-            next_check = *i;
+        LIBED2K_ASSERT((*i)->should_check_file());
+        if ((*i)->state() == transfer_status::queued_for_checking) queued.push_back(*i);
     }
-    // only start a new one if we removed the one that is checking
-    LIBED2K_ASSERT(done != m_queued_for_checking.end());
-    if (done == m_queued_for_checking.end()) return;
 
-    if (next_check != t && t->state() == transfer_status::checking_files)
-        next_check->start_checking();
+    std::sort(queued.begin(), queued.end(), boost::bind(&transfer::queue_position, _1)
+        < boost::bind(&transfer::queue_position, _2));
 
-    m_queued_for_checking.erase(done);
+    for (std::vector<boost::shared_ptr<transfer> >::iterator i = queued.begin()
+        , end(queued.end()); i != end; ++i)
+    {
+        if (busy.insert(check_device(**i)).second) (*i)->start_checking();
+    }
+}
+
+void session_impl::add_connection(const boost::intrusive_ptr<peer_connection>& c)
+{
+    if (m_connections.insert(c).second)
+        m_connection_index.insert(std::make_pair(address2int(c->remote().address()), c.get()));
 }
 
 void session_impl::close_connection(const peer_connection* p, const error_code& ec)
 {
     assert(p->is_disconnecting());
 
+    std::pair<connection_index::iterator, connection_index::iterator> range =
+        m_connection_index.equal_range(address2int(p->remote().address()));
+
+    for (connection_index::iterator i = range.first; i != range.second; ++i)
+    {
+        if (i->second != p) continue;
+        m_connection_index.erase(i);
+        break;
+    }
+
     connection_map::iterator i =
         std::find_if(m_connections.begin(), m_connections.end(),
                      boost::bind(&boost::intrusive_ptr<peer_connection>::get, _1) == p);
@@ -733,6 +900,7 @@ transfer_handle session_impl::add_transfer(add_transfer_params const& params, er
     transfer_ptr->start();
 
     m_transfers.insert(std::make_pair(params.file_hash, transfer_ptr));
+    queue_announce(params.file_hash);
 
     transfer_handle handle(transfer_ptr);
     m_alerts.post_alert_should(added_transfer_alert(handle));
@@ -759,6 +927,10 @@ void session_impl::remove_transfer(const transfer_handle& h, int options)
 
         //t.set_queue_position(-1);
         m_transfers.erase(i);
+        unqueue_announce(hash);
+        for (server_connection_list::iterator j = m_server_connections.begin(),
+                 end(m_server_connections.end()); j != end; ++j)
+            (*j)->m_announced_files.erase(hash);
 
         m_alerts.post_alert_should(deleted_transfer_alert(hash));
     }
@@ -816,7 +988,7 @@ peer_connection_handle session_impl::add_peer_connection(net_identifier np, erro
     boost::intrusive_ptr<peer_connection> c(
         new peer_connection(*this, boost::weak_ptr<transfer>(), sock, endp, NULL));
 
-    m_connections.insert(c);
+    add_connection(c);
 
     m_half_open.enqueue(boost::bind(&peer_connection::connect, c, _1),
                         boost::bind(&peer_connection::on_timeout, c),
@@ -825,6 +997,98 @@ peer_connection_handle session_impl::add_peer_connection(net_identifier np, erro
     return (peer_connection_handle(c, this));
 }
 
+void session_impl::request_callback(boost::intrusive_ptr<server_connection> sc,
+                                    boost::uint32_t client_id, const md4_hash& hash)
+{
+    if (is_aborted() || m_paused) return;
+
+    callback_key key(net_identifier(sc->serverEndpoint()), client_id);
+
+    // callback is already on the way
+    if (m_pending_callbacks.find(key) != m_pending_callbacks.end()) return;
+
+    DBG("queue callback request {id: " << client_id << ", server: " << sc->serverEndpoint()
+        << ", file: " << hash << "}");
+
+    pending_callback& pc = m_pending_callbacks[key];
+    pc.server = sc;
+    pc.hash = hash;
+    pc.ticket = -1;
+
+    m_half_open.enqueue(boost::bind(&session_impl::on_callback_connect, this, key, _1),
+                        boost::bind(&session_impl::on_callback_timeout, this, key),
+                        libed2k::seconds(m_settings.peer_callback_timeout));
+}
+
+void session_impl::on_callback_connect(callback_key key, int ticket)
+{
+    boost::mutex::scoped_lock l(m_mutex);
+
+    std::map<callback_key, pending_callback>::iterator i = m_pending_callbacks.find(key);
+
+    if (i == m_pending_callbacks.end())
+    {
+        m_half_open.done(ticket);
+        return;
+    }
+
+    // the peer can be asked only through the server it is logged on
+    if (!i->second.server->online())
+    {
+        DBG("callback server went offline {id: " << key.second << "}");
+        m_half_open.done(ticket);
+        m_pending_callbacks.erase(i);
+        return;
+    }
+
+    i->second.ticket = ticket;
+    i->second.server->post_callback_request(key.second);
+}
+
+void session_impl::on_callback_timeout(callback_key key)
+{
+    boost::mutex::scoped_lock l(m_mutex);
+    DBG("callback timed out {id: " << key.second << "}");
+    m_pending_callbacks.erase(key);
+}
+
+bool session_impl::accept_callback(const net_identifier& server, boost::uint32_t client_id, md4_hash& hash)
+{
+    std::map<callback_key, pending_callback>::iterator i =
+        m_pending_callbacks.find(callback_key(server, client_id));
+    if (i == m_pending_callbacks.end()) return false;
+
+    DBG("callback accepted {id: " << client_id << ", file: " << i->second.hash << "}");
+    if (i->second.ticket >= 0) m_half_open.done(i->second.ticket);
+    hash = i->second.hash;
+    m_pending_callbacks.erase(i);
+    return true;
+}
+
+void session_impl::on_callback_requested(const net_identifier& np)
+{
+    tcp::endpoint endp(ip::address::from_string(int2ipstr(np.m_nIP)), np.m_nPort);
+
+    if (m_ip_filter.access(endp.address()) & ip_filter::blocked)
+    {
+        DBG("filtered blocked callback ip " << endp);
+        m_alerts.post_alert_should(peer_blocked_alert(transfer_handle(), endp.address()));
+        return;
+    }
+
+    if (num_connections() >= max_connections())
+    {
+        DBG("number of connections limit exceeded, callback to " << endp << " rejected");
+        return;
+    }
+
+    DBG("callback to " << endp);
+
+    // outgoing connection without transfer, the peer tells which file it wants
+    error_code ec;
+    add_peer_connection(np, ec);
+}
+
 std::pair<char*, int> session_impl::allocate_buffer(int size)
 {
     int num_buffers = (size + send_buffer_size - 1) / send_buffer_size;
@@ -873,6 +1137,55 @@ std::string session_impl::buffer_usage()
             % (used_send_buffer * 100.f / send_buffer_capacity)).str();
 }
 
+cache_status session_impl::get_cache_status() const
+{
+    cache_status ret = m_disk_thread.status();
+
+    // buffers and file handles are shared, they're counted by each thread
+    for (std::vector<boost::shared_ptr<disk_io_thread> >::const_iterator i = m_device_threads.begin(),
+             end(m_device_threads.end()); i != end; ++i)
+    {
+        cache_status s = (*i)->status();
+        ret.blocks_written += s.blocks_written;
+        ret.writes += s.writes;
+        ret.blocks_read += s.blocks_read;
+        ret.blocks_read_hit += s.blocks_read_hit;
+        ret.reads += s.reads;
+        ret.queued_bytes += s.queued_bytes;
+        ret.cache_size += s.cache_size;
+        ret.read_cache_size += s.read_cache_size;
+        ret.average_queue_time += s.average_queue_time;
+        ret.average_read_time += s.average_read_time;
+        ret.average_write_time += s.average_write_time;
+        ret.average_hash_time += s.average_hash_time;
+        ret.average_job_time += s.average_job_time;
+        ret.average_sort_time += s.average_sort_time;
+        ret.job_queue_length += s.job_queue_length;
+        ret.cumulative_job_time += s.cumulative_job_time;
+        ret.cumulative_read_time += s.cumulative_read_time;
+        ret.cumulative_write_time += s.cumulative_write_time;
+        ret.cumulative_hash_time += s.cumulative_hash_time;
+        ret.cumulative_sort_time += s.cumulative_sort_time;
+        ret.total_read_back += s.total_read_back;
+        ret.read_queue_size += s.read_queue_size;
+        ret.read_cache_misses += s.read_cache_misses;
+        ret.recent_ghost_hits += s.recent_ghost_hits;
+        ret.frequent_ghost_hits += s.frequent_ghost_hits;
+        ret.frequent_cache_size += s.frequent_cache_size;
+        ret.recent_cache_target += s.recent_cache_target;
+    }
+
+    int threads = int(m_device_threads.size()) + 1;
+    ret.average_queue_time /= threads;
+    ret.average_read_time /= threads;
+    ret.average_write_time /= threads;
+    ret.average_hash_time /= threads;
+    ret.average_job_time /= threads;
+    ret.average_sort_time /= threads;
+
+    return ret;
+}
+
 session_status session_impl::status() const
 {
     session_status s;
@@ -919,7 +1232,38 @@ session_status session_impl::status() const
 
 const tcp::endpoint& session_impl::server() const
 {
-    return m_server_connection->m_target;
+    return current_server()->m_target;
+}
+
+boost::intrusive_ptr<server_connection> session_impl::current_server() const
+{
+    boost::intrusive_ptr<server_connection> res = m_server_connections.front();
+
+    for (server_connection_list::const_iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
+    {
+        if (!(*i)->online()) continue;
+        if (!isLowId((*i)->client_id())) return *i;
+        if (!res->online()) res = *i;
+    }
+
+    return res;
+}
+
+boost::uint32_t session_impl::client_id() const
+{
+    return current_server()->client_id();
+}
+
+bool session_impl::is_server_address(const ip::address& addr) const
+{
+    for (server_connection_list::const_iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
+    {
+        if ((*i)->m_target.address() == addr) return true;
+    }
+
+    return false;
 }
 
 void session_impl::abort()
@@ -949,9 +1293,12 @@ void session_impl::abort()
         t.abort();
     }
 
-    DBG("aborting all server requests");
-    //m_server_connection.abort_all_requests();
-    m_server_connection->close(errors::session_closing);
+    DBG("aborting all server requests (" << m_server_connections.size() << ")");
+    for (server_connection_list::iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
+    {
+        (*i)->close(errors::session_closing);
+    }
 
     DBG("aborting all connections (" << m_connections.size() << ")");
 
@@ -974,6 +1321,10 @@ void session_impl::abort()
     m_upload_rate.close();
 
     m_disk_thread.abort();
+
+    for (std::vector<boost::shared_ptr<disk_io_thread> >::iterator i = m_device_threads.begin(),
+             end(m_device_threads.end()); i != end; ++i)
+        (*i)->abort();
 }
 
 void session_impl::pause()
@@ -1059,32 +1410,50 @@ void session_impl::on_tick(error_code const& e)
     // TODO: should it be implemented?
 
     // --------------------------------------------------------------
-    // server connection
+    // server connections
     // --------------------------------------------------------------
     // we always check status changing because it check before reconnect processing
-    bool server_conn_change_state = m_server_connection_state != m_server_connection->state();
-    if (server_conn_change_state)
+    char server_state = SC_OFFLINE;
+    server_connection_list online_servers;
+
+    for (server_connection_list::const_iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
     {
-        m_server_connection_state = m_server_connection->state();
+        if ((*i)->online()) online_servers.push_back(*i);
+        else if ((*i)->connecting()) server_state = SC_PROCESS;
+    }
+
+    if (!online_servers.empty()) server_state = SC_ONLINE;
+    m_server_connection_state = server_state;
 
-        // when server connection changes its state to offline -
-        // we drop announces status for all transfers
-        if (m_server_connection->offline())
+    // transfers are partitioned over online servers for announcing -
+    // offers on servers which went offline are lost, those transfers go back
+    // to announce queue. Server which came online again could lose offers
+    // between ticks, so its transfers are announced again too, and it takes
+    // back its share from the others
+    if (online_servers != m_announce_servers)
+    {
+        for (server_connection_list::iterator i = m_server_connections.begin(),
+                 end(m_server_connections.end()); i != end; ++i)
         {
-            for (transfer_map::iterator i = m_transfers.begin(),
-                     end(m_transfers.end()); i != end; ++i)
-            {
-                transfer& t = *i->second;
-                t.set_announced(false);
-            }
+            bool was_online = std::find(m_announce_servers.begin(),
+                m_announce_servers.end(), *i) != m_announce_servers.end();
+            if (!(*i)->online() || !was_online) drop_server_announces(**i);
         }
+
+        m_announce_servers.swap(online_servers);
+        rebalance_announces();
     }
 
-    if (m_server_connection->online()) announce(tick_interval_ms);
+    if (!m_announce_servers.empty()) announce(tick_interval_ms);
 
     reconnect(tick_interval_ms);
 
-    m_server_connection->check_keep_alive(tick_interval_ms);
+    for (server_connection_list::iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
+    {
+        (*i)->check_keep_alive(tick_interval_ms);
+    }
 
     update_active_transfers();
 
@@ -1256,23 +1625,81 @@ session_impl::listen_socket_t session_impl::setup_listener(
 
 void session_impl::post_search_request(search_request& ro)
 {
-    m_server_connection->post_search_request(ro);
+    current_server()->post_search_request(ro);
 }
 
 void session_impl::post_search_more_result_request()
 {
-    m_server_connection->post_search_more_result_request();
+    current_server()->post_search_more_result_request();
 }
 
 void session_impl::post_cancel_search()
 {
     shared_files_list sl;
-    m_server_connection->post_announce(sl);
+    current_server()->post_announce(sl);
 }
 
 void session_impl::post_sources_request(const md4_hash& hFile, boost::uint64_t nSize)
 {
-    m_server_connection->post_sources_request(hFile, nSize);
+    // sources from all servers are merged in transfer's policy
+    for (server_connection_list::iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
+    {
+        (*i)->post_sources_request(hFile, nSize);
+    }
+}
+
+void session_impl::queue_announce(const md4_hash& hash)
+{
+    if (m_announce_queued.find(hash) != m_announce_queued.end()) return;
+    m_announce_queued[hash] = m_announce_queue.insert(m_announce_queue.end(), hash);
+}
+
+void session_impl::unqueue_announce(const md4_hash& hash)
+{
+    std::map<md4_hash, std::list<md4_hash>::iterator>::iterator i = m_announce_queued.find(hash);
+    if (i == m_announce_queued.end()) return;
+    m_announce_queue.erase(i->second);
+    m_announce_queued.erase(i);
+}
+
+void session_impl::drop_server_announces(server_connection& sc)
+{
+    for (std::set<md4_hash>::const_iterator i = sc.m_announced_files.begin(),
+             end(sc.m_announced_files.end()); i != end; ++i)
+    {
+        boost::shared_ptr<transfer> t = find_transfer(*i).lock();
+        if (!t) continue;
+        t->set_announced(false);
+        queue_announce(*i);
+    }
+
+    sc.m_announced_files.clear();
+    sc.m_user_announced = false;
+}
+
+void session_impl::rebalance_announces()
+{
+    for (size_t n = 0; n < m_announce_servers.size(); ++n)
+    {
+        server_connection& sc = *m_announce_servers[n];
+        bool moved = false;
+
+        for (std::set<md4_hash>::const_iterator i = sc.m_announced_files.begin(),
+                 end(sc.m_announced_files.end()); i != end && !moved; ++i)
+        {
+            moved = announce_server_index(*i, m_announce_servers) != n;
+        }
+
+        if (!moved) continue;
+
+        // offers can't be withdrawn one by one - empty offer list clears
+        // all of them, the transfers still belonging here are announced again
+        DBG("session_impl::rebalance_announces: withdraw offers on " << sc.hostname());
+        shared_files_list sl;
+        sc.post_announce(sl);
+        drop_server_announces(sc);
+    }
 }
 
 void session_impl::announce(int tick_interval_ms)
@@ -1293,131 +1720,193 @@ void session_impl::announce(int tick_interval_ms)
 
     m_last_announce_duration = 0;
 
-    shared_files_list offer_list;
+    // one offer list for each online server
+    std::vector<shared_files_list> offer_lists(m_announce_servers.size());
+    size_t full_lists = 0;
 
-    for (transfer_map::const_iterator i = m_transfers.begin(); i != m_transfers.end(); ++i)
+    // transfers are taken in order they were queued, the ones whose server
+    // got enough offers keep their places
+    for (std::list<md4_hash>::iterator i = m_announce_queue.begin();
+         i != m_announce_queue.end() && full_lists < offer_lists.size();)
     {
+        boost::shared_ptr<transfer> t = find_transfer(*i).lock();
+
+        if (!t)
+        {
+            m_announce_queued.erase(*i);
+            m_announce_queue.erase(i++);
+            continue;
+        }
+
+        size_t n = announce_server_index(*i, m_announce_servers);
+        shared_files_list& offer_list = offer_lists[n];
+
         // we send no more m_max_announces_per_call elements in one packet
         if (offer_list.m_collection.size() >= m_settings.m_max_announces_per_call)
         {
-            break;
+            ++i;
+            continue;
         }
 
-        transfer& t = *i->second;
+        // transfer in checking state has empty announce,
+        // it will be queued again on state change
+        shared_file_entry se = t->getAnnounce(*m_announce_servers[n]);
 
-        // add transfer to announce list when it has one piece at least and it is not announced yet
-        if (!t.is_announced())
+        if (!se.is_empty())
         {
-            shared_file_entry se = t.getAnnounce();
+            offer_list.add(se);
+            t->set_announced(true); // mark transfer as announced
+            m_announce_servers[n]->m_announced_files.insert(*i);
 
-            if (!se.is_empty())
-            {
-                offer_list.add(se);
-                t.set_announced(true); // mark transfer as announced
-            }
+            if (offer_list.m_collection.size() == m_settings.m_max_announces_per_call)
+                ++full_lists;
         }
-    }
 
-    if (offer_list.m_size > 0)
-    {
-        DBG("session_impl::announce: " << offer_list.m_size);
-        m_server_connection->post_announce(offer_list);
+        m_announce_queued.erase(*i);
+        m_announce_queue.erase(i++);
     }
 
-    // generate announce for user as transfer when all transfers were announced but user wasn't
-    // NOTE - new_announces don't work since server doesn't update users transfer information after first announce
-    if ((offer_list.m_size == 0) && !m_user_announced)
+    for (size_t n = 0; n < m_announce_servers.size(); ++n)
     {
-        DBG("all transfer probably ware announced - announce user with correct size");
-        __file_size total_size;
-        total_size.nQuadPart = 0;
+        server_connection& sc = *m_announce_servers[n];
+        shared_files_list& offer_list = offer_lists[n];
 
-        for (transfer_map::const_iterator i = m_transfers.begin(); i != m_transfers.end(); ++i)
+        if (offer_list.m_size > 0)
         {
-            transfer& t = *i->second;
-            total_size.nQuadPart += t.size();
+            DBG("session_impl::announce: " << offer_list.m_size << " on " << sc.hostname());
+            sc.post_announce(offer_list);
         }
 
-        shared_file_entry se;
-        se.m_hFile = m_settings.user_agent;
-
-        if (m_server_connection->tcp_flags() & SRV_TCPFLG_COMPRESSION)
-        {
-            // publishing an incomplete file
-            se.m_network_point.m_nIP    = 0xFBFBFBFB;
-            se.m_network_point.m_nPort  = 0xFBFB;
-        }
-        else
+        // generate announce for user as transfer when all transfers were announced but user wasn't
+        // NOTE - new_announces don't work since server doesn't update users transfer information after first announce
+        if ((offer_list.m_size == 0) && !sc.m_user_announced)
         {
-            se.m_network_point.m_nIP     = m_server_connection->client_id();
-            se.m_network_point.m_nPort   = settings().listen_port;
-        }
+            DBG("all transfer probably ware announced - announce user with correct size on " << sc.hostname());
+            __file_size total_size;
+            total_size.nQuadPart = 0;
 
-        // file name is user name with special mark
-        se.m_list.add_tag(make_string_tag(std::string("+++USERNICK+++ ") + m_settings.client_name, FT_FILENAME, true));
-        se.m_list.add_tag(make_typed_tag(m_server_connection->client_id(), FT_FILESIZE, true));
+            for (transfer_map::const_iterator i = m_transfers.begin(); i != m_transfers.end(); ++i)
+            {
+                transfer& t = *i->second;
+                total_size.nQuadPart += t.size();
+            }
 
-        // write users size
-        if (m_server_connection->tcp_flags() & SRV_TCPFLG_NEWTAGS)
-        {
-            se.m_list.add_tag(make_typed_tag(total_size.nLowPart, FT_MEDIA_LENGTH, true));
-            se.m_list.add_tag(make_typed_tag(total_size.nHighPart, FT_MEDIA_BITRATE, true));
-        }
-        else
-        {
-            se.m_list.add_tag(make_typed_tag(total_size.nLowPart, FT_ED2K_MEDIA_LENGTH, false));
-            se.m_list.add_tag(make_typed_tag(total_size.nHighPart, FT_ED2K_MEDIA_BITRATE, false));
-        }
+            shared_file_entry se;
+            se.m_hFile = m_settings.user_agent;
 
-        offer_list.add(se);
-        m_server_connection->post_announce(offer_list);
-        m_user_announced = true;
+            if (sc.tcp_flags() & SRV_TCPFLG_COMPRESSION)
+            {
+                // publishing an incomplete file
+                se.m_network_point.m_nIP    = 0xFBFBFBFB;
+                se.m_network_point.m_nPort  = 0xFBFB;
+            }
+            else
+            {
+                se.m_network_point.m_nIP     = sc.client_id();
+                se.m_network_point.m_nPort   = settings().listen_port;
+            }
+
+            // file name is user name with special mark
+            se.m_list.add_tag(make_string_tag(std::string("+++USERNICK+++ ") + m_settings.client_name, FT_FILENAME, true));
+            se.m_list.add_tag(make_typed_tag(sc.client_id(), FT_FILESIZE, true));
+
+            // write users size
+            if (sc.tcp_flags() & SRV_TCPFLG_NEWTAGS)
+            {
+                se.m_list.add_tag(make_typed_tag(total_size.nLowPart, FT_MEDIA_LENGTH, true));
+                se.m_list.add_tag(make_typed_tag(total_size.nHighPart, FT_MEDIA_BITRATE, true));
+            }
+            else
+            {
+                se.m_list.add_tag(make_typed_tag(total_size.nLowPart, FT_ED2K_MEDIA_LENGTH, false));
+                se.m_list.add_tag(make_typed_tag(total_size.nHighPart, FT_ED2K_MEDIA_BITRATE, false));
+            }
+
+            offer_list.add(se);
+            sc.post_announce(offer_list);
+            sc.m_user_announced = true;
+        }
     }
 }
 
 void session_impl::reconnect(int tick_interval_ms)
 {
+    for (server_connection_list::iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
+    {
+        (*i)->check_reconnect(tick_interval_ms);
+    }
+}
 
-    if (m_settings.server_reconnect_timeout == -1)
+void session_impl::server_conn_start()
+{
+    for (server_connection_list::iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
     {
-        // do not execute reconnect - feature turned off
-        return;
+        (*i)->start();
     }
+}
 
-    if (!m_server_connection->offline())
+void session_impl::server_conn_stop()
+{
+    // announces of stopped servers are queued again on next tick
+    for (server_connection_list::iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
     {
-        m_last_connect_duration = 0;
-        return;
+        (*i)->stop();
     }
+}
 
-    m_last_connect_duration += tick_interval_ms;
+void session_impl::update_server_connections()
+{
+    session_settings::server_list servers;
+    servers.push_back(std::make_pair(m_settings.server_hostname, m_settings.server_port));
 
-    if (m_last_connect_duration < m_settings.server_reconnect_timeout*1000)
+    for (session_settings::server_list::const_iterator i = m_settings.additional_servers.begin(),
+             end(m_settings.additional_servers.end()); i != end; ++i)
     {
-        return;
+        if (!i->first.empty() && std::find(servers.begin(), servers.end(), *i) == servers.end())
+            servers.push_back(*i);
     }
 
-    // perform reconnect
-    m_last_connect_duration = 0;
-    m_server_connection->start();
-}
+    server_connection_list conns;
 
-void session_impl::server_conn_start()
-{
-    m_server_connection->start();
-}
+    for (session_settings::server_list::const_iterator i = servers.begin(),
+             end(servers.end()); i != end; ++i)
+    {
+        // keep existing connection to the same server
+        server_connection_list::iterator c = std::find_if(
+            m_server_connections.begin(), m_server_connections.end(),
+            boost::bind(&server_connection::hostname, _1) == i->first &&
+            boost::bind(&server_connection::port, _1) == i->second);
 
-void session_impl::server_conn_stop()
-{
-    m_server_connection->stop();
+        if (c != m_server_connections.end())
+        {
+            conns.push_back(*c);
+            m_server_connections.erase(c);
+        }
+        else
+        {
+            conns.push_back(new server_connection(*this, i->first, i->second));
+            // session already works - new server starts immediately
+            if (is_listening()) conns.back()->start();
+        }
+    }
 
-    for (transfer_map::iterator i = m_transfers.begin(); i != m_transfers.end(); ++i)
+    // connections to servers removed from settings
+    for (server_connection_list::iterator i = m_server_connections.begin(),
+             end(m_server_connections.end()); i != end; ++i)
     {
-        transfer& t = *i->second;
-        t.set_announced(false);
+        (*i)->stop();
+        drop_server_announces(**i);
     }
 
-    m_user_announced = false;
+    m_announce_servers.erase(
+        std::remove_if(m_announce_servers.begin(), m_announce_servers.end(),
+                       !boost::bind(&server_connection::online, _1)),
+        m_announce_servers.end());
+
+    m_server_connections.swap(conns);
 }
 
 void session_impl::update_connections_limit()
@@ -1430,7 +1919,7 @@ void session_impl::update_connections_limit()
         if (getrlimit(RLIMIT_NOFILE, &l) == 0
             && l.rlim_cur != RLIM_INFINITY)
         {
-            m_settings.connections_limit = l.rlim_cur - m_settings.file_pool_size;
+            m_settings.connections_limit = l.rlim_cur - m_filepool.size_limit();
             if (m_settings.connections_limit < 5) m_settings.connections_limit = 5;
         }
 #endif
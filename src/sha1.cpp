@@ -0,0 +1,171 @@
+/*
+ * SHA-1 (FIPS 180-1) message digest.
+ *
+ * Straightforward implementation following the structure of md4.cpp:
+ * 64 byte blocks are read big-endian into a 16 word ring, no compile-time
+ * endianness configuration is needed. Placed in the public domain.
+ */
+
+#include "libed2k/sha1.hpp"
+#include <string.h>
+
+namespace libed2k{
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+ * GET reads 4 input bytes in big-endian byte order.
+ */
+#define GET(p, n) \
+	(((boost::uint32_t)(p)[(n) * 4] << 24) | \
+	((boost::uint32_t)(p)[(n) * 4 + 1] << 16) | \
+	((boost::uint32_t)(p)[(n) * 4 + 2] << 8) | \
+	(boost::uint32_t)(p)[(n) * 4 + 3])
+
+/*
+ * This processes one or more 64-byte data blocks, but does NOT update
+ * the bit counters.  There are no alignment requirements.
+ */
+static const unsigned char* body(struct sha1_context *ctx, const unsigned char *data, size_t size)
+{
+	boost::uint32_t w[16];
+	boost::uint32_t a, b, c, d, e, f, k, t;
+
+	do {
+		a = ctx->state[0];
+		b = ctx->state[1];
+		c = ctx->state[2];
+		d = ctx->state[3];
+		e = ctx->state[4];
+
+		for (int i = 0; i < 80; ++i) {
+			if (i < 16) {
+				w[i] = GET(data, i);
+			} else {
+				t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15];
+				w[i & 15] = ROTL(t, 1);
+			}
+
+			if (i < 20) {
+				f = d ^ (b & (c ^ d));
+				k = 0x5A827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+
+			t = ROTL(a, 5) + f + e + k + w[i & 15];
+			e = d;
+			d = c;
+			c = ROTL(b, 30);
+			b = a;
+			a = t;
+		}
+
+		ctx->state[0] += a;
+		ctx->state[1] += b;
+		ctx->state[2] += c;
+		ctx->state[3] += d;
+		ctx->state[4] += e;
+
+		data += 64;
+	} while (size -= 64);
+
+	return data;
+}
+
+void sha1_init(struct sha1_context *ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xEFCDAB89;
+	ctx->state[2] = 0x98BADCFE;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xC3D2E1F0;
+
+	ctx->lo = 0;
+	ctx->hi = 0;
+}
+
+void sha1_update(struct sha1_context *ctx, const unsigned char *data, size_t size)
+{
+	boost::uint32_t saved_lo;
+	size_t used, free;
+
+	saved_lo = ctx->lo;
+	if ((ctx->lo = (saved_lo + size) & 0x1fffffff) < saved_lo)
+		ctx->hi++;
+	ctx->hi += size >> 29;
+
+	used = saved_lo & 0x3f;
+
+	if (used) {
+		free = 64 - used;
+
+		if (size < free) {
+			memcpy(&ctx->buffer[used], data, size);
+			return;
+		}
+
+		memcpy(&ctx->buffer[used], data, free);
+		data += free;
+		size -= free;
+		body(ctx, ctx->buffer, 64);
+	}
+
+	if (size >= 64) {
+		data = body(ctx, data, size & ~(size_t)0x3f);
+		size &= 0x3f;
+	}
+
+	memcpy(ctx->buffer, data, size);
+}
+
+void sha1_final(struct sha1_context *ctx, unsigned char result[SHA1_HASH_SIZE])
+{
+	size_t used, free;
+
+	used = ctx->lo & 0x3f;
+
+	ctx->buffer[used++] = 0x80;
+
+	free = 64 - used;
+
+	if (free < 8) {
+		memset(&ctx->buffer[used], 0, free);
+		body(ctx, ctx->buffer, 64);
+		used = 0;
+		free = 64;
+	}
+
+	memset(&ctx->buffer[used], 0, free - 8);
+
+	// bit length, big-endian
+	ctx->lo <<= 3;
+	ctx->buffer[56] = ctx->hi >> 24;
+	ctx->buffer[57] = ctx->hi >> 16;
+	ctx->buffer[58] = ctx->hi >> 8;
+	ctx->buffer[59] = ctx->hi;
+	ctx->buffer[60] = ctx->lo >> 24;
+	ctx->buffer[61] = ctx->lo >> 16;
+	ctx->buffer[62] = ctx->lo >> 8;
+	ctx->buffer[63] = ctx->lo;
+
+	body(ctx, ctx->buffer, 64);
+
+	for (int i = 0; i < 5; ++i) {
+		result[i * 4] = ctx->state[i] >> 24;
+		result[i * 4 + 1] = ctx->state[i] >> 16;
+		result[i * 4 + 2] = ctx->state[i] >> 8;
+		result[i * 4 + 3] = ctx->state[i];
+	}
+
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+}
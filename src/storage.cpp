@@ -409,7 +409,11 @@ namespace libed2k
         m_save_path = complete(path);
     }
 
-    default_storage::~default_storage() { m_pool.release(this); }
+    default_storage::~default_storage()
+    {
+        abandon_move();
+        m_pool.release(this);
+    }
 
     bool default_storage::initialize(bool allocate_files)
     {
@@ -512,6 +516,7 @@ namespace libed2k
     bool default_storage::rename_file(int index, std::string const& new_filename)
     {
         if (index < 0 || index >= files().num_files()) return true;
+        abandon_move();
         std::string old_name = combine_path(m_save_path, files().file_path(files().at(index)));
         m_pool.release(this, index);
 
@@ -550,6 +555,7 @@ namespace libed2k
 
     bool default_storage::delete_files()
     {
+        abandon_move();
         // make sure we don't have the files open
         m_pool.release(this);
 
@@ -755,6 +761,7 @@ namespace libed2k
     // returns true on success
     bool default_storage::move_storage(std::string const& sp)
     {
+        abandon_move();
         std::string save_path = complete(sp);
 
         error_code ec;
@@ -807,6 +814,245 @@ namespace libed2k
         return ret;
     }
 
+    int default_storage::move_storage_some(std::string const& sp, bool start
+        , size_type& moved, size_type& total)
+    {
+        std::string save_path = complete(sp);
+        error_code ec;
+
+        if (start)
+        {
+            abandon_move();
+
+            // within a device the files are renamed, that's quick
+            if (path_device(save_path) == path_device(m_save_path))
+                return move_storage(save_path) ? 0 : -1;
+
+            create_directories(save_path, ec);
+            if (ec)
+            {
+                set_error(save_path, ec);
+                return -1;
+            }
+
+            m_move.reset(new move_state);
+            m_move->save_path = save_path;
+            m_move->current = 0;
+            m_move->offset = 0;
+            m_move->moved = 0;
+            m_move->total = 0;
+            m_move->dirty.assign(m_files.num_pieces(), false);
+
+            std::set<std::string> to_remove;
+            file_storage const& f = files();
+            for (file_storage::iterator i = f.begin(), end(f.end()); i != end; ++i)
+            {
+                if (i->pad_file) continue;
+                std::string path = f.file_path(*i);
+                to_remove.insert(split_path(path).c_str());
+
+                // files not written yet are created at the new path
+                move_state::moved_file mf;
+                mf.index = f.file_index(*i);
+                mf.from = combine_path(m_save_path, path);
+                mf.to = combine_path(save_path, path);
+                mf.size = i->size;
+                if (!exists(mf.from)) continue;
+                m_move->files.push_back(mf);
+                m_move->total += mf.size;
+            }
+            m_move->remove.assign(to_remove.begin(), to_remove.end());
+        }
+        else if (!m_move || m_move->save_path != save_path)
+        {
+            // another move replaced this one
+            set_error(save_path, error_code(boost::asio::error::operation_aborted));
+            return -1;
+        }
+
+        size_type budget = 16 * 1024 * 1024;
+        if (m_settings && settings().move_storage_slice_size > 0)
+            budget = settings().move_storage_slice_size;
+        while (m_move->current < int(m_move->files.size()) && budget > 0)
+        {
+            move_state::moved_file const& mf = m_move->files[m_move->current];
+            if (!m_move->from)
+            {
+                m_move->from = new file(mf.from, file::read_only, ec);
+                if (!ec) create_directories(parent_path(mf.to), ec);
+                if (!ec) m_move->to = new file(mf.to, file::read_write, ec);
+                if (ec)
+                {
+                    set_error(m_move->to ? mf.to : mf.from, ec);
+                    abandon_move();
+                    return -1;
+                }
+
+                // filesystems with reflinks share the data instead, subvolumes
+                // of btrfs are devices of their own
+                if (clone_file(*m_move->from, *m_move->to))
+                {
+                    m_move->moved += mf.size - m_move->offset;
+                    m_move->offset = mf.size;
+                }
+            }
+
+            while (m_move->offset < mf.size && budget > 0)
+            {
+                size_type n = copy_range(*m_move->from, *m_move->to, m_move->offset
+                    , (std::min)(budget, mf.size - m_move->offset), ec);
+                if (ec)
+                {
+                    set_error(mf.to, ec);
+                    abandon_move();
+                    return -1;
+                }
+
+                // the rest of the file isn't there yet, slots written
+                // there later are copied again
+                if (n == 0) n = mf.size - m_move->offset;
+                m_move->offset += n;
+                m_move->moved += n;
+                budget -= n;
+            }
+            if (m_move->offset < mf.size) break;
+
+            // the transfer is switched to the copy only once it's on the disk
+            if (!m_move->to->sync(ec))
+            {
+                set_error(mf.to, ec);
+                abandon_move();
+                return -1;
+            }
+            m_move->from.reset();
+            m_move->to.reset();
+            ++m_move->current;
+            m_move->offset = 0;
+        }
+
+        while (m_move->current == int(m_move->files.size()) && budget > 0)
+        {
+            std::vector<bool>::iterator d = std::find(m_move->dirty.begin(), m_move->dirty.end(), true);
+            if (d == m_move->dirty.end()) break;
+
+            int slot = int(d - m_move->dirty.begin());
+            *d = false;
+            if (!copy_moved_slot(slot))
+            {
+                abandon_move();
+                return -1;
+            }
+            m_move->moved += m_files.piece_size(slot);
+            budget -= m_files.piece_size(slot);
+        }
+
+        moved = m_move->moved;
+        total = m_move->total;
+        if (m_move->current < int(m_move->files.size())
+            || std::find(m_move->dirty.begin(), m_move->dirty.end(), true) != m_move->dirty.end())
+            return 1;
+
+        m_pool.release(this);
+        for (std::vector<std::string>::const_iterator i = m_move->remove.begin()
+            , end(m_move->remove.end()); i != end; ++i)
+        {
+            remove_all(combine_path(m_save_path, *i), ec);
+        }
+        m_save_path = m_move->save_path;
+        m_move.reset();
+        return 0;
+    }
+
+    void default_storage::moved_range_written(int slot, int offset, int size)
+    {
+        size_type start = slot * (size_type)m_files.piece_length() + offset;
+        file_storage::iterator file_iter = files().file_at_offset(start);
+        size_type file_offset = start - file_iter->offset;
+
+        for (; size > 0 && file_iter != files().end(); ++file_iter)
+        {
+            int index = files().file_index(*file_iter);
+            int written = int((std::min)(size_type(size), file_iter->size - file_offset));
+            size -= written;
+
+            int k = 0;
+            for (; k < int(m_move->files.size()) && m_move->files[k].index != index; ++k);
+
+            if (k == int(m_move->files.size()))
+            {
+                // the file didn't exist when the move started
+                move_state::moved_file mf;
+                mf.index = index;
+                mf.from = combine_path(m_save_path, files().file_path(*file_iter));
+                mf.to = combine_path(m_move->save_path, files().file_path(*file_iter));
+                mf.size = file_iter->size;
+                m_move->files.push_back(mf);
+                m_move->total += mf.size;
+            }
+            else if ((k < m_move->current
+                || (k == m_move->current && file_offset < m_move->offset))
+                && !m_move->dirty[slot])
+            {
+                // rewinding the copy would never let a downloading file
+                // finish moving, the slot is copied again after the rest
+                m_move->dirty[slot] = true;
+                m_move->total += m_files.piece_size(slot);
+            }
+            file_offset = 0;
+        }
+    }
+
+    bool default_storage::copy_moved_slot(int slot)
+    {
+        std::vector<file_slice> slices = files().map_block(slot, 0, m_files.piece_size(slot));
+        for (std::vector<file_slice>::const_iterator i = slices.begin()
+            , end(slices.end()); i != end; ++i)
+        {
+            std::vector<move_state::moved_file>::const_iterator mf = m_move->files.begin();
+            for (; mf != m_move->files.end() && mf->index != i->file_index; ++mf);
+            if (mf == m_move->files.end()) continue;
+
+            error_code ec;
+            file from(mf->from, file::read_only, ec);
+            if (ec)
+            {
+                set_error(mf->from, ec);
+                return false;
+            }
+            file to(mf->to, file::read_write, ec);
+
+            size_type copied = 0;
+            while (!ec && copied < i->size)
+            {
+                size_type n = copy_range(from, to, i->offset + copied, i->size - copied, ec);
+                if (n <= 0) break;
+                copied += n;
+            }
+            if (!ec) to.sync(ec);
+            if (ec)
+            {
+                set_error(mf->to, ec);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void default_storage::abandon_move()
+    {
+        if (!m_move) return;
+        m_move->from.reset();
+        m_move->to.reset();
+
+        error_code ec;
+        for (std::vector<move_state::moved_file>::const_iterator i = m_move->files.begin()
+            , end(m_move->files.end()); i != end; ++i)
+        {
+            remove(i->to, ec);
+        }
+        m_move.reset();
+    }
+
 #ifdef LIBED2K_DEBUG
 /*
     void default_storage::shuffle()
@@ -938,17 +1184,16 @@ ret:
 #endif
         fileop op = { &file::writev, &default_storage::write_unaligned
             , m_settings ? settings().disk_io_write_mode : 0, file::read_write };
-#ifdef LIBED2K_DISK_STATS
         int ret = readwritev(bufs, slot, offset, num_bufs, op);
+#ifdef LIBED2K_DISK_STATS
         if (pool)
         {
             pool->m_disk_access_log << log_time() << " write_end "
                 << (physical_offset(slot, offset) + ret) << std::endl;
         }
-        return ret;
-#else
-        return readwritev(bufs, slot, offset, num_bufs, op);
 #endif
+        if (m_move && ret > 0) moved_range_written(slot, offset, ret);
+        return ret;
     }
 
     size_type default_storage::physical_offset(int slot, int offset)
@@ -991,6 +1236,46 @@ ret:
         return ret;
     }
 
+    int default_storage::map_slot(int slot, int offset, int size, int mode
+        , boost::intrusive_ptr<file>& f, size_type& file_offset)
+    {
+        LIBED2K_ASSERT(slot >= 0);
+        LIBED2K_ASSERT(slot < m_files.num_pieces());
+        LIBED2K_ASSERT(offset >= 0);
+        LIBED2K_ASSERT(offset + size <= m_files.piece_size(slot));
+
+        // writes have to be seen by a move copying the files
+        if (m_move && mode != file::read_only) return -1;
+
+        size_type start = slot * (size_type)m_files.piece_length() + offset;
+        file_storage::iterator file_iter = files().file_at_offset(start);
+        if (file_iter == files().end() || file_iter->pad_file) return -1;
+
+        file_offset = start - file_iter->offset;
+        int ret = int((std::min)(size_type(size), file_iter->size - file_offset));
+        if (ret <= 0) return -1;
+
+        error_code ec;
+        f = open_file(file_iter, mode, ec);
+        if ((mode == file::read_write) && ec == boost::system::errc::no_such_file_or_directory)
+        {
+            ec.clear();
+            std::string path = combine_path(m_save_path, files().file_path(*file_iter));
+            create_directories(parent_path(path), ec);
+            if (!ec) f = open_file(file_iter, mode, ec);
+        }
+
+        // aligned access has to go through readwritev
+        if (!f || ec || (f->open_mode() & file::no_buffer))
+        {
+            f.reset();
+            return -1;
+        }
+
+        file_offset += files().file_base(*file_iter);
+        return ret;
+    }
+
     void default_storage::hint_read(int slot, int offset, int size)
     {
         size_type start = slot * (size_type)m_files.piece_length() + offset;
@@ -1374,6 +1659,10 @@ ret:
             || (cache_setting == session_settings::disable_os_cache_for_aligned_files
             && ((fe->offset + files().file_base(*fe)) & (m_page_size-1)) == 0))
             mode |= file::no_buffer;
+        // reads and writes share the handle, both of them get it
+        const int direct = session_settings::disable_os_cache_for_aligned_blocks;
+        if (m_settings && (settings().disk_io_write_mode == direct || settings().disk_io_read_mode == direct))
+            mode |= file::direct_io;
         bool lock_files = m_settings ? settings().lock_files : false;
         if (lock_files) mode |= file::lock_file;
         if (!m_allocate_files) mode |= file::sparse;
@@ -1465,10 +1754,11 @@ ret:
         , m_scratch_piece(-1)
         , m_last_piece(-1)
         , m_storage_constructor(sc)
-        , m_io_thread(io)
+        , m_io_thread(&io)
+        , m_move_thread(0)
         , m_torrent(torrent)
     {
-        m_storage->m_disk_pool = &m_io_thread;
+        m_storage->m_disk_pool = m_io_thread;
     }
 
     void piece_manager::finalize_file(int index)
@@ -1478,6 +1768,17 @@ ret:
     {
     }
 
+    disk_io_thread& piece_manager::io_thread() const
+    {
+        mutex::scoped_lock l(m_io_mutex);
+        return *m_io_thread;
+    }
+
+    bool piece_manager::can_write() const
+    {
+        return io_thread().can_write();
+    }
+
     void piece_manager::async_finalize_file(int file)
     {
         disk_io_job j;
@@ -1485,7 +1786,7 @@ ret:
         j.action = disk_io_job::finalize_file;
         j.piece = file;
         boost::function<void(int, disk_io_job const&)> empty;
-        m_io_thread.add_job(j, empty);
+        io_thread().add_job(j, empty);
     }
 
     void piece_manager::async_save_resume_data(
@@ -1494,7 +1795,7 @@ ret:
         disk_io_job j;
         j.storage = this;
         j.action = disk_io_job::save_resume_data;
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
     }
 
     void piece_manager::async_clear_read_cache(
@@ -1503,7 +1804,7 @@ ret:
         disk_io_job j;
         j.storage = this;
         j.action = disk_io_job::clear_read_cache;
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
     }
 
     void piece_manager::async_release_files(
@@ -1512,12 +1813,12 @@ ret:
         disk_io_job j;
         j.storage = this;
         j.action = disk_io_job::release_files;
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
     }
 
     void piece_manager::abort_disk_io()
     {
-        m_io_thread.stop(this);
+        io_thread().stop(this);
     }
 
     void piece_manager::async_delete_files(
@@ -1526,17 +1827,23 @@ ret:
         disk_io_job j;
         j.storage = this;
         j.action = disk_io_job::delete_files;
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
     }
 
     void piece_manager::async_move_storage(std::string const& p
-        , boost::function<void(int, disk_io_job const&)> const& handler)
+        , boost::function<void(int, disk_io_job const&)> const& handler
+        , disk_io_thread* io)
     {
+        {
+            mutex::scoped_lock l(m_io_mutex);
+            m_move_thread = io;
+        }
+
         disk_io_job j;
         j.storage = this;
         j.action = disk_io_job::move_storage;
         j.str = p;
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
     }
 
     void piece_manager::async_check_fastresume(lazy_entry const* resume_data
@@ -1547,7 +1854,7 @@ ret:
         j.storage = this;
         j.action = disk_io_job::check_fastresume;
         j.buffer = (char*)resume_data;
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
     }
 
     void piece_manager::async_rename_file(int index, std::string const& name
@@ -1558,7 +1865,7 @@ ret:
         j.piece = index;
         j.str = name;
         j.action = disk_io_job::rename_file;
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
     }
 
     void piece_manager::async_check_files(
@@ -1567,7 +1874,7 @@ ret:
         disk_io_job j;
         j.storage = this;
         j.action = disk_io_job::check_files;
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
     }
 
     void piece_manager::async_read_and_hash(
@@ -1584,7 +1891,7 @@ ret:
         j.buffer = 0;
         j.cache_min_time = cache_expiry;
         LIBED2K_ASSERT(r.length <= m_storage->disk_pool()->block_size());
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
 #ifdef LIBED2K_DEBUG
         mutex::scoped_lock l(m_mutex);
         // if this assert is hit, it suggests
@@ -1605,14 +1912,30 @@ ret:
         j.buffer_size = 0;
         j.buffer = 0;
         j.cache_min_time = cache_expiry;
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
+    }
+
+    void piece_manager::async_read_ahead(peer_request const& r
+        , boost::function<void(int, disk_io_job const&)> const& handler
+        , int cache_expiry)
+    {
+        disk_io_job j;
+        j.storage = this;
+        j.action = disk_io_job::cache_piece;
+        j.piece = r.piece;
+        j.offset = r.start;
+        j.buffer_size = r.length;
+        j.buffer = 0;
+        j.cache_min_time = cache_expiry;
+        io_thread().add_job(j, handler);
     }
 
     void piece_manager::async_read(
         peer_request const& r
         , boost::function<void(int, disk_io_job const&)> const& handler
         , int cache_line_size
-        , int cache_expiry)
+        , int cache_expiry
+        , int flags)
     {
         disk_io_job j;
         j.storage = this;
@@ -1623,11 +1946,12 @@ ret:
         j.buffer = 0;
         j.max_cache_line = cache_line_size;
         j.cache_min_time = cache_expiry;
+        j.flags = flags;
 
         // if a buffer is not specified, only one block can be read
         // since that is the size of the pool allocator's buffers
         LIBED2K_ASSERT(r.length <= m_storage->disk_pool()->block_size());
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
 #ifdef LIBED2K_DEBUG
         mutex::scoped_lock l(m_mutex);
         // if this assert is hit, it suggests
@@ -1643,7 +1967,7 @@ ret:
     {
         LIBED2K_ASSERT(r.length <= m_storage->disk_pool()->block_size());
         // the buffer needs to be allocated through the io_thread
-        LIBED2K_ASSERT(m_io_thread.is_disk_buffer(buffer.get()));
+        LIBED2K_ASSERT(io_thread().is_disk_buffer(buffer.get()));
 
         disk_io_job j;
         j.storage = this;
@@ -1652,7 +1976,7 @@ ret:
         j.offset = r.start;
         j.buffer_size = r.length;
         j.buffer = buffer.get();
-        int queue_size = m_io_thread.add_job(j, handler);
+        int queue_size = io_thread().add_job(j, handler);
         buffer.release();
 
         return queue_size;
@@ -1666,7 +1990,7 @@ ret:
         j.action = disk_io_job::hash;
         j.piece = piece;
 
-        m_io_thread.add_job(j, handler);
+        io_thread().add_job(j, handler);
     }
 
     std::string piece_manager::save_path() const
@@ -1679,14 +2003,7 @@ ret:
     {
         LIBED2K_ASSERT(!m_storage->error());
 
-        partial_hash ph;
-
-        std::map<int, partial_hash>::iterator i = m_piece_hasher.find(piece);
-        if (i != m_piece_hasher.end())
-        {
-            ph = i->second;
-            m_piece_hasher.erase(i);
-        }
+        partial_hash ph = take_partial_hash(piece);
 
         int slot = slot_for(piece);
         LIBED2K_ASSERT(slot != has_no_slot);
@@ -1696,14 +2013,12 @@ ret:
         return ph.h.final();
     }
 
-    int piece_manager::move_storage_impl(std::string const& save_path)
+    int piece_manager::move_storage_impl(std::string const& save_path, bool start
+        , size_type& moved, size_type& total)
     {
-        if (m_storage->move_storage(save_path))
-        {
-            m_save_path = complete(save_path);
-            return 0;
-        }
-        return -1;
+        int ret = m_storage->move_storage_some(save_path, start, moved, total);
+        if (ret == 0) m_save_path = complete(save_path);
+        return ret;
     }
 
     void piece_manager::write_resume_data(entry& rd) const
@@ -1733,6 +2048,18 @@ ret:
             }
         }
 
+        if (!m_fingerprints.empty())
+        {
+            // 8 bytes per piece, big endian
+            std::string& fps = rd["piece fingerprints"].string();
+            fps.resize(m_fingerprints.size() * 8);
+            for (size_t i = 0; i < m_fingerprints.size(); ++i)
+            {
+                for (int k = 0; k < 8; ++k)
+                    fps[i * 8 + k] = char(m_fingerprints[i] >> (56 - k * 8));
+            }
+        }
+
         rd["allocation"] = m_storage_mode == storage_mode_sparse?"sparse"
             :m_storage_mode == storage_mode_allocate?"full":"compact";
     }
@@ -1754,6 +2081,94 @@ ret:
         m_free_slots.push_back(slot_index);
     }
 
+    namespace
+    {
+        // pages sampled across a slot for its fingerprint
+        const int fingerprint_pages = 4;
+        const int fingerprint_page_size = 4096;
+    }
+
+    bool piece_manager::fingerprint_slot(int slot, boost::uint64_t& fp)
+    {
+        int piece_size = m_files.piece_size(slot);
+        int page = (std::min)(fingerprint_page_size, piece_size);
+        char buf[fingerprint_page_size];
+        hasher h;
+
+        for (int i = 0; i < fingerprint_pages; ++i)
+        {
+            // the first and the last pages and the ones evenly spread between
+            int offset = int(size_type(piece_size - page) * i / (fingerprint_pages - 1));
+            if (i < fingerprint_pages - 1) offset -= offset % fingerprint_page_size;
+
+            file::iovec_t b = {buf, page};
+            if (m_storage->readv(&b, slot, offset, 1) != page) return false;
+            h.update(buf, page);
+        }
+
+        md4_hash digest = h.final();
+        fp = 0;
+        for (int k = 0; k < 8; ++k) fp = (fp << 8) | digest[k];
+        // 0 stands for unknown fingerprints
+        if (fp == 0) fp = 1;
+        return true;
+    }
+
+    void piece_manager::queue_fingerprint(int piece_index)
+    {
+        mutex::scoped_lock lock(m_mutex);
+        if (m_storage_mode == internal_storage_mode_compact_deprecated) return;
+        m_fingerprint_queue.push_back(piece_index);
+    }
+
+    void piece_manager::update_fingerprints()
+    {
+        mutex::scoped_lock lock(m_mutex);
+        if (m_fingerprint_queue.empty()) return;
+
+        std::vector<int> pieces;
+        pieces.swap(m_fingerprint_queue);
+        lock.unlock();
+
+        std::vector<boost::uint64_t> fps(pieces.size(), 0);
+        for (size_t i = 0; i < pieces.size(); ++i)
+        {
+            // pieces which can't be read are hashed in full next time
+            if (!fingerprint_slot(slot_for(pieces[i]), fps[i])) clear_error();
+        }
+
+        lock.lock();
+        if (m_fingerprints.empty()) m_fingerprints.resize(m_files.num_pieces(), 0);
+        for (size_t i = 0; i < pieces.size(); ++i)
+            m_fingerprints[pieces[i]] = fps[i];
+    }
+
+    bool piece_manager::read_fingerprints(lazy_entry const& rd, bool files_changed)
+    {
+        int num_pieces = m_files.num_pieces();
+        lazy_entry const* pieces = rd.dict_find_string("pieces");
+        lazy_entry const* fps = rd.dict_find_string("piece fingerprints");
+
+        if (pieces == 0 || fps == 0
+            || pieces->string_length() != num_pieces
+            || fps->string_length() != num_pieces * 8)
+            return false;
+
+        char const* p = pieces->string_ptr();
+        unsigned char const* f = reinterpret_cast<unsigned char const*>(fps->string_ptr());
+        m_fingerprints.assign(num_pieces, 0);
+        if (files_changed) m_resume_pieces.assign(num_pieces, false);
+
+        for (int i = 0; i < num_pieces; ++i, f += 8)
+        {
+            if ((p[i] & 1) == 0) continue;
+            for (int k = 0; k < 8; ++k) m_fingerprints[i] = (m_fingerprints[i] << 8) | f[k];
+            if (files_changed) m_resume_pieces[i] = true;
+        }
+
+        return true;
+    }
+
     void piece_manager::hint_read_impl(int piece_index, int offset, int size)
     {
         m_last_piece = piece_index;
@@ -1797,86 +2212,92 @@ ret:
         // only save the partial hash if the write succeeds
         if (ret != size) return ret;
 
-        if (m_storage->settings().disable_hash_checks) return ret;
+        update_partial_hash(piece_index, offset, iov, num_bufs);
+        return ret;
+    }
+
+    bool piece_manager::update_partial_hash(
+        int piece_index
+      , int offset
+      , file::iovec_t const* bufs
+      , int num_bufs)
+    {
+        if (m_storage->settings().disable_hash_checks) return false;
 
 #if defined LIBED2K_PARTIAL_HASH_LOG && LIBED2K_USE_IOSTREAM
         std::ofstream out("partial_hash.log", std::ios::app);
 #endif
 
-        if (offset == 0)
+        std::map<int, partial_hash>::iterator i = m_piece_hasher.find(piece_index);
+        if (i == m_piece_hasher.end())
         {
-            partial_hash& ph = m_piece_hasher[piece_index];
-            LIBED2K_ASSERT(ph.offset == 0);
-            ph.offset = size;
+            if (offset != 0)
+            {
+#if defined LIBED2K_PARTIAL_HASH_LOG && LIBED2K_USE_IOSTREAM
+                out << time_now_string() << " SKIPPING (no entry) ["
+                    " s: " << this
+                    << " p: " << piece_index
+                    << " off: " << offset
+                    << " entries: " << m_piece_hasher.size()
+                    << " ]" << std::endl;
+#endif
+                return false;
+            }
 
-            for (file::iovec_t* i = iov, *end(iov + num_bufs); i < end; ++i)
-                ph.h.update((char const*)i->iov_base, i->iov_len);
+            i = m_piece_hasher.insert(std::make_pair(piece_index, partial_hash())).first;
+        }
 
+        // data behind the cursor was hashed while it was in the write cache,
+        // data ahead of it has to be read back when the piece is verified
+        if (offset != i->second.offset)
+        {
 #if defined LIBED2K_PARTIAL_HASH_LOG && LIBED2K_USE_IOSTREAM
-            out << time_now_string() << " NEW ["
+            out << time_now_string() << " SKIPPING (out of order) ["
                 " s: " << this
                 << " p: " << piece_index
                 << " off: " << offset
-                << " size: " << size
                 << " entries: " << m_piece_hasher.size()
                 << " ]" << std::endl;
 #endif
+            return false;
         }
-        else
-        {
-            std::map<int, partial_hash>::iterator i = m_piece_hasher.find(piece_index);
-            if (i != m_piece_hasher.end())
-            {
-#ifdef LIBED2K_DEBUG
-                LIBED2K_ASSERT(i->second.offset > 0);
-                int hash_offset = i->second.offset;
-                LIBED2K_ASSERT(offset >= hash_offset);
-#endif
-                if (offset == i->second.offset)
-                {
-#ifdef LIBED2K_PARTIAL_HASH_LOG
-                    out << time_now_string() << " UPDATING ["
-                        " s: " << this
-                        << " p: " << piece_index
-                        << " off: " << offset
-                        << " size: " << size
-                        << " entries: " << m_piece_hasher.size()
-                        << " ]" << std::endl;
-#endif
-                    for (file::iovec_t* b = iov, *end(iov + num_bufs); b < end; ++b)
-                    {
-                        i->second.h.update((char const*)b->iov_base, b->iov_len);
-                        i->second.offset += b->iov_len;
-                    }
-                }
-#ifdef LIBED2K_PARTIAL_HASH_LOG
-                else
-                {
-                    out << time_now_string() << " SKIPPING (out of order) ["
-                        " s: " << this
-                        << " p: " << piece_index
-                        << " off: " << offset
-                        << " size: " << size
-                        << " entries: " << m_piece_hasher.size()
-                        << " ]" << std::endl;
-                }
-#endif
-            }
-#ifdef LIBED2K_PARTIAL_HASH_LOG
-            else
-            {
-                out << time_now_string() << " SKIPPING (no entry) ["
-                    " s: " << this
-                    << " p: " << piece_index
-                    << " off: " << offset
-                    << " size: " << size
-                    << " entries: " << m_piece_hasher.size()
-                    << " ]" << std::endl;
-            }
+
+#if defined LIBED2K_PARTIAL_HASH_LOG && LIBED2K_USE_IOSTREAM
+        out << time_now_string() << " UPDATING ["
+            " s: " << this
+            << " p: " << piece_index
+            << " off: " << offset
+            << " entries: " << m_piece_hasher.size()
+            << " ]" << std::endl;
 #endif
+
+        for (file::iovec_t const* b = bufs, *end(bufs + num_bufs); b < end; ++b)
+        {
+            i->second.h.update((char const*)b->iov_base, b->iov_len);
+            i->second.offset += b->iov_len;
         }
 
-        return ret;
+        return true;
+    }
+
+    int piece_manager::partial_hash_offset(int piece_index) const
+    {
+        std::map<int, partial_hash>::const_iterator i = m_piece_hasher.find(piece_index);
+        return (i == m_piece_hasher.end()) ? 0 : i->second.offset;
+    }
+
+    partial_hash piece_manager::take_partial_hash(int piece_index)
+    {
+        partial_hash ph;
+
+        std::map<int, partial_hash>::iterator i = m_piece_hasher.find(piece_index);
+        if (i != m_piece_hasher.end())
+        {
+            ph = i->second;
+            m_piece_hasher.erase(i);
+        }
+
+        return ph;
     }
 
     size_type piece_manager::physical_offset(
@@ -1893,6 +2314,24 @@ ret:
         return m_storage->physical_offset(slot, offset);
     }
 
+    int piece_manager::map_piece_impl(
+        int piece_index
+        , int offset
+        , int size
+        , bool write
+        , boost::intrusive_ptr<file>& f
+        , size_type& file_offset)
+    {
+        LIBED2K_ASSERT(offset >= 0);
+        LIBED2K_ASSERT(piece_index >= 0 && piece_index < m_files.num_pieces());
+
+        m_last_piece = piece_index;
+        int slot = write ? allocate_slot_for_piece(piece_index) : slot_for(piece_index);
+        if (slot < 0) return -1;
+        return m_storage->map_slot(slot, offset, size
+            , write ? file::read_write : file::read_only, f, file_offset);
+    }
+
     int piece_manager::identify_data(
         md4_hash const& large_hash
         , md4_hash const& small_hash
@@ -2102,8 +2541,19 @@ ret:
         if (rd.dict_find_string_value("allocation") != "compact")
             storage_mode = storage_mode_sparse;
 
+        bool fingerprints = storage_mode != internal_storage_mode_compact_deprecated
+            && m_storage_mode != internal_storage_mode_compact_deprecated;
+
         if (!m_storage->verify_resume_data(rd, error))
+        {
+            // the files changed since the resume data was saved, the full
+            // check trusts the pieces it has as far as their fingerprints match
+            if (fingerprints && m_storage->settings().quick_resume_verify)
+                read_fingerprints(rd, true);
             return check_no_fastresume(error);
+        }
+
+        if (fingerprints) read_fingerprints(rd, false);
 
         // assume no piece is out of place (i.e. in a slot
         // other than the one it should be in)
@@ -2278,12 +2728,12 @@ ret:
     // is finished
     int piece_manager::check_files(int& current_slot, int& have_piece, error_code& error)
     {
+        current_slot = m_current_slot;
+        have_piece = -1;
+
         if (m_state == state_none) return check_no_fastresume(error);
 
         LIBED2K_ASSERT(int(m_piece_to_slot.size()) == m_files.num_pieces());
-
-        current_slot = m_current_slot;
-        have_piece = -1;
         if (m_state == state_expand_pieces)
         {
             INVARIANT_CHECK;
@@ -2425,6 +2875,7 @@ ret:
 
             // clear the memory we've been using
             std::multimap<md4_hash, int>().swap(m_hash_to_piece);
+            std::vector<bool>().swap(m_resume_pieces);
 
             if (m_storage_mode != internal_storage_mode_compact_deprecated)
             {
@@ -2497,22 +2948,47 @@ ret:
                 m_hash_to_piece.insert(std::pair<const md4_hash, int>(m_info->hash_for_piece(i), i));
         }
 
+        // let the next slot be read ahead while this one is hashed,
+        // the whole file is checked front to back
+        if (m_current_slot + 1 < m_files.num_pieces())
+            m_storage->hint_read(m_current_slot + 1, 0, m_files.piece_size(m_current_slot + 1));
+
+        md4_hash large_hash;
+        md4_hash small_hash;
+        bool verified = false;
+
+        if (!m_resume_pieces.empty())
+        {
+            // pieces the resume data has are hashed only when their sampled
+            // pages don't match, the others may have been completed while
+            // the files changed and are hashed in full
+            boost::uint64_t fp = 0;
+            if (m_resume_pieces[m_current_slot] && m_fingerprints[m_current_slot] != 0)
+            {
+                if (!fingerprint_slot(m_current_slot, fp)) clear_error();
+                verified = fp == m_fingerprints[m_current_slot];
+            }
+            if (verified) large_hash = m_info->hash_for_piece(m_current_slot);
+        }
+
         partial_hash ph;
         int num_read = 0;
         int piece_size = m_files.piece_size(m_current_slot);
         int small_piece_size = m_files.piece_size(m_files.num_pieces() - 1);
-        bool read_short = true;
-        md4_hash small_hash;
-        if (piece_size == small_piece_size)
-        {
-            num_read = hash_for_slot(m_current_slot, ph, piece_size, 0, 0);
-        }
-        else
+        bool read_short = false;
+        if (!verified)
         {
-            num_read = hash_for_slot(m_current_slot, ph, piece_size
-                , small_piece_size, &small_hash);
+            if (piece_size == small_piece_size)
+            {
+                num_read = hash_for_slot(m_current_slot, ph, piece_size, 0, 0);
+            }
+            else
+            {
+                num_read = hash_for_slot(m_current_slot, ph, piece_size
+                    , small_piece_size, &small_hash);
+            }
+            read_short = num_read != piece_size;
         }
-        read_short = num_read != piece_size;
 
         if (read_short)
         {
@@ -2532,10 +3008,14 @@ ret:
             return skip_file();
         }
 
-        md4_hash large_hash = ph.h.final();
+        if (!verified) large_hash = ph.h.final();
         int piece_index = identify_data(large_hash, small_hash, m_current_slot);
 
-        if (piece_index >= 0) have_piece = piece_index;
+        if (piece_index >= 0)
+        {
+            have_piece = piece_index;
+            if (!verified) queue_fingerprint(piece_index);
+        }
 
         if (piece_index != m_current_slot
             && piece_index >= 0)
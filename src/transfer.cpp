@@ -21,7 +21,8 @@ namespace libed2k
         m_incomplete(-1),
         m_policy(this),
         m_info(new transfer_info(hash, filename(filepath), size)),
-        m_minute_timer(minutes(1), min_time())
+        m_minute_timer(minutes(1), min_time()),
+        m_last_source_exchange(min_time())
     {}
 
     transfer::transfer(aux::session_impl& ses, ip::tcp::endpoint const& net_interface,
@@ -55,9 +56,21 @@ namespace libed2k
         m_total_failed_bytes(0),
         m_total_redundant_bytes(0),
         m_minute_timer(minutes(1), min_time()),
-        m_last_active(0)
+        m_last_source_exchange(min_time()),
+        m_last_active(0),
+        m_aich_root(p.aich_root_hash),
+        m_aich_piece_hashes(p.aich_piece_hashes)
     {
         if (p.resume_data) m_resume_data.swap(*p.resume_data);
+
+        // piece hashes are good for recovery data only when they give the root
+        if (!m_aich_piece_hashes.empty() &&
+            (size_type(m_aich_piece_hashes.size()) != div_ceil(p.file_size, PIECE_SIZE) ||
+             aich_root_hash(p.file_size, m_aich_piece_hashes) != m_aich_root))
+        {
+            ERR("AICH hashes don't match root {transfer: " << p.file_hash << "}");
+            m_aich_piece_hashes.clear();
+        }
     }
 
     transfer::~transfer()
@@ -89,6 +102,8 @@ namespace libed2k
         res.file_path = file_path();
         res.file_size = size();
         res.piece_hashses = piece_hashses();
+        res.aich_root_hash = m_aich_root;
+        res.aich_piece_hashes = m_aich_piece_hashes;
         //res.resume_data = &m_resume_data;
         res.storage_mode = m_storage_mode;
         //res.duplicate_is_error = ???
@@ -168,6 +183,12 @@ namespace libed2k
 
         if (s != transfer_status::seeding)
             activate(true);
+
+        // announce depends on checking and seed state
+        if (s != transfer_status::queued_for_checking &&
+            s != transfer_status::checking_files &&
+            s != transfer_status::checking_resume_data)
+            m_ses.queue_announce(hash());
     }
 
     bool transfer::want_more_peers() const
@@ -176,13 +197,20 @@ namespace libed2k
             m_policy.num_peers() == 0 && !m_abort;
     }
 
+    bool transfer::want_exchange_sources() const
+    {
+        return m_ses.settings().source_exchange_interval > 0 &&
+            !is_paused() && !is_finished() && has_picker() && !m_abort &&
+            int(m_policy.num_peers()) < m_ses.settings().max_peerlist_size;
+    }
+
     void transfer::request_peers()
     {
         APP("request peers by hash: " << hash() << ", size: " << size());
-        m_ses.m_server_connection->post_sources_request(hash(), size());
+        m_ses.post_sources_request(hash(), size());
     }
 
-    void transfer::add_peer(const tcp::endpoint& peer)
+    void transfer::add_peer(const tcp::endpoint& peer, bool connectable)
     {
         if (m_ses.m_ip_filter.access(peer.address()) & ip_filter::blocked)
         {
@@ -192,7 +220,7 @@ namespace libed2k
             return;
         }
 
-        m_policy.add_peer(peer);
+        m_policy.add_peer(peer, connectable);
     }
 
     bool transfer::want_more_connections() const
@@ -213,7 +241,7 @@ namespace libed2k
 
         // add the newly connected peer to this transfer's peer list
         m_connections.insert(boost::get_pointer(c));
-        m_ses.m_connections.insert(c);
+        m_ses.add_connection(c);
         m_policy.set_connection(peerinfo, c.get());
         c->start();
 
@@ -312,6 +340,9 @@ namespace libed2k
         m_policy.connection_closed(*c);
         c->set_peer(0);
         m_connections.erase(c);
+
+        // pieces waiting for recovery data from the peer go to download again
+        aich_recovery_received(c, -1, aich_recovery_data());
     }
 
     void transfer::get_peer_info(std::vector<peer_info>& infos)
@@ -343,7 +374,7 @@ namespace libed2k
             if (p->is_disconnecting())
                 m_connections.erase(m_connections.begin());
             else
-                p->disconnect(ec);
+                p->next_transfer(ec);
         }
     }
 
@@ -391,6 +422,8 @@ namespace libed2k
     {
         //TODO: update progress
         m_picker->we_have(index);
+        // partial downloads are offered once they have something to share
+        if (m_picker->num_have() == 1) m_ses.queue_announce(hash());
     }
 
     size_t transfer::num_pieces() const
@@ -447,7 +480,7 @@ namespace libed2k
 
         m_ses.m_alerts.post_alert_should(finished_transfer_alert(handle(), seeds.size() > 0));
         std::for_each(seeds.begin(), seeds.end(),
-                      boost::bind(&peer_connection::disconnect, _1, errors::transfer_finished, 0));
+                      boost::bind(&peer_connection::next_transfer, _1, errors::transfer_finished));
 
         if (m_abort) return;
 
@@ -601,8 +634,10 @@ namespace libed2k
     {
         if (m_owning_storage.get())
         {
+            // the storage runs its jobs on the thread of the new device
             m_owning_storage->async_move_storage(
-                save_path, boost::bind(&transfer::on_storage_moved, shared_from_this(), _1, _2));
+                save_path, boost::bind(&transfer::on_storage_moved, shared_from_this(), _1, _2),
+                &m_ses.disk_thread(save_path));
         }
         else
         {
@@ -611,6 +646,12 @@ namespace libed2k
         }
     }
 
+    bool transfer::can_write_to_disk() const
+    {
+        if (!m_owning_storage.get()) return m_ses.can_write_to_disk();
+        return m_owning_storage->can_write();
+    }
+
     bool transfer::rename_file(const std::string& name)
     {
         DBG("renaming file in transfer {hash: " << hash() <<
@@ -710,10 +751,13 @@ namespace libed2k
         // increase the total amount of failed bytes
         add_failed_bytes(PIECE_SIZE);
 
-        // TODO:
-        // decrease the trust point of all peers that sent
-        // parts of this piece.
-        // first, build a set of all peers that participated
+        // the peers that sent blocks of this piece, in blocks order
+        std::vector<void*> downloaders;
+        m_picker->get_downloaders(downloaders, index);
+
+        // the piece stays finished in the picker until AICH
+        // tells which of its blocks are corrupt
+        if (request_aich_recovery(index, downloaders)) return;
 
         // we have to let the piece_picker know that
         // this piece failed the check as it can restore it
@@ -728,6 +772,290 @@ namespace libed2k
 
         LIBED2K_ASSERT(m_storage);
         LIBED2K_ASSERT(m_picker->have_piece(index) == false);
+
+        // without AICH the blame is certain only when
+        // the whole piece came from one peer
+        std::set<void*> peers(downloaders.begin(), downloaders.end());
+        if (peers.size() == 1 && *peers.begin()) ban_peer(static_cast<peer*>(*peers.begin()));
+    }
+
+    bool transfer::request_aich_recovery(int index, const std::vector<void*>& downloaders)
+    {
+        if (!m_aich_root.defined() || m_aich_recovery.count(index)) return false;
+
+        for (std::set<peer_connection*>::iterator i = m_connections.begin(),
+                 end(m_connections.end()); i != end; ++i)
+        {
+            peer_connection* p = *i;
+            std::map<ip::address, aich_hash>::const_iterator vote = m_aich_votes.find(p->remote().address());
+
+            // the peer has the piece and the same tree
+            const bitfield& pieces = p->remote_pieces();
+
+            if (!p->supports_aich() || index >= int(pieces.size()) || !pieces[index] || p->is_disconnecting() ||
+                vote == m_aich_votes.end() || vote->second != m_aich_root)
+                continue;
+
+            aich_recovery& ar = m_aich_recovery[index];
+            ar.source = p;
+            ar.requested = time_now();
+            ar.downloaders = downloaders;
+            p->request_aich_recovery(hash(), index, m_aich_root);
+            return true;
+        }
+
+        DBG("no peer for AICH recovery {transfer: " << hash() << ", piece: " << index << "}");
+        return false;
+    }
+
+    void transfer::aich_recovery_received(peer_connection* c, int index, const aich_recovery_data& data)
+    {
+        if (index < 0)
+        {
+            std::vector<int> rejected;
+
+            for (std::map<int, aich_recovery>::iterator i = m_aich_recovery.begin(),
+                     end(m_aich_recovery.end()); i != end; ++i)
+            {
+                if (i->second.source == c) rejected.push_back(i->first);
+            }
+
+            for (std::vector<int>::iterator i = rejected.begin(), end(rejected.end()); i != end; ++i)
+                aich_recovery_failed(*i);
+
+            return;
+        }
+
+        std::map<int, aich_recovery>::iterator itr = m_aich_recovery.find(index);
+        if (itr == m_aich_recovery.end() || itr->second.source != c) return;
+
+        std::vector<aich_hash> block_hashes;
+
+        if (!aich_check_recovery_data(size(), index, m_aich_root, data, block_hashes))
+        {
+            ERR("AICH recovery data don't match root {transfer: " << hash() << ", piece: " << index << "}");
+            aich_recovery_failed(index);
+            return;
+        }
+
+        // blocks of our data are checked against trusted hashes
+        itr->second.source = 0;
+        async_read_piece(index, boost::bind(&transfer::on_aich_piece_read, shared_from_this(),
+                                            _1, _2, _3, block_hashes));
+    }
+
+    void transfer::on_aich_piece_read(int index, const std::vector<char>& data, const error_code& ec,
+                                      std::vector<aich_hash> block_hashes)
+    {
+        std::map<int, aich_recovery>::iterator itr = m_aich_recovery.find(index);
+        if (itr == m_aich_recovery.end() || itr->second.source != 0) return;
+
+        if (ec || !has_picker() || data.empty())
+        {
+            aich_recovery_failed(index);
+            return;
+        }
+
+        aich_piece_hasher hasher;
+        hasher.update(&data[0], data.size());
+        const std::vector<aich_hash>& our_hashes = hasher.block_hashes();
+
+        if (our_hashes.size() != block_hashes.size())
+        {
+            aich_recovery_failed(index);
+            return;
+        }
+
+        std::vector<void*> downloaders;
+        downloaders.swap(itr->second.downloaders);
+        m_aich_recovery.erase(itr);
+
+        // picker blocks don't match AICH blocks, picker block is good
+        // when all AICH blocks it overlaps are good
+        int blocks_in_piece = m_picker->blocks_in_piece(index);
+        std::vector<bool> good(blocks_in_piece, true);
+        std::set<peer*> corrupters;
+        int corrupt = 0;
+
+        for (int b = 0; b < blocks_in_piece; ++b)
+        {
+            size_type start = size_type(b) * BLOCK_SIZE;
+            size_type end = std::min<size_type>(start + BLOCK_SIZE, data.size());
+
+            for (size_type a = start / AICH_BLOCK_SIZE; a <= (end - 1) / AICH_BLOCK_SIZE; ++a)
+            {
+                if (our_hashes[a] != block_hashes[a]) good[b] = false;
+            }
+
+            if (!good[b])
+            {
+                ++corrupt;
+                if (b < int(downloaders.size()) && downloaders[b])
+                    corrupters.insert(static_cast<peer*>(downloaders[b]));
+            }
+        }
+
+        m_picker->restore_piece(index);
+        restore_piece_state(index);
+
+        // all blocks match AICH, though piece doesn't match its MD4 hash
+        if (corrupt == 0)
+        {
+            ERR("AICH found no corrupt blocks {transfer: " << hash() << ", piece: " << index << "}");
+            return;
+        }
+
+        for (int b = 0; b < blocks_in_piece; ++b)
+        {
+            piece_block block(index, b);
+
+            if (good[b] && m_picker->num_peers(block) == 0 && !m_picker->is_finished(block))
+                m_picker->mark_as_finished(block, b < int(downloaders.size()) ? downloaders[b] : 0);
+        }
+
+        DBG("AICH recovered piece {transfer: " << hash() << ", piece: " << index
+            << ", corrupt blocks: " << corrupt << " of " << blocks_in_piece << "}");
+
+        // banning disconnects, so picker is done first
+        for (std::set<peer*>::iterator i = corrupters.begin(), end(corrupters.end()); i != end; ++i)
+            ban_peer(*i);
+    }
+
+    void transfer::aich_recovery_failed(int index)
+    {
+        m_aich_recovery.erase(index);
+        if (!has_picker() || m_picker->have_piece(index)) return;
+
+        DBG("AICH recovery failed {transfer: " << hash() << ", piece: " << index << "}");
+        m_picker->restore_piece(index);
+        restore_piece_state(index);
+    }
+
+    void transfer::async_aich_answer(int index, const aich_answer_handler& handler)
+    {
+        std::map<int, aich_recovery_data>::const_iterator answer = m_aich_answers.find(index);
+
+        if (answer != m_aich_answers.end())
+        {
+            handler(index, answer->second, true);
+            return;
+        }
+
+        std::vector<aich_answer_handler>& waiters = m_aich_answer_waiters[index];
+        waiters.push_back(handler);
+        if (waiters.size() > 1) return;
+
+        async_read_piece(index, boost::bind(&transfer::on_aich_answer_read, shared_from_this(), _1, _2, _3));
+    }
+
+    void transfer::on_aich_answer_read(int index, const std::vector<char>& data, const error_code& ec)
+    {
+        std::vector<aich_answer_handler> waiters;
+        waiters.swap(m_aich_answer_waiters[index]);
+        m_aich_answer_waiters.erase(index);
+
+        aich_recovery_data rd;
+        bool ok = false;
+
+        if (!ec && !data.empty())
+        {
+            aich_piece_hasher hasher;
+            hasher.update(&data[0], data.size());
+            ok = aich_make_recovery_data(size(), index, m_aich_piece_hashes, hasher.block_hashes(), rd);
+
+            if (!ok)
+                ERR("AICH hashes don't match piece data {file: " << hash() << ", piece: " << index << "}");
+        }
+
+        if (ok)
+        {
+            // a few answers are enough, peers ask for pieces being recovered at the same time
+            if (m_aich_answers.size() >= 4) m_aich_answers.erase(m_aich_answers.begin());
+            m_aich_answers[index] = rd;
+        }
+
+        for (std::vector<aich_answer_handler>::iterator i = waiters.begin(), end(waiters.end()); i != end; ++i)
+            (*i)(index, rd, ok);
+    }
+
+    void transfer::aich_root_vote(const ip::address& addr, const aich_hash& root)
+    {
+        m_aich_votes[addr] = root;
+
+        if (m_aich_root.defined()) return;
+
+        std::map<aich_hash, int> counts;
+        std::pair<aich_hash, int> best;
+
+        for (std::map<ip::address, aich_hash>::const_iterator i = m_aich_votes.begin(),
+                 end(m_aich_votes.end()); i != end; ++i)
+        {
+            int count = ++counts[i->second];
+            if (count > best.second) best = std::make_pair(i->second, count);
+        }
+
+        if (best.second >= m_ses.settings().aich_trust_sources &&
+            best.second * 100 >= int(m_aich_votes.size()) * AICH_TRUST_PERCENT)
+        {
+            DBG("AICH root trusted {transfer: " << hash() << ", root: " << best.first
+                << ", votes: " << best.second << " of " << m_aich_votes.size() << "}");
+            m_aich_root = best.first;
+        }
+    }
+
+    void transfer::ban_peer(peer* p)
+    {
+        if (p->banned) return;
+
+        DBG("ban peer for corrupt data {transfer: " << hash() << ", peer: " << p->endpoint << "}");
+        p->banned = true;
+
+        if (p->connection) p->connection->disconnect(errors::peer_banned, 2);
+    }
+
+    void transfer::async_read_piece(int index, const read_piece_handler& handler)
+    {
+        LIBED2K_ASSERT(m_storage);
+
+        boost::shared_ptr<read_piece_struct> rp(new read_piece_struct);
+        int piece_size = m_info->piece_size(index);
+        int blocks = div_ceil(piece_size, BLOCK_SIZE);
+
+        rp->index = index;
+        rp->data.resize(piece_size);
+        rp->blocks_left = blocks;
+        rp->handler = handler;
+
+        for (int b = 0; b < blocks; ++b)
+        {
+            peer_request r;
+            r.piece = index;
+            r.start = b * BLOCK_SIZE;
+            r.length = std::min<int>(piece_size - r.start, BLOCK_SIZE);
+            m_storage->async_read(r, boost::bind(&transfer::on_piece_read, shared_from_this(), _1, _2, r, rp));
+        }
+    }
+
+    void transfer::on_piece_read(int ret, disk_io_job const& j, peer_request r,
+                                 boost::shared_ptr<read_piece_struct> rp)
+    {
+        boost::mutex::scoped_lock l(m_ses.m_mutex);
+
+        disk_buffer_holder buffer(m_ses.m_disk_thread, j.buffer);
+
+        if (ret != r.length)
+        {
+            if (!rp->ec) rp->ec = j.error ? j.error : error_code(errors::file_too_short);
+        }
+        else
+        {
+            std::memcpy(&rp->data[r.start], buffer.get(), r.length);
+        }
+
+        if (--rp->blocks_left > 0) return;
+
+        if (rp->ec) rp->data.clear();
+        rp->handler(rp->index, rp->data, rp->ec);
     }
 
     void transfer::restore_piece_state(int index)
@@ -1004,6 +1332,14 @@ namespace libed2k
     {
         boost::mutex::scoped_lock l(m_ses.m_mutex);
 
+        // copying to another device, called until it's done
+        if (ret > 0)
+        {
+            m_ses.m_alerts.post_alert_should(
+                storage_move_progress_alert(handle(), j.moved, j.move_size));
+            return;
+        }
+
         if (ret == 0)
         {
             DBG("storage successfully moved {hash: " << hash() << ", to: " << j.str << "}");
@@ -1038,11 +1374,15 @@ namespace libed2k
         std::vector<boost::uint8_t> file_prio;
         file_prio.push_back(1);
 
+        storage_constructor_type sc = default_storage_constructor;
+        if (m_ses.settings().use_mapped_storage)
+            sc = boost::bind(&mapped_storage_constructor, _1, _2, _3, _4, _5, boost::ref(m_ses.m_mappings));
+
         // the shared_from_this() will create an intentional
         // cycle of ownership, see the hpp file for description.
         m_owning_storage = new piece_manager(
             shared_from_this(), m_info, m_save_path, m_ses.m_filepool,
-            m_ses.m_disk_thread, default_storage_constructor, m_storage_mode, file_prio);
+            m_ses.disk_thread(m_save_path), sc, m_storage_mode, file_prio);
         m_storage = m_owning_storage.get();
 
         if (has_picker())
@@ -1220,6 +1560,25 @@ namespace libed2k
         if (m_minute_timer.expired(now) && want_more_peers())
             request_peers();
 
+        // sources connected to us for other transfers serve this one too
+        if (want_more_connections()) m_policy.share_connections();
+
+        // ask one connected peer at a time for the sources it knows
+        if (now - m_last_source_exchange >=
+            seconds(m_ses.settings().transfer_source_exchange_interval) &&
+            want_exchange_sources())
+        {
+            for (std::set<peer_connection*>::iterator i = m_connections.begin(),
+                     end(m_connections.end()); i != end; ++i)
+            {
+                if ((*i)->request_sources(now))
+                {
+                    m_last_source_exchange = now;
+                    break;
+                }
+            }
+        }
+
         // if we're in upload only mode and we're auto-managed
         // leave upload mode every 10 minutes hoping that the error
         // condition has been fixed
@@ -1260,6 +1619,15 @@ namespace libed2k
 
         if (m_upload_mode) ++m_upload_mode_time;
 
+        for (std::map<int, aich_recovery>::iterator i = m_aich_recovery.begin();
+             i != m_aich_recovery.end();)
+        {
+            int index = i->first;
+            bool expired = i->second.source && now - i->second.requested >= seconds(AICH_RECOVERY_TIMEOUT);
+            ++i;
+            if (expired) aich_recovery_failed(index);
+        }
+
         accumulator += m_stat;
         m_total_uploaded += m_stat.last_payload_uploaded();
         m_total_downloaded += m_stat.last_payload_downloaded();
@@ -1350,6 +1718,11 @@ namespace libed2k
     }
 
     shared_file_entry transfer::getAnnounce() const
+    {
+        return getAnnounce(*m_ses.current_server());
+    }
+
+    shared_file_entry transfer::getAnnounce(const server_connection& sc) const
     {
         shared_file_entry entry;
 
@@ -1364,7 +1737,7 @@ namespace libed2k
 
         // TODO - implement generate file entry from transfer here
         entry.m_hFile = hash();
-        if (m_ses.m_server_connection->tcp_flags() & SRV_TCPFLG_COMPRESSION)
+        if (sc.tcp_flags() & SRV_TCPFLG_COMPRESSION)
         {
             if (!is_seed())
             {
@@ -1381,7 +1754,7 @@ namespace libed2k
         }
         else
         {
-            entry.m_network_point.m_nIP     = m_ses.m_server_connection->client_id();
+            entry.m_network_point.m_nIP     = sc.client_id();
             entry.m_network_point.m_nPort   = m_ses.settings().listen_port;
         }
 
@@ -1398,7 +1771,7 @@ namespace libed2k
 
         bool bFileTypeAdded = false;
 
-        if (m_ses.m_server_connection->tcp_flags() & SRV_TCPFLG_TYPETAGINTEGER)
+        if (sc.tcp_flags() & SRV_TCPFLG_TYPETAGINTEGER)
         {
             // Send integer file type tags to newer servers
             boost::uint32_t eFileType = GetED2KFileTypeSearchID(GetED2KFileTypeID(name()));
@@ -1563,7 +1936,12 @@ namespace libed2k
         // we're not done checking yet
         // this handler will be called repeatedly until
         // we're done, or encounter a failure
-        if (ret == piece_manager::need_full_check) return;
+        if (ret == piece_manager::need_full_check)
+        {
+            m_ses.m_alerts.post_alert_should(
+                transfer_checking_progress_alert(handle(), j.piece, num_pieces()));
+            return;
+        }
 
         dequeue_transfer_check();
         file_checked();
@@ -1691,6 +2069,18 @@ namespace libed2k
             hv.push_back(piece_hashses.at(n).toString());
         }
 
+        if (m_aich_root.defined())
+        {
+            ret["aich-root"] = m_aich_root.toString();
+            ret["aich-hashset-values"] = entry::list_type();
+            entry::list_type& ah = ret["aich-hashset-values"].list();
+
+            for (size_t n = 0; n < m_aich_piece_hashes.size(); ++n)
+            {
+                ah.push_back(m_aich_piece_hashes[n].toString());
+            }
+        }
+
         ret["upload_rate_limit"] = upload_limit();
         ret["download_rate_limit"] = download_limit();
         // TODO - add real values
@@ -1728,6 +2118,28 @@ namespace libed2k
 
         int paused_ = rd.dict_find_int_value("paused", -1);
         if (paused_ != -1) m_paused = paused_;
+
+        // AICH root given with parameters wins over the saved one
+        std::string aich_root = rd.dict_find_string_value("aich-root");
+
+        if (!m_aich_root.defined() && !aich_root.empty())
+        {
+            m_aich_root = aich_hash::fromString(aich_root);
+            lazy_entry const* ah = rd.dict_find_list("aich-hashset-values");
+            std::vector<aich_hash> aich_hashes;
+
+            for (int n = 0; ah && n < ah->list_size(); ++n)
+            {
+                aich_hashes.push_back(aich_hash::fromString(ah->list_at(n)->string_value()));
+            }
+
+            if (!aich_hashes.empty() &&
+                size_type(aich_hashes.size()) == div_ceil(size(), PIECE_SIZE) &&
+                aich_root_hash(size(), aich_hashes) == m_aich_root)
+            {
+                m_aich_piece_hashes.swap(aich_hashes);
+            }
+        }
     }
 
     void transfer::handle_disk_error(disk_io_job const& j, peer_connection* c)
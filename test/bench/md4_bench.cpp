@@ -0,0 +1,93 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "libed2k/constants.hpp"
+#include "libed2k/hasher.hpp"
+#include "libed2k/md4.hpp"
+
+using namespace libed2k;
+
+/**
+  * measures single core MD4 throughput of the plain hasher against md4_batch
+  * with each lane count, on buffers of ed2k piece size as share hashing uses
+  * usage: md4_bench [buffers count] [rounds]
+ */
+
+namespace
+{
+    double elapsed(const boost::posix_time::ptime& start)
+    {
+        return double((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()) / 1000000;
+    }
+
+    void report(const char* name, size_t bytes, double seconds)
+    {
+        std::cout << std::setw(16) << std::left << name
+                  << std::setw(10) << std::right << std::fixed << std::setprecision(1)
+                  << (double(bytes) / (1024 * 1024)) / seconds << " MB/s" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t count = (argc > 1) ? std::atoi(argv[1]) : 16;
+    size_t rounds = (argc > 2) ? std::atoi(argv[2]) : 4;
+    const size_t piece = size_t(PIECE_SIZE);
+
+    if (count == 0 || rounds == 0)
+    {
+        std::cerr << "usage: " << argv[0] << " [buffers count] [rounds]" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::vector<unsigned char> > buffers(count, std::vector<unsigned char>(piece));
+    std::vector<const unsigned char*> data(count);
+    std::vector<size_t> size(count, piece);
+    std::vector<unsigned char> digests(count * MD4_HASH_SIZE);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (size_t n = 0; n < piece; ++n) buffers[i][n] = static_cast<unsigned char>(std::rand());
+        data[i] = &buffers[i][0];
+    }
+
+    const size_t total = count * piece * rounds;
+    std::cout << count << " buffers of " << piece << " bytes, " << rounds << " rounds" << std::endl;
+
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            hasher h;
+            h.update(reinterpret_cast<const char*>(data[i]), piece);
+            h.final();
+        }
+    }
+    report("hasher", total, elapsed(start));
+
+    const size_t lanes[] = { 1, 4, 8 };
+
+    for (size_t l = 0; l < sizeof(lanes) / sizeof(lanes[0]); ++l)
+    {
+        // skip engines this CPU has no instructions for
+        if (md4_batch_lanes(lanes[l]) != lanes[l]) continue;
+
+        start = boost::posix_time::microsec_clock::universal_time();
+        for (size_t r = 0; r < rounds; ++r)
+        {
+            md4_batch(&data[0], &size[0], count,
+                      reinterpret_cast<unsigned char(*)[MD4_HASH_SIZE]>(&digests[0]), lanes[l]);
+        }
+
+        std::ostringstream name;
+        name << "md4_batch x" << lanes[l];
+        report(name.str().c_str(), total, elapsed(start));
+    }
+
+    return 0;
+}
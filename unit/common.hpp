@@ -1,8 +1,12 @@
 #include <fstream>
 #include <string>
 #include <set>
+#include <sstream>
 #include <boost/bind.hpp>
+#include <boost/asio.hpp>
 #include "libed2k/filesystem.hpp"
+#include "libed2k/packet_struct.hpp"
+#include "libed2k/archive.hpp"
 #include "libed2k/size_type.hpp"
 #include "libed2k/utf8.hpp"
 
@@ -37,3 +41,121 @@ public:
 private:
     std::set<std::string> m_files;
 };
+
+/**
+  * loopback end of ed2k wire standing in for server or peer:
+  * exchanges packets with the session synchronously, every operation
+  * gives up after timeout instead of blocking the test
+ */
+class stand_in
+{
+public:
+    stand_in(const boost::asio::ip::address& addr = boost::asio::ip::address_v4::loopback()) :
+        m_acceptor(m_io, libed2k::tcp::endpoint(addr, 0)),
+        m_socket(m_io),
+        m_timer(m_io)
+    {}
+
+    unsigned short port() const { return m_acceptor.local_endpoint().port(); }
+
+    bool accept()
+    {
+        m_acceptor.async_accept(m_socket, boost::bind(&stand_in::on_complete, this, _1));
+        return wait();
+    }
+
+    bool connect(unsigned short port)
+    {
+        m_socket.async_connect(
+            libed2k::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port),
+            boost::bind(&stand_in::on_complete, this, _1));
+        return wait();
+    }
+
+    void close()
+    {
+        libed2k::error_code ignore;
+        m_socket.close(ignore);
+    }
+
+    // skips incoming packets until one of the given type
+    bool read_packet(libed2k::proto_type type, std::string& body)
+    {
+        for (;;)
+        {
+            libed2k::libed2k_header header;
+            boost::asio::async_read(m_socket, boost::asio::buffer(&header, sizeof(header)),
+                                    boost::bind(&stand_in::on_complete, this, _1));
+            if (!wait()) return false;
+
+            body.resize(header.m_size - 1);
+
+            if (!body.empty())
+            {
+                boost::asio::async_read(m_socket, boost::asio::buffer(&body[0], body.size()),
+                                        boost::bind(&stand_in::on_complete, this, _1));
+                if (!wait()) return false;
+            }
+
+            if (header.m_type == type) return true;
+        }
+    }
+
+    template<typename T>
+    bool write_packet(libed2k::proto_type type, T& t,
+                      libed2k::proto_type protocol = libed2k::OP_EDONKEYPROT)
+    {
+        std::stringstream body(std::ios::out | std::ios::in | std::ios::binary);
+        libed2k::archive::ed2k_oarchive oa(body);
+        oa << t;
+
+        libed2k::libed2k_header header;
+        header.m_protocol = protocol;
+        header.m_size = body.str().size() + 1;
+        header.m_type = type;
+
+        std::string packet(reinterpret_cast<const char*>(&header), sizeof(header));
+        packet += body.str();
+        boost::asio::async_write(m_socket, boost::asio::buffer(packet),
+                                 boost::bind(&stand_in::on_complete, this, _1));
+        return wait();
+    }
+
+private:
+    bool wait()
+    {
+        m_error = boost::asio::error::timed_out;
+        m_timer.expires_from_now(boost::posix_time::seconds(10));
+        m_timer.async_wait(boost::bind(&stand_in::on_timeout, this, _1));
+        m_io.reset();
+        m_io.run();
+        return !m_error;
+    }
+
+    void on_complete(const libed2k::error_code& ec)
+    {
+        m_error = ec;
+        m_timer.cancel();
+    }
+
+    void on_timeout(const libed2k::error_code& ec)
+    {
+        if (ec == boost::asio::error::operation_aborted) return;
+        libed2k::error_code ignore;
+        m_acceptor.close(ignore);
+        m_socket.close(ignore);
+    }
+
+    boost::asio::io_service m_io;
+    libed2k::tcp::acceptor m_acceptor;
+    libed2k::tcp::socket m_socket;
+    boost::asio::deadline_timer m_timer;
+    libed2k::error_code m_error;
+};
+
+inline unsigned short free_port()
+{
+    boost::asio::io_service io;
+    libed2k::tcp::acceptor acceptor(io, libed2k::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    return acceptor.local_endpoint().port();
+}
@@ -0,0 +1,195 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string>
+#include <sstream>
+#include <boost/test/unit_test.hpp>
+#include "libed2k/aich.hpp"
+#include "libed2k/sha1.hpp"
+#include "libed2k/util.hpp"
+#include "libed2k/archive.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_aich)
+
+namespace
+{
+    std::string sha1_hex(const std::string& data)
+    {
+        libed2k::aich_hash hash;
+        libed2k::sha1_context ctx;
+        libed2k::sha1_init(&ctx);
+        libed2k::sha1_update(&ctx, reinterpret_cast<const unsigned char*>(data.c_str()), data.size());
+        libed2k::sha1_final(&ctx, hash.getContainer());
+
+        static const char hex[] = "0123456789abcdef";
+        std::string res;
+
+        for (size_t n = 0; n < libed2k::SHA1_HASH_SIZE; ++n)
+        {
+            res += hex[hash.getContainer()[n] >> 4];
+            res += hex[hash.getContainer()[n] & 0x0F];
+        }
+
+        return res;
+    }
+
+    // distinct fake hashes for tree tests, no real data needed
+    libed2k::aich_hash make_hash(int seed)
+    {
+        libed2k::aich_hash hash;
+        std::string data = libed2k::int2ipstr(seed);
+        libed2k::sha1_context ctx;
+        libed2k::sha1_init(&ctx);
+        libed2k::sha1_update(&ctx, reinterpret_cast<const unsigned char*>(data.c_str()), data.size());
+        libed2k::sha1_final(&ctx, hash.getContainer());
+        return hash;
+    }
+
+    std::vector<libed2k::aich_hash> piece_blocks(libed2k::size_type file_size, int piece)
+    {
+        libed2k::size_type size = std::min(libed2k::PIECE_SIZE, file_size - piece * libed2k::PIECE_SIZE);
+        std::vector<libed2k::aich_hash> blocks;
+
+        for (libed2k::size_type n = 0; n < libed2k::div_ceil(size, libed2k::AICH_BLOCK_SIZE); ++n)
+            blocks.push_back(make_hash(piece * 1000 + int(n)));
+
+        return blocks;
+    }
+
+    std::vector<libed2k::aich_hash> part_hashes(libed2k::size_type file_size)
+    {
+        std::vector<libed2k::aich_hash> parts;
+
+        for (int piece = 0; piece < int(libed2k::div_ceil(file_size, libed2k::PIECE_SIZE)); ++piece)
+        {
+            libed2k::size_type size = std::min(libed2k::PIECE_SIZE, file_size - piece * libed2k::PIECE_SIZE);
+            parts.push_back(libed2k::aich_part_hash(piece_blocks(file_size, piece), size,
+                                                    libed2k::aich_left_part(file_size, piece)));
+        }
+
+        return parts;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_sha1)
+{
+    BOOST_CHECK_EQUAL(sha1_hex(""), "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+    BOOST_CHECK_EQUAL(sha1_hex("abc"), "a9993e364706816aba3e25717850c26c9cd0d89d");
+    BOOST_CHECK_EQUAL(sha1_hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+                      "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+    BOOST_CHECK_EQUAL(sha1_hex(std::string(1000000, 'a')), "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+}
+
+BOOST_AUTO_TEST_CASE(test_aich_hash_conversion)
+{
+    libed2k::aich_hash hash = make_hash(1);
+    BOOST_CHECK(hash.defined());
+    BOOST_CHECK(!libed2k::aich_hash().defined());
+    BOOST_CHECK_EQUAL(hash.toString().size(), 32U);
+    BOOST_CHECK(libed2k::aich_hash::fromString(hash.toString()) == hash);
+    BOOST_CHECK(!libed2k::aich_hash::fromString("XXX").defined());
+}
+
+BOOST_AUTO_TEST_CASE(test_piece_hasher)
+{
+    std::string data(libed2k::AICH_BLOCK_SIZE * 2 + 100, '\0');
+
+    for (size_t n = 0; n < data.size(); ++n)
+        data[n] = static_cast<char>(n * 7);
+
+    libed2k::aich_piece_hasher whole;
+    whole.update(data.c_str(), data.size());
+
+    libed2k::aich_piece_hasher chunked;
+    for (size_t pos = 0; pos < data.size(); pos += 1000)
+        chunked.update(data.c_str() + pos, std::min<size_t>(1000, data.size() - pos));
+
+    BOOST_REQUIRE_EQUAL(whole.block_hashes().size(), 3U);
+    BOOST_CHECK(whole.block_hashes() == chunked.block_hashes());
+    BOOST_CHECK(whole.final(true) == chunked.final(true));
+
+    // three blocks: left branch gives two blocks to the left child, right branch one
+    libed2k::aich_piece_hasher left;
+    left.update(data.c_str(), data.size());
+    libed2k::aich_piece_hasher right;
+    right.update(data.c_str(), data.size());
+    BOOST_CHECK(left.final(true) != right.final(false));
+
+    // data smaller than one block hashes to the block itself
+    libed2k::aich_piece_hasher small;
+    small.update(data.c_str(), 100);
+    BOOST_CHECK(small.final(true) == small.block_hashes()[0]);
+}
+
+BOOST_AUTO_TEST_CASE(test_tree_geometry)
+{
+    // single piece file tree is the piece itself
+    libed2k::size_type file_size = libed2k::PIECE_SIZE - 1000;
+    std::vector<libed2k::aich_hash> parts = part_hashes(file_size);
+    BOOST_REQUIRE_EQUAL(parts.size(), 1U);
+    BOOST_CHECK(libed2k::aich_root_hash(file_size, parts) == parts[0]);
+
+    // three pieces: root gives two pieces to the left, which splits them in halves
+    file_size = libed2k::PIECE_SIZE * 2 + 1000;
+    BOOST_CHECK(libed2k::aich_left_part(file_size, 0));
+    BOOST_CHECK(!libed2k::aich_left_part(file_size, 1));
+    BOOST_CHECK(!libed2k::aich_left_part(file_size, 2));
+}
+
+BOOST_AUTO_TEST_CASE(test_recovery_data)
+{
+    const libed2k::size_type sizes[] = {
+        libed2k::PIECE_SIZE + libed2k::AICH_BLOCK_SIZE * 3 + 17,
+        libed2k::PIECE_SIZE * 5,
+        libed2k::PIECE_SIZE * 7 - 1 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        std::vector<libed2k::aich_hash> parts = part_hashes(sizes[s]);
+        libed2k::aich_hash root = libed2k::aich_root_hash(sizes[s], parts);
+
+        for (int piece = 0; piece < int(parts.size()); ++piece)
+        {
+            std::vector<libed2k::aich_hash> blocks = piece_blocks(sizes[s], piece);
+            libed2k::aich_recovery_data data;
+            BOOST_REQUIRE(libed2k::aich_make_recovery_data(sizes[s], piece, parts, blocks, data));
+
+            // goes through the wire format
+            std::ostringstream sstream_out(std::ios_base::binary);
+            libed2k::archive::ed2k_oarchive out_string_archive(sstream_out);
+            out_string_archive << data;
+
+            std::istringstream sstream_in(sstream_out.str(), std::ios_base::binary);
+            libed2k::archive::ed2k_iarchive in_string_archive(sstream_in);
+            libed2k::aich_recovery_data received;
+            in_string_archive >> received;
+            BOOST_REQUIRE_EQUAL(received.m_hashes.size(), data.m_hashes.size());
+
+            std::vector<libed2k::aich_hash> trusted;
+            BOOST_CHECK(libed2k::aich_check_recovery_data(sizes[s], piece, root, received, trusted));
+            BOOST_CHECK(trusted == blocks);
+
+            // corrupt block hash
+            libed2k::aich_recovery_data tampered = received;
+            tampered.m_hashes.back().second = make_hash(-1);
+            trusted.clear();
+            BOOST_CHECK(!libed2k::aich_check_recovery_data(sizes[s], piece, root, tampered, trusted));
+            BOOST_CHECK(trusted.empty());
+
+            // wrong piece
+            BOOST_CHECK(!libed2k::aich_check_recovery_data(sizes[s], (piece + 1) % int(parts.size()), root, received, trusted));
+
+            // blocks which do not give the piece hash
+            std::vector<libed2k::aich_hash> wrong_blocks = blocks;
+            wrong_blocks[0] = make_hash(-2);
+            BOOST_CHECK(!libed2k::aich_make_recovery_data(sizes[s], piece, parts, wrong_blocks, data));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
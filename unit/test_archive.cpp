@@ -683,6 +683,45 @@ BOOST_AUTO_TEST_CASE(test_packets)
     BOOST_CHECK(flist.m_collection[2].m_network_point.m_nPort == 5);
 }
 
+BOOST_AUTO_TEST_CASE(test_source_exchange_packets)
+{
+    libed2k::client_answer_sources2 as;
+    as.m_hFile = libed2k::md4_hash::terminal;
+    as.m_sources.resize(2);
+    as.m_sources[0].m_nUserId = 0x0100007F;
+    as.m_sources[0].m_nPort = 4662;
+    as.m_sources[1].m_nUserId = 0x0200007F;
+    as.m_sources[1].m_nPort = 4663;
+    as.m_sources[1].m_hUser = libed2k::md4_hash::emule;
+    as.m_sources[1].m_nCryptOptions = 1;
+
+    for (boost::uint8_t version = 1; version <= libed2k::SOURCE_EXCHANGE2_VERSION; ++version)
+    {
+        as.m_nVersion = version;
+        std::stringstream sstream_out(std::ios::out | std::ios::in | std::ios::binary);
+        libed2k::archive::ed2k_oarchive out_string_archive(sstream_out);
+        out_string_archive << as;
+
+        // <version 1><hash 16><count 2> and <id 4><port 2><server ip 4><server port 2>
+        // per source, user hash since version 2, crypt options since version 4
+        size_t source_size = 12 + (version >= 2 ? 16 : 0) + (version >= 4 ? 1 : 0);
+        BOOST_CHECK_EQUAL(sstream_out.str().size(), 19 + 2 * source_size);
+
+        sstream_out.seekg(0, std::ios::beg);
+        libed2k::archive::ed2k_iarchive in_string_archive(sstream_out);
+        libed2k::client_answer_sources2 das;
+        in_string_archive >> das;
+
+        BOOST_CHECK_EQUAL(das.m_nVersion, version);
+        BOOST_CHECK(das.m_hFile == as.m_hFile);
+        BOOST_REQUIRE_EQUAL(das.m_sources.size(), 2U);
+        BOOST_CHECK_EQUAL(das.m_sources[0].m_nUserId, 0x0100007FU);
+        BOOST_CHECK_EQUAL(das.m_sources[1].m_nPort, 4663);
+        BOOST_CHECK(das.m_sources[1].m_hUser == (version >= 2 ? libed2k::md4_hash::emule : libed2k::md4_hash()));
+        BOOST_CHECK_EQUAL(das.m_sources[1].m_nCryptOptions, version >= 4 ? 1 : 0);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(test_emule_collection)
 {
 #ifdef WIN32
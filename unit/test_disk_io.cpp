@@ -0,0 +1,1023 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include "libed2k/allocator.hpp"
+#include "libed2k/disk_io_thread.hpp"
+#include "libed2k/disk_buffer_holder.hpp"
+#include "libed2k/file_pool.hpp"
+#include "libed2k/mapped_storage.hpp"
+#include "libed2k/transfer_info.hpp"
+#include "libed2k/peer_request.hpp"
+#include "libed2k/hasher.hpp"
+#include "libed2k/bencode.hpp"
+#include "libed2k/lazy_entry.hpp"
+#include "common.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_disk_io)
+
+namespace
+{
+    const char* const filename = "test_disk_io.bin";
+
+    // single piece of a few blocks, written out of order and verified
+    struct piece_writer
+    {
+        piece_writer(int hashing_threads, bool quick_resume_verify = true
+            , bool use_io_uring = false, libed2k::mapping_cache* mappings = 0
+            , int io_buffer_mode = libed2k::session_settings::enable_os_cache) :
+            m_disk_thread(m_ios, boost::function<void()>(), m_files, libed2k::BLOCK_SIZE),
+            m_data(libed2k::BLOCK_SIZE * 5 + 1000, '\0'),
+            m_hash_result(1),
+            m_check_result(1),
+            m_fastresume_result(1),
+            m_have_piece(-1),
+            m_reads(0),
+            m_move_result(1),
+            m_move_reports(0),
+            m_moved(0),
+            m_released(false)
+        {
+            for (size_t n = 0; n < m_data.size(); ++n)
+                m_data[n] = static_cast<char>(n % 251);
+
+            libed2k::md4_hash hash = libed2k::hasher(&m_data[0], m_data.size()).final();
+            boost::intrusive_ptr<libed2k::transfer_info> info(
+                new libed2k::transfer_info(hash, filename, m_data.size()));
+
+            libed2k::storage_constructor_type sc = libed2k::default_storage_constructor;
+            if (mappings) sc = boost::bind(&libed2k::mapped_storage_constructor
+                , _1, _2, _3, _4, _5, boost::ref(*mappings));
+
+            m_holder.hold(filename);
+            m_storage = new libed2k::piece_manager(boost::shared_ptr<void>(), info, ".", m_files,
+                m_disk_thread, sc, libed2k::storage_mode_sparse, std::vector<boost::uint8_t>());
+
+            libed2k::session_settings* settings = new libed2k::session_settings();
+            settings->hashing_threads = hashing_threads;
+            settings->quick_resume_verify = quick_resume_verify;
+            settings->use_io_uring = use_io_uring;
+            settings->disk_io_write_mode = io_buffer_mode;
+            settings->disk_io_read_mode = io_buffer_mode;
+            libed2k::disk_io_job j;
+            j.action = libed2k::disk_io_job::update_settings;
+            j.buffer = reinterpret_cast<char*>(settings);
+            m_disk_thread.add_job(j);
+        }
+
+        ~piece_writer()
+        {
+            m_disk_thread.abort();
+            m_ios.run();
+            m_disk_thread.join();
+        }
+
+        void write(int block, char corrupt = 0)
+        {
+            libed2k::peer_request r;
+            r.piece = 0;
+            r.start = block * libed2k::BLOCK_SIZE;
+            r.length = std::min<int>(libed2k::BLOCK_SIZE, int(m_data.size()) - r.start);
+
+            libed2k::disk_buffer_holder buffer(m_disk_thread, m_disk_thread.allocate_buffer("test"));
+            memcpy(buffer.get(), &m_data[r.start], r.length);
+            buffer.get()[0] ^= corrupt;
+            m_storage->async_write(r, buffer, boost::bind(&piece_writer::on_write, this, _1, _2));
+        }
+
+        // queues reads of all blocks and waits for them
+        void read_all()
+        {
+            int blocks = (int(m_data.size()) + libed2k::BLOCK_SIZE - 1) / libed2k::BLOCK_SIZE;
+            for (int block = 0; block < blocks; ++block)
+            {
+                libed2k::peer_request r;
+                r.piece = 0;
+                r.start = block * libed2k::BLOCK_SIZE;
+                r.length = std::min<int>(libed2k::BLOCK_SIZE, int(m_data.size()) - r.start);
+                m_storage->async_read(r, boost::bind(&piece_writer::on_read, this, _1, _2));
+            }
+            while (m_reads < blocks) m_ios.run_one();
+        }
+
+        int verify()
+        {
+            m_storage->async_hash(0, boost::bind(&piece_writer::on_hash, this, _1, _2));
+            while (m_hash_result == 1) m_ios.run_one();
+            return m_hash_result;
+        }
+
+        // puts the piece on disk behind the storage's back, its middle
+        // is not among the pages sampled for fingerprints
+        void store(char corrupt = 0, size_t offset = std::string::npos)
+        {
+            std::vector<char> data(m_data);
+            data[offset == std::string::npos ? data.size() / 2 : offset] ^= corrupt;
+            std::ofstream of(filename, std::ios_base::binary | std::ios_base::out);
+            of.write(&data[0], data.size());
+        }
+
+        int check()
+        {
+            m_storage->async_check_files(boost::bind(&piece_writer::on_check, this, _1, _2));
+            while (m_check_result == 1) m_ios.run_one();
+            return m_check_result;
+        }
+
+        libed2k::entry save_resume_data()
+        {
+            m_storage->async_save_resume_data(boost::bind(&piece_writer::on_resume_data, this, _1, _2));
+            while (!m_resume_data) m_ios.run_one();
+            return *m_resume_data;
+        }
+
+        int check_fastresume(const libed2k::entry& rd)
+        {
+            libed2k::bencode(std::back_inserter(m_resume_buffer), rd);
+            libed2k::error_code ec;
+            BOOST_REQUIRE(libed2k::lazy_bdecode(&m_resume_buffer[0]
+                , &m_resume_buffer[0] + m_resume_buffer.size(), m_resume_entry, ec) == 0);
+
+            m_storage->async_check_fastresume(&m_resume_entry
+                , boost::bind(&piece_writer::on_fastresume, this, _1, _2));
+            while (m_fastresume_result == 1) m_ios.run_one();
+            return m_fastresume_result;
+        }
+
+        void move_storage(std::string const& path, libed2k::disk_io_thread* io = 0)
+        {
+            m_move_result = 1;
+            m_moved = 0;
+            m_storage->async_move_storage(path, boost::bind(&piece_writer::on_move, this, _1, _2), io);
+        }
+
+        // flushes the cache and waits for the files to be closed
+        void release()
+        {
+            m_released = false;
+            m_storage->async_release_files(boost::bind(&piece_writer::on_release, this, _1, _2));
+            while (!m_released) m_ios.run_one();
+        }
+
+        void on_release(int ret, libed2k::disk_io_job const& j)
+        {
+            m_released = true;
+        }
+
+        int wait_move()
+        {
+            while (m_move_result > 0) m_ios.run_one();
+            return m_move_result;
+        }
+
+        void on_move(int ret, libed2k::disk_io_job const& j)
+        {
+            if (ret <= 0)
+            {
+                m_move_result = ret;
+                m_move_error = j.error;
+                return;
+            }
+            BOOST_CHECK(j.moved < j.move_size);
+            BOOST_CHECK(j.moved >= m_moved);
+            m_moved = j.moved;
+            ++m_move_reports;
+        }
+
+        void on_fastresume(int ret, libed2k::disk_io_job const& j)
+        {
+            m_fastresume_result = ret;
+        }
+
+        void on_read(int ret, libed2k::disk_io_job const& j)
+        {
+            libed2k::disk_buffer_holder buffer(m_disk_thread, j.buffer);
+            BOOST_REQUIRE_EQUAL(ret, j.buffer_size);
+            BOOST_CHECK(memcmp(buffer.get(), &m_data[j.offset], j.buffer_size) == 0);
+            ++m_reads;
+        }
+
+        void on_resume_data(int ret, libed2k::disk_io_job const& j)
+        {
+            m_resume_data = j.resume_data;
+        }
+
+        void on_write(int ret, libed2k::disk_io_job const& j)
+        {
+            BOOST_CHECK_EQUAL(ret, j.buffer_size);
+        }
+
+        void on_hash(int ret, libed2k::disk_io_job const& j)
+        {
+            m_hash_result = ret;
+        }
+
+        void on_check(int ret, libed2k::disk_io_job const& j)
+        {
+            if (j.offset >= 0) m_have_piece = j.offset;
+            if (ret != libed2k::piece_manager::need_full_check) m_check_result = ret;
+        }
+
+        libed2k::io_service m_ios;
+        libed2k::file_pool m_files;
+        libed2k::disk_io_thread m_disk_thread;
+        boost::intrusive_ptr<libed2k::piece_manager> m_storage;
+        std::vector<char> m_data;
+        test_files_holder m_holder;
+        int m_hash_result;
+        int m_check_result;
+        int m_fastresume_result;
+        int m_have_piece;
+        int m_reads;
+        int m_move_result;
+        int m_move_reports;
+        libed2k::size_type m_moved;
+        libed2k::error_code m_move_error;
+        bool m_released;
+        boost::shared_ptr<libed2k::entry> m_resume_data;
+        std::vector<char> m_resume_buffer;
+        libed2k::lazy_entry m_resume_entry;
+    };
+}
+
+namespace
+{
+    // reads blocks of a sparse file of a few pieces through a small read cache
+    struct cache_reader
+    {
+        cache_reader(int pieces) :
+            m_disk_thread(m_ios, boost::function<void()>(), m_files, libed2k::BLOCK_SIZE),
+            m_done(false)
+        {
+            libed2k::size_type size = libed2k::PIECE_SIZE * pieces;
+            m_holder.hold(filename);
+            std::ofstream of(filename, std::ios_base::binary | std::ios_base::out);
+            of.seekp(size - 1);
+            of.put('\0');
+            of.close();
+
+            boost::intrusive_ptr<libed2k::transfer_info> info(
+                new libed2k::transfer_info(libed2k::md4_hash(), filename, size));
+            m_storage = new libed2k::piece_manager(boost::shared_ptr<void>(), info, ".", m_files,
+                m_disk_thread, libed2k::default_storage_constructor, libed2k::storage_mode_sparse,
+                std::vector<boost::uint8_t>());
+
+            libed2k::session_settings* settings = new libed2k::session_settings();
+            settings->cache_size = 8;
+            settings->read_cache_line_size = 2;
+            settings->default_cache_min_age = 0;
+            libed2k::disk_io_job j;
+            j.action = libed2k::disk_io_job::update_settings;
+            j.buffer = reinterpret_cast<char*>(settings);
+            m_disk_thread.add_job(j);
+        }
+
+        ~cache_reader()
+        {
+            m_disk_thread.abort();
+            m_ios.run();
+            m_disk_thread.join();
+        }
+
+        void read(int piece, int block)
+        {
+            read_range(piece, block * libed2k::BLOCK_SIZE, libed2k::BLOCK_SIZE);
+        }
+
+        void read_range(int piece, int start, int length)
+        {
+            libed2k::peer_request r;
+            r.piece = piece;
+            r.start = start;
+            r.length = length;
+            m_done = false;
+            m_storage->async_read(r, boost::bind(&cache_reader::on_read, this, _1, _2));
+            while (!m_done) m_ios.run_one();
+        }
+
+        void on_read(int ret, libed2k::disk_io_job const& j)
+        {
+            libed2k::disk_buffer_holder buffer(m_disk_thread, j.buffer);
+            BOOST_CHECK_EQUAL(ret, j.buffer_size);
+            m_done = true;
+        }
+
+        int read_ahead(int piece, int start, int length)
+        {
+            libed2k::peer_request r;
+            r.piece = piece;
+            r.start = start;
+            r.length = length;
+            m_done = false;
+            m_storage->async_read_ahead(r, boost::bind(&cache_reader::on_read_ahead, this, _1, _2));
+            while (!m_done) m_ios.run_one();
+            return m_ret;
+        }
+
+        void on_read_ahead(int ret, libed2k::disk_io_job const&)
+        {
+            m_ret = ret;
+            m_done = true;
+        }
+
+        // the buffer of the returned job has to be freed by the caller
+        libed2k::disk_io_job reference(int piece, int start, int length)
+        {
+            libed2k::peer_request r;
+            r.piece = piece;
+            r.start = start;
+            r.length = length;
+            m_done = false;
+            m_storage->async_read(r, boost::bind(&cache_reader::on_reference, this, _1, _2)
+                , 0, 0, libed2k::disk_io_job::cache_reference);
+            while (!m_done) m_ios.run_one();
+            return m_job;
+        }
+
+        void on_reference(int ret, libed2k::disk_io_job const& j)
+        {
+            BOOST_CHECK_EQUAL(ret, j.buffer_size);
+            m_job = j;
+            m_done = true;
+        }
+
+        void clear_cache()
+        {
+            m_done = false;
+            m_storage->async_clear_read_cache(boost::bind(&cache_reader::on_read_ahead, this, _1, _2));
+            while (!m_done) m_ios.run_one();
+        }
+
+        libed2k::io_service m_ios;
+        libed2k::file_pool m_files;
+        libed2k::disk_io_thread m_disk_thread;
+        boost::intrusive_ptr<libed2k::piece_manager> m_storage;
+        test_files_holder m_holder;
+        bool m_done;
+        int m_ret;
+        libed2k::disk_io_job m_job;
+    };
+}
+
+BOOST_AUTO_TEST_CASE(test_verify_without_read_back)
+{
+    const int order[] = { 3, 1, 5, 0, 4, 2 };
+
+    for (int threads = 0; threads < 3; ++threads)
+    {
+        piece_writer w(threads);
+        for (size_t n = 0; n < sizeof(order) / sizeof(order[0]); ++n) w.write(order[n]);
+
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+        BOOST_CHECK_EQUAL(w.m_disk_thread.status().total_read_back, 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_hash_cached_blocks)
+{
+    {
+        // blocks behind the gap stay in the write cache until it's filled
+        piece_writer w(0);
+        for (int block = 5; block > 0; --block) w.write(block);
+        for (int n = 0; n < 100 && w.m_disk_thread.status().cache_size < 5; ++n) libed2k::sleep(10);
+        BOOST_CHECK_EQUAL(w.m_disk_thread.status().cache_size, 5);
+        BOOST_CHECK_EQUAL(w.m_disk_thread.status().blocks_written, 0);
+
+        w.write(0);
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+        BOOST_CHECK_EQUAL(w.m_disk_thread.status().total_read_back, 0);
+    }
+
+    {
+        // out of space, blocks not hashed yet are written and read back later
+        piece_writer w(0);
+        libed2k::session_settings* settings = new libed2k::session_settings();
+        settings->hashing_threads = 0;
+        settings->cache_size = 2;
+        libed2k::disk_io_job j;
+        j.action = libed2k::disk_io_job::update_settings;
+        j.buffer = reinterpret_cast<char*>(settings);
+        w.m_disk_thread.add_job(j);
+
+        for (int block = 5; block >= 0; --block) w.write(block);
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+        BOOST_CHECK(w.m_disk_thread.status().total_read_back > 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_verify_corrupt_piece)
+{
+    for (int threads = 0; threads < 2; ++threads)
+    {
+        piece_writer w(threads);
+        for (int block = 5; block >= 0; --block) w.write(block, block == 2 ? 1 : 0);
+
+        BOOST_CHECK_EQUAL(w.verify(), -2);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_check_files)
+{
+    for (int threads = 0; threads < 2; ++threads)
+    {
+        for (char corrupt = 0; corrupt < 2; ++corrupt)
+        {
+            piece_writer w(threads);
+            w.store(corrupt);
+
+            BOOST_CHECK_EQUAL(w.check(), 0);
+            BOOST_CHECK_EQUAL(w.m_have_piece, corrupt ? -1 : 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_quick_resume_verify)
+{
+    libed2k::entry rd;
+
+    {
+        piece_writer w(1);
+        for (int block = 0; block < 6; ++block) w.write(block);
+        BOOST_REQUIRE_EQUAL(w.verify(), 0);
+        rd = w.save_resume_data();
+    }
+
+    BOOST_REQUIRE_EQUAL(rd["piece fingerprints"].string().size(), 8U);
+    rd["pieces"] = std::string(1, '\x01');
+    // timestamps no longer match, like after files were restored from backup
+    libed2k::entry::list_type& file_size = rd["file sizes"].list().front().list();
+    file_size.back() = file_size.back().integer() + 10;
+
+    {
+        // only sampled pages are read, the middle of the piece is trusted
+        piece_writer w(1);
+        w.store(1);
+        BOOST_CHECK_EQUAL(w.check_fastresume(rd), libed2k::piece_manager::need_full_check);
+        BOOST_CHECK_EQUAL(w.check(), 0);
+        BOOST_CHECK_EQUAL(w.m_have_piece, 0);
+    }
+
+    {
+        // a changed sampled page gets the piece hashed in full
+        piece_writer w(1);
+        w.store(1, 0);
+        BOOST_CHECK_EQUAL(w.check_fastresume(rd), libed2k::piece_manager::need_full_check);
+        BOOST_CHECK_EQUAL(w.check(), 0);
+        BOOST_CHECK_EQUAL(w.m_have_piece, -1);
+    }
+
+    {
+        piece_writer w(1, false);
+        w.store(1);
+        BOOST_CHECK_EQUAL(w.check_fastresume(rd), libed2k::piece_manager::need_full_check);
+        BOOST_CHECK_EQUAL(w.check(), 0);
+        BOOST_CHECK_EQUAL(w.m_have_piece, -1);
+    }
+
+    {
+        // a piece the resume data doesn't have is hashed in full
+        rd["pieces"] = std::string(1, '\x00');
+        piece_writer w(1);
+        w.store();
+        BOOST_CHECK_EQUAL(w.check_fastresume(rd), libed2k::piece_manager::need_full_check);
+        BOOST_CHECK_EQUAL(w.check(), 0);
+        BOOST_CHECK_EQUAL(w.m_have_piece, 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_io_uring)
+{
+    // falls back to blocking I/O where io_uring can't be used
+    for (int threads = 0; threads < 2; ++threads)
+    {
+        piece_writer w(threads, true, true);
+        for (int block = 0; block < 6; ++block) w.write(block);
+
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+        BOOST_CHECK_EQUAL(w.m_disk_thread.status().total_read_back, 0);
+        w.read_all();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_mapped_storage)
+{
+    libed2k::mapping_cache mappings(1);
+
+    {
+        piece_writer w(1, true, false, &mappings);
+        for (int block = 0; block < 6; ++block) w.write(block);
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+
+        // written through the mapping, regular reads see it
+        std::vector<char> data(w.m_data.size());
+        std::ifstream in(filename, std::ios_base::binary | std::ios_base::in);
+        BOOST_REQUIRE(in.read(&data[0], data.size()));
+        BOOST_CHECK(data == w.m_data);
+    }
+
+    // the storage unmapped its file when it went away
+    BOOST_CHECK_EQUAL(mappings.num_windows(), 0);
+
+    {
+        // blocks not in the cache are copied out of the mapping
+        piece_writer w(1, true, false, &mappings);
+        w.store();
+        w.read_all();
+#if LIBED2K_USE_MMAP
+        BOOST_CHECK_EQUAL(mappings.num_windows(), 1);
+#endif
+    }
+
+    BOOST_CHECK_EQUAL(mappings.num_windows(), 0);
+}
+
+#if LIBED2K_USE_MMAP && defined LIBED2K_LINUX
+BOOST_AUTO_TEST_CASE(test_mapped_write_allocates)
+{
+    test_files_holder holder;
+    holder.hold(filename);
+    libed2k::error_code ec;
+    boost::intrusive_ptr<libed2k::file> f(new libed2k::file(filename
+        , libed2k::file::read_write | libed2k::file::sparse, ec));
+    BOOST_REQUIRE(!ec);
+
+    // the sparse file is extended with a hole, the window mapped
+    // for writing has none a full disk would fault in
+    const libed2k::size_type file_size = 1024 * 1024;
+    libed2k::mapping_cache mappings(1);
+    libed2k::mapping_cache::window* w = 0;
+    int size = libed2k::BLOCK_SIZE;
+    char* p = mappings.pin(&mappings, 0, f, 0, file_size, true, size, w);
+    BOOST_REQUIRE(p);
+    mappings.unpin(w, p, 0);
+    mappings.release(&mappings);
+
+    struct stat st;
+    BOOST_REQUIRE(stat(filename, &st) == 0);
+    BOOST_CHECK_EQUAL(st.st_size, file_size);
+    BOOST_CHECK_GE(libed2k::size_type(st.st_blocks) * 512, file_size);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(test_direct_io)
+{
+    {
+        // whole blocks bypass the OS cache, the short last one doesn't
+        piece_writer w(0, true, false, 0, libed2k::session_settings::disable_os_cache_for_aligned_blocks);
+        for (int block = 0; block < 6; ++block) w.write(block);
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+        w.read_all();
+
+        std::vector<char> data(w.m_data.size() + 1);
+        std::ifstream in(filename, std::ios_base::binary | std::ios_base::in);
+        BOOST_CHECK_EQUAL(in.read(&data[0], data.size()).gcount(), int(w.m_data.size()));
+        data.resize(w.m_data.size());
+        BOOST_CHECK(data == w.m_data);
+    }
+
+    test_files_holder holder;
+    holder.hold(filename);
+    libed2k::error_code ec;
+    libed2k::file f(filename, libed2k::file::read_write | libed2k::file::direct_io, ec);
+    BOOST_REQUIRE(!ec);
+
+    libed2k::aligned_holder buf(libed2k::BLOCK_SIZE);
+    memset(buf.get(), 'a', libed2k::BLOCK_SIZE);
+    libed2k::file::iovec_t b = { buf.get(), libed2k::BLOCK_SIZE };
+    BOOST_CHECK_EQUAL(f.writev(0, &b, 1, ec), libed2k::BLOCK_SIZE);
+    b.iov_len = 100;
+    BOOST_CHECK_EQUAL(f.writev(libed2k::BLOCK_SIZE, &b, 1, ec), 100);
+    BOOST_CHECK_EQUAL(f.get_size(ec), libed2k::BLOCK_SIZE + 100);
+
+    // not every filesystem takes O_DIRECT
+    if (f.open_mode() & libed2k::file::direct_io)
+    {
+        b.iov_len = libed2k::BLOCK_SIZE;
+        BOOST_CHECK(f.io_handle(0, &b, 1) != f.native_handle());
+        BOOST_CHECK(f.io_handle(1, &b, 1) == f.native_handle());
+        b.iov_len = 100;
+        BOOST_CHECK(f.io_handle(0, &b, 1) == f.native_handle());
+    }
+
+    memset(buf.get(), 0, libed2k::BLOCK_SIZE);
+    b.iov_len = libed2k::BLOCK_SIZE;
+    BOOST_CHECK_EQUAL(f.readv(100, &b, 1, ec), libed2k::BLOCK_SIZE);
+    BOOST_CHECK_EQUAL(std::count(buf.get(), buf.get() + libed2k::BLOCK_SIZE, 'a'), libed2k::BLOCK_SIZE);
+    BOOST_CHECK(!ec);
+}
+
+BOOST_AUTO_TEST_CASE(test_move_storage)
+{
+    // the files are copied to another device, tmpfs usually is one
+    std::string path = "/dev/shm/test_move_storage";
+    if (libed2k::path_device(path) == libed2k::path_device(".")) return;
+
+    {
+        piece_writer w(0);
+        for (int block = 0; block < 6; ++block) w.write(block);
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+
+        libed2k::session_settings* settings = new libed2k::session_settings();
+        settings->hashing_threads = 0;
+        settings->move_storage_slice_size = libed2k::BLOCK_SIZE;
+        libed2k::disk_io_job j;
+        j.action = libed2k::disk_io_job::update_settings;
+        j.buffer = reinterpret_cast<char*>(settings);
+        w.m_disk_thread.add_job(j);
+
+        // reads are served from the old path between the slices
+        w.move_storage(path);
+        w.read_all();
+        BOOST_CHECK_EQUAL(w.wait_move(), 0);
+        BOOST_CHECK_EQUAL(w.m_move_reports, 5);
+        BOOST_CHECK(!libed2k::exists(filename));
+
+        std::string moved = libed2k::combine_path(path, filename);
+        std::vector<char> data(w.m_data.size());
+        std::ifstream in(moved.c_str(), std::ios_base::binary | std::ios_base::in);
+        BOOST_REQUIRE(in.read(&data[0], data.size()));
+        BOOST_CHECK(data == w.m_data);
+
+        w.m_reads = 0;
+        w.read_all();
+    }
+
+    libed2k::error_code ec;
+    libed2k::remove_all(path, ec);
+}
+
+BOOST_AUTO_TEST_CASE(test_move_to_device_thread)
+{
+    std::string path = "/dev/shm/test_move_storage";
+    if (libed2k::path_device(path) == libed2k::path_device(".")) return;
+
+    {
+        piece_writer w(0);
+        libed2k::disk_io_thread second(w.m_ios, boost::function<void()>(), w.m_files
+            , libed2k::BLOCK_SIZE, &w.m_disk_thread);
+
+        // blocks cached by the first thread are written out before
+        // the second one takes the storage
+        for (int block = 0; block < 3; ++block) w.write(block);
+        w.move_storage(path, &second);
+        for (int block = 3; block < 6; ++block) w.write(block);
+        BOOST_CHECK_EQUAL(w.wait_move(), 0);
+        BOOST_CHECK(&w.m_storage->io_thread() == &second);
+
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+        w.read_all();
+        BOOST_CHECK(second.status().blocks_read > 0);
+
+        second.abort();
+        second.join();
+    }
+
+    libed2k::error_code ec;
+    libed2k::remove_all(path, ec);
+}
+
+BOOST_AUTO_TEST_CASE(test_write_during_move)
+{
+    std::string path = "/dev/shm/test_move_storage";
+    if (libed2k::path_device(path) == libed2k::path_device(".")) return;
+
+    {
+        // flushed blocks don't go around the storage with io_uring
+        piece_writer w(0, true, true);
+        for (int block = 0; block < 6; ++block) w.write(block);
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+
+        libed2k::session_settings* settings = new libed2k::session_settings();
+        settings->hashing_threads = 0;
+        settings->use_io_uring = true;
+        settings->move_storage_slice_size = 1024;
+        libed2k::disk_io_job j;
+        j.action = libed2k::disk_io_job::update_settings;
+        j.buffer = reinterpret_cast<char*>(settings);
+        w.m_disk_thread.add_job(j);
+
+        // the first block is written again and flushed once it's copied
+        w.move_storage(path);
+        while (w.m_move_reports == 0 && w.m_move_result > 0) w.m_ios.run_one();
+        w.write(0, 1);
+        w.release();
+        BOOST_CHECK_EQUAL(w.wait_move(), 0);
+
+        std::string moved = libed2k::combine_path(path, filename);
+        std::vector<char> data(w.m_data.size());
+        std::ifstream in(moved.c_str(), std::ios_base::binary | std::ios_base::in);
+        BOOST_REQUIRE(in.read(&data[0], data.size()));
+        w.m_data[0] ^= 1;
+        BOOST_CHECK(data == w.m_data);
+    }
+
+    libed2k::error_code ec;
+    libed2k::remove_all(path, ec);
+}
+
+BOOST_AUTO_TEST_CASE(test_move_downloading_file)
+{
+    std::string path = "/dev/shm/test_move_storage";
+    if (libed2k::path_device(path) == libed2k::path_device(".")) return;
+
+    {
+        piece_writer w(0);
+        for (int block = 0; block < 6; ++block) w.write(block);
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+
+        libed2k::session_settings* settings = new libed2k::session_settings();
+        settings->hashing_threads = 0;
+        settings->move_storage_slice_size = 1024;
+        libed2k::disk_io_job j;
+        j.action = libed2k::disk_io_job::update_settings;
+        j.buffer = reinterpret_cast<char*>(settings);
+        w.m_disk_thread.add_job(j);
+
+        // the first block is written behind the copy after every slice of
+        // the first half, the move still goes on and finishes
+        w.move_storage(path);
+        char corrupt = 0;
+        while (w.m_move_result > 0 && w.m_move_reports < 100000)
+        {
+            int reports = w.m_move_reports;
+            w.m_ios.run_one();
+            if (w.m_move_reports == reports || w.m_moved >= libed2k::size_type(w.m_data.size() / 2)) continue;
+
+            corrupt = corrupt == 1 ? 2 : 1;
+            w.write(0, corrupt);
+            w.release();
+        }
+        BOOST_CHECK_EQUAL(w.m_move_result, 0);
+        BOOST_CHECK(corrupt != 0);
+
+        std::string moved = libed2k::combine_path(path, filename);
+        std::vector<char> data(w.m_data.size());
+        std::ifstream in(moved.c_str(), std::ios_base::binary | std::ios_base::in);
+        BOOST_REQUIRE(in.read(&data[0], data.size()));
+        w.m_data[0] ^= corrupt;
+        BOOST_CHECK(data == w.m_data);
+    }
+
+    libed2k::error_code ec;
+    libed2k::remove_all(path, ec);
+}
+
+BOOST_AUTO_TEST_CASE(test_abort_move)
+{
+    std::string path = "/dev/shm/test_move_storage";
+    if (libed2k::path_device(path) == libed2k::path_device(".")) return;
+
+    {
+        piece_writer w(0);
+        for (int block = 0; block < 6; ++block) w.write(block);
+        BOOST_CHECK_EQUAL(w.verify(), 0);
+
+        libed2k::session_settings* settings = new libed2k::session_settings();
+        settings->hashing_threads = 0;
+        // tiny slices, the move can't be through before it's aborted
+        settings->move_storage_slice_size = 16;
+        libed2k::disk_io_job j;
+        j.action = libed2k::disk_io_job::update_settings;
+        j.buffer = reinterpret_cast<char*>(settings);
+        w.m_disk_thread.add_job(j);
+
+        // the move is cancelled with the transfer's disk jobs
+        w.move_storage(path);
+        while (w.m_move_reports == 0 && w.m_move_result > 0) w.m_ios.run_one();
+        w.m_storage->abort_disk_io();
+        BOOST_CHECK(w.wait_move() < 0);
+        BOOST_CHECK_EQUAL(w.m_move_error, boost::asio::error::operation_aborted);
+
+        // the copy is gone once the abort is through, the files stay
+        // where they were
+        w.release();
+        BOOST_CHECK(!libed2k::exists(libed2k::combine_path(path, filename)));
+        BOOST_CHECK(libed2k::exists(filename));
+    }
+
+    libed2k::error_code ec;
+    libed2k::remove_all(path, ec);
+}
+
+BOOST_AUTO_TEST_CASE(test_file_pool)
+{
+    test_files_holder holder;
+    holder.hold(filename);
+    std::ofstream(filename, std::ios_base::binary | std::ios_base::out).put('\0');
+    libed2k::transfer_info info(libed2k::md4_hash(), filename, 1);
+    libed2k::file_storage const& fs = info.files();
+    std::string path = libed2k::complete(".");
+
+    // storages sharing a file for reading, more of them than handles
+    char storages[20];
+    libed2k::file_pool pool(8);
+    libed2k::error_code ec;
+    for (int n = 0; n < 20; ++n)
+        BOOST_REQUIRE(pool.open_file(&storages[n], path, fs.begin(), fs, libed2k::file::read_only, ec));
+
+    libed2k::size_type hits, misses;
+    pool.status(hits, misses);
+    BOOST_CHECK_EQUAL(hits, 0);
+    BOOST_CHECK_EQUAL(misses, 20);
+
+    // the most recently used handle of every shard is kept
+    BOOST_CHECK(pool.open_file(&storages[19], path, fs.begin(), fs, libed2k::file::read_only, ec));
+    pool.status(hits, misses);
+    BOOST_CHECK_EQUAL(hits, 1);
+
+    pool.release(&storages[19]);
+    BOOST_CHECK(pool.open_file(&storages[19], path, fs.begin(), fs, libed2k::file::read_only, ec));
+    pool.status(hits, misses);
+    BOOST_CHECK_EQUAL(hits, 1);
+    BOOST_CHECK_EQUAL(misses, 21);
+
+    // a pool smaller than the number of shards keeps no more handles than its size
+    libed2k::file_pool small(2);
+    std::vector<boost::intrusive_ptr<libed2k::file> > opened;
+    for (int n = 0; n < 20; ++n)
+    {
+        opened.push_back(small.open_file(&storages[n], path, fs.begin(), fs, libed2k::file::read_only, ec));
+        BOOST_REQUIRE(opened.back());
+    }
+
+    int kept = 0;
+    for (int n = 0; n < 20; ++n)
+        if (opened[n]->refcount() > 1) ++kept;
+    BOOST_CHECK_LE(kept, 2);
+
+    BOOST_CHECK_LE(libed2k::file_pool::default_size(), int(libed2k::file_pool::max_default_size));
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_buffer_pool)
+{
+    libed2k::io_service ios;
+    libed2k::file_pool files;
+    libed2k::disk_io_thread first(ios, boost::function<void()>(), files, libed2k::BLOCK_SIZE);
+    libed2k::disk_io_thread second(ios, boost::function<void()>(), files, libed2k::BLOCK_SIZE, &first);
+
+    // buffers of one device thread are returned to the session through the other
+    char* buf = second.allocate_buffer("test");
+    BOOST_REQUIRE(buf);
+    BOOST_CHECK_EQUAL(first.in_use(), 1);
+    BOOST_CHECK_EQUAL(second.in_use(), 1);
+    first.free_buffer(buf);
+    BOOST_CHECK_EQUAL(second.in_use(), 0);
+
+    // the threads split the cache between them
+    BOOST_CHECK_EQUAL(first.users(), 2);
+    BOOST_CHECK_EQUAL(second.users(), 2);
+
+    second.abort();
+    first.abort();
+    ios.run();
+    second.join();
+    first.join();
+}
+
+BOOST_AUTO_TEST_CASE(test_buffer_magazines)
+{
+    libed2k::disk_buffer_pool pool(libed2k::BLOCK_SIZE);
+
+    // the buffer freed last is taken first by the same thread
+    char* first = pool.allocate_buffer("read cache");
+    BOOST_REQUIRE(first);
+    pool.free_buffer(first);
+    BOOST_CHECK_EQUAL(pool.in_use(), 0);
+    BOOST_CHECK(pool.allocate_buffer("send buffer") == first);
+
+    // buffers freed by another thread go back to the pool when it exits
+    std::vector<char*> bufs;
+    for (int i = 0; i < 20; ++i) bufs.push_back(pool.allocate_buffer("receive buffer"));
+    BOOST_CHECK_EQUAL(pool.in_use(), 21);
+    boost::thread t(boost::bind(&libed2k::disk_buffer_pool::free_multiple_buffers
+        , &pool, &bufs[0], int(bufs.size())));
+    t.join();
+    BOOST_CHECK_EQUAL(pool.in_use(), 1);
+
+    std::map<std::string, libed2k::size_type> categories;
+    pool.category_allocations(categories);
+    BOOST_CHECK_EQUAL(categories["read cache"], 1);
+    BOOST_CHECK_EQUAL(categories["send buffer"], 1);
+    BOOST_CHECK_EQUAL(categories["receive buffer"], 20);
+
+    // only the slab of the buffer in use is kept
+    pool.release_memory();
+    libed2k::size_type total, huge;
+    pool.slab_memory(total, huge);
+    BOOST_CHECK_EQUAL(total, libed2k::BLOCK_SIZE);
+    BOOST_CHECK_EQUAL(huge, 0);
+    pool.free_buffer(first);
+}
+
+BOOST_AUTO_TEST_CASE(test_scan_resistant_read_cache)
+{
+    cache_reader r(3);
+
+    // a block read by two peers makes its piece frequently used
+    r.read(0, 0);
+    r.read(0, 0);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.status().frequent_cache_size, 2);
+
+    // a peer streaming other pieces gets the rest of the cache
+    for (int piece = 1; piece < 3; ++piece)
+    {
+        for (int block = 0; block < 8; ++block) r.read(piece, block);
+    }
+
+    libed2k::cache_status before = r.m_disk_thread.status();
+    BOOST_CHECK_EQUAL(before.read_cache_misses, 3);
+    BOOST_CHECK_EQUAL(before.frequent_cache_size, 2);
+
+    r.read(0, 1);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.status().blocks_read_hit, before.blocks_read_hit + 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_unaligned_sequential_reader)
+{
+    cache_reader r(1);
+
+    // eMule asks for 180KB ranges, they're cut at block boundaries, so
+    // the reader gets most blocks in two parts
+    const int range = 180 * 1024;
+    for (int offset = 0; offset < libed2k::PIECE_SIZE;)
+    {
+        int next = (std::min)(offset + range, int(libed2k::PIECE_SIZE));
+        while (offset < next)
+        {
+            int end = (std::min)(next, int(offset / libed2k::BLOCK_SIZE + 1) * int(libed2k::BLOCK_SIZE));
+            r.read_range(0, offset, end - offset);
+            offset = end;
+        }
+    }
+
+    libed2k::cache_status st = r.m_disk_thread.status();
+    BOOST_CHECK(st.blocks_read_hit > 0);
+    BOOST_CHECK_EQUAL(st.frequent_cache_size, 0);
+
+    // reading the same bytes again is a second reader
+    r.read_range(0, libed2k::PIECE_SIZE - 1000, 1000);
+    BOOST_CHECK(r.m_disk_thread.status().frequent_cache_size > 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_upload_read_ahead)
+{
+    const int block = libed2k::BLOCK_SIZE;
+    cache_reader r(1);
+
+    // the range is read in whole blocks with one read
+    BOOST_CHECK_EQUAL(r.read_ahead(0, block / 2, 3 * block), 4 * block);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.status().read_cache_size, 4);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.status().reads, 1);
+
+    // cached blocks aren't read again and nothing is evicted for the rest
+    BOOST_CHECK_EQUAL(r.read_ahead(0, 2 * block, 10 * block), 4 * block);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.status().read_cache_size, 8);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.status().reads, 2);
+
+    for (int b = 0; b < 8; ++b) r.read(0, b);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.status().blocks_read_hit, 8);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.status().reads, 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_cache_reference)
+{
+    const int block = libed2k::BLOCK_SIZE;
+    cache_reader r(1);
+    BOOST_CHECK_EQUAL(r.read_ahead(0, 0, 2 * block), 2 * block);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.in_use(), 2);
+
+    // both peers get the cached block itself, nothing is copied
+    libed2k::disk_io_job first = r.reference(0, block + 100, 1000);
+    libed2k::disk_io_job second = r.reference(0, block + 200, 1000);
+    BOOST_CHECK(first.buffer != 0);
+    BOOST_CHECK(first.buffer == second.buffer);
+    BOOST_CHECK_EQUAL(first.buffer_offset, 100);
+    BOOST_CHECK_EQUAL(second.buffer_offset, 200);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.in_use(), 2);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.status().blocks_read_hit, 2);
+
+    // a range across blocks is copied
+    libed2k::disk_io_job copy = r.reference(0, block - 100, 1000);
+    BOOST_CHECK_EQUAL(copy.buffer_offset, 0);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.in_use(), 3);
+    r.m_disk_thread.free_buffer(copy.buffer);
+
+    // the block outlives the cache until the last reference is gone
+    r.clear_cache();
+    BOOST_CHECK_EQUAL(r.m_disk_thread.in_use(), 1);
+    r.m_disk_thread.free_buffer(first.buffer);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.in_use(), 1);
+    r.m_disk_thread.free_buffer(second.buffer);
+    BOOST_CHECK_EQUAL(r.m_disk_thread.in_use(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
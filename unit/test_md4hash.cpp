@@ -123,4 +123,65 @@ BOOST_AUTO_TEST_CASE(test_partial_hashing_and_hashset)
     }
 }
 
+BOOST_AUTO_TEST_CASE(test_batch_hashing)
+{
+    // lengths around block and padding bounds, a couple of longer ones
+    const size_t sizes[] = { 0, 1, 3, 55, 56, 57, 63, 64, 65, 119, 120, 128, 1000, 4099,
+                             size_t(libed2k::BLOCK_SIZE), size_t(libed2k::BLOCK_SIZE) + 77 };
+    const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+
+    std::vector<std::string> buffers;
+    std::vector<libed2k::md4_hash> expected;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::string data(sizes[i], '\0');
+        for (size_t n = 0; n < data.size(); ++n) data[n] = char(n * 7 + i);
+        buffers.push_back(data);
+
+        libed2k::hasher h;
+        if (!data.empty()) h.update(data);
+        expected.push_back(h.final());
+    }
+
+    BOOST_CHECK_EQUAL(libed2k::hasher("abc", 3).final().toString(),
+                      std::string("A448017AAF21D8525FC10AE87AA6729D"));
+
+    // every engine available on this CPU and every number of buffers up to all
+    const size_t lanes[] = { 1, 4, 8 };
+
+    for (size_t l = 0; l < sizeof(lanes) / sizeof(lanes[0]); ++l)
+    {
+        for (size_t n = 1; n <= count; ++n)
+        {
+            std::vector<const unsigned char*> data;
+            std::vector<size_t> size;
+            std::vector<unsigned char> digests(n * libed2k::MD4_HASH_SIZE);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                data.push_back(reinterpret_cast<const unsigned char*>(buffers[i].data()));
+                size.push_back(buffers[i].size());
+            }
+
+            libed2k::md4_batch(&data[0], &size[0], n,
+                               reinterpret_cast<unsigned char(*)[libed2k::MD4_HASH_SIZE]>(&digests[0]),
+                               lanes[l]);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                libed2k::md4_hash h;
+                memcpy(h.getContainer(), &digests[i * libed2k::MD4_HASH_SIZE], libed2k::MD4_HASH_SIZE);
+                BOOST_CHECK_EQUAL(h, expected[i]);
+            }
+        }
+    }
+
+    libed2k::hasher_batch batch;
+    for (size_t i = 0; i < count; ++i) batch.add(buffers[i].data(), buffers[i].size());
+    BOOST_CHECK_EQUAL(batch.size(), count);
+    BOOST_CHECK(batch.final() == expected);
+    BOOST_CHECK(batch.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,187 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <sstream>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "libed2k/session.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/add_transfer_params.hpp"
+#include "libed2k/packet_struct.hpp"
+#include "libed2k/util.hpp"
+#include "common.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_peer_connection)
+
+namespace ip = boost::asio::ip;
+
+BOOST_AUTO_TEST_CASE(test_multiplexed_transfers)
+{
+    const boost::uint32_t loopback = libed2k::address2int(ip::address_v4::loopback());
+    const libed2k::md4_hash hashes[] = {
+        libed2k::md4_hash::fromString("DB48A1C00CC972488C29D3FEC9F16A79"),
+        libed2k::md4_hash::fromString("1AA8AFE3018B38D9B4D880D0683CCEB5") };
+    const char* files[] = { "./multiplex_test1.bin", "./multiplex_test2.bin" };
+    std::string body;
+
+    test_files_holder tfh;
+    stand_in server(ip::address::from_string("127.0.0.2"));
+    libed2k::session_settings settings;
+    settings.server_hostname = "127.0.0.2";
+    settings.server_port = server.port();
+    settings.server_reconnect_timeout = -1;
+    settings.listen_port = free_port();
+    libed2k::session ses(libed2k::fingerprint(), "0.0.0.0", settings);
+
+    BOOST_REQUIRE(server.accept());
+    BOOST_REQUIRE(server.read_packet(libed2k::OP_LOGINREQUEST, body));
+    boost::uint32_t client_id = loopback;
+    BOOST_REQUIRE(server.write_packet(libed2k::OP_IDCHANGE, client_id));
+
+    // the same peer is a source for both transfers
+    stand_in peer;
+
+    for (int n = 0; n < 2; ++n)
+    {
+        tfh.hold(files[n]);
+
+        libed2k::add_transfer_params params;
+        params.file_hash = hashes[n];
+        params.file_path = files[n];
+        params.file_size = 100;
+        BOOST_REQUIRE(ses.add_transfer(params).is_valid());
+
+        libed2k::found_file_sources fs;
+        fs.m_hFile = hashes[n];
+        fs.m_sources.m_collection.push_back(libed2k::net_identifier(loopback, peer.port()));
+        BOOST_REQUIRE(server.write_packet(libed2k::OP_FOUNDSOURCES, fs));
+    }
+
+    {
+        BOOST_REQUIRE(peer.accept());
+        BOOST_REQUIRE(peer.read_packet(libed2k::OP_HELLO, body));
+
+        libed2k::client_hello_answer hello_answer(libed2k::md4_hash::emule,
+                                                  libed2k::net_identifier(loopback, peer.port()),
+                                                  libed2k::net_identifier(loopback, server.port()),
+                                                  "peer", "peer", 0x3c);
+        BOOST_REQUIRE(peer.write_packet(libed2k::OP_HELLOANSWER, hello_answer));
+        BOOST_REQUIRE(peer.read_packet(libed2k::OP_REQUESTFILENAME, body));
+        BOOST_REQUIRE_EQUAL(body.size(), libed2k::MD4_HASH_SIZE);
+        libed2k::md4_hash first(std::vector<boost::uint8_t>(body.begin(), body.end()));
+        BOOST_CHECK(first == hashes[0] || first == hashes[1]);
+
+        // let the other transfer find the connection
+        boost::this_thread::sleep(boost::posix_time::seconds(2));
+
+        // the peer has no first file, the second one is requested over the same connection
+        libed2k::client_no_file nf;
+        nf.m_hFile = first;
+        BOOST_REQUIRE(peer.write_packet(libed2k::OP_FILEREQANSNOFIL, nf));
+        BOOST_REQUIRE(peer.read_packet(libed2k::OP_REQUESTFILENAME, body));
+        BOOST_REQUIRE_EQUAL(body.size(), libed2k::MD4_HASH_SIZE);
+        libed2k::md4_hash second(std::vector<boost::uint8_t>(body.begin(), body.end()));
+        BOOST_CHECK(second == (first == hashes[0] ? hashes[1] : hashes[0]));
+        peer.close();
+    }
+
+    // let session drop closed peers before it goes down
+    boost::this_thread::sleep(boost::posix_time::seconds(1));
+}
+
+BOOST_AUTO_TEST_CASE(test_source_exchange)
+{
+    const boost::uint32_t loopback = libed2k::address2int(ip::address_v4::loopback());
+    const boost::uint32_t listed = libed2k::address2int(ip::address::from_string("127.0.0.5"));
+    const boost::uint32_t exchanged = libed2k::address2int(ip::address::from_string("127.0.0.6"));
+    const libed2k::md4_hash hash = libed2k::md4_hash::fromString("DB48A1C00CC972488C29D3FEC9F16A79");
+    const char* file = "./exchange_test.bin";
+    std::string body;
+
+    test_files_holder tfh;
+    tfh.hold(file);
+    stand_in server(ip::address::from_string("127.0.0.2"));
+    libed2k::session_settings settings;
+    settings.server_hostname = "127.0.0.2";
+    settings.server_port = server.port();
+    settings.server_reconnect_timeout = -1;
+    settings.listen_port = free_port();
+    libed2k::session ses(libed2k::fingerprint(), "0.0.0.0", settings);
+
+    BOOST_REQUIRE(server.accept());
+    BOOST_REQUIRE(server.read_packet(libed2k::OP_LOGINREQUEST, body));
+    boost::uint32_t client_id = loopback;
+    BOOST_REQUIRE(server.write_packet(libed2k::OP_IDCHANGE, client_id));
+
+    libed2k::add_transfer_params params;
+    params.file_hash = hash;
+    params.file_path = file;
+    params.file_size = 100;
+    libed2k::transfer_handle h = ses.add_transfer(params);
+    BOOST_REQUIRE(h.is_valid());
+
+    // sources told twice are listed once
+    stand_in peer;
+    libed2k::found_file_sources fs;
+    fs.m_hFile = hash;
+    for (int n = 0; n < 2; ++n)
+    {
+        fs.m_sources.m_collection.push_back(libed2k::net_identifier(loopback, peer.port()));
+        fs.m_sources.m_collection.push_back(libed2k::net_identifier(listed, free_port()));
+    }
+    BOOST_REQUIRE(server.write_packet(libed2k::OP_FOUNDSOURCES, fs));
+
+    BOOST_REQUIRE(peer.accept());
+    BOOST_REQUIRE(peer.read_packet(libed2k::OP_HELLO, body));
+    BOOST_CHECK_EQUAL(h.status().list_peers, 2);
+
+    libed2k::client_hello_answer hello_answer(libed2k::md4_hash::emule,
+                                              libed2k::net_identifier(loopback, peer.port()),
+                                              libed2k::net_identifier(loopback, server.port()),
+                                              "peer", "peer", 0x3c);
+    BOOST_REQUIRE(peer.write_packet(libed2k::OP_HELLOANSWER, hello_answer));
+    BOOST_REQUIRE(peer.read_packet(libed2k::OP_REQUESTFILENAME, body));
+
+    // the peer tells a source it knows
+    libed2k::client_answer_sources2 as;
+    as.m_nVersion = 1;
+    as.m_hFile = hash;
+    as.m_sources.resize(1);
+    as.m_sources[0].m_nUserId = exchanged;
+    as.m_sources[0].m_nPort = free_port();
+    BOOST_REQUIRE(peer.write_packet(libed2k::OP_ANSWERSOURCES2, as, libed2k::OP_EMULEPROT));
+
+    // only sources learned by exchange are passed on besides connected peers
+    libed2k::client_request_sources2 rs;
+    rs.m_nVersion = 1;
+    rs.m_hFile = hash;
+    BOOST_REQUIRE(peer.write_packet(libed2k::OP_REQUESTSOURCES2, rs, libed2k::OP_EMULEPROT));
+    BOOST_REQUIRE(peer.read_packet(libed2k::OP_ANSWERSOURCES2, body));
+    {
+        std::stringstream sstream(body);
+        libed2k::archive::ed2k_iarchive ia(sstream);
+        libed2k::client_answer_sources2 answer;
+        ia >> answer;
+        BOOST_CHECK(answer.m_hFile == hash);
+        BOOST_REQUIRE_EQUAL(answer.m_sources.size(), 1U);
+        BOOST_CHECK_EQUAL(answer.m_sources[0].m_nUserId, exchanged);
+        BOOST_CHECK_EQUAL(answer.m_sources[0].m_nPort, as.m_sources[0].m_nPort);
+    }
+
+    // the peer asks again too soon
+    BOOST_REQUIRE(peer.write_packet(libed2k::OP_REQUESTSOURCES2, rs, libed2k::OP_EMULEPROT));
+    BOOST_CHECK(!peer.read_packet(libed2k::OP_ANSWERSOURCES2, body));
+    BOOST_CHECK_EQUAL(h.status().list_peers, 3);
+    peer.close();
+
+    // let session drop closed peers before it goes down
+    boost::this_thread::sleep(boost::posix_time::seconds(1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
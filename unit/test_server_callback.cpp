@@ -0,0 +1,120 @@
+#ifndef WIN32
+#define BOOST_TEST_DYN_LINK
+#endif
+
+#ifdef STAND_ALONE
+#   define BOOST_TEST_MODULE Main
+#endif
+
+#include <sstream>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "libed2k/session.hpp"
+#include "libed2k/session_settings.hpp"
+#include "libed2k/add_transfer_params.hpp"
+#include "libed2k/packet_struct.hpp"
+#include "libed2k/util.hpp"
+#include "common.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_server_callback)
+
+namespace ip = boost::asio::ip;
+
+BOOST_AUTO_TEST_CASE(test_callbacks)
+{
+    const boost::uint32_t low_id = 1234;
+    const boost::uint32_t loopback = libed2k::address2int(ip::address_v4::loopback());
+    const libed2k::md4_hash hash = libed2k::md4_hash::fromString("DB48A1C00CC972488C29D3FEC9F16A79");
+    std::string body;
+
+    test_files_holder tfh;
+    tfh.hold("./callback_test.bin");
+
+    // session doesn't take connections from server address for peers
+    stand_in server(ip::address::from_string("127.0.0.2"));
+    libed2k::session_settings settings;
+    settings.server_hostname = "127.0.0.2";
+    settings.server_port = server.port();
+    settings.server_reconnect_timeout = -1;
+    settings.listen_port = free_port();
+    libed2k::session ses(libed2k::fingerprint(), "0.0.0.0", settings);
+
+    BOOST_REQUIRE(server.accept());
+    BOOST_REQUIRE(server.read_packet(libed2k::OP_LOGINREQUEST, body));
+    boost::uint32_t client_id = loopback;
+    BOOST_REQUIRE(server.write_packet(libed2k::OP_IDCHANGE, client_id));
+
+    // server asks us to connect to firewalled peer
+    {
+        stand_in caller;
+        libed2k::net_identifier caller_point(loopback, caller.port());
+        BOOST_REQUIRE(server.write_packet(libed2k::OP_CALLBACKREQUESTED, caller_point));
+        BOOST_REQUIRE(caller.accept());
+        BOOST_CHECK(caller.read_packet(libed2k::OP_HELLO, body));
+    }
+
+    // low id source found for our transfer is asked to call us back
+    libed2k::add_transfer_params params;
+    params.file_hash = hash;
+    params.file_path = "./callback_test.bin";
+    params.file_size = 100;
+
+    {
+        libed2k::transfer_handle h = ses.add_transfer(params);
+        BOOST_REQUIRE(h.is_valid());
+
+        libed2k::found_file_sources fs;
+        fs.m_hFile = hash;
+        fs.m_sources.m_collection.push_back(libed2k::net_identifier(low_id, 4662));
+        BOOST_REQUIRE(server.write_packet(libed2k::OP_FOUNDSOURCES, fs));
+        BOOST_REQUIRE(server.read_packet(libed2k::OP_CALLBACKREQUEST, body));
+        BOOST_REQUIRE_EQUAL(body.size(), sizeof(boost::uint32_t));
+        BOOST_CHECK_EQUAL(*reinterpret_cast<const boost::uint32_t*>(body.data()), low_id);
+
+        const libed2k::net_identifier server_point(
+            libed2k::address2int(ip::address::from_string("127.0.0.2")), server.port());
+
+        // the same low id on another server isn't the peer we asked
+        {
+            stand_in other;
+            BOOST_REQUIRE(other.connect(settings.listen_port));
+            libed2k::client_hello hello(libed2k::md4_hash::emule,
+                                        libed2k::net_identifier(low_id, 4662),
+                                        libed2k::net_identifier(loopback, server.port()),
+                                        "other", "other", 0x3c);
+            hello.m_nHashLength = libed2k::MD4_HASH_SIZE;
+            BOOST_REQUIRE(other.write_packet(libed2k::OP_HELLO, hello));
+            BOOST_REQUIRE(other.read_packet(libed2k::OP_HELLOANSWER, body));
+            libed2k::client_hello_answer hello_answer(libed2k::md4_hash::emule,
+                                                      libed2k::net_identifier(low_id, 4662),
+                                                      libed2k::net_identifier(loopback, server.port()),
+                                                      "other", "other", 0x3c);
+            BOOST_REQUIRE(other.write_packet(libed2k::OP_HELLOANSWER, hello_answer));
+            BOOST_CHECK(!other.read_packet(libed2k::OP_REQUESTFILENAME, body));
+        }
+
+        // the source connects and gets the file request after handshake
+        stand_in source;
+        BOOST_REQUIRE(source.connect(settings.listen_port));
+        libed2k::client_hello hello(libed2k::md4_hash::emule,
+                                    libed2k::net_identifier(low_id, 4662),
+                                    server_point, "source", "source", 0x3c);
+        hello.m_nHashLength = libed2k::MD4_HASH_SIZE;
+        BOOST_REQUIRE(source.write_packet(libed2k::OP_HELLO, hello));
+        BOOST_REQUIRE(source.read_packet(libed2k::OP_HELLOANSWER, body));
+
+        libed2k::client_hello_answer hello_answer(libed2k::md4_hash::emule,
+                                                  libed2k::net_identifier(low_id, 4662),
+                                                  server_point, "source", "source", 0x3c);
+        BOOST_REQUIRE(source.write_packet(libed2k::OP_HELLOANSWER, hello_answer));
+        BOOST_REQUIRE(source.read_packet(libed2k::OP_REQUESTFILENAME, body));
+        BOOST_REQUIRE_EQUAL(body.size(), libed2k::MD4_HASH_SIZE);
+        BOOST_CHECK(libed2k::md4_hash(std::vector<boost::uint8_t>(body.begin(), body.end())) == hash);
+    }
+
+    // let session drop closed peers before it goes down
+    boost::this_thread::sleep(boost::posix_time::seconds(1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
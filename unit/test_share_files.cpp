@@ -7,11 +7,14 @@
 #endif
 
 #include <sstream>
+#include <map>
 #include <locale.h>
 #include <boost/test/unit_test.hpp>
+#include <boost/filesystem/operations.hpp>
 
 #include "libed2k/constants.hpp"
 #include "libed2k/file.hpp"
+#include "libed2k/hasher.hpp"
 #include "libed2k/log.hpp"
 #include "libed2k/transfer.hpp"
 #include "libed2k/deadline_timer.hpp"
@@ -122,6 +125,59 @@ BOOST_AUTO_TEST_CASE(test_string_conversions)
     }
 }
 
+BOOST_AUTO_TEST_CASE(test_known_file_lookup)
+{
+    const char* names[] = { "first.bin", "second.bin", "first.bin", "\xEF\xBB\xBFthird.bin" };
+    const boost::uint32_t timestamps[] = { 100, 100, 100, 200 };
+    const libed2k::size_type sizes[] = { 1000, 2000, 1000, 5000000000LL };
+    const size_t count = sizeof(names) / sizeof(names[0]);
+    std::vector<libed2k::md4_hash> hashes;
+
+    libed2k::known_file_collection kfc;
+
+    for (size_t n = 0; n < count; ++n)
+    {
+        libed2k::known_file_entry entry;
+        entry.m_nLastChanged = timestamps[n];
+        entry.m_hFile = libed2k::hasher(names[n], strlen(names[n])).final();
+        entry.m_list.add_tag(libed2k::make_string_tag(std::string(names[n]), libed2k::FT_FILENAME, true));
+        entry.m_list.add_tag(libed2k::make_typed_tag(boost::uint64_t(sizes[n]), libed2k::FT_FILESIZE, true));
+        kfc.m_known_file_list.m_collection.push_back(entry);
+        hashes.push_back(entry.m_hFile);
+    }
+
+    // duplicates differ by hash - the first one is taken
+    hashes[2] = libed2k::md4_hash::terminal;
+    kfc.m_known_file_list.m_collection[2].m_hFile = hashes[2];
+
+    std::stringstream sstream;
+    libed2k::archive::ed2k_oarchive ofa(sstream);
+    ofa << kfc;
+
+    libed2k::known_file_collection loaded;
+    libed2k::archive::ed2k_iarchive ifa(sstream);
+    ifa >> loaded;
+
+    BOOST_CHECK_EQUAL(loaded.extract_transfer_params(100, 1000, "dir/first.bin").file_hash, hashes[0]);
+    BOOST_CHECK_EQUAL(loaded.extract_transfer_params(100, 2000, "second.bin").file_hash, hashes[1]);
+    BOOST_CHECK_EQUAL(loaded.extract_transfer_params(200, 5000000000LL, "third.bin").file_hash, hashes[3]);
+    BOOST_CHECK_EQUAL(loaded.extract_transfer_params(100, 1000, "dir/first.bin").file_size, 1000);
+
+    // time, size or name mismatch means changed file
+    BOOST_CHECK(!loaded.extract_transfer_params(101, 1000, "first.bin").file_hash.defined());
+    BOOST_CHECK(!loaded.extract_transfer_params(100, 1001, "first.bin").file_hash.defined());
+    BOOST_CHECK(!loaded.extract_transfer_params(100, 1000, "second.bin").file_hash.defined());
+
+    // appended entries are found as well
+    libed2k::known_file_entry entry;
+    entry.m_nLastChanged = 300;
+    entry.m_hFile = libed2k::md4_hash::emule;
+    entry.m_list.add_tag(libed2k::make_string_tag(std::string("fourth.bin"), libed2k::FT_FILENAME, true));
+    entry.m_list.add_tag(libed2k::make_typed_tag(boost::uint32_t(10), libed2k::FT_FILESIZE, true));
+    loaded.m_known_file_list.m_collection.push_back(entry);
+    BOOST_CHECK_EQUAL(loaded.extract_transfer_params(300, 10, "fourth.bin").file_hash, libed2k::md4_hash::emule);
+}
+
 BOOST_AUTO_TEST_CASE(test_concurrency)
 {
     const char* names[TCOUNT] = {"xxx", "yyy", "zzz"};
@@ -193,16 +249,24 @@ BOOST_AUTO_TEST_CASE(test_add_transfer_params_maker)
     WAIT_TPM(sit.m_tpm);
     sit.m_tpm.stop();
 
+    // files are hashed in parallel and complete in any order
+    std::map<std::string, libed2k::md4_hash> hashes;
+
     for (size_t n = 0; n < sz; ++n)
     {
-        std::stringstream s;
-        s << filename << n;
         BOOST_REQUIRE(sit.m_alerts.wait_for_alert(libed2k::milliseconds(10)));
         std::auto_ptr<libed2k::alert> aptr = sit.m_alerts.get();
         libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
         BOOST_REQUIRE(a);
         BOOST_CHECK(!a->m_ec);
-        BOOST_CHECK_MESSAGE(a->m_atp.file_hash == tmpl[n].second, s.str());
+        hashes[a->m_atp.file_path] = a->m_atp.file_hash;
+    }
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << filename << n;
+        BOOST_CHECK_MESSAGE(hashes[s.str()] == tmpl[n].second, s.str());
     }
 
     // start hashing and free resources
@@ -317,6 +381,249 @@ BOOST_AUTO_TEST_CASE(test_add_transfer_params_maker)
     DBG("test_add_transfer_params_maker {completed}");
 }
 
+BOOST_AUTO_TEST_CASE(test_parallel_hashing)
+{
+    libed2k::io_service ios;
+    libed2k::alert_manager am(ios);
+    // two buffers for three hash threads and two readers keep pipeline busy
+    libed2k::transfer_params_maker tpm(am, "", 3, 2, 2);
+    am.set_alert_mask(libed2k::alert::all_categories);
+
+    test_files_holder tfh;
+    const size_t sz = 6;
+    const libed2k::size_type sizes[sz] = { 1, libed2k::PIECE_SIZE*3, 4000, libed2k::PIECE_SIZE*2 + 1, 2, libed2k::PIECE_SIZE - 1 };
+    std::map<std::string, libed2k::md4_hash> expected;
+    bool cancel = false;
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        std::stringstream s;
+        s << "parallel_hashing" << n;
+        BOOST_REQUIRE(generate_test_file(sizes[n], s.str()));
+        tfh.hold(s.str());
+        expected[s.str()] = libed2k::file2atp()(s.str(), cancel).first.file_hash;
+    }
+
+    tpm.start();
+
+    for (std::map<std::string, libed2k::md4_hash>::iterator i = expected.begin(); i != expected.end(); ++i)
+    {
+        tpm.make_transfer_params(i->first);
+    }
+
+    WAIT_TPM(tpm);
+
+    for (size_t n = 0; n < sz; ++n)
+    {
+        BOOST_REQUIRE(am.wait_for_alert(libed2k::milliseconds(10)));
+        std::auto_ptr<libed2k::alert> aptr = am.get();
+        libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+        BOOST_REQUIRE(a);
+        BOOST_CHECK(!a->m_ec);
+        BOOST_CHECK_MESSAGE(expected[a->m_atp.file_path] == a->m_atp.file_hash, a->m_atp.file_path);
+        BOOST_CHECK(a->m_atp.seed_mode);
+    }
+
+    // cancelled files come back once with cancel error, the rest completes
+    for (std::map<std::string, libed2k::md4_hash>::iterator i = expected.begin(); i != expected.end(); ++i)
+    {
+        tpm.make_transfer_params(i->first);
+    }
+
+    tpm.cancel_transfer_params("parallel_hashing1");
+    tpm.cancel_transfer_params("parallel_hashing3");
+    WAIT_TPM(tpm);
+    tpm.stop();
+
+    size_t cancelled = 0;
+    size_t completed = 0;
+
+    while (am.wait_for_alert(libed2k::milliseconds(10)))
+    {
+        std::auto_ptr<libed2k::alert> aptr = am.get();
+        libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+        BOOST_REQUIRE(a);
+
+        if (a->m_ec)
+        {
+            BOOST_CHECK_EQUAL(a->m_ec, libed2k::errors::make_error_code(libed2k::errors::file_params_making_was_cancelled));
+            BOOST_CHECK(a->m_atp.file_path == "parallel_hashing1" || a->m_atp.file_path == "parallel_hashing3");
+            ++cancelled;
+        }
+        else
+        {
+            BOOST_CHECK_MESSAGE(expected[a->m_atp.file_path] == a->m_atp.file_hash, a->m_atp.file_path);
+            ++completed;
+        }
+    }
+
+    // files still in order on cancel produce no alerts
+    BOOST_CHECK_EQUAL(completed, sz - 2);
+    BOOST_CHECK(cancelled <= 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_known_file_write_back)
+{
+    libed2k::io_service ios;
+    libed2k::alert_manager am(ios);
+    am.set_alert_mask(libed2k::alert::all_categories);
+    const std::string known = "write_back_known.met";
+    const std::string journal = known + ".journal";
+    const char* names[] = { "write_back0", "write_back1", "write_back2" };
+    const libed2k::size_type sizes[] = { 100, libed2k::PIECE_SIZE + 1, libed2k::PIECE_SIZE*2 };
+    std::map<std::string, libed2k::md4_hash> hashes;
+
+    test_files_holder tfh;
+    tfh.hold(known);
+    tfh.hold(journal);
+
+    {
+        libed2k::transfer_params_maker tpm(am, known, 2, 2, 1);
+        tpm.start();
+
+        for (size_t n = 0; n < 3; ++n)
+        {
+            BOOST_REQUIRE(generate_test_file(sizes[n], names[n]));
+            tfh.hold(names[n]);
+            tpm.make_transfer_params(names[n]);
+        }
+
+        WAIT_TPM(tpm);
+
+        while (am.wait_for_alert(libed2k::milliseconds(10)))
+        {
+            std::auto_ptr<libed2k::alert> aptr = am.get();
+            libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+            BOOST_REQUIRE(a);
+            BOOST_CHECK(!a->m_ec);
+            hashes[a->m_atp.file_path] = a->m_atp.file_hash;
+        }
+
+        BOOST_REQUIRE_EQUAL(hashes.size(), 3U);
+
+        // hashed file is known before the journal has it - same size and time isn't read again
+        std::time_t mtime = boost::filesystem::last_write_time(names[1]);
+        {
+            std::ofstream of(names[1], std::ios_base::binary | std::ios_base::out);
+            of << std::string(size_t(sizes[1]), 'Y');
+        }
+        boost::filesystem::last_write_time(names[1], mtime);
+
+        tpm.make_transfer_params(names[1]);
+        WAIT_TPM(tpm);
+        BOOST_REQUIRE(am.wait_for_alert(libed2k::milliseconds(1000)));
+        std::auto_ptr<libed2k::alert> aptr = am.get();
+        libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+        BOOST_REQUIRE(a);
+        BOOST_CHECK_EQUAL(a->m_atp.file_hash, hashes[names[1]]);
+        tpm.stop();
+    }
+
+    // few hashed files stay in journal
+    BOOST_CHECK(libed2k::exists(journal));
+    BOOST_CHECK(!libed2k::exists(known));
+
+    // same size and time - file is taken from journal without reading
+    std::time_t mtime = boost::filesystem::last_write_time(names[0]);
+    {
+        std::ofstream of(names[0], std::ios_base::binary | std::ios_base::out);
+        of << std::string(size_t(sizes[0]), 'Y');
+    }
+    boost::filesystem::last_write_time(names[0], mtime);
+
+    // broken journal tail forces merge into known.met on load
+    {
+        std::ofstream of(journal.c_str(), std::ios_base::binary | std::ios_base::out | std::ios_base::app);
+        of << '\x01' << '\x02';
+    }
+
+    {
+        libed2k::transfer_params_maker tpm(am, known, 2, 2, 1);
+        tpm.start();
+        tpm.make_transfer_params(names[0]);
+        tpm.make_transfer_params(names[1]);
+        WAIT_TPM(tpm);
+        tpm.stop();
+
+        for (size_t n = 0; n < 2; ++n)
+        {
+            BOOST_REQUIRE(am.wait_for_alert(libed2k::milliseconds(10)));
+            std::auto_ptr<libed2k::alert> aptr = am.get();
+            libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get());
+            BOOST_REQUIRE(a);
+            BOOST_CHECK(!a->m_ec);
+            BOOST_CHECK_MESSAGE(hashes[a->m_atp.file_path] == a->m_atp.file_hash, a->m_atp.file_path);
+        }
+    }
+
+    BOOST_CHECK(libed2k::exists(known));
+    BOOST_CHECK(!libed2k::exists(journal));
+
+    // merged known.met serves files too
+    libed2k::known_file_collection kfc;
+    std::ifstream ifs(known.c_str(), std::ios_base::binary | std::ios_base::in);
+    libed2k::archive::ed2k_iarchive ifa(ifs);
+    ifa >> kfc;
+    BOOST_CHECK_EQUAL(kfc.m_known_file_list.m_collection.size(), 3U);
+    libed2k::file_status fs;
+    libed2k::error_code ec;
+    libed2k::stat_file(names[2], &fs, ec);
+    BOOST_REQUIRE(!ec);
+    libed2k::add_transfer_params atp = kfc.extract_transfer_params(fs.mtime, fs.file_size, names[2]);
+    BOOST_CHECK_EQUAL(atp.file_hash, hashes[names[2]]);
+    BOOST_CHECK_EQUAL(atp.piece_hashses.size(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(test_known_file_compact)
+{
+    libed2k::known_file_collection kfc;
+    const char* names[] = { "compact0", "compact1", "compact0" };
+
+    for (size_t n = 0; n < 3; ++n)
+    {
+        libed2k::add_transfer_params atp;
+        atp.file_path = names[n];
+        atp.file_size = 100;
+        atp.file_hash = libed2k::hasher(names[n], int(n) + 1).final();
+        atp.piece_hashses.push_back(atp.file_hash);
+        kfc.m_known_file_list.m_collection.push_back(libed2k::known_file_entry(atp, 1000));
+    }
+
+    // the file was hashed again - lookups never reach the later entry
+    libed2k::md4_hash first = kfc.m_known_file_list.m_collection[0].m_hFile;
+    libed2k::md4_hash second = kfc.m_known_file_list.m_collection[1].m_hFile;
+    kfc.compact();
+    BOOST_REQUIRE_EQUAL(kfc.m_known_file_list.m_collection.size(), 2U);
+    BOOST_CHECK_EQUAL(kfc.m_known_file_list.m_collection[0].m_hFile, first);
+    BOOST_CHECK_EQUAL(kfc.m_known_file_list.m_collection[1].m_hFile, second);
+    BOOST_CHECK_EQUAL(kfc.extract_transfer_params(1000, 100, "compact0").file_hash, first);
+    BOOST_CHECK_EQUAL(kfc.extract_transfer_params(1000, 100, "compact1").file_hash, second);
+
+    // files not shared since expiration time are dropped, lookup marks the file as shared
+    const boost::uint32_t now = static_cast<boost::uint32_t>(time(0));
+    kfc.m_known_file_list.m_collection[0].set_last_shared(now - 100);
+    kfc.m_known_file_list.m_collection[1].set_last_shared(now - 100);
+    BOOST_CHECK_EQUAL(kfc.m_known_file_list.m_collection[0].last_shared(), now - 100);
+    BOOST_CHECK_EQUAL(kfc.extract_transfer_params(1000, 100, "compact1").file_hash, second);
+    BOOST_CHECK_GE(kfc.m_known_file_list.m_collection[1].last_shared(), now);
+
+    kfc.compact(now - 50);
+    BOOST_REQUIRE_EQUAL(kfc.m_known_file_list.m_collection.size(), 1U);
+    BOOST_CHECK_EQUAL(kfc.m_known_file_list.m_collection[0].m_hFile, second);
+    BOOST_CHECK(!kfc.extract_transfer_params(1000, 100, "compact0").file_hash.defined());
+
+    // the time the file was shared last is saved with it
+    std::stringstream sstream;
+    libed2k::archive::ed2k_oarchive ofa(sstream);
+    ofa << kfc;
+    libed2k::known_file_collection loaded;
+    libed2k::archive::ed2k_iarchive ifa(sstream);
+    ifa >> loaded;
+    BOOST_REQUIRE_EQUAL(loaded.m_known_file_list.m_collection.size(), 1U);
+    BOOST_CHECK_EQUAL(loaded.m_known_file_list.m_collection[0].last_shared(),
+                      kfc.m_known_file_list.m_collection[0].last_shared());
+}
+
 BOOST_AUTO_TEST_CASE(test_cancel_filename_in_progress)
 {
     const char* filepath = "it is simple test name";
@@ -356,4 +663,143 @@ BOOST_AUTO_TEST_CASE(test_cancel_filename_in_progress)
     BOOST_CHECK(!sit.m_alerts.wait_for_alert(libed2k::milliseconds(10)));
 }
 
+namespace
+{
+    // next transfer parameters or removal from share monitor, empty on timeout
+    std::string wait_share_event(libed2k::alert_manager& am, bool& removed)
+    {
+        if (!am.wait_for_alert(libed2k::seconds(5))) return std::string();
+        std::auto_ptr<libed2k::alert> aptr = am.get();
+
+        if (libed2k::transfer_params_alert* a = dynamic_cast<libed2k::transfer_params_alert*>(aptr.get()))
+        {
+            BOOST_CHECK(!a->m_ec);
+            removed = false;
+            return a->m_atp.file_path;
+        }
+
+        libed2k::shared_file_removed_alert* a = dynamic_cast<libed2k::shared_file_removed_alert*>(aptr.get());
+        BOOST_REQUIRE(a);
+        removed = true;
+        return a->m_file_path;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_share_monitor)
+{
+    libed2k::io_service ios;
+    libed2k::alert_manager am(ios);
+    am.set_alert_mask(libed2k::alert::all_categories);
+    libed2k::transfer_params_maker tpm(am, "", 1, 2, 1);
+    libed2k::share_monitor monitor(am, tpm, 0, 1);
+
+    const std::string dir = "share_monitor";
+    const std::string sub = libed2k::combine_path(dir, "sub");
+    libed2k::error_code ec;
+    libed2k::remove_all(dir, ec);
+    libed2k::create_directories(sub, ec);
+    BOOST_REQUIRE(!ec);
+
+    const std::string file1 = libed2k::combine_path(dir, "file1");
+    const std::string file2 = libed2k::combine_path(sub, "file2");
+    BOOST_REQUIRE(generate_test_file(100, file1));
+    BOOST_REQUIRE(generate_test_file(libed2k::PIECE_SIZE + 1, file2));
+
+    tpm.start();
+    monitor.add_directory(dir);
+
+    // files already there are hashed on start
+    std::set<std::string> files;
+    bool removed = false;
+    files.insert(wait_share_event(am, removed));
+    BOOST_CHECK(!removed);
+    files.insert(wait_share_event(am, removed));
+    BOOST_CHECK(!removed);
+    BOOST_CHECK(files.count(file1) && files.count(file2));
+
+    // file completed elsewhere and moved in
+    const std::string file3 = libed2k::combine_path(sub, "file3");
+    BOOST_REQUIRE(generate_test_file(200, "share_monitor_file3"));
+    libed2k::rename("share_monitor_file3", file3, ec);
+    BOOST_REQUIRE(!ec);
+    BOOST_CHECK_EQUAL(wait_share_event(am, removed), file3);
+    BOOST_CHECK(!removed);
+
+    // changed file is dropped before new parameters come
+    BOOST_REQUIRE(generate_test_file(150, file1));
+    BOOST_CHECK_EQUAL(wait_share_event(am, removed), file1);
+    BOOST_CHECK(removed);
+    BOOST_CHECK_EQUAL(wait_share_event(am, removed), file1);
+    BOOST_CHECK(!removed);
+
+    libed2k::remove(file1, ec);
+    BOOST_CHECK_EQUAL(wait_share_event(am, removed), file1);
+    BOOST_CHECK(removed);
+
+    // removed directory doesn't report its files
+    monitor.remove_directory(dir);
+    monitor.stop();
+    tpm.stop();
+    BOOST_CHECK(!am.wait_for_alert(libed2k::milliseconds(10)));
+    libed2k::remove_all(dir, ec);
+}
+
+BOOST_AUTO_TEST_CASE(test_share_monitor_nested_roots)
+{
+    libed2k::io_service ios;
+    libed2k::alert_manager am(ios);
+    am.set_alert_mask(libed2k::alert::all_categories);
+    libed2k::transfer_params_maker tpm(am, "", 1, 2, 1);
+    libed2k::share_monitor monitor(am, tpm, 0, 1);
+
+    const std::string dir = "share_monitor_nested";
+    const std::string sub = libed2k::combine_path(dir, "sub");
+    const std::string deeper = libed2k::combine_path(sub, "deeper");
+    libed2k::error_code ec;
+    libed2k::remove_all(dir, ec);
+    libed2k::create_directories(sub, ec);
+    BOOST_REQUIRE(!ec);
+
+    const std::string file1 = libed2k::combine_path(dir, "file1");
+    const std::string file2 = libed2k::combine_path(sub, "file2");
+    BOOST_REQUIRE(generate_test_file(100, file1));
+    BOOST_REQUIRE(generate_test_file(200, file2));
+
+    tpm.start();
+    monitor.add_directory(dir);
+
+    std::set<std::string> files;
+    bool removed = false;
+    files.insert(wait_share_event(am, removed));
+    files.insert(wait_share_event(am, removed));
+    BOOST_CHECK(files.count(file1) && files.count(file2));
+
+    // root inside recursive one neither hashes its files again nor stops
+    // watching its subdirectories
+    monitor.add_directory(sub, false);
+    libed2k::sleep(100);
+    BOOST_CHECK(!am.wait_for_alert(libed2k::milliseconds(10)));
+
+    libed2k::create_directory(deeper, ec);
+    BOOST_REQUIRE(!ec);
+    const std::string file3 = libed2k::combine_path(deeper, "file3");
+    BOOST_REQUIRE(generate_test_file(300, "share_monitor_nested_file3"));
+    libed2k::rename("share_monitor_nested_file3", file3, ec);
+    BOOST_REQUIRE(!ec);
+    BOOST_CHECK_EQUAL(wait_share_event(am, removed), file3);
+    BOOST_CHECK(!removed);
+
+    // nested root stays shared when enclosing one is removed
+    monitor.remove_directory(dir);
+    libed2k::sleep(100);
+    libed2k::remove(file2, ec);
+    BOOST_CHECK_EQUAL(wait_share_event(am, removed), file2);
+    BOOST_CHECK(removed);
+
+    monitor.stop();
+    tpm.stop();
+    BOOST_CHECK(!am.wait_for_alert(libed2k::milliseconds(10)));
+    libed2k::remove_all(dir, ec);
+}
+
 BOOST_AUTO_TEST_SUITE_END()